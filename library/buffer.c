@@ -18,6 +18,8 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -28,6 +30,28 @@
 #include "buffer.h"
 #include "utils.h"
 
+/*
+ * Buffers are allocated from caches of fixed size chunks when using
+ * twopence_buf_new_pooled(). The smallest chunk size matches the default
+ * packet size of our protocol, which is what nearly all I/O buffers are
+ * sized for. The larger ones are for connections that negotiated
+ * jumbo frames; we cache fewer of those.
+ */
+#define TWOPENCE_BUF_POOL_CHUNK		32768
+
+#define __TWOPENCE_BUF_SLAB(name, size, max) \
+	TWOPENCE_SLAB_INIT(name, sizeof(twopence_buf_t) + (size), max)
+
+static twopence_slab_t	__twopence_buf_slab[] = {
+	__TWOPENCE_BUF_SLAB("buffer",		TWOPENCE_BUF_POOL_CHUNK,	64),
+	__TWOPENCE_BUF_SLAB("buffer-64k",	TWOPENCE_BUF_POOL_CHUNK << 1,	16),
+	__TWOPENCE_BUF_SLAB("buffer-128k",	TWOPENCE_BUF_POOL_CHUNK << 2,	8),
+	__TWOPENCE_BUF_SLAB("buffer-256k",	TWOPENCE_BUF_POOL_CHUNK << 3,	8),
+	__TWOPENCE_BUF_SLAB("buffer-512k",	TWOPENCE_BUF_POOL_CHUNK << 4,	4),
+	__TWOPENCE_BUF_SLAB("buffer-1m",	TWOPENCE_BUF_POOL_CHUNK << 5,	4),
+};
+#define TWOPENCE_BUF_POOL_CLASSES	(sizeof(__twopence_buf_slab) / sizeof(__twopence_buf_slab[0]))
+
 void
 twopence_buf_init(twopence_buf_t *bp)
 {
@@ -47,6 +71,8 @@ twopence_buf_destroy(twopence_buf_t *bp)
 {
 	if (bp->dynamic)
 		free(bp->base);
+	if (bp->ring)
+		munmap(bp->base, 2 * bp->size);
 	twopence_buf_init(bp);
 }
 
@@ -61,6 +87,99 @@ twopence_buf_new(size_t size)
 	return bp;
 }
 
+/*
+ * Allocate a buffer that is recycled through the buffer cache when freed.
+ * Only buffers close to the chunk size are taken from the cache; others
+ * would waste too much memory.
+ */
+twopence_buf_t *
+twopence_buf_new_pooled(size_t size)
+{
+	size_t chunk = TWOPENCE_BUF_POOL_CHUNK;
+	twopence_buf_t *bp;
+	unsigned int i;
+
+	if (size <= TWOPENCE_BUF_POOL_CHUNK / 2)
+		return twopence_buf_new(size);
+
+	for (i = 0; i < TWOPENCE_BUF_POOL_CLASSES; ++i, chunk <<= 1) {
+		if (size > chunk || size <= chunk / 2)
+			continue;
+
+		bp = twopence_slab_alloc(&__twopence_buf_slab[i]);
+		twopence_buf_init(bp);
+		bp->base = (char *)(bp + 1);
+		bp->size = size;
+		bp->pooled = i + 1;
+		return bp;
+	}
+
+	return twopence_buf_new(size);
+}
+
+/*
+ * Ring buffers are used for receiving on the transport socket.
+ *
+ * We map the same memory twice, back to back, so that any window of up to
+ * bp->size bytes starting inside the first mapping is contiguous in memory.
+ * This allows the protocol code to dissect packets in place even if they
+ * wrap around the end of the ring, and we never have to move a partial
+ * packet to the front of the buffer.
+ * head always stays within the first copy; twopence_buf_compact() rewinds
+ * head and tail by bp->size once head has moved past it.
+ */
+static void *
+__twopence_buf_map_mirror(size_t size)
+{
+#ifdef MFD_CLOEXEC
+	char *base;
+	int fd;
+
+	if ((fd = memfd_create("twopence-ring", MFD_CLOEXEC)) < 0)
+		return NULL;
+
+	if (ftruncate(fd, size) < 0)
+		goto failed;
+
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto failed;
+
+	if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	 || mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, 2 * size);
+		goto failed;
+	}
+
+	close(fd);
+	return base;
+
+failed:
+	close(fd);
+#endif
+	return NULL;
+}
+
+twopence_buf_t *
+twopence_buf_new_ring(size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	twopence_buf_t *bp;
+	void *base;
+
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	if ((base = __twopence_buf_map_mirror(size)) == NULL) {
+		twopence_debug("unable to create ring buffer, falling back to linear buffer");
+		return twopence_buf_new(size);
+	}
+
+	bp = twopence_calloc(1, sizeof(*bp));
+	bp->base = base;
+	bp->size = size;
+	bp->ring = 1;
+	return bp;
+}
+
 twopence_buf_t *
 twopence_buf_clone(twopence_buf_t *bp)
 {
@@ -75,8 +194,13 @@ twopence_buf_clone(twopence_buf_t *bp)
 void
 twopence_buf_free(twopence_buf_t *bp)
 {
+	unsigned int pooled = bp->pooled;
+
 	twopence_buf_destroy(bp);
-	free(bp);
+	if (pooled)
+		twopence_slab_free(&__twopence_buf_slab[pooled - 1], bp);
+	else
+		free(bp);
 }
 
 const void *
@@ -94,12 +218,23 @@ twopence_buf_tail(const twopence_buf_t *bp)
 unsigned int
 twopence_buf_tailroom(const twopence_buf_t *bp)
 {
+	if (bp->ring) {
+		unsigned int room = bp->size - twopence_buf_count(bp);
+
+		/* Do not run off the end of the second mapping before
+		 * the buffer has been rewound. */
+		if (room > 2 * bp->size - bp->tail)
+			room = 2 * bp->size - bp->tail;
+		return room;
+	}
 	return bp->size - bp->tail;
 }
 
 unsigned int
 twopence_buf_tailroom_max(const twopence_buf_t *bp)
 {
+	if (bp->ring)
+		return bp->size - twopence_buf_count(bp);
 	return bp->size - bp->tail;
 }
 
@@ -140,6 +275,10 @@ twopence_buf_resize(twopence_buf_t *bp, unsigned int want_size)
 	if (want_size <= bp->size)
 		return true;
 
+	/* Ring buffers have a fixed size */
+	if (bp->ring)
+		return false;
+
 	if (want_size < BUFFER_MIN_SIZE) {
 		new_size = BUFFER_MIN_SIZE;
 	} else
@@ -172,9 +311,8 @@ twopence_buf_ensure_tailroom(twopence_buf_t *bp, unsigned int want_tailroom)
 	unsigned int tailroom;
 
 	tailroom = twopence_buf_tailroom(bp);
-	if (tailroom < want_tailroom) {
-		twopence_buf_resize(bp, bp->tail + want_tailroom);
-	}
+	if (tailroom < want_tailroom)
+		return twopence_buf_resize(bp, bp->tail + want_tailroom);
 	return true;
 }
 
@@ -208,6 +346,17 @@ twopence_buf_advance_head(twopence_buf_t *bp, unsigned int len)
 	bp->head += len;
 }
 
+/*
+ * Undo twopence_buf_advance_head(), so that data that has been
+ * consumed can be used again.
+ */
+void
+twopence_buf_rewind_head(twopence_buf_t *bp, unsigned int len)
+{
+	assert(bp->head >= len);
+	bp->head -= len;
+}
+
 void
 twopence_buf_truncate(twopence_buf_t *bp, unsigned int len)
 {
@@ -301,6 +450,16 @@ twopence_buf_compact(twopence_buf_t *bp)
 {
 	unsigned int count = twopence_buf_count(bp);
 
+	if (bp->ring) {
+		/* No need to move any data; just switch from the
+		 * second copy of the ring to the first. */
+		if (bp->head >= bp->size) {
+			bp->head -= bp->size;
+			bp->tail -= bp->size;
+		}
+		return;
+	}
+
 	if (count)
 		memmove(bp->base, bp->base + bp->head, count);
 	bp->head = 0;
@@ -31,13 +31,17 @@ struct twopence_buf {
 	unsigned int	head;
 	unsigned int	tail;
 	unsigned int	size;
-	unsigned int	dynamic : 1;
+	unsigned int	dynamic : 1,
+			pooled : 3,	/* buffer cache class + 1 */
+			ring : 1;
 };
 
 extern void		twopence_buf_init(twopence_buf_t *bp);
 extern void		twopence_buf_init_static(twopence_buf_t *bp, void *data, size_t len);
 extern void		twopence_buf_destroy(twopence_buf_t *bp);
 extern twopence_buf_t *	twopence_buf_new(size_t max_size);
+extern twopence_buf_t *	twopence_buf_new_pooled(size_t max_size);
+extern twopence_buf_t *	twopence_buf_new_ring(size_t size);
 extern twopence_buf_t *	twopence_buf_clone(twopence_buf_t *bp);
 extern void		twopence_buf_free(twopence_buf_t *bp);
 extern const void *	twopence_buf_head(const twopence_buf_t *bp);
@@ -53,6 +57,7 @@ extern void		twopence_buf_reserve_head(twopence_buf_t *bp, unsigned int len);
 extern void *		twopence_buf_reserve_tail(twopence_buf_t *bp, unsigned int len);
 extern void		twopence_buf_advance_tail(twopence_buf_t *bp, unsigned int len);
 extern void		twopence_buf_advance_head(twopence_buf_t *bp, unsigned int len);
+extern void		twopence_buf_rewind_head(twopence_buf_t *bp, unsigned int len);
 extern void		twopence_buf_truncate(twopence_buf_t *bp, unsigned int len);
 extern bool		twopence_buf_append(twopence_buf_t *bp, const void *data, unsigned int len);
 extern bool		twopence_buf_get(twopence_buf_t *bp, void *data, unsigned int len);
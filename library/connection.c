@@ -37,6 +37,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "connection.h"
 
@@ -57,16 +58,74 @@ struct twopence_connection {
 	twopence_sock_t *		client_sock;
 	unsigned int			client_id;
 
+	/* Max packet size negotiated in the HELLO exchange */
+	unsigned int			max_packet;
+
+	/* Compression of CHAN_DATA packets, negotiated in the HELLO exchange */
+	unsigned int			compress;
+	twopence_compress_stats_t	compress_stats;
+
+	/* Per-channel flow control, as of version 4.1 */
+	bool				flow_control;
+
+	/* Report resource usage of commands, as of version 4.5 */
+	bool				rusage;
+
+	/* Timestamp command output, as of version 4.6 */
+	bool				timestamps;
+
+	/* Session resumption, as of version 4.2 */
+	struct {
+		bool			enabled;
+		unsigned int		grace;		/* seconds */
+		twopence_timer_t *	timer;		/* while detached from the transport */
+		twopence_conn_t *	next;		/* on the list of detached sessions */
+
+		uint32_t		received;	/* sequenced packets received */
+		uint32_t		acked;		/* ... and acknowledged */
+		unsigned int		unacked_bytes;
+	} resume;
+
 	struct {
 		unsigned int		send_timeout;
 		struct timeval		send_deadline;
+		twopence_timer_t *	send_timer;
 		unsigned int		recv_timeout;
 		struct timeval		recv_deadline;
+		twopence_timer_t *	recv_timer;
 	} keepalive;
 
 	/* We may want to have concurrent transactions later on */
 	twopence_transaction_list_t	transactions;
 	twopence_transaction_list_t	done_transactions;
+
+	/* The pool we're in, and whether we count as detached there */
+	twopence_conn_pool_t *		pool;
+	bool				counted_detached;
+
+	/* With epoll: our place on the ready list of the pool, the fd of
+	 * our transport, and the transactions that have something to do
+	 * or wait for the transport's queue to drain */
+	twopence_ready_t		ready;
+	twopence_pollgroup_t		poll;
+	twopence_ready_list_t		ready_transactions;
+	twopence_ready_list_t		xmit_waiters;
+};
+
+struct twopence_connection_pool {
+	twopence_conn_list_t	connections;
+	unsigned int		nconns;
+	unsigned int		ndetached;
+
+	/* NULL when using ppoll() */
+	twopence_epoll_t *	epoll;
+
+	/* With epoll, the connections that have something to do */
+	twopence_ready_list_t	ready;
+
+	struct {
+		void		(*close_connection)(twopence_conn_t *);
+	} callbacks;
 };
 
 /* When keepalives are enabled, we will shut down the link
@@ -74,6 +133,12 @@ struct twopence_connection {
 #define TWOPENCE_KEEPALIVE_RECV_TIMEOUT	TWOPENCE_PROTO_DEFAULT_KEEPALIVE
 #define TWOPENCE_KEEPALIVE_SEND_TIMEOUT	(TWOPENCE_KEEPALIVE_RECV_TIMEOUT / 4)
 
+/* Sessions that lost their transport, and wait to be resumed.
+ * A session may be picked up by whichever thread accepts the new
+ * transport, so this list is shared and needs a lock. */
+static twopence_conn_t *	twopence_conn_detached;
+static pthread_mutex_t		twopence_conn_detached_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 twopence_conn_list_insert(twopence_conn_list_t *list, twopence_conn_t *conn)
 {
@@ -94,13 +159,339 @@ twopence_conn_new(twopence_conn_semantics_t *semantics, twopence_sock_t *client_
 	conn->semantics = semantics;
 	conn->client_sock = client_sock;
 	conn->client_id = client_id;
+	conn->max_packet = TWOPENCE_PROTO_MAX_PACKET;
+
+	twopence_ready_init(&conn->ready, conn);
+	twopence_pollgroup_init(&conn->poll, &conn->ready);
+	twopence_ready_list_init(&conn->ready_transactions, &conn->ready);
+	twopence_ready_list_init(&conn->xmit_waiters, NULL);
 
 	return conn;
 }
 
+void
+twopence_conn_set_max_packet(twopence_conn_t *conn, unsigned int max_packet)
+{
+	twopence_debug("using max packet size %u", max_packet);
+	conn->max_packet = max_packet;
+	if (conn->client_sock)
+		twopence_sock_set_max_packet(conn->client_sock, max_packet);
+}
+
+void
+twopence_conn_set_compression(twopence_conn_t *conn, unsigned int compress)
+{
+	twopence_debug("%s compression", compress? "using" : "not using");
+	conn->compress = compress;
+}
+
+void
+twopence_conn_get_compress_stats(const twopence_conn_t *conn, twopence_compress_stats_t *stats)
+{
+	*stats = conn->compress_stats;
+}
+
+static void
+__twopence_conn_report_codec_stats(const char *what, const twopence_codec_stats_t *stats)
+{
+	if (stats->npackets == 0)
+		return;
+
+	twopence_debug("%s: %lu packets (%lu compressed), %llu bytes -> %llu bytes (ratio %.2f), %llu.%03llu ms CPU",
+			what, stats->npackets, stats->ncompressed,
+			stats->raw_bytes, stats->wire_bytes,
+			stats->wire_bytes? (double) stats->raw_bytes / stats->wire_bytes : 1.0,
+			stats->cpu_nsec / 1000000, (stats->cpu_nsec / 1000) % 1000);
+}
+
+static void
+twopence_conn_report_compress_stats(const twopence_conn_t *conn)
+{
+	if (!conn->compress)
+		return;
+
+	__twopence_conn_report_codec_stats("compression stats sent", &conn->compress_stats.deflate);
+	__twopence_conn_report_codec_stats("compression stats received", &conn->compress_stats.inflate);
+}
+
+void
+twopence_conn_set_flow_control(twopence_conn_t *conn, bool flow_control)
+{
+	twopence_debug("%s per-channel flow control", flow_control? "using" : "not using");
+	conn->flow_control = flow_control;
+}
+
+/*
+ * How long the server keeps a session around after losing the transport.
+ * On the client, this is what the server told us in the HELLO exchange.
+ */
+void
+twopence_conn_set_grace_period(twopence_conn_t *conn, unsigned int grace)
+{
+	conn->resume.grace = grace;
+}
+
+void
+twopence_conn_set_resumable(twopence_conn_t *conn, bool resumable)
+{
+	if (resumable && conn->resume.grace == 0)
+		resumable = false;
+
+	twopence_debug("%s session resumption", resumable? "using" : "not using");
+	conn->resume.enabled = resumable;
+	if (resumable)
+		twopence_sock_enable_replay(conn->client_sock);
+}
+
+/*
+ * What we need for the HELLO packet when resuming a session
+ */
+void
+twopence_conn_get_resume_state(const twopence_conn_t *conn, twopence_protocol_resume_t *resume)
+{
+	resume->grace = conn->resume.grace;
+	resume->received = conn->resume.received;
+}
+
+/*
+ * Keepalives and the grace period of detached sessions are timers on
+ * the heap of the thread that owns the connection, so that the event
+ * loop doesn't have to check every connection's deadlines on every
+ * round. Traffic merely moves the keepalive deadlines; if a timer goes
+ * off before its deadline, it is armed again for the remainder.
+ */
+static void
+twopence_conn_cancel_timer(twopence_timer_t **timerp)
+{
+	if (*timerp) {
+		twopence_timer_cancel(*timerp);
+		*timerp = NULL;
+	}
+}
+
+static void
+twopence_conn_arm_timer(twopence_conn_t *conn, twopence_timer_t **timerp, const struct timeval *deadline,
+			void (*callback)(twopence_timer_t *, void *))
+{
+	unsigned long timeout_ms = 0;
+	struct timeval now, delta;
+
+	twopence_conn_cancel_timer(timerp);
+
+	twopence_loop_clock_get(&now);
+	if (timercmp(deadline, &now, >)) {
+		timersub(deadline, &now, &delta);
+		timeout_ms = 1000 * delta.tv_sec + (delta.tv_usec + 999) / 1000;
+	}
+
+	if (twopence_timer_create(timeout_ms, timerp) >= 0)
+		twopence_timer_set_callback(*timerp, callback, conn);
+}
+
+static void
+twopence_conn_pause_timers(twopence_conn_t *conn)
+{
+	if (conn->keepalive.send_timer)
+		twopence_timer_pause(conn->keepalive.send_timer);
+	if (conn->keepalive.recv_timer)
+		twopence_timer_pause(conn->keepalive.recv_timer);
+	if (conn->resume.timer)
+		twopence_timer_pause(conn->resume.timer);
+}
+
+static void
+twopence_conn_unpause_timers(twopence_conn_t *conn)
+{
+	if (conn->keepalive.send_timer)
+		twopence_timer_unpause(conn->keepalive.send_timer);
+	if (conn->keepalive.recv_timer)
+		twopence_timer_unpause(conn->keepalive.recv_timer);
+	if (conn->resume.timer)
+		twopence_timer_unpause(conn->resume.timer);
+}
+
+static void
+twopence_conn_unlink_detached(twopence_conn_t *conn)
+{
+	twopence_conn_t **pos;
+
+	pthread_mutex_lock(&twopence_conn_detached_lock);
+	for (pos = &twopence_conn_detached; *pos; pos = &(*pos)->resume.next) {
+		if (*pos == conn) {
+			*pos = conn->resume.next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&twopence_conn_detached_lock);
+	conn->resume.next = NULL;
+	twopence_conn_cancel_timer(&conn->resume.timer);
+}
+
+static twopence_conn_t *
+twopence_conn_find_detached(unsigned int client_id)
+{
+	twopence_conn_t *conn;
+
+	pthread_mutex_lock(&twopence_conn_detached_lock);
+	for (conn = twopence_conn_detached; conn; conn = conn->resume.next) {
+		if (conn->client_id == client_id)
+			break;
+	}
+	pthread_mutex_unlock(&twopence_conn_detached_lock);
+	return conn;
+}
+
+bool
+twopence_conn_is_detached(const twopence_conn_t *conn)
+{
+	return conn->client_sock != NULL && twopence_sock_is_detached(conn->client_sock);
+}
+
+/*
+ * The pool keeps count of its detached sessions, so that it can tell
+ * when there is nothing left but sessions waiting to be resumed.
+ */
+static void
+twopence_conn_update_detached(twopence_conn_t *conn)
+{
+	bool detached = conn->pool != NULL && twopence_conn_is_detached(conn);
+
+	if (detached == conn->counted_detached)
+		return;
+
+	if (detached)
+		conn->pool->ndetached++;
+	else
+		conn->pool->ndetached--;
+	conn->counted_detached = detached;
+}
+
+static void
+twopence_conn_resume_timeout(twopence_timer_t *timer, void *user_data)
+{
+	twopence_conn_t *conn = user_data;
+
+	conn->resume.timer = NULL;
+	if (!twopence_conn_is_detached(conn))
+		return;
+
+	twopence_log_error("session %u was not resumed within %u seconds, closing",
+			conn->client_id, conn->resume.grace);
+	twopence_conn_unlink_detached(conn);
+	twopence_conn_cancel_transactions(conn, TWOPENCE_TRANSPORT_ERROR);
+	twopence_conn_close(conn);
+}
+
+/*
+ * The transport went away. If the session can be resumed, close the
+ * socket but keep everything else around for the grace period.
+ * Returns false if the caller should close the connection instead.
+ */
+static bool
+twopence_conn_transport_lost(twopence_conn_t *conn)
+{
+	if (!conn->resume.enabled || conn->client_sock == NULL)
+		return false;
+
+	if (twopence_sock_is_detached(conn->client_sock))
+		return true;
+
+	if (conn->transactions.head)
+		twopence_log_error("transport lost while there were pending transactions; keeping session %u for %u seconds",
+				conn->client_id, conn->resume.grace);
+	else
+		twopence_debug("transport lost; keeping session %u for %u seconds",
+				conn->client_id, conn->resume.grace);
+
+	twopence_sock_detach(conn->client_sock);
+	twopence_conn_update_detached(conn);
+	if (twopence_timer_create(1000 * conn->resume.grace, &conn->resume.timer) >= 0)
+		twopence_timer_set_callback(conn->resume.timer, twopence_conn_resume_timeout, conn);
+
+	pthread_mutex_lock(&twopence_conn_detached_lock);
+	conn->resume.next = twopence_conn_detached;
+	twopence_conn_detached = conn;
+	pthread_mutex_unlock(&twopence_conn_detached_lock);
+	return true;
+}
+
+/*
+ * Resume a detached session on the transport of @sock, after the peer
+ * told us it received @received packets so far.
+ */
+bool
+twopence_conn_resume(twopence_conn_t *conn, twopence_sock_t *sock, uint32_t received)
+{
+	if (!twopence_sock_reattach(conn->client_sock, sock, received))
+		return false;
+
+	twopence_conn_unlink_detached(conn);
+	twopence_conn_update_detached(conn);
+	twopence_ready_mark(&conn->ready);
+
+	/* The peer learns what we received from the HELLO packet */
+	conn->resume.acked = conn->resume.received;
+	conn->resume.unacked_bytes = 0;
+
+	/* The handshake may have taken a while */
+	twopence_loop_clock_update(NULL);
+	twopence_conn_update_recv_keepalive(conn);
+	twopence_debug("session %u resumed", conn->client_id);
+	return true;
+}
+
+/*
+ * Acknowledge the packets we received, so that the peer can drop them.
+ * Unless @force is given, wait until a few of them have accumulated.
+ */
+static void
+twopence_conn_send_ack(twopence_conn_t *conn, bool force)
+{
+	twopence_protocol_state_t ps = { .cid = conn->client_id, .xid = 0 };
+
+	if (!conn->resume.enabled || conn->resume.received == conn->resume.acked)
+		return;
+
+	if (!force
+	 && conn->resume.received - conn->resume.acked < TWOPENCE_PROTO_ACK_PACKETS
+	 && conn->resume.unacked_bytes < TWOPENCE_PROTO_ACK_WINDOW * conn->max_packet)
+		return;
+
+	twopence_sock_queue_ctrl(conn->client_sock,
+			twopence_protocol_build_ack_packet(&ps, conn->resume.received));
+	conn->resume.acked = conn->resume.received;
+	conn->resume.unacked_bytes = 0;
+}
+
+/*
+ * The receive buffer must be able to hold a complete packet
+ * plus the start of the next one. If we negotiated a larger
+ * max packet size, replace it with a larger one.
+ */
+static void
+twopence_conn_resize_recvbuf(twopence_conn_t *conn)
+{
+	twopence_buf_t *bp, *nbp;
+
+	bp = twopence_sock_get_recvbuf(conn->client_sock);
+	if (bp == NULL || bp->size >= 2 * conn->max_packet)
+		return;
+
+	/* After resuming a session, this may already hold the first
+	 * packets the peer retransmitted */
+	nbp = twopence_buf_new_ring(2 * conn->max_packet);
+	twopence_buf_append(nbp, twopence_buf_head(bp), twopence_buf_count(bp));
+	twopence_buf_advance_head(bp, twopence_buf_count(bp));
+	twopence_sock_post_recvbuf(conn->client_sock, nbp);
+}
+
 void
 twopence_conn_set_keepalive(twopence_conn_t *conn, int keepalive)
 {
+	/* The timeouts may change, so start over */
+	twopence_conn_cancel_timer(&conn->keepalive.send_timer);
+	twopence_conn_cancel_timer(&conn->keepalive.recv_timer);
+
 	if (keepalive == 0) {
 		twopence_debug("disable keepalives");
 		memset(&conn->keepalive, 0, sizeof(conn->keepalive));
@@ -120,6 +511,8 @@ twopence_conn_set_keepalive(twopence_conn_t *conn, int keepalive)
 
 		conn->keepalive.recv_timeout = keepalive;
 
+		/* We're not inside the event loop, so the loop clock may be stale */
+		twopence_loop_clock_update(NULL);
 		twopence_conn_update_send_keepalive(conn);
 		twopence_conn_update_recv_keepalive(conn);
 	}
@@ -142,6 +535,10 @@ twopence_conn_close(twopence_conn_t *conn)
 	if (conn->client_sock)
 		twopence_sock_free(conn->client_sock);
 	conn->client_sock = NULL;
+
+	/* Have the event loop drop us from the pool */
+	twopence_conn_update_detached(conn);
+	twopence_ready_mark(&conn->ready);
 }
 
 bool
@@ -155,42 +552,128 @@ twopence_conn_free(twopence_conn_t *conn)
 {
 	twopence_transaction_t *trans;
 
+	if (conn->pool)
+		twopence_conn_pool_remove_connection(conn);
 	twopence_conn_unlink(conn);
+	twopence_conn_unlink_detached(conn);
+	twopence_conn_cancel_timer(&conn->keepalive.send_timer);
+	twopence_conn_cancel_timer(&conn->keepalive.recv_timer);
 	twopence_conn_close(conn);
 	while ((trans = conn->transactions.head) != NULL) {
 		twopence_transaction_unlink(trans);
 		twopence_transaction_free(trans);
 	}
+	while ((trans = conn->done_transactions.head) != NULL) {
+		twopence_transaction_unlink(trans);
+		twopence_transaction_free(trans);
+	}
+	twopence_transaction_list_destroy(&conn->transactions);
+	twopence_transaction_list_destroy(&conn->done_transactions);
+	twopence_pollgroup_destroy(&conn->poll);
+	twopence_conn_report_compress_stats(conn);
 	free(conn);
 }
 
 void
-twopence_conn_update_send_keepalive(twopence_conn_t *conn)
+twopence_conn_send_keepalive(twopence_conn_t *conn)
+{
+	twopence_protocol_state_t ps = { .cid = conn->client_id, .xid = 0 };
+
+	twopence_debug("send a keepalive packet");
+	twopence_sock_queue_ctrl(conn->client_sock,
+			twopence_protocol_build_simple_packet_ps(&ps, TWOPENCE_PROTO_TYPE_KEEPALIVE));
+	twopence_conn_send_ack(conn, true);
+
+	/* The keepalive goes out ahead of any queued data, but if the link
+	 * is congested, it may not have been sent yet. Do not queue
+	 * another one before the next one is due. */
+	twopence_loop_clock_get(&conn->keepalive.send_deadline);
+	conn->keepalive.send_deadline.tv_sec += conn->keepalive.send_timeout;
+}
+
+static void
+twopence_conn_send_keepalive_timeout(twopence_timer_t *timer, void *user_data)
+{
+	twopence_conn_t *conn = user_data;
+	struct timeval now;
+
+	conn->keepalive.send_timer = NULL;
+
+	/* While detached, there is nobody to talk to. Once the session
+	 * has been resumed, twopence_conn_update_send_keepalive will
+	 * arm the timer again. */
+	if (conn->client_sock == NULL || twopence_conn_is_detached(conn))
+		return;
+
+	twopence_loop_clock_get(&now);
+	if (!timercmp(&now, &conn->keepalive.send_deadline, <)) {
+		/* FIXME: If the socket's send queue is jammed, warn about it */
+
+		/* Transmit a keepalive packet */
+		twopence_conn_send_keepalive(conn);
+	}
+
+	twopence_conn_arm_timer(conn, &conn->keepalive.send_timer, &conn->keepalive.send_deadline,
+			twopence_conn_send_keepalive_timeout);
+}
+
+static void
+twopence_conn_recv_keepalive_timeout(twopence_timer_t *timer, void *user_data)
 {
-	if (conn->keepalive.send_timeout != 0
-	 && conn->client_sock != NULL
-	 && twopence_sock_get_xmit_ts(conn->client_sock, &conn->keepalive.send_deadline))
-		conn->keepalive.send_deadline.tv_sec += conn->keepalive.send_timeout;
+	twopence_conn_t *conn = user_data;
+	struct timeval now;
+
+	conn->keepalive.recv_timer = NULL;
+
+	/* Resuming the session arms the timer again */
+	if (conn->client_sock == NULL || twopence_conn_is_detached(conn))
+		return;
+
+	twopence_loop_clock_get(&now);
+	if (timercmp(&now, &conn->keepalive.recv_deadline, <)) {
+		twopence_conn_arm_timer(conn, &conn->keepalive.recv_timer, &conn->keepalive.recv_deadline,
+				twopence_conn_recv_keepalive_timeout);
+		return;
+	}
+
+	/* A peer that stops talking on a working link is hung rather
+	 * than disconnected, so this is not something we resume from */
+	twopence_log_error("link is idle for too long, closing");
+	twopence_conn_close(conn);
 }
 
 void
-twopence_conn_update_recv_keepalive(twopence_conn_t *conn)
+twopence_conn_update_send_keepalive(twopence_conn_t *conn)
 {
-	if (conn->keepalive.recv_timeout != 0) {
-		gettimeofday(&conn->keepalive.recv_deadline, NULL);
-		conn->keepalive.recv_deadline.tv_sec += conn->keepalive.recv_timeout;
+	struct timeval deadline;
+
+	if (conn->keepalive.send_timeout == 0 || conn->client_sock == NULL)
+		return;
+
+	/* Never move the deadline backwards; see twopence_conn_send_keepalive */
+	if (twopence_sock_get_xmit_ts(conn->client_sock, &deadline)) {
+		deadline.tv_sec += conn->keepalive.send_timeout;
+		if (timercmp(&deadline, &conn->keepalive.send_deadline, >))
+			conn->keepalive.send_deadline = deadline;
 	}
+
+	if (conn->keepalive.send_timer == NULL && timerisset(&conn->keepalive.send_deadline))
+		twopence_conn_arm_timer(conn, &conn->keepalive.send_timer, &conn->keepalive.send_deadline,
+				twopence_conn_send_keepalive_timeout);
 }
 
 void
-twopence_conn_send_keepalive(twopence_conn_t *conn)
+twopence_conn_update_recv_keepalive(twopence_conn_t *conn)
 {
-	twopence_protocol_state_t ps = { .cid = conn->client_id, .xid = 0 };
+	if (conn->keepalive.recv_timeout == 0 || conn->client_sock == NULL)
+		return;
 
-	twopence_debug("send a keepalive packet");
-	twopence_sock_xmit(conn->client_sock,
-			twopence_protocol_build_simple_packet_ps(&ps, TWOPENCE_PROTO_TYPE_KEEPALIVE));
-	twopence_conn_update_send_keepalive(conn);
+	twopence_loop_clock_get(&conn->keepalive.recv_deadline);
+	conn->keepalive.recv_deadline.tv_sec += conn->keepalive.recv_timeout;
+
+	if (conn->keepalive.recv_timer == NULL)
+		twopence_conn_arm_timer(conn, &conn->keepalive.recv_timer, &conn->keepalive.recv_deadline,
+				twopence_conn_recv_keepalive_timeout);
 }
 
 int
@@ -209,57 +692,151 @@ twopence_conn_accept(twopence_conn_t *conn)
 	return twopence_sock_accept(conn->client_sock);
 }
 
-unsigned int
-twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
+/*
+ * Returns false if the transport is gone, and the connection has been closed
+ */
+static bool
+twopence_conn_check_transport(twopence_conn_t *conn)
 {
-	unsigned int current_num_fds = pinfo->num_fds;
-	twopence_transaction_t *trans;
 	twopence_sock_t *sock;
-	int rc;
 
-	sock = conn->client_sock;
-	if (sock && twopence_sock_is_dead(sock)) {
+	/* Closed by one of our timers, or after an I/O error */
+	if ((sock = conn->client_sock) == NULL)
+		return false;
+
+	if (twopence_sock_is_dead(sock) && !twopence_conn_transport_lost(conn)) {
 		twopence_debug("connection: client socket is dead, closing\n");
-		conn->client_sock = NULL;
-		twopence_sock_free(sock);
-		return 0;
+		twopence_conn_close(conn);
+		return false;
 	}
+	return true;
+}
 
-	for (trans = conn->transactions.head; trans; trans = trans->next) {
-		if ((rc = twopence_transaction_fill_poll(trans, pinfo)) < 0) {
-			/* most likely a timeout */
-			twopence_transaction_set_error(trans, rc);
-		}
-	}
+static void
+twopence_conn_fill_poll_transport(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
+{
+	twopence_sock_t *sock;
+
+	/* While detached, we keep servicing the transactions, but there is
+	 * nothing to do for the transport. */
+	if (twopence_conn_is_detached(conn))
+		return;
 
 	if ((sock = conn->client_sock) != NULL) {
 		twopence_sock_prepare_poll(sock);
 
 		/* Make sure we have a receive buffer posted. */
-		twopence_sock_post_recvbuf_if_needed(sock, TWOPENCE_PROTO_MAX_PACKET);
+		twopence_conn_resize_recvbuf(conn);
+		twopence_sock_post_recvbuf_if_needed(sock, 2 * conn->max_packet);
 
 		twopence_sock_fill_poll(sock, pinfo);
 	}
+}
 
-	/* Check the keepalive timers */
-	if (!twopence_timeout_update(&pinfo->timeout, &conn->keepalive.send_deadline)) {
-		/* FIXME: If the socket's send queue is jammed, warn about it */
-
-		/* Transmit a keepalive packet */
-		twopence_conn_send_keepalive(conn);
+unsigned int
+twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
+{
+	unsigned int current_num_fds = pinfo->num_fds;
+	twopence_transaction_t *trans;
+	int rc;
 
-		twopence_timeout_update(&pinfo->timeout, &conn->keepalive.send_deadline);
-	}
-	if (!twopence_timeout_update(&pinfo->timeout, &conn->keepalive.recv_deadline)) {
-		twopence_log_error("link is idle for too long, closing");
-		twopence_conn_close(conn);
+	if (!twopence_conn_check_transport(conn))
 		return 0;
+
+	/* Transaction timeouts, keepalives and the grace period of a detached
+	 * session are timers, which we don't have to check here. */
+	for (trans = conn->transactions.head; trans; trans = trans->next) {
+		if ((rc = twopence_transaction_fill_poll(trans, pinfo)) < 0)
+			twopence_transaction_set_error(trans, rc);
 	}
 
+	twopence_conn_fill_poll_transport(conn, pinfo);
+
 	/* Return the number of fds we've added */
 	return pinfo->num_fds - current_num_fds;
 }
 
+/*
+ * With epoll, the event loop only looks at the transactions on the
+ * ready list of the connection.
+ */
+static void
+twopence_conn_watch_transaction(twopence_conn_t *conn, twopence_transaction_t *trans)
+{
+	twopence_ready_attach(&trans->ready, &conn->ready_transactions);
+	twopence_ready_attach(&trans->xmit_wait, &conn->xmit_waiters);
+	twopence_ready_mark(&trans->ready);
+}
+
+static void
+twopence_conn_unwatch_transaction(twopence_transaction_t *trans)
+{
+	twopence_ready_detach(&trans->ready);
+	twopence_ready_detach(&trans->xmit_wait);
+	twopence_epoll_unwatch(&trans->poll);
+}
+
+/*
+ * Fill in the poll group of a transaction, and register it.
+ * Returns false if epoll cannot handle its fds.
+ */
+static bool
+twopence_conn_epoll_fill_transaction(twopence_epoll_t *ep, twopence_transaction_t *trans)
+{
+	twopence_pollinfo_t *pinfo;
+	int rc;
+
+	pinfo = twopence_pollgroup_prepare(&trans->poll, twopence_transaction_num_channels(trans));
+	if ((rc = twopence_transaction_fill_poll(trans, pinfo)) < 0)
+		twopence_transaction_set_error(trans, rc);
+
+	if (trans->done) {
+		/* Complete it in this round */
+		twopence_ready_mark(&trans->ready);
+	} else
+	if (twopence_sock_flow_pending(trans->socket, trans->id)) {
+		/* Its sources are not polled until some of its data
+		 * has gone out */
+		twopence_ready_mark(&trans->xmit_wait);
+	}
+
+	return twopence_epoll_watch(ep, &trans->poll);
+}
+
+/*
+ * Fill in the poll groups of the transactions on our ready list, and
+ * of the transport. Returns false if epoll cannot handle our fds.
+ */
+static bool
+twopence_conn_epoll_fill(twopence_epoll_t *ep, twopence_conn_t *conn)
+{
+	twopence_ready_t marker, *node;
+
+	if (!twopence_conn_check_transport(conn))
+		return true;
+
+	twopence_ready_list_mark_end(&conn->ready_transactions, &marker);
+	while ((node = twopence_ready_list_pop(&conn->ready_transactions)) != &marker) {
+		if (!twopence_conn_epoll_fill_transaction(ep, node->owner)) {
+			twopence_ready_unlink(&marker);
+			return false;
+		}
+	}
+
+	twopence_conn_fill_poll_transport(conn, twopence_pollgroup_prepare(&conn->poll, 1));
+	if (!twopence_epoll_watch(ep, &conn->poll))
+		return false;
+
+	/* Filling in the transport covers what the transactions queued to
+	 * it. We only need to stay on the ready list if one of the
+	 * transactions is done. */
+	if (conn->ready_transactions.head == NULL)
+		twopence_ready_unlink(&conn->ready);
+	else
+		twopence_ready_mark(&conn->ready);
+	return true;
+}
+
 /*
  * Add a transaction to the connection
  */
@@ -267,6 +844,8 @@ void
 twopence_conn_add_transaction(twopence_conn_t *conn, twopence_transaction_t *trans)
 {
 	twopence_transaction_list_insert(&conn->transactions, trans);
+	if (conn->ready.list)
+		twopence_conn_watch_transaction(conn, trans);
 }
 
 void
@@ -278,15 +857,16 @@ twopence_conn_add_transaction_done(twopence_conn_t *conn, twopence_transaction_t
 twopence_transaction_t *
 twopence_conn_reap_transaction(twopence_conn_t *conn, int wait_for_xid)
 {
-	twopence_transaction_t *rover;
+	twopence_transaction_t *trans;
 
-	for (rover = conn->done_transactions.head; rover != NULL; rover = rover->next) {
-		if (wait_for_xid == 0 || rover->id == wait_for_xid) {
-			twopence_transaction_unlink(rover);
-			return rover;
-		}
-	}
-	return NULL;
+	if (wait_for_xid == 0)
+		trans = conn->done_transactions.head;
+	else
+		trans = twopence_transaction_list_find(&conn->done_transactions, wait_for_xid);
+
+	if (trans != NULL)
+		twopence_transaction_unlink(trans);
+	return trans;
 }
 
 bool
@@ -295,10 +875,32 @@ twopence_conn_has_pending_transactions(const twopence_conn_t *conn)
 	return conn->transactions.head != NULL;
 }
 
+/*
+ * A connection is idle if it is up, has nothing left to send, and
+ * no transactions, running or finished. Such a connection can be handed
+ * to a new owner.
+ */
+bool
+twopence_conn_is_idle(const twopence_conn_t *conn)
+{
+	return conn->client_sock != NULL
+	    && !twopence_conn_is_detached(conn)
+	    && conn->transactions.head == NULL
+	    && conn->done_transactions.head == NULL
+	    && twopence_sock_xmit_queue_bytes(conn->client_sock) == 0;
+}
+
+unsigned int
+twopence_conn_get_keepalive(const twopence_conn_t *conn)
+{
+	return conn->keepalive.recv_timeout;
+}
+
 static void
 twopence_conn_transaction_complete(twopence_conn_t *conn, twopence_transaction_t *trans)
 {
 	twopence_transaction_unlink(trans);
+	twopence_conn_unwatch_transaction(trans);
 
 	/* In the server, we're no longer interested in the transaction once
 	 * we're finished with it. On the client side, we do not dispose of it
@@ -333,22 +935,48 @@ twopence_conn_cancel_transactions(twopence_conn_t *conn, int error)
  * Find the transaction corresponding to a given XID.
  */
 twopence_transaction_t *
-twopence_conn_find_transaction(twopence_conn_t *conn, uint16_t xid)
+twopence_conn_find_transaction(twopence_conn_t *conn, uint32_t xid)
 {
-	twopence_transaction_t *trans;
-
-	for (trans = conn->transactions.head; trans; trans = trans->next) {
-		if (trans->id == xid)
-			return trans;
-	}
-
-	return NULL;
+	return twopence_transaction_list_find(&conn->transactions, xid);
 }
 
 twopence_transaction_t *
 twopence_conn_transaction_new(twopence_conn_t *conn, unsigned int type, const twopence_protocol_state_t *ps)
 {
-	return twopence_transaction_new(conn->client_sock, type, ps);
+	twopence_transaction_t *trans;
+
+	trans = twopence_transaction_new(conn->client_sock, type, ps);
+	trans->stats.compress = &conn->compress_stats;
+	return trans;
+}
+
+/*
+ * A client reconnected on @conn, and asks to resume session @client_id.
+ * If we still have it, move the new transport over to it. The connection
+ * we received the HELLO on is left without a transport, and goes away.
+ */
+static bool
+twopence_conn_resume_session(twopence_conn_t *conn, unsigned int client_id, unsigned int version,
+		twopence_protocol_resume_t *resume)
+{
+	twopence_conn_t *session;
+	twopence_protocol_resume_t my_resume;
+
+	if ((session = twopence_conn_find_detached(client_id)) == NULL) {
+		twopence_log_error("client asks to resume session %u, which is gone; starting a new session", client_id);
+		return false;
+	}
+
+	if (!twopence_conn_resume(session, conn->client_sock, resume->received))
+		return false;
+
+	twopence_conn_get_resume_state(session, &my_resume);
+
+	/* This has to go out ahead of the packets we retransmit */
+	twopence_sock_queue_ctrl(session->client_sock,
+			twopence_protocol_build_hello_packet(session->client_id, session->keepalive.recv_timeout, version,
+				session->max_packet, session->compress, &my_resume));
+	return true;
 }
 
 static bool
@@ -357,15 +985,52 @@ twopence_conn_process_hello(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 {
 	unsigned char client_version[2];
 	unsigned int his_keepalive, my_keepalive;
+	unsigned int version, max_packet, compress;
+	twopence_protocol_resume_t resume;
+	unsigned int resume_cid = ps->cid;
 
-	if (!twopence_protocol_dissect_hello_packet(payload, client_version, &his_keepalive)) {
+	if (!twopence_protocol_dissect_hello_packet(payload, client_version, &his_keepalive, &max_packet, &compress, &resume)) {
 		twopence_debug("bad HELLO packet from client");
 		client_version[0] = client_version[1] = 0;
 		his_keepalive = 0;
+		max_packet = TWOPENCE_PROTO_MAX_PACKET;
+		compress = 0;
+		resume_cid = 0;
+	}
+
+	twopence_debug("hello/%u received from client (version %u.%u, keepalive=%u, max packet %u, compression 0x%x)",
+			ps->xid, client_version[0], client_version[1], his_keepalive, max_packet, compress);
+
+	/* Talk version 3 to older clients. Version 3 does not know
+	 * about jumbo frames or compression. */
+	if (client_version[0] >= TWOPENCE_PROTOCOL_VERSMAJOR) {
+		version = TWOPENCE_PROTOCOL_VERSION;
+		if (client_version[0] == TWOPENCE_PROTOCOL_VERSMAJOR
+		 && client_version[1] < TWOPENCE_PROTOCOL_VERSMINOR)
+			version = (TWOPENCE_PROTOCOL_VERSMAJOR << 8) | client_version[1];
+		if (max_packet > TWOPENCE_PROTO_MAX_JUMBO)
+			max_packet = TWOPENCE_PROTO_MAX_JUMBO;
+
+		/* Pick the first algorithm we both support */
+		compress &= twopence_protocol_compress_supported();
+		compress &= -compress;
+	} else {
+		version = TWOPENCE_PROTOCOL_VERSMAJOR_COMPAT << 8;
+		max_packet = TWOPENCE_PROTO_MAX_PACKET;
+		compress = 0;
 	}
 
-	twopence_debug("hello/%u received from client (version %u.%u, keepalive=%u)",
-			ps->xid, client_version[0], client_version[1], his_keepalive);
+	/* A client that presents its old client id wants to resume that session */
+	if (resume_cid != 0 && version >= TWOPENCE_PROTOCOL_VERSION_RESUME
+	 && twopence_conn_resume_session(conn, resume_cid, version, &resume))
+		return true;
+
+	twopence_conn_set_max_packet(conn, max_packet);
+	twopence_conn_set_compression(conn, compress);
+	twopence_conn_set_flow_control(conn, version >= TWOPENCE_PROTOCOL_VERSION_FLOW_CONTROL);
+	twopence_conn_set_resumable(conn, version >= TWOPENCE_PROTOCOL_VERSION_RESUME);
+	conn->rusage = (version >= TWOPENCE_PROTOCOL_VERSION_RUSAGE);
+	conn->timestamps = (version >= TWOPENCE_PROTOCOL_VERSION_TIMESTAMPS);
 
 	if (his_keepalive == 0xFFFF)
 		his_keepalive = TWOPENCE_PROTO_DEFAULT_KEEPALIVE;
@@ -377,8 +1042,10 @@ twopence_conn_process_hello(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 		my_keepalive = his_keepalive;
 	twopence_conn_set_keepalive(conn, my_keepalive);
 
+	resume.grace = conn->resume.enabled? conn->resume.grace : 0;
+	resume.received = 0;
 	twopence_sock_queue_xmit(conn->client_sock,
-			twopence_protocol_build_hello_packet(conn->client_id, my_keepalive));
+			twopence_protocol_build_hello_packet(conn->client_id, my_keepalive, version, max_packet, compress, &resume));
 	return true;
 }
 
@@ -391,8 +1058,8 @@ twopence_conn_process_request(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 	if (!conn->semantics || !conn->semantics->process_request)
 		return false;
 
-	trans = twopence_transaction_new(conn->client_sock, hdr->type, ps);
-	if (!conn->semantics->process_request(trans, payload)) {
+	trans = twopence_conn_transaction_new(conn, hdr->type, ps);
+	if (!conn->semantics->process_request(conn, trans, payload)) {
 #if 0
 		twopence_debug("bad %s packet in incoming request",
 			twopence_protocol_packet_type_to_name(hdr->type));
@@ -429,12 +1096,23 @@ twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp)
 			/* kill the connection? */
 			return false;
 		}
+		ps.max_packet = conn->max_packet;
+		ps.compress = conn->compress;
+		ps.flow_control = conn->flow_control;
+		ps.resume = conn->resume.enabled;
+		ps.rusage = conn->rusage;
+		ps.timestamps = conn->timestamps;
 		twopence_debug("connection_process_packet cid=%u xid=%u type=%c len=%u\n",
 				ps.cid, ps.xid, hdr->type, twopence_buf_count(&payload));
 
-		if (hdr->type == TWOPENCE_PROTO_TYPE_HELLO && ps.cid == 0) {
+		if (hdr->type == TWOPENCE_PROTO_TYPE_HELLO && (ps.cid == 0 || ps.cid != conn->client_id)) {
 			/* Process HELLO packet from client */
 			twopence_conn_process_hello(conn, hdr, &payload, &ps);
+
+			/* If the client resumed another session, the rest of
+			 * the receive buffer belongs to that session now. */
+			if (twopence_sock_get_recvbuf(conn->client_sock) != bp)
+				return true;
 			continue;
 		}
 
@@ -449,6 +1127,20 @@ twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp)
 			continue;
 		}
 
+		if (hdr->type == TWOPENCE_PROTO_TYPE_ACK) {
+			uint32_t received;
+
+			if (!twopence_protocol_dissect_ack_packet(&payload, &received)
+			 || !twopence_sock_replay_ack(conn->client_sock, received))
+				twopence_log_error("bad ACK packet from peer");
+			continue;
+		}
+
+		if (conn->resume.enabled) {
+			conn->resume.received++;
+			conn->resume.unacked_bytes += twopence_buf_count(&payload);
+		}
+
 		trans = twopence_conn_find_transaction(conn, ps.xid);
 		if (trans != NULL) {
 			twopence_transaction_recv_packet(trans, hdr, &payload);
@@ -456,6 +1148,7 @@ twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp)
 			switch (hdr->type) {
 			case TWOPENCE_PROTO_TYPE_CHAN_DATA:
 			case TWOPENCE_PROTO_TYPE_CHAN_EOF:
+			case TWOPENCE_PROTO_TYPE_CHAN_CREDIT:
 			case TWOPENCE_PROTO_TYPE_INTR:
 				/* Due to bad timing, we may receive the stdin EOF indication from the
 				 * client after the process as exited. In this case, the transaction
@@ -489,6 +1182,10 @@ twopence_conn_process_incoming(twopence_conn_t *conn)
 			/* Something went wrong */
 			return false;
 		}
+
+		/* The buffer has been handed over to a resumed session */
+		if (twopence_sock_get_recvbuf(conn->client_sock) != bp)
+			return true;
 	}
 
 	if (twopence_buf_count(bp) == 0) {
@@ -498,26 +1195,37 @@ twopence_conn_process_incoming(twopence_conn_t *conn)
 		/* There's an incomplete packet after the end of
 		 * the one(s) we just processed.
 		 * Make sure we still have ample tailroom
-		 * to receive the rest of the packet.
+		 * to receive the rest of the packet. For the ring
+		 * buffer we normally use, compacting does not move
+		 * any data, and it cannot grow; if there is still not
+		 * enough room, we would stop reading from the socket
+		 * and hang forever.
 		 */
-		if (twopence_buf_tailroom_max(bp) < TWOPENCE_PROTO_MAX_PACKET)
+		if (twopence_buf_tailroom(bp) < conn->max_packet) {
 			twopence_buf_compact(bp);
+			if (!twopence_buf_ensure_tailroom(bp, conn->max_packet)) {
+				twopence_log_error("no room in receive buffer for the rest of a packet");
+				twopence_sock_mark_dead(conn->client_sock);
+			}
+		}
 	}
 
 	return true;
 }
 
-int
-twopence_conn_doio(twopence_conn_t *conn)
+static int
+twopence_conn_doio_transport(twopence_conn_t *conn)
 {
-	twopence_transaction_t *trans, *next;
 	twopence_sock_t *sock;
 
-	if ((sock = conn->client_sock) != NULL) {
+	if ((sock = conn->client_sock) != NULL && !twopence_sock_is_detached(sock)) {
 		if (twopence_sock_doio(sock) < 0) {
-			twopence_log_error("I/O error on socket: %m\n");
-			twopence_conn_close(conn);
-			return TWOPENCE_TRANSPORT_ERROR;
+			if (!twopence_conn_transport_lost(conn)) {
+				twopence_log_error("I/O error on socket: %m\n");
+				twopence_conn_close(conn);
+				return TWOPENCE_TRANSPORT_ERROR;
+			}
+			return 0;
 		}
 
 		/* See if we have received one or more complete packets */
@@ -532,7 +1240,12 @@ twopence_conn_doio(twopence_conn_t *conn)
 			 * current transaction to the client.
 			 * Otherwise, we are really done with this socket and
 			 * can close it.
+			 * If the session can be resumed, there is no point in
+			 * sending anything; we will do that once the client
+			 * is back.
 			 */
+			if (twopence_conn_transport_lost(conn))
+				return 0;
 			if (twopence_sock_xmit_queue_bytes(sock) == 0)
 				twopence_sock_mark_dead(sock);
 		}
@@ -542,20 +1255,44 @@ twopence_conn_doio(twopence_conn_t *conn)
 			twopence_conn_close(conn);
 			return 0;
 		}
+
+		twopence_conn_send_ack(conn, false);
 	}
 
+	return 0;
+}
+
+/*
+ * Returns true if the transaction is done
+ */
+static bool
+twopence_conn_doio_transaction(twopence_conn_t *conn, twopence_transaction_t *trans)
+{
+	twopence_transaction_doio(trans);
+	if (!trans->done)
+		return false;
+
+	/* Remove the transaction from the list of pending.
+	 * Depending on the semantics, this may free the
+	 * transaction, or move it to the list of completed
+	 * transactions, or doing something yet entirely
+	 * different. */
+	twopence_conn_transaction_complete(conn, trans);
+	return true;
+}
+
+int
+twopence_conn_doio(twopence_conn_t *conn)
+{
+	twopence_transaction_t *trans, *next;
+	int rc;
+
+	if ((rc = twopence_conn_doio_transport(conn)) < 0)
+		return rc;
+
 	for (trans = conn->transactions.head; trans != NULL; trans = next) {
 		next = trans->next;
-
-		twopence_transaction_doio(trans);
-		if (trans->done) {
-			/* Remove the transaction from the list of pending.
-			 * Depending on the semantics, this may free the
-			 * transaction, or move it to the list of completed
-			 * transactions, or doing something yet entirely
-			 * different. */
-			twopence_conn_transaction_complete(conn, trans);
-		}
+		twopence_conn_doio_transaction(conn, trans);
 	}
 
 	/* If anything has been sent down the socket, update our keepalive xmit timer */
@@ -564,47 +1301,226 @@ twopence_conn_doio(twopence_conn_t *conn)
 	return 0;
 }
 
-struct twopence_connection_pool {
-	twopence_conn_list_t	connections;
+/*
+ * With epoll, only service the transactions on our ready list, and
+ * those waiting for the transport's queue to drain if it did.
+ */
+static int
+twopence_conn_epoll_doio(twopence_conn_t *conn)
+{
+	twopence_ready_t marker, *node;
+	unsigned int queued = 0;
+	int rc;
 
-	struct {
-		void		(*close_connection)(twopence_conn_t *);
-	} callbacks;
-};
+	if (conn->client_sock)
+		queued = twopence_sock_xmit_queue_bytes(conn->client_sock);
+
+	if ((rc = twopence_conn_doio_transport(conn)) < 0)
+		return rc;
+
+	if (conn->client_sock == NULL || twopence_sock_xmit_queue_bytes(conn->client_sock) < queued) {
+		while ((node = twopence_ready_list_pop(&conn->xmit_waiters)) != NULL) {
+			twopence_transaction_t *trans = node->owner;
+
+			twopence_ready_mark(&trans->ready);
+		}
+	}
+
+	/* This includes the transactions that just received packets */
+	twopence_ready_list_mark_end(&conn->ready_transactions, &marker);
+	while ((node = twopence_ready_list_pop(&conn->ready_transactions)) != &marker) {
+		twopence_transaction_t *trans = node->owner;
+
+		/* Fill in its pollinfo again in the next round */
+		if (!twopence_conn_doio_transaction(conn, trans))
+			twopence_ready_mark(&trans->ready);
+	}
+
+	twopence_conn_update_send_keepalive(conn);
+	return 0;
+}
 
 twopence_conn_pool_t *
-twopence_conn_pool_new(void)
+twopence_conn_pool_new_backend(twopence_conn_pool_backend_t backend)
 {
 	twopence_conn_pool_t *pool;
 
 	pool = twopence_calloc(1, sizeof(*pool));
 	pool->callbacks.close_connection = twopence_conn_free;
+	twopence_ready_list_init(&pool->ready, NULL);
+
+	if (backend == TWOPENCE_CONN_POOL_DEFAULT) {
+		const char *env = getenv("TWOPENCE_POLL_BACKEND");
+
+		if (env && !strcmp(env, "ppoll"))
+			backend = TWOPENCE_CONN_POOL_PPOLL;
+		else
+			backend = TWOPENCE_CONN_POOL_EPOLL;
+	}
+
+	/* If epoll is not available, silently fall back to ppoll */
+	if (backend == TWOPENCE_CONN_POOL_EPOLL)
+		pool->epoll = twopence_epoll_new();
+
+	twopence_debug("connection pool uses %s", pool->epoll? "epoll" : "ppoll");
 	return pool;
 }
 
+twopence_conn_pool_t *
+twopence_conn_pool_new(void)
+{
+	return twopence_conn_pool_new_backend(TWOPENCE_CONN_POOL_DEFAULT);
+}
+
 void
 twopence_conn_pool_set_callback_close_connection(twopence_conn_pool_t *pool, void (*cb)(twopence_conn_t *))
 {
 	pool->callbacks.close_connection = cb;
 }
 
+/*
+ * With epoll, put the connection and all of its transactions on the
+ * ready lists, so that they fill in their poll groups.
+ */
+static void
+twopence_conn_pool_watch(twopence_conn_pool_t *pool, twopence_conn_t *conn)
+{
+	twopence_transaction_t *trans;
+
+	twopence_ready_attach(&conn->ready, &pool->ready);
+	if (conn->client_sock)
+		twopence_sock_set_owner(conn->client_sock, &conn->ready);
+	for (trans = conn->transactions.head; trans; trans = trans->next)
+		twopence_conn_watch_transaction(conn, trans);
+	twopence_ready_mark(&conn->ready);
+}
+
+static void
+twopence_conn_pool_unwatch(twopence_conn_t *conn)
+{
+	twopence_transaction_t *trans;
+
+	for (trans = conn->transactions.head; trans; trans = trans->next)
+		twopence_conn_unwatch_transaction(trans);
+	if (conn->client_sock)
+		twopence_sock_set_owner(conn->client_sock, NULL);
+	twopence_ready_detach(&conn->ready);
+	twopence_epoll_unwatch(&conn->poll);
+}
+
 void
 twopence_conn_pool_add_connection(twopence_conn_pool_t *pool, twopence_conn_t *conn)
 {
 	twopence_conn_list_insert(&pool->connections, conn);
+	conn->pool = pool;
+	pool->nconns++;
+	twopence_conn_update_detached(conn);
+
+	if (pool->epoll)
+		twopence_conn_pool_watch(pool, conn);
+	twopence_conn_unpause_timers(conn);
 }
 
-bool
-twopence_conn_pool_poll(twopence_conn_pool_t *pool)
+/*
+ * Take a connection out of its pool, e.g. to hand it to another thread.
+ * This must be called by the thread owning the pool.
+ */
+void
+twopence_conn_pool_remove_connection(twopence_conn_t *conn)
+{
+	twopence_conn_pool_t *pool = conn->pool;
+
+	twopence_conn_unlink(conn);
+	if (pool != NULL) {
+		twopence_conn_pool_unwatch(conn);
+		if (conn->counted_detached)
+			pool->ndetached--;
+		conn->counted_detached = false;
+		pool->nconns--;
+		conn->pool = NULL;
+	}
+
+	/* Our timers go with the connection */
+	twopence_conn_pause_timers(conn);
+}
+
+static void
+twopence_conn_pool_close_connection(twopence_conn_pool_t *pool, twopence_conn_t *conn)
+{
+	twopence_conn_pool_remove_connection(conn);
+	if (pool->callbacks.close_connection)
+		pool->callbacks.close_connection(conn);
+}
+
+/*
+ * epoll cannot register the same fd twice, which happens when several
+ * transactions write to the same file. Go back to ppoll for good.
+ */
+static void
+twopence_conn_pool_disable_epoll(twopence_conn_pool_t *pool)
+{
+	twopence_conn_t *conn;
+
+	twopence_debug("epoll: cannot handle this set of fds, falling back to ppoll");
+	for (conn = pool->connections.head; conn; conn = conn->next)
+		twopence_conn_pool_unwatch(conn);
+
+	twopence_ready_list_init(&pool->ready, NULL);
+	twopence_epoll_free(pool->epoll);
+	pool->epoll = NULL;
+}
+
+/*
+ * A signal interrupted the wait. We cannot tell whom it was meant for,
+ * e.g. which command exited, so have everybody take a look.
+ */
+static void
+twopence_conn_pool_mark_all(twopence_conn_pool_t *pool)
+{
+	twopence_conn_t *conn;
+	twopence_transaction_t *trans;
+
+	for (conn = pool->connections.head; conn; conn = conn->next) {
+		for (trans = conn->transactions.head; trans; trans = trans->next)
+			twopence_ready_mark(&trans->ready);
+		twopence_ready_mark(&conn->ready);
+	}
+}
+
+/*
+ * epoll_pwait() only lets in the signals of its mask if it has to sleep.
+ * When there are always events, a SIGCHLD could be kept pending
+ * forever. So if one is pending, open the mask briefly ourselves.
+ */
+static bool
+twopence_conn_pool_deliver_signals(const sigset_t *mask)
+{
+	sigset_t pending, omask;
+	int sig;
+
+	if (sigpending(&pending) < 0)
+		return false;
+
+	for (sig = 1; sig < NSIG; ++sig) {
+		if (sigismember(&pending, sig) && !sigismember(mask, sig))
+			break;
+	}
+	if (sig >= NSIG)
+		return false;
+
+	sigprocmask(SIG_SETMASK, mask, &omask);
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	return true;
+}
+
+static bool
+twopence_conn_pool_poll_ppoll(twopence_conn_pool_t *pool, const struct timeval *deadline)
 {
 	twopence_pollinfo_t poll_info;
 	twopence_conn_t *conn, *next;
-	unsigned int maxfds = 0;
+	unsigned int maxfds = 0, nlive = 0;
 	sigset_t mask;
 
-	if (pool->connections.head == NULL)
-		return false;
-
 	for (conn = pool->connections.head; conn; conn = conn->next) {
 		twopence_transaction_t *trans;
 
@@ -620,20 +1536,22 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 	 * This will cause us to pass a timeout value of 0 to ppoll() later
 	 * in twopence_pollinfo_ppoll() */
 	twopence_timers_update_timeout(&poll_info.timeout);
+	if (deadline)
+		(void) twopence_timeout_update(&poll_info.timeout, deadline);
 
 	for (conn = pool->connections.head; conn; conn = next) {
 		next = conn->next;
 
 		if (twopence_conn_fill_poll(conn, &poll_info) == 0) {
 			if (conn->client_sock == NULL) {
-				twopence_conn_unlink(conn);
-
-				if (pool->callbacks.close_connection)
-					pool->callbacks.close_connection(conn);
+				twopence_conn_pool_close_connection(pool, conn);
 				continue;
 			}
-			twopence_debug("connection doesn't wait for anything?!\n");
+			if (!twopence_conn_is_detached(conn))
+				twopence_debug("connection doesn't wait for anything?!\n");
 		}
+		if (!twopence_conn_is_detached(conn))
+			nlive++;
 	}
 
 	if (pool->connections.head == NULL) {
@@ -641,6 +1559,14 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 		return false;
 	}
 
+	/* Detached sessions wait for their client to come back, which
+	 * is up to the caller. Their transactions are serviced whenever
+	 * we are polling for something else anyway. */
+	if (nlive == 0) {
+		twopence_debug("Only detached sessions left\n");
+		return false;
+	}
+
 	/* Query the current sigprocmask, and allow SIGCHLD while we're polling */
 	sigprocmask(SIG_BLOCK, NULL, &mask);
 	sigdelset(&mask, SIGCHLD);
@@ -671,3 +1597,121 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 	return !!pool->connections.head;
 }
 
+/*
+ * With epoll, a round of the event loop only looks at the connections
+ * and transactions on the ready lists: first to fill in their poll
+ * groups, and after waiting, to service them.
+ */
+static bool
+twopence_conn_pool_poll_epoll(twopence_conn_pool_t *pool, const struct timeval *deadline)
+{
+	twopence_ready_t marker, *node;
+	twopence_timeout_t timeout;
+	twopence_conn_t *conn;
+	sigset_t mask;
+	long msec;
+	int n;
+
+	twopence_ready_list_mark_end(&pool->ready, &marker);
+	while ((node = twopence_ready_list_pop(&pool->ready)) != &marker) {
+		conn = node->owner;
+
+		if (!twopence_conn_epoll_fill(pool->epoll, conn)) {
+			twopence_ready_unlink(&marker);
+			twopence_conn_pool_disable_epoll(pool);
+			return twopence_conn_pool_poll_ppoll(pool, deadline);
+		}
+
+		if (conn->client_sock == NULL)
+			twopence_conn_pool_close_connection(pool, conn);
+	}
+
+	if (pool->connections.head == NULL) {
+		twopence_debug("All connections closed\n");
+		return false;
+	}
+
+	/* See twopence_conn_pool_poll_ppoll */
+	if (pool->ndetached == pool->nconns) {
+		twopence_debug("Only detached sessions left\n");
+		return false;
+	}
+
+	/* Transactions that are done are completed right away */
+	msec = 0;
+	if (pool->ready.head == NULL) {
+		twopence_timeout_init(&timeout);
+		twopence_timers_update_timeout(&timeout);
+		if (deadline)
+			(void) twopence_timeout_update(&timeout, deadline);
+
+		msec = -1;
+		if (timerisset(&timeout.until)) {
+			struct timeval delta;
+
+			/* Round up, so that we do not wake up just before the deadline */
+			timersub(&timeout.until, &timeout.now, &delta);
+			msec = 1000 * delta.tv_sec + (delta.tv_usec + 999) / 1000;
+		}
+	}
+
+	/* Query the current sigprocmask, and allow SIGCHLD while we're polling */
+	sigprocmask(SIG_BLOCK, NULL, &mask);
+	sigdelset(&mask, SIGCHLD);
+
+	n = twopence_epoll_wait(pool->epoll, msec, &mask);
+	if ((n < 0 && errno == EINTR)
+	 || ((n > 0 || msec == 0) && twopence_conn_pool_deliver_signals(&mask)))
+		twopence_conn_pool_mark_all(pool);
+
+	twopence_ready_list_mark_end(&pool->ready, &marker);
+	while ((node = twopence_ready_list_pop(&pool->ready)) != &marker) {
+		int rc;
+
+		conn = node->owner;
+
+		/* This is really just for accepting incoming connections on a listening
+		 * socket. */
+		if (conn->semantics && conn->semantics->doio) {
+			rc = conn->semantics->doio(pool, conn);
+		} else {
+			rc = twopence_conn_epoll_doio(conn);
+		}
+
+		if (rc < 0) {
+			twopence_log_error("%s: error when processing IO, closing connection: %s", __func__, twopence_strerror(rc));
+			twopence_conn_close(conn);
+		}
+
+		/* Fill in our pollinfo again in the next round */
+		twopence_ready_mark(&conn->ready);
+	}
+
+	/* We do this as the last thing before returning, in order to minimize the
+	 * risk of harmful user behavior */
+	twopence_timers_run();
+
+	return !!pool->connections.head;
+}
+
+bool
+twopence_conn_pool_poll(twopence_conn_pool_t *pool)
+{
+	return twopence_conn_pool_poll_deadline(pool, NULL);
+}
+
+/*
+ * Same as above, but do not wait beyond the given deadline.
+ * This is what the asynchronous client API uses to drive all
+ * connections from a single event loop.
+ */
+bool
+twopence_conn_pool_poll_deadline(twopence_conn_pool_t *pool, const struct timeval *deadline)
+{
+	if (pool->connections.head == NULL)
+		return false;
+
+	if (pool->epoll)
+		return twopence_conn_pool_poll_epoll(pool, deadline);
+	return twopence_conn_pool_poll_ppoll(pool, deadline);
+}
@@ -32,12 +32,21 @@ typedef struct twopence_connection_pool twopence_conn_pool_t;
 typedef const struct semantics twopence_conn_semantics_t;
 struct semantics {
 	int		(*doio)(twopence_conn_pool_t *, twopence_conn_t *);
-	bool		(*process_request)(twopence_transaction_t *, twopence_buf_t *);
+	bool		(*process_request)(twopence_conn_t *, twopence_transaction_t *, twopence_buf_t *);
 	void		(*end_transaction)(twopence_conn_t *, twopence_transaction_t *);
 };
 
 extern twopence_conn_t *	twopence_conn_new(twopence_conn_semantics_t *semantics, twopence_sock_t *sock, unsigned int client_id);
 extern void			twopence_conn_set_keepalive(twopence_conn_t *, int);
+extern void			twopence_conn_set_max_packet(twopence_conn_t *, unsigned int);
+extern void			twopence_conn_set_compression(twopence_conn_t *, unsigned int);
+extern void			twopence_conn_get_compress_stats(const twopence_conn_t *, twopence_compress_stats_t *);
+extern void			twopence_conn_set_flow_control(twopence_conn_t *, bool);
+extern void			twopence_conn_set_grace_period(twopence_conn_t *, unsigned int);
+extern void			twopence_conn_set_resumable(twopence_conn_t *, bool);
+extern void			twopence_conn_get_resume_state(const twopence_conn_t *, twopence_protocol_resume_t *);
+extern bool			twopence_conn_resume(twopence_conn_t *, twopence_sock_t *, uint32_t);
+extern bool			twopence_conn_is_detached(const twopence_conn_t *);
 extern void			twopence_conn_free(twopence_conn_t *conn);
 extern unsigned int		twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo);
 extern int			twopence_conn_doio(twopence_conn_t *conn);
@@ -54,13 +63,24 @@ extern void			twopence_conn_update_recv_keepalive(twopence_conn_t *conn);
 extern void			twopence_conn_add_transaction(twopence_conn_t *conn, twopence_transaction_t *trans);
 extern void			twopence_conn_add_transaction_done(twopence_conn_t *conn, twopence_transaction_t *trans);
 extern twopence_transaction_t *	twopence_conn_reap_transaction(twopence_conn_t *conn, int wait_for);
-extern twopence_transaction_t *	twopence_conn_find_transaction(twopence_conn_t *conn, uint16_t xid);
+extern twopence_transaction_t *	twopence_conn_find_transaction(twopence_conn_t *conn, uint32_t xid);
 extern bool			twopence_conn_has_pending_transactions(const twopence_conn_t *conn);
+extern bool			twopence_conn_is_idle(const twopence_conn_t *conn);
+extern unsigned int		twopence_conn_get_keepalive(const twopence_conn_t *conn);
 extern void			twopence_conn_cancel_transactions(twopence_conn_t *conn, int error);
 
+typedef enum {
+	TWOPENCE_CONN_POOL_DEFAULT = 0,
+	TWOPENCE_CONN_POOL_PPOLL,
+	TWOPENCE_CONN_POOL_EPOLL,
+} twopence_conn_pool_backend_t;
+
 extern twopence_conn_pool_t *	twopence_conn_pool_new(void);
+extern twopence_conn_pool_t *	twopence_conn_pool_new_backend(twopence_conn_pool_backend_t);
 extern void			twopence_conn_pool_add_connection(twopence_conn_pool_t *pool, twopence_conn_t *conn);
+extern void			twopence_conn_pool_remove_connection(twopence_conn_t *conn);
 extern bool			twopence_conn_pool_poll(twopence_conn_pool_t *pool);
+extern bool			twopence_conn_pool_poll_deadline(twopence_conn_pool_t *pool, const struct timeval *deadline);
 extern void			twopence_conn_pool_set_callback_close_connection(twopence_conn_pool_t *pool, void (*cb)(twopence_conn_t *));
 
 #endif /* CONNECTION_H */
@@ -0,0 +1,450 @@
+/*
+ * epoll backend for the connection pool
+ *
+ * Copyright (C) 2014-2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * With ppoll(), the kernel has to look at every single fd each time we
+ * go to sleep, and we have to tell it about all of them again.
+ *
+ * Here, every connection and transaction keeps the fds it waits for in
+ * a poll group of its own, which stays registered with the epoll
+ * instance until its owner fills it in again. That only happens when
+ * one of the fds fired, or something else changed what the owner is
+ * waiting for; see twopence_ready_mark. So an iteration of the event
+ * loop only costs as much as the number of objects that have
+ * something to do, and system calls are needed only for fds that were
+ * added, dropped, or whose event mask changed.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "twopence.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+#define TWOPENCE_EPOLL_MAX_EVENTS	64
+
+typedef struct twopence_epoll_reg {
+	uint32_t		cookie;		/* 0 if not registered */
+	twopence_pollgroup_t *	group;
+	unsigned int		index;		/* into the group's pollfd array */
+	unsigned int		generation;	/* last time the group was filled in */
+	short			events;
+	bool			always_ready;	/* epoll does not support this fd (regular files) */
+} twopence_epoll_reg_t;
+
+struct twopence_epoll {
+	twopence_epoll_t *	next;
+	int			fd;
+
+	unsigned int		generation;
+	uint32_t		next_cookie;
+
+	/* Indexed by fd */
+	unsigned int		max_fd;
+	twopence_epoll_reg_t *	reg;
+
+	/* Registered fds that epoll refused to take */
+	unsigned int		nalways;
+	int *			always;
+
+	struct epoll_event	events[TWOPENCE_EPOLL_MAX_EVENTS];
+};
+
+/*
+ * Each thread runs its own event loop, so the list of epoll instances
+ * is per thread, too. An fd is only ever polled by the thread that owns
+ * the connection, so forget_fd() only needs to look at this thread's
+ * instances.
+ */
+static __thread twopence_epoll_t *	__twopence_epoll_list;
+
+twopence_epoll_t *
+twopence_epoll_new(void)
+{
+	twopence_epoll_t *ep;
+	int fd;
+
+	if ((fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		twopence_debug("epoll_create1: %m");
+		return NULL;
+	}
+
+	ep = twopence_calloc(1, sizeof(*ep));
+	ep->fd = fd;
+	ep->next_cookie = 1;
+
+	ep->next = __twopence_epoll_list;
+	__twopence_epoll_list = ep;
+	return ep;
+}
+
+/*
+ * The caller must have unwatched all groups
+ */
+void
+twopence_epoll_free(twopence_epoll_t *ep)
+{
+	twopence_epoll_t **pos;
+
+	for (pos = &__twopence_epoll_list; *pos; pos = &(*pos)->next) {
+		if (*pos == ep) {
+			*pos = ep->next;
+			break;
+		}
+	}
+
+	if (ep->fd >= 0)
+		close(ep->fd);
+	free(ep->reg);
+	free(ep->always);
+	free(ep);
+}
+
+static twopence_epoll_reg_t *
+twopence_epoll_get_reg(twopence_epoll_t *ep, int fd)
+{
+	if ((unsigned int) fd >= ep->max_fd) {
+		unsigned int new_max = ep->max_fd? : 64;
+
+		while (new_max <= (unsigned int) fd)
+			new_max *= 2;
+
+		ep->reg = twopence_realloc(ep->reg, new_max * sizeof(ep->reg[0]));
+		memset(ep->reg + ep->max_fd, 0, (new_max - ep->max_fd) * sizeof(ep->reg[0]));
+		ep->always = twopence_realloc(ep->always, new_max * sizeof(ep->always[0]));
+		ep->max_fd = new_max;
+	}
+	return &ep->reg[fd];
+}
+
+static inline uint64_t
+twopence_epoll_key(int fd, uint32_t cookie)
+{
+	return ((uint64_t) cookie << 32) | (uint32_t) fd;
+}
+
+static bool
+twopence_epoll_ctl(twopence_epoll_t *ep, int op, int fd, twopence_epoll_reg_t *reg, short events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = twopence_epoll_key(fd, reg->cookie);
+	return epoll_ctl(ep->fd, op, fd, &ev) == 0;
+}
+
+static bool
+twopence_epoll_add(twopence_epoll_t *ep, int fd, twopence_epoll_reg_t *reg, twopence_pollgroup_t *group, short events)
+{
+	reg->cookie = ep->next_cookie++;
+	if (ep->next_cookie == 0)
+		ep->next_cookie = 1;
+
+	if (!twopence_epoll_ctl(ep, EPOLL_CTL_ADD, fd, reg, events)) {
+		if (errno != EPERM) {
+			twopence_log_error("epoll: unable to add fd %d: %m", fd);
+			reg->cookie = 0;
+			return false;
+		}
+
+		/* Regular files and the like can always be read and written */
+		reg->always_ready = true;
+		ep->always[ep->nalways++] = fd;
+	}
+
+	if (group->nregistered >= group->max_registered) {
+		group->max_registered = group->max_registered? 2 * group->max_registered : 4;
+		group->registered = twopence_realloc(group->registered, group->max_registered * sizeof(int));
+	}
+	group->registered[group->nregistered++] = fd;
+	group->epoll = ep;
+
+	reg->group = group;
+	reg->events = events;
+	return true;
+}
+
+static void
+twopence_epoll_del(twopence_epoll_t *ep, int fd, twopence_epoll_reg_t *reg)
+{
+	unsigned int j;
+
+	/* This will fail if the fd has been closed in the meantime,
+	 * which is just fine. */
+	if (!reg->always_ready) {
+		(void) epoll_ctl(ep->fd, EPOLL_CTL_DEL, fd, NULL);
+	} else {
+		for (j = 0; j < ep->nalways; ++j) {
+			if (ep->always[j] == fd) {
+				ep->always[j] = ep->always[--(ep->nalways)];
+				break;
+			}
+		}
+	}
+	memset(reg, 0, sizeof(*reg));
+}
+
+static void
+twopence_epoll_unregister(twopence_epoll_t *ep, int fd)
+{
+	twopence_pollgroup_t *group = ep->reg[fd].group;
+	unsigned int j;
+
+	twopence_epoll_del(ep, fd, &ep->reg[fd]);
+	for (j = 0; j < group->nregistered; ++j) {
+		if (group->registered[j] == fd) {
+			group->registered[j] = group->registered[--(group->nregistered)];
+			break;
+		}
+	}
+}
+
+/*
+ * This must be called before closing an fd that may have been polled.
+ * Once the fd is closed, we can no longer remove it from the epoll set;
+ * and if the same fd number is reused for another file, we would not
+ * notice that it has to be registered again.
+ */
+void
+twopence_epoll_forget_fd(int fd)
+{
+	twopence_epoll_t *ep;
+
+	for (ep = __twopence_epoll_list; ep; ep = ep->next) {
+		if (fd >= 0 && (unsigned int) fd < ep->max_fd && ep->reg[fd].cookie)
+			twopence_epoll_unregister(ep, fd);
+	}
+}
+
+/*
+ * Something went wrong that we cannot fix with a single epoll_ctl call,
+ * such as an event reported for an fd that has been closed and reused.
+ * Start over with a fresh epoll instance, and have the owners of all
+ * fds register them again.
+ */
+static bool
+twopence_epoll_reset(twopence_epoll_t *ep)
+{
+	unsigned int fd;
+
+	twopence_debug("epoll: resetting epoll instance");
+
+	for (fd = 0; fd < ep->max_fd; ++fd) {
+		twopence_epoll_reg_t *reg = &ep->reg[fd];
+
+		if (reg->cookie) {
+			reg->group->nregistered = 0;
+			twopence_ready_mark(reg->group->owner);
+		}
+	}
+	if (ep->reg)
+		memset(ep->reg, 0, ep->max_fd * sizeof(ep->reg[0]));
+	ep->nalways = 0;
+
+	close(ep->fd);
+	if ((ep->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		twopence_log_error("epoll_create1: %m");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Bring the registrations of a group in sync with what its owner just
+ * filled in. Returns false if we cannot handle this set of fds, and
+ * the caller should fall back to ppoll().
+ */
+bool
+twopence_epoll_watch(twopence_epoll_t *ep, twopence_pollgroup_t *group)
+{
+	twopence_pollinfo_t *pinfo = &group->pinfo;
+	unsigned int i, j, gen;
+
+	if (ep->fd < 0)
+		return false;
+
+	gen = ++(ep->generation);
+	for (i = 0; i < pinfo->num_fds; ++i) {
+		struct pollfd *pfd = &pinfo->pfd[i];
+		twopence_epoll_reg_t *reg;
+
+		pfd->revents = 0;
+		if (pfd->fd < 0)
+			continue;
+
+		reg = twopence_epoll_get_reg(ep, pfd->fd);
+		if (reg->cookie && (reg->group != group || reg->generation == gen)) {
+			/* The same fd is polled twice */
+			return false;
+		}
+
+		if (reg->cookie == 0) {
+			if (!twopence_epoll_add(ep, pfd->fd, reg, group, pfd->events))
+				return false;
+		} else
+		if (reg->events != pfd->events && !reg->always_ready) {
+			if (!twopence_epoll_ctl(ep, EPOLL_CTL_MOD, pfd->fd, reg, pfd->events)) {
+				/* The fd was closed and reopened since the last time,
+				 * and the kernel dropped the old registration. */
+				if (errno != ENOENT)
+					return false;
+				twopence_epoll_unregister(ep, pfd->fd);
+				if (!twopence_epoll_add(ep, pfd->fd, reg, group, pfd->events))
+					return false;
+			}
+			reg->events = pfd->events;
+		}
+
+		reg->generation = gen;
+		reg->index = i;
+	}
+
+	/* Drop the fds the owner is no longer interested in. Setting their
+	 * event mask to 0 would not do, as epoll always reports errors and
+	 * hangups. */
+	for (j = 0; j < group->nregistered; ) {
+		int fd = group->registered[j];
+		twopence_epoll_reg_t *reg = &ep->reg[fd];
+
+		if (reg->generation != gen) {
+			twopence_epoll_del(ep, fd, reg);
+			group->registered[j] = group->registered[--(group->nregistered)];
+		} else {
+			++j;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * The owner of the group goes away, or stops using epoll
+ */
+void
+twopence_epoll_unwatch(twopence_pollgroup_t *group)
+{
+	twopence_epoll_t *ep = group->epoll;
+
+	if (ep != NULL) {
+		while (group->nregistered) {
+			int fd = group->registered[--(group->nregistered)];
+
+			twopence_epoll_del(ep, fd, &ep->reg[fd]);
+		}
+	}
+	group->nregistered = 0;
+	group->epoll = NULL;
+}
+
+/*
+ * Wait for events, and put the owners of the fds that fired on their
+ * ready lists.
+ */
+int
+twopence_epoll_wait(twopence_epoll_t *ep, long timeout, const sigset_t *mask)
+{
+	unsigned int j;
+	int i, n;
+
+	if (ep->fd < 0 && !twopence_epoll_reset(ep))
+		return -1;
+
+	for (j = 0; j < ep->nalways; ++j) {
+		twopence_epoll_reg_t *reg = &ep->reg[ep->always[j]];
+
+		reg->group->pinfo.pfd[reg->index].revents = reg->events & (POLLIN | POLLOUT);
+		twopence_ready_mark(reg->group->owner);
+		timeout = 0;
+	}
+
+	n = epoll_pwait(ep->fd, ep->events, TWOPENCE_EPOLL_MAX_EVENTS, timeout, mask);
+	twopence_loop_clock_update(NULL);
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; ++i) {
+		struct epoll_event *ev = &ep->events[i];
+		int fd = (int) (ev->data.u64 & 0xffffffff);
+		uint32_t cookie = ev->data.u64 >> 32;
+		twopence_epoll_reg_t *reg;
+
+		if ((unsigned int) fd >= ep->max_fd
+		 || (reg = &ep->reg[fd])->cookie != cookie) {
+			/* This is an event for a file we no longer know
+			 * about. This can happen if the fd was closed while a
+			 * dup of it was still open somewhere. We cannot
+			 * remove it from the epoll set by fd any longer. */
+			twopence_debug("epoll: stale event for fd %d", fd);
+			twopence_epoll_reset(ep);
+			break;
+		}
+
+		reg->group->pinfo.pfd[reg->index].revents = ev->events & (POLLIN | POLLOUT | POLLHUP | POLLERR);
+		twopence_ready_mark(reg->group->owner);
+	}
+
+	return n;
+}
+
+#else
+
+twopence_epoll_t *
+twopence_epoll_new(void)
+{
+	return NULL;
+}
+
+void
+twopence_epoll_forget_fd(int fd)
+{
+}
+
+void
+twopence_epoll_free(twopence_epoll_t *ep)
+{
+}
+
+bool
+twopence_epoll_watch(twopence_epoll_t *ep, twopence_pollgroup_t *group)
+{
+	return false;
+}
+
+void
+twopence_epoll_unwatch(twopence_pollgroup_t *group)
+{
+}
+
+int
+twopence_epoll_wait(twopence_epoll_t *ep, long timeout, const sigset_t *mask)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
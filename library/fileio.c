@@ -0,0 +1,439 @@
+/*
+ * Asynchronous file I/O for transaction channels.
+ *
+ * Copyright (C) 2014-2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Regular files always poll as readable and writable, so reading or
+ * writing them from the event loop stalls everything else whenever the
+ * disk is slow. Instead, file channels hand their reads and writes to a
+ * small pool of worker threads, and pick up the results when the
+ * notification pipe of the file becomes readable.
+ *
+ * Requests of a file complete in the order they were submitted. At most
+ * TWOPENCE_FILEIO_MAX_INFLIGHT of them are passed to the workers at any
+ * time; the rest wait in the file's queue.
+ *
+ * All the workers ever touch is the request they are working on. When
+ * the owner frees a file while some of its requests are still being
+ * worked on, the last worker to finish cleans up.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fileio.h"
+#include "utils.h"
+
+typedef struct twopence_fileio_req twopence_fileio_req_t;
+struct twopence_fileio_req {
+	twopence_fileio_req_t *	next;		/* the file's list of requests, in order */
+	twopence_fileio_req_t *	work_next;	/* the workers' queue */
+	twopence_fileio_t *	io;
+
+	bool			write;
+	off_t			offset;
+	unsigned int		count;
+	twopence_buf_t *	buffer;
+
+	bool			dispatched;
+	bool			done;		/* protected by the pool lock */
+	int			result;		/* bytes transferred, or a negative errno */
+};
+
+struct twopence_fileio {
+	int			fd;
+	int			notify[2];	/* written to by workers when a request completes */
+	off_t			offset;		/* where the next request goes */
+
+	/* All requests that have not been reaped yet */
+	twopence_fileio_req_t *	head;
+	twopence_fileio_req_t **tail;
+	twopence_fileio_req_t *	next_dispatch;
+	unsigned int		npending;
+	unsigned int		pending_bytes;
+	unsigned int		ninflight;
+
+	/* Protected by the pool lock */
+	unsigned int		nworking;	/* dispatched, but not completed */
+	bool			orphaned;	/* freed by the owner */
+};
+
+static struct twopence_fileio_pool {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+
+	unsigned int		nthreads;
+	unsigned int		nrunning;
+
+	twopence_fileio_req_t *	work_head;
+	twopence_fileio_req_t **work_tail;
+} twopence_fileio_pool = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.cond		= PTHREAD_COND_INITIALIZER,
+	.work_tail	= &twopence_fileio_pool.work_head,
+};
+
+/*
+ * Set the number of worker threads. With 0 (the default), file channels
+ * do their I/O from the event loop, as all other channels do.
+ * Threads are started on first use, and never stopped.
+ */
+void
+twopence_fileio_set_threads(unsigned int nthreads)
+{
+	pthread_mutex_lock(&twopence_fileio_pool.lock);
+	twopence_fileio_pool.nthreads = nthreads;
+	pthread_mutex_unlock(&twopence_fileio_pool.lock);
+}
+
+bool
+twopence_fileio_enabled(void)
+{
+	bool enabled;
+
+	pthread_mutex_lock(&twopence_fileio_pool.lock);
+	enabled = twopence_fileio_pool.nthreads != 0;
+	pthread_mutex_unlock(&twopence_fileio_pool.lock);
+	return enabled;
+}
+
+static void
+twopence_fileio_destroy(twopence_fileio_t *io)
+{
+	close(io->fd);
+	close(io->notify[0]);
+	close(io->notify[1]);
+	free(io);
+}
+
+static void
+twopence_fileio_req_free(twopence_fileio_req_t *req)
+{
+	if (req->buffer)
+		twopence_buf_free(req->buffer);
+	free(req);
+}
+
+/*
+ * Executed by the worker threads
+ */
+static void
+twopence_fileio_perform(twopence_fileio_req_t *req)
+{
+	unsigned int done = 0;
+	ssize_t n;
+
+	while (done < req->count) {
+		if (req->write)
+			n = pwrite(req->io->fd, (const char *) twopence_buf_head(req->buffer) + done,
+					req->count - done, req->offset + done);
+		else
+			n = pread(req->io->fd, (char *) twopence_buf_tail(req->buffer) + done,
+					req->count - done, req->offset + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			req->result = -errno;
+			return;
+		}
+
+		/* The file shrank while we were reading it */
+		if (n == 0) {
+			req->result = -EIO;
+			return;
+		}
+		done += n;
+	}
+	req->result = done;
+}
+
+/*
+ * Called with the pool lock held
+ */
+static void
+twopence_fileio_complete(twopence_fileio_req_t *req)
+{
+	twopence_fileio_t *io = req->io;
+
+	io->nworking--;
+	req->done = true;
+
+	if (!io->orphaned) {
+		/* If the pipe is full, there's a wakeup pending anyway */
+		if (write(io->notify[1], "", 1) < 0 && errno != EAGAIN)
+			twopence_log_error("file I/O: unable to post completion: %m");
+		return;
+	}
+
+	twopence_fileio_req_free(req);
+	if (io->nworking == 0)
+		twopence_fileio_destroy(io);
+}
+
+static void *
+twopence_fileio_worker(void *arg)
+{
+	struct twopence_fileio_pool *pool = arg;
+	twopence_fileio_req_t *req;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		bool skip;
+
+		while ((req = pool->work_head) == NULL)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if ((pool->work_head = req->work_next) == NULL)
+			pool->work_tail = &pool->work_head;
+		skip = req->io->orphaned;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!skip)
+			twopence_fileio_perform(req);
+
+		pthread_mutex_lock(&pool->lock);
+		twopence_fileio_complete(req);
+	}
+
+	return NULL;
+}
+
+/*
+ * Called with the pool lock held.
+ * The workers must not handle any signals; in the server, SIGCHLD
+ * has to interrupt the ppoll() of the event loop.
+ */
+static void
+twopence_fileio_start_threads(struct twopence_fileio_pool *pool)
+{
+	sigset_t all, saved;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+	/* Files created before the pool was disabled still need a worker */
+	while (pool->nrunning < (pool->nthreads? : 1)) {
+		pthread_attr_t attr;
+		pthread_t thread;
+		int rv;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		rv = pthread_create(&thread, &attr, twopence_fileio_worker, pool);
+		pthread_attr_destroy(&attr);
+
+		if (rv != 0) {
+			twopence_log_error("unable to start file I/O thread: %s", strerror(rv));
+			break;
+		}
+		pool->nrunning++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/*
+ * Pass queued requests on to the workers, up to the in-flight limit
+ */
+static void
+twopence_fileio_dispatch(twopence_fileio_t *io)
+{
+	struct twopence_fileio_pool *pool = &twopence_fileio_pool;
+	twopence_fileio_req_t *req;
+
+	while (io->ninflight < TWOPENCE_FILEIO_MAX_INFLIGHT && (req = io->next_dispatch) != NULL) {
+		io->next_dispatch = req->next;
+		io->ninflight++;
+		req->dispatched = true;
+
+		pthread_mutex_lock(&pool->lock);
+		if (pool->nrunning == 0)
+			twopence_fileio_start_threads(pool);
+		io->nworking++;
+		*(pool->work_tail) = req;
+		pool->work_tail = &req->work_next;
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/*
+ * Create a file for asynchronous I/O. It takes over the fd, and
+ * closes it when freed.
+ */
+twopence_fileio_t *
+twopence_fileio_new(int fd)
+{
+	twopence_fileio_t *io;
+
+	io = twopence_calloc(1, sizeof(*io));
+	if (pipe2(io->notify, O_NONBLOCK | O_CLOEXEC) < 0) {
+		twopence_log_error("%s: unable to create pipe: %m", __func__);
+		free(io);
+		return NULL;
+	}
+
+	io->fd = fd;
+	io->tail = &io->head;
+	return io;
+}
+
+void
+twopence_fileio_free(twopence_fileio_t *io)
+{
+	twopence_fileio_req_t *req, *next;
+	bool destroy;
+
+	twopence_epoll_forget_fd(io->notify[0]);
+
+	pthread_mutex_lock(&twopence_fileio_pool.lock);
+	io->orphaned = true;
+	for (req = io->head; req; req = next) {
+		next = req->next;
+
+		/* The worker will free this one */
+		if (req->dispatched && !req->done)
+			continue;
+		twopence_fileio_req_free(req);
+	}
+	destroy = (io->nworking == 0);
+	pthread_mutex_unlock(&twopence_fileio_pool.lock);
+
+	if (destroy)
+		twopence_fileio_destroy(io);
+}
+
+static void
+twopence_fileio_submit(twopence_fileio_t *io, bool is_write, twopence_buf_t *bp, unsigned int count)
+{
+	twopence_fileio_req_t *req;
+
+	req = twopence_calloc(1, sizeof(*req));
+	req->io = io;
+	req->write = is_write;
+	req->offset = io->offset;
+	req->count = count;
+	req->buffer = bp;
+
+	io->offset += count;
+	io->npending++;
+	io->pending_bytes += count;
+
+	*(io->tail) = req;
+	io->tail = &req->next;
+	if (io->next_dispatch == NULL)
+		io->next_dispatch = req;
+
+	twopence_fileio_dispatch(io);
+}
+
+/*
+ * Read the next count bytes of the file into bp, which must have
+ * that much tail room.
+ */
+void
+twopence_fileio_read(twopence_fileio_t *io, twopence_buf_t *bp, unsigned int count)
+{
+	twopence_fileio_submit(io, false, bp, count);
+}
+
+/*
+ * Append the contents of bp to the file. The request takes
+ * over the buffer.
+ */
+void
+twopence_fileio_write(twopence_fileio_t *io, twopence_buf_t *bp)
+{
+	twopence_fileio_submit(io, true, bp, twopence_buf_count(bp));
+}
+
+/*
+ * Return the oldest request if it has completed. The caller owns the
+ * buffer. For reads, it holds the data read; for writes, it is empty.
+ * result is the number of bytes transferred, or a negative errno.
+ */
+bool
+twopence_fileio_reap(twopence_fileio_t *io, twopence_buf_t **bpp, int *result)
+{
+	twopence_fileio_req_t *req;
+	char dummy[64];
+	bool done;
+
+	if ((req = io->head) == NULL)
+		return false;
+
+	/* Drain the pipe before looking at the request, so that we
+	 * cannot miss a wakeup for it */
+	while (read(io->notify[0], dummy, sizeof(dummy)) > 0)
+		;
+
+	pthread_mutex_lock(&twopence_fileio_pool.lock);
+	done = req->done;
+	pthread_mutex_unlock(&twopence_fileio_pool.lock);
+	if (!done)
+		return false;
+
+	if ((io->head = req->next) == NULL)
+		io->tail = &io->head;
+	io->npending--;
+	io->pending_bytes -= req->count;
+	io->ninflight--;
+
+	if (req->result > 0) {
+		if (req->write)
+			twopence_buf_advance_head(req->buffer, req->result);
+		else
+			twopence_buf_advance_tail(req->buffer, req->result);
+	}
+
+	*bpp = req->buffer;
+	*result = req->result;
+	free(req);
+
+	twopence_fileio_dispatch(io);
+	return true;
+}
+
+/*
+ * Number of requests and bytes that have been submitted, but not reaped
+ */
+unsigned int
+twopence_fileio_pending(const twopence_fileio_t *io)
+{
+	return io->npending;
+}
+
+unsigned int
+twopence_fileio_pending_bytes(const twopence_fileio_t *io)
+{
+	return io->pending_bytes;
+}
+
+/*
+ * The fd to poll for POLLIN while requests are pending
+ */
+int
+twopence_fileio_poll_fd(const twopence_fileio_t *io)
+{
+	return io->notify[0];
+}
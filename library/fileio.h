@@ -0,0 +1,47 @@
+/*
+ * Asynchronous file I/O for transaction channels.
+ *
+ * Copyright (C) 2014-2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "buffer.h"
+
+/* How many requests of a single file may be in the hands of the
+ * worker threads at the same time. Requests beyond that are held back
+ * until earlier ones complete. */
+#define TWOPENCE_FILEIO_MAX_INFLIGHT	4
+
+typedef struct twopence_fileio twopence_fileio_t;
+
+extern void		twopence_fileio_set_threads(unsigned int nthreads);
+extern bool		twopence_fileio_enabled(void);
+
+extern twopence_fileio_t *twopence_fileio_new(int fd);
+extern void		twopence_fileio_free(twopence_fileio_t *);
+extern void		twopence_fileio_read(twopence_fileio_t *, twopence_buf_t *bp, unsigned int count);
+extern void		twopence_fileio_write(twopence_fileio_t *, twopence_buf_t *bp);
+extern bool		twopence_fileio_reap(twopence_fileio_t *, twopence_buf_t **bpp, int *result);
+extern unsigned int	twopence_fileio_pending(const twopence_fileio_t *);
+extern unsigned int	twopence_fileio_pending_bytes(const twopence_fileio_t *);
+extern int		twopence_fileio_poll_fd(const twopence_fileio_t *);
+
+#endif /* FILEIO_H */
@@ -64,9 +64,12 @@ twopence_trace(const char *fmt, ...)
 
   va_start(ap, fmt);
   if (twopence_log_file) {
+    /* Keep lines from different threads from getting mixed up */
+    flockfile(twopence_log_file);
     vfprintf(twopence_log_file, fmt, ap);
     if (strchr(fmt, '\n') == NULL)
       fputc('\n', twopence_log_file);
+    funlockfile(twopence_log_file);
   }
   if (twopence_log_syslog) {
     vsyslog(LOG_DEBUG, fmt, ap);
@@ -83,10 +86,12 @@ twopence_log_error(const char *fmt, ...)
 
   va_start(ap, fmt);
   if (twopence_log_file) {
+    flockfile(twopence_log_file);
     fprintf(twopence_log_file, "Error: ");
     vfprintf(twopence_log_file, fmt, ap);
     if (strchr(fmt, '\n') == NULL)
       fputc('\n', twopence_log_file);
+    funlockfile(twopence_log_file);
   }
   if (twopence_log_syslog) {
     vsyslog(LOG_ERR, fmt, ap);
@@ -103,10 +108,12 @@ twopence_log_warning(const char *fmt, ...)
 
   va_start(ap, fmt);
   if (twopence_log_file) {
+    flockfile(twopence_log_file);
     fprintf(twopence_log_file, "Warning: ");
     vfprintf(twopence_log_file, fmt, ap);
     if (strchr(fmt, '\n') == NULL)
       fputc('\n', twopence_log_file);
+    funlockfile(twopence_log_file);
   }
   if (twopence_log_syslog) {
     vsyslog(LOG_WARNING, fmt, ap);
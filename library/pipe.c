@@ -19,9 +19,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <sys/time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 
 #include "twopence.h"
 #include "protocol.h"
@@ -29,10 +34,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "pipe.h"
 #include "utils.h"
 
-static int				__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *keepalive);
+static int				__twopence_pipe_process_hello(twopence_buf_t *bp, twopence_protocol_state_t *ps, unsigned int *keepalive,
+						twopence_protocol_resume_t *resume);
 static void				__twopence_pipe_end_transaction(twopence_conn_t *, twopence_transaction_t *);
 
-static twopence_conn_pool_t *		twopence_pipe_connection_pool;
+/*
+ * Every thread has its own event loop. A target is attached to the loop
+ * of the thread that connected it, and only that thread may drive it.
+ */
+static __thread twopence_conn_pool_t *	twopence_pipe_connection_pool;
 
 static twopence_conn_semantics_t	twopence_client_semantics = {
 	.end_transaction	= __twopence_pipe_end_transaction,
@@ -50,6 +60,8 @@ twopence_pipe_target_init(struct twopence_pipe_target *target, int plugin_type,
   target->base.plugin_type = plugin_type;
   target->base.ops = plugin_ops;
   target->keepalive = -1;
+  target->connect_timeout = -1;
+  target->max_packet = TWOPENCE_PROTO_DEFAULT_JUMBO;
   target->link_ops = link_ops;
 }
 
@@ -76,52 +88,455 @@ _twopence_invalid_username(const char *username)
 /*
  * Wrap the link functions
  */
-static int
-__twopence_pipe_open_link(struct twopence_pipe_target *handle)
+static unsigned int
+__twopence_pipe_keepalive(const struct twopence_pipe_target *handle)
 {
-  if (handle->connection && twopence_conn_is_closed(handle->connection))
-    return TWOPENCE_TRANSPORT_ERROR;
+  if (handle->keepalive < 0)
+    return 0xFFFF;		/* request keepalive but accept server's pick */
+  return handle->keepalive;
+}
 
-  if (handle->connection == NULL) {
-    unsigned int client_id = 0;
-    unsigned int keepalive = 0;
-    twopence_sock_t *sock;
+/*
+ * Bringing up the link: connect, then exchange HELLO packets.
+ *
+ * This is done for any number of targets from a single poll loop, so that
+ * bringing up a fleet of targets takes as long as the slowest of them, not
+ * the sum of all. Links that resolve to a list of addresses (tcp) are dialed
+ * without blocking; if the first address does not answer within
+ * TWOPENCE_PIPE_DIAL_DELAY_MSEC, we try the next one in parallel, and
+ * take whichever connects first ("happy eyeballs"). All other links are
+ * opened right away.
+ */
+#define TWOPENCE_PIPE_DIAL_DELAY_MSEC	250
+#define TWOPENCE_PIPE_DIAL_MAX		4
 
-    /* The socket we are given should be set up for blocking I/O */
-    sock = handle->link_ops->open(handle);
-    if (sock == NULL)
-      return TWOPENCE_OPEN_SESSION_ERROR;
+typedef struct twopence_pipe_dialer {
+  struct twopence_pipe_target *handle;
 
-    if (handle->keepalive < 0)
-      keepalive = 0xFFFF;		/* request keepalive but accept server's pick */
-    else
-      keepalive = handle->keepalive;
-    twopence_debug("using keepalive=%u", (int) keepalive);
+  /* 1 while in progress, then 0 or a negative error */
+  int				rc;
+  struct timeval		deadline;
 
-    if (__twopence_pipe_handshake(sock, &client_id, &keepalive) < 0) {
-      twopence_sock_free(sock);
-      return TWOPENCE_OPEN_SESSION_ERROR;
+  struct addrinfo *		ai_list;
+  struct addrinfo *		ai_next;
+  struct timeval		next_attempt;
+  unsigned int			nattempts;
+  int				attempt_fd[TWOPENCE_PIPE_DIAL_MAX];
+  struct pollfd *		attempt_pfd[TWOPENCE_PIPE_DIAL_MAX];
+
+  /* Once connected, we wait for the server's HELLO on this socket */
+  twopence_sock_t *		sock;
+  struct pollfd *		sock_pfd;
+
+  twopence_protocol_state_t	ps;
+  twopence_protocol_resume_t	resume;
+  unsigned int			keepalive;
+} twopence_pipe_dialer_t;
+
+static void
+__twopence_pipe_dialer_init(twopence_pipe_dialer_t *dialer, struct twopence_pipe_target *handle,
+		const struct timeval *deadline)
+{
+  memset(dialer, 0, sizeof(*dialer));
+  dialer->handle = handle;
+  dialer->rc = 1;
+  dialer->keepalive = __twopence_pipe_keepalive(handle);
+
+  twopence_loop_clock_update(NULL);
+  if (handle->connect_timeout >= 0) {
+    struct timeval delta;
+
+    delta.tv_sec = handle->connect_timeout / 1000;
+    delta.tv_usec = 1000 * (handle->connect_timeout % 1000);
+    twopence_loop_clock_get(&dialer->deadline);
+    timeradd(&dialer->deadline, &delta, &dialer->deadline);
+  }
+  if (deadline && (!timerisset(&dialer->deadline) || timercmp(deadline, &dialer->deadline, <)))
+    dialer->deadline = *deadline;
+}
+
+static void
+__twopence_pipe_dialer_close_attempts(twopence_pipe_dialer_t *dialer)
+{
+  while (dialer->nattempts)
+    close(dialer->attempt_fd[--(dialer->nattempts)]);
+
+  if (dialer->ai_list) {
+    freeaddrinfo(dialer->ai_list);
+    dialer->ai_list = dialer->ai_next = NULL;
+  }
+}
+
+static void
+__twopence_pipe_dialer_finish(twopence_pipe_dialer_t *dialer, int rc)
+{
+  __twopence_pipe_dialer_close_attempts(dialer);
+  if (rc < 0 && dialer->sock) {
+    twopence_sock_free(dialer->sock);
+    dialer->sock = NULL;
+  }
+  dialer->rc = rc;
+}
+
+/*
+ * The link is up; send our HELLO.
+ * The socket we are given should be set up for blocking I/O
+ */
+static void
+__twopence_pipe_dialer_connected(twopence_pipe_dialer_t *dialer, twopence_sock_t *sock)
+{
+  twopence_buf_t *bp;
+
+  __twopence_pipe_dialer_close_attempts(dialer);
+  dialer->sock = sock;
+
+  twopence_debug("%s: link is up, sending HELLO", dialer->handle->base.ops->name);
+  bp = twopence_protocol_build_hello_packet(dialer->ps.cid, dialer->keepalive,
+			  TWOPENCE_PROTOCOL_VERSION, dialer->ps.max_packet, dialer->ps.compress, &dialer->resume);
+  if (twopence_sock_xmit(sock, bp) < 0) {
+    __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+    return;
+  }
+
+  twopence_sock_post_recvbuf_if_needed(sock, 4 * TWOPENCE_PROTO_MAX_PACKET);
+}
+
+static void
+__twopence_pipe_dialer_connected_fd(twopence_pipe_dialer_t *dialer, int fd)
+{
+  int f;
+
+  /* Note, we do not keep O_NONBLOCK here, but we do set O_CLOEXEC */
+  if ((f = fcntl(fd, F_GETFL)) >= 0)
+    fcntl(fd, F_SETFL, f & ~O_NONBLOCK);
+  __twopence_pipe_dialer_connected(dialer, twopence_sock_new_flags(fd, O_RDWR | O_CLOEXEC));
+}
+
+/*
+ * Start connecting to the next address
+ */
+static void
+__twopence_pipe_dialer_next(twopence_pipe_dialer_t *dialer)
+{
+  struct addrinfo *ai;
+  int fd;
+
+  while ((ai = dialer->ai_next) != NULL && dialer->nattempts < TWOPENCE_PIPE_DIAL_MAX) {
+    dialer->ai_next = ai->ai_next;
+
+    fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      continue;
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      __twopence_pipe_dialer_connected_fd(dialer, fd);
+      return;
     }
 
-    twopence_debug("handshake complete, my client id is %d, keepalive is %u", client_id, keepalive);
-    handle->connection = twopence_conn_new(&twopence_client_semantics, sock, client_id);
-    handle->ps.cid = client_id;
-    handle->ps.xid = 1;
+    if (errno != EINPROGRESS) {
+      /* Okay, this address didn't work. Try the next one */
+      twopence_debug("%s: connect failed: %m", dialer->handle->base.ops->name);
+      close(fd);
+      continue;
+    }
 
-    /* If keepalive is -2, ignore the result of the keepalive negotiation and
-     * force them to off.
-     * This only exists so that we can test that keepalives work */
-    if (handle->keepalive == -2)
-      keepalive = 0;
+    dialer->attempt_fd[dialer->nattempts++] = fd;
 
-    twopence_conn_set_keepalive(handle->connection, keepalive);
+    twopence_loop_clock_get(&dialer->next_attempt);
+    dialer->next_attempt.tv_usec += 1000 * TWOPENCE_PIPE_DIAL_DELAY_MSEC;
+    if (dialer->next_attempt.tv_usec >= 1000000) {
+      dialer->next_attempt.tv_sec++;
+      dialer->next_attempt.tv_usec -= 1000000;
+    }
+    return;
+  }
 
-    if (twopence_pipe_connection_pool == NULL) {
-      twopence_pipe_connection_pool = twopence_conn_pool_new();
-      twopence_conn_pool_set_callback_close_connection(twopence_pipe_connection_pool, NULL);
+  if (dialer->nattempts == 0) {
+    twopence_log_error("%s: unable to connect", dialer->handle->base.ops->name);
+    __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+  }
+}
+
+static void
+__twopence_pipe_dialer_begin(twopence_pipe_dialer_t *dialer)
+{
+  struct twopence_pipe_target *handle = dialer->handle;
+  twopence_sock_t *sock;
+
+  if (handle->link_ops->resolve) {
+    if (handle->link_ops->resolve(handle, &dialer->ai_list) < 0) {
+      __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+      return;
     }
+    dialer->ai_next = dialer->ai_list;
+    __twopence_pipe_dialer_next(dialer);
+    return;
+  }
+
+  if ((sock = handle->link_ops->open(handle)) == NULL) {
+    __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+    return;
+  }
+  __twopence_pipe_dialer_connected(dialer, sock);
+}
+
+static void
+__twopence_pipe_dialer_fill_poll(twopence_pipe_dialer_t *dialer, twopence_pollinfo_t *pinfo)
+{
+  unsigned int i;
 
-    twopence_conn_pool_add_connection(twopence_pipe_connection_pool, handle->connection);
+  if (dialer->sock) {
+    dialer->sock_pfd = twopence_pollinfo_update(pinfo, twopence_sock_id(dialer->sock), POLLIN, &dialer->deadline);
+    return;
+  }
+
+  for (i = 0; i < dialer->nattempts; ++i)
+    dialer->attempt_pfd[i] = twopence_pollinfo_update(pinfo, dialer->attempt_fd[i], POLLOUT, &dialer->deadline);
+  if (dialer->ai_next && dialer->nattempts < TWOPENCE_PIPE_DIAL_MAX)
+    twopence_timeout_update(&pinfo->timeout, &dialer->next_attempt);
+}
+
+static void
+__twopence_pipe_dialer_doio(twopence_pipe_dialer_t *dialer)
+{
+  struct timeval now;
+  unsigned int i;
+
+  if (dialer->sock) {
+    twopence_buf_t *bp = twopence_sock_get_recvbuf(dialer->sock);
+
+    if (dialer->sock_pfd && dialer->sock_pfd->revents) {
+      int count = twopence_sock_recv_buffer(dialer->sock, bp);
+
+      if (count == 0) {
+        twopence_log_error("unexpected EOF on link");
+        __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+        return;
+      }
+      if (count < 0 && errno != EAGAIN && errno != EINTR) {
+        twopence_log_error("receive error on link: %m");
+        __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+        return;
+      }
+    }
+    dialer->sock_pfd = NULL;
+
+    if (twopence_protocol_buffer_complete(bp)) {
+      __twopence_pipe_dialer_finish(dialer,
+		      __twopence_pipe_process_hello(bp, &dialer->ps, &dialer->keepalive, &dialer->resume));
+      return;
+    }
+  } else {
+    for (i = 0; i < dialer->nattempts; ) {
+      struct pollfd *pfd = dialer->attempt_pfd[i];
+      int fd = dialer->attempt_fd[i], err = 0;
+      socklen_t len = sizeof(err);
+
+      dialer->attempt_pfd[i] = NULL;
+      if (pfd == NULL || pfd->revents == 0) {
+        i++;
+        continue;
+      }
+
+      /* Take this attempt off the list */
+      dialer->attempt_fd[i] = dialer->attempt_fd[--(dialer->nattempts)];
+      dialer->attempt_pfd[i] = dialer->attempt_pfd[dialer->nattempts];
+
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+      if (err == 0) {
+        __twopence_pipe_dialer_connected_fd(dialer, fd);
+        return;
+      }
+
+      twopence_debug("%s: connect failed: %s", dialer->handle->base.ops->name, strerror(err));
+      close(fd);
+    }
+
+    twopence_loop_clock_get(&now);
+    if (dialer->nattempts == 0 || timercmp(&now, &dialer->next_attempt, >=))
+      __twopence_pipe_dialer_next(dialer);
+    if (dialer->rc <= 0)
+      return;
+  }
+
+  twopence_loop_clock_get(&now);
+  if (timerisset(&dialer->deadline) && timercmp(&now, &dialer->deadline, >=)) {
+    twopence_log_error("%s: timed out connecting to server", dialer->handle->base.ops->name);
+    __twopence_pipe_dialer_finish(dialer, TWOPENCE_OPEN_SESSION_ERROR);
+  }
+}
+
+/*
+ * Run all dialers until each of them has either succeeded or failed
+ */
+static void
+__twopence_pipe_dial(twopence_pipe_dialer_t *dialers, unsigned int count)
+{
+  struct pollfd *pfd;
+  unsigned int i;
+
+  for (i = 0; i < count; ++i) {
+    if (dialers[i].rc > 0)
+      __twopence_pipe_dialer_begin(&dialers[i]);
+  }
+
+  pfd = twopence_calloc(count * TWOPENCE_PIPE_DIAL_MAX, sizeof(pfd[0]));
+  while (true) {
+    twopence_pollinfo_t pinfo;
+    unsigned int busy = 0;
+
+    twopence_pollinfo_init(&pinfo, pfd, count * TWOPENCE_PIPE_DIAL_MAX);
+    for (i = 0; i < count; ++i) {
+      if (dialers[i].rc > 0) {
+        __twopence_pipe_dialer_fill_poll(&dialers[i], &pinfo);
+        busy++;
+      }
+    }
+
+    if (busy == 0)
+      break;
+
+    if (twopence_pollinfo_poll(&pinfo) < 0 && errno != EINTR) {
+      twopence_log_error("poll: %m");
+      for (i = 0; i < count; ++i) {
+        if (dialers[i].rc > 0)
+          __twopence_pipe_dialer_finish(&dialers[i], TWOPENCE_OPEN_SESSION_ERROR);
+      }
+      break;
+    }
+
+    for (i = 0; i < count; ++i) {
+      if (dialers[i].rc > 0)
+        __twopence_pipe_dialer_doio(&dialers[i]);
+    }
+  }
+
+  free(pfd);
+}
+
+/*
+ * The link to the server went away. Reconnect, and ask the server to
+ * resume our session, so that we do not lose any running commands.
+ * We keep trying for as long as the server promised to hang on to it.
+ */
+static int
+__twopence_pipe_resume_link(struct twopence_pipe_target *handle)
+{
+  twopence_conn_t *conn = handle->connection;
+  twopence_protocol_resume_t resume;
+  struct timeval now, deadline;
+
+  twopence_conn_get_resume_state(conn, &resume);
+  twopence_loop_clock_update(&deadline);
+  deadline.tv_sec += resume.grace;
+
+  do {
+    twopence_pipe_dialer_t dialer;
+
+    twopence_debug("trying to resume session %u", handle->ps.cid);
+    __twopence_pipe_dialer_init(&dialer, handle, &deadline);
+    dialer.ps = handle->ps;
+    twopence_conn_get_resume_state(conn, &dialer.resume);
+    __twopence_pipe_dial(&dialer, 1);
+
+    if (dialer.rc == 0) {
+      if (dialer.ps.cid == handle->ps.cid && twopence_conn_resume(conn, dialer.sock, dialer.resume.received)) {
+        twopence_sock_free(dialer.sock);
+        return 0;
+      }
+
+      twopence_sock_free(dialer.sock);
+      twopence_log_error("server was unable to resume session %u", handle->ps.cid);
+      break;
+    }
+
+    twopence_loop_clock_update(&now);
+    if (timercmp(&now, &deadline, >=))
+      break;
+    sleep(1);
+    twopence_loop_clock_update(&now);
+  } while (timercmp(&now, &deadline, <));
+
+  twopence_conn_close(conn);
+  return TWOPENCE_TRANSPORT_ERROR;
+}
+
+static void
+__twopence_pipe_dialer_prepare(twopence_pipe_dialer_t *dialer, struct twopence_pipe_target *handle)
+{
+  __twopence_pipe_dialer_init(dialer, handle, NULL);
+  dialer->ps.max_packet = handle->max_packet;
+  dialer->ps.compress = handle->compress & twopence_protocol_compress_supported();
+  twopence_debug("using keepalive=%u", (int) dialer->keepalive);
+}
+
+/*
+ * Attach the connection to the event loop of the calling thread
+ */
+static void
+__twopence_pipe_attach_pool(struct twopence_pipe_target *handle)
+{
+  if (twopence_pipe_connection_pool == NULL) {
+    twopence_pipe_connection_pool = twopence_conn_pool_new();
+    twopence_conn_pool_set_callback_close_connection(twopence_pipe_connection_pool, NULL);
+  }
+
+  twopence_conn_pool_add_connection(twopence_pipe_connection_pool, handle->connection);
+  handle->pool = twopence_pipe_connection_pool;
+}
+
+/*
+ * The handshake is complete; set up the connection
+ */
+static void
+__twopence_pipe_dialer_complete(twopence_pipe_dialer_t *dialer)
+{
+  struct twopence_pipe_target *handle = dialer->handle;
+  unsigned int keepalive = dialer->keepalive;
+  twopence_protocol_state_t ps = dialer->ps;
+
+  twopence_debug("handshake complete, my client id is %d, keepalive is %u", ps.cid, keepalive);
+  handle->connection = twopence_conn_new(&twopence_client_semantics, dialer->sock, ps.cid);
+  twopence_conn_set_max_packet(handle->connection, ps.max_packet);
+  twopence_conn_set_compression(handle->connection, ps.compress);
+  twopence_conn_set_flow_control(handle->connection, ps.flow_control);
+  twopence_conn_set_grace_period(handle->connection, dialer->resume.grace);
+  twopence_conn_set_resumable(handle->connection, ps.resume);
+  handle->ps = ps;
+  handle->ps.xid = 1;
+  dialer->sock = NULL;
+
+  /* If keepalive is -2, ignore the result of the keepalive negotiation and
+   * force them to off.
+   * This only exists so that we can test that keepalives work */
+  if (handle->keepalive == -2)
+    keepalive = 0;
+
+  twopence_conn_set_keepalive(handle->connection, keepalive);
+  __twopence_pipe_attach_pool(handle);
+}
+
+static int
+__twopence_pipe_open_link(struct twopence_pipe_target *handle)
+{
+  handle->adopted = false;
+
+  if (handle->connection && twopence_conn_is_detached(handle->connection))
+    return __twopence_pipe_resume_link(handle);
+
+  if (handle->connection && twopence_conn_is_closed(handle->connection))
+    return TWOPENCE_TRANSPORT_ERROR;
+
+  if (handle->connection == NULL) {
+    twopence_pipe_dialer_t dialer;
+
+    __twopence_pipe_dialer_prepare(&dialer, handle);
+    __twopence_pipe_dial(&dialer, 1);
+    if (dialer.rc < 0)
+      return TWOPENCE_OPEN_SESSION_ERROR;
+
+    __twopence_pipe_dialer_complete(&dialer);
   }
 
   return 0;
@@ -151,73 +566,68 @@ __twopence_pipe_send(struct twopence_pipe_target *handle, twopence_buf_t *bp)
 }
 
 /*
- * Read a chunk (normally called a packet or frame) from the link
- */
-static twopence_buf_t *
-__twopence_pipe_read_packet(twopence_sock_t *sock)
-{
-  twopence_buf_t *bp;
-
-  bp = twopence_sock_get_recvbuf(sock);
-
-  /* Receive more data from the link until we have at least one
-   * complete packet.
-   * Note: we may receive more data than that.
-   */
-  while (!twopence_protocol_buffer_complete(bp)) {
-    int count;
-
-    /* FIXME: heed the link timeout */
-    count = twopence_sock_recv_buffer_blocking(sock, bp);
-    if (count == 0) {
-      twopence_log_error("unexpected EOF on link");
-      return NULL;
-    }
-    if (count < 0) {
-      twopence_log_error("receive error on link: %m");
-      return NULL;
-    }
-  }
-
-  return bp;
-}
-
-/*
- * Perform the initial exchange of HELLO packets
+ * Process the server's reply to our HELLO packet.
+ * On input, ps->max_packet is the max packet size we would like to use,
+ * and ps->compress holds the compression algorithms we offered.
+ * When resuming a session, ps->cid is our old client id.
+ * On success, ps contains the client id assigned by the server, the
+ * header format, max packet size and compression to use on this connection,
+ * and resume holds the server's grace period and the number of packets
+ * it received.
  */
 static int
-__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *line_timeout)
+__twopence_pipe_process_hello(twopence_buf_t *bp, twopence_protocol_state_t *my_ps, unsigned int *line_timeout,
+		twopence_protocol_resume_t *resume)
 {
-  twopence_buf_t *bp, payload;
+  twopence_buf_t payload;
   const twopence_hdr_t *hdr;
   twopence_protocol_state_t ps;
   unsigned char server_version[2];
-  unsigned int server_keepalive;
+  unsigned int server_keepalive, server_max_packet, server_compress;
+  twopence_protocol_resume_t server_resume;
   int rc = 0;
 
-  /* Transmit and free the buffer */
-  rc = twopence_sock_xmit(sock, twopence_protocol_build_hello_packet(0, *line_timeout));
-  if (rc < 0)
-    return rc;
-
-  twopence_sock_post_recvbuf_if_needed(sock, 4 * TWOPENCE_PROTO_MAX_PACKET);
-
-  if ((bp = __twopence_pipe_read_packet(sock)) == NULL)
-    return TWOPENCE_PROTOCOL_ERROR;
-
   memset(&ps, 0, sizeof(ps));
   if ((hdr = twopence_protocol_dissect_ps(bp, &payload, &ps)) != NULL
    && hdr->type == TWOPENCE_PROTO_TYPE_HELLO
-   && twopence_protocol_dissect_hello_packet(&payload, server_version, &server_keepalive)) {
-    twopence_debug("received server HELLO reply: version %u.%u, keepalive=%u",
-		    server_version[0], server_version[1], server_keepalive);
-    if (server_version[0] != TWOPENCE_PROTOCOL_VERSMAJOR
-     || server_version[1] < TWOPENCE_PROTOCOL_VERSMINOR) {
+   && twopence_protocol_dissect_hello_packet(&payload, server_version, &server_keepalive, &server_max_packet, &server_compress,
+	   &server_resume)) {
+    twopence_debug("received server HELLO reply: version %u.%u, keepalive=%u, max packet %u, compression 0x%x",
+		    server_version[0], server_version[1], server_keepalive, server_max_packet, server_compress);
+    /* The server may pick an older minor version than ours; this just
+     * means some optional features will not be used. */
+    if (server_version[0] < TWOPENCE_PROTOCOL_VERSMAJOR_COMPAT
+     || server_version[0] > TWOPENCE_PROTOCOL_VERSMAJOR) {
       twopence_log_error("Protocol version not compatible. We use %u.%u, server uses %u.%u",
 	      TWOPENCE_PROTOCOL_VERSMAJOR, TWOPENCE_PROTOCOL_VERSMINOR, server_version[0], server_version[1]);
       return TWOPENCE_INCOMPATIBLE_PROTOCOL_ERROR;
     }
-    *client_id = ps.cid;
+
+    /* A version 3 server uses the old header and 32K packets */
+    my_ps->cid = ps.cid;
+    my_ps->wide = (server_version[0] >= 4);
+    if (!my_ps->wide)
+      server_max_packet = TWOPENCE_PROTO_MAX_PACKET;
+    if (server_max_packet > TWOPENCE_PROTO_MAX_JUMBO) {
+      twopence_log_error("Server asks for a max packet size of %u, which is too large", server_max_packet);
+      return TWOPENCE_PROTOCOL_ERROR;
+    }
+    my_ps->max_packet = server_max_packet;
+
+    /* The server picks one of the algorithms we offered, if any */
+    if (server_compress & (server_compress - 1) || server_compress & ~my_ps->compress) {
+      twopence_log_error("Server asks for compression 0x%x, which we did not offer", server_compress);
+      return TWOPENCE_PROTOCOL_ERROR;
+    }
+    my_ps->compress = server_compress;
+    my_ps->flow_control = ((server_version[0] << 8) | server_version[1]) >= TWOPENCE_PROTOCOL_VERSION_FLOW_CONTROL;
+    my_ps->batch = ((server_version[0] << 8) | server_version[1]) >= TWOPENCE_PROTOCOL_VERSION_BATCH;
+    my_ps->file_ops = ((server_version[0] << 8) | server_version[1]) >= TWOPENCE_PROTOCOL_VERSION_FILE_OPS;
+    my_ps->rusage = ((server_version[0] << 8) | server_version[1]) >= TWOPENCE_PROTOCOL_VERSION_RUSAGE;
+    my_ps->timestamps = ((server_version[0] << 8) | server_version[1]) >= TWOPENCE_PROTOCOL_VERSION_TIMESTAMPS;
+    my_ps->argv = ((server_version[0] << 8) | server_version[1]) >= TWOPENCE_PROTOCOL_VERSION_ARGV;
+    my_ps->resume = server_resume.grace != 0;
+    *resume = server_resume;
     if (*line_timeout == 0 || server_keepalive < *line_timeout)
       *line_timeout = server_keepalive;
     rc = 0;
@@ -239,7 +649,7 @@ twopence_pipe_transaction_new(struct twopence_pipe_target *handle, unsigned int
 
   trans = twopence_conn_transaction_new(handle->connection, type, &handle->ps);
   if (trans)
-	  handle->ps.xid++;
+	  twopence_protocol_next_xid(&handle->ps);
   return trans;
 }
 
@@ -329,7 +739,9 @@ __twopence_pipe_get_completed_transaction(struct twopence_pipe_target *handle, i
 int
 __twopence_pipe_doio(struct twopence_pipe_target *handle)
 {
-  twopence_conn_pool_poll(twopence_pipe_connection_pool);
+  twopence_conn_pool_poll(handle->pool);
+  if (twopence_conn_is_detached(handle->connection))
+    (void) __twopence_pipe_resume_link(handle);
   if (twopence_conn_is_closed(handle->connection))
     return TWOPENCE_TRANSPORT_ERROR;
 
@@ -360,6 +772,8 @@ __twopence_transaction_run(struct twopence_pipe_target *handle, twopence_transac
   status->pid = trans->id;
   status->major = trans->client.status_ret.major;
   status->minor = trans->client.status_ret.minor;
+  status->rusage = trans->client.status_ret.rusage;
+  status->timing = trans->client.status_ret.timing;
 
   if (trans->client.exception < 0)
     return trans->client.exception;
@@ -381,6 +795,11 @@ __twopence_pipe_command_recv(twopence_transaction_t *trans, const twopence_hdr_t
     twopence_transaction_set_error(trans, TWOPENCE_COMMAND_TIMEOUT_ERROR);
     break;
 
+  case TWOPENCE_PROTO_TYPE_RUSAGE:
+    if (!twopence_protocol_dissect_rusage_packet(payload, &trans->client.status_ret.rusage))
+      goto receive_results_error;
+    break;
+
   case TWOPENCE_PROTO_TYPE_MAJOR:
     if (!twopence_protocol_dissect_major_packet(payload, &trans->client.status_ret.major))
       goto receive_results_error;
@@ -439,6 +858,44 @@ recv_file_error:
   return true;
 }
 
+/*
+ * Callback function that handles incoming packets for a file operation.
+ */
+static bool
+__twopence_pipe_file_op_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+  twopence_file_stat_t st;
+
+  switch (hdr->type) {
+  case TWOPENCE_PROTO_TYPE_FILE_INFO:
+    while (twopence_buf_count(payload)) {
+      if (!twopence_protocol_dissect_file_stat(payload, &st))
+        goto receive_results_error;
+      twopence_file_op_add_entry(trans->client.file_op, &st);
+    }
+    break;
+
+  case TWOPENCE_PROTO_TYPE_MAJOR:
+    if (!twopence_protocol_dissect_major_packet(payload, &trans->client.status_ret.major))
+      goto receive_results_error;
+    break;
+
+  case TWOPENCE_PROTO_TYPE_MINOR:
+    if (!twopence_protocol_dissect_minor_packet(payload, &trans->client.status_ret.minor))
+      goto receive_results_error;
+    trans->done = true;
+    break;
+
+  default:
+    goto receive_results_error;
+  }
+  return true;
+
+receive_results_error:
+  twopence_transaction_set_error(trans, TWOPENCE_RECEIVE_RESULTS_ERROR);
+  return true;
+}
+
 static bool
 __twopence_pipe_extract_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
 {
@@ -493,6 +950,7 @@ __twopence_pipe_command(struct twopence_pipe_target *handle, twopence_command_t
 
   trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
   trans->recv = __twopence_pipe_command_recv;
+  twopence_transaction_set_command(trans, cmd);
 
   // Send command packet
   if ((rc = twopence_transaction_send_command(trans, cmd)) < 0)
@@ -524,6 +982,122 @@ out:
   return rc;
 }
 
+/*
+ * Wait for a command of a batch to complete, and record its result.
+ * The server reports commands it skipped with a major status of ECANCELED.
+ */
+static void
+__twopence_pipe_batch_wait(struct twopence_pipe_target *handle, twopence_transaction_t *trans, twopence_batch_entry_t *entry)
+{
+  handle->current_transaction = trans;
+  entry->rc = __twopence_transaction_run(handle, trans, &entry->status);
+  handle->current_transaction = NULL;
+
+  if (entry->rc == 0 && entry->status.major == ECANCELED)
+    entry->rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+
+  // If we gave up on the command, make sure the server does, too.
+  // Otherwise, a sequential batch would be stuck behind it.
+  if (entry->rc == TWOPENCE_COMMAND_TIMEOUT_ERROR)
+    (void) twopence_transaction_send_interrupt(trans);
+
+  twopence_transaction_free(trans);
+}
+
+// Send a batch of commands to the remote host
+//
+// Each BATCH packet carries as many commands as fit into one packet.
+// The server runs every command as a transaction of its own, using
+// consecutive xids starting with the xid of the BATCH packet, so we
+// create one client transaction per command to collect its output.
+//
+// Returns 0 if the batch was processed, or a negative error code
+static int
+__twopence_pipe_batch(struct twopence_pipe_target *handle, twopence_batch_t *batch)
+{
+  bool sequential = (batch->policy != TWOPENCE_BATCH_PARALLEL);
+  twopence_transaction_t **trans;
+  unsigned int first, count, i;
+  bool failed = false;
+  int rc;
+
+  for (i = 0; i < batch->count; ++i) {
+    twopence_command_t *cmd = &batch->entries[i]->command;
+
+    if (_twopence_invalid_username(cmd->user))
+      return TWOPENCE_PARAMETER_ERROR;
+    if (cmd->command == NULL || *cmd->command == '\0')
+      return TWOPENCE_PARAMETER_ERROR;
+  }
+
+  // Open communication link
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  // Older servers do not understand batches; let the caller fall back
+  if (!handle->ps.batch)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  trans = twopence_calloc(batch->count, sizeof(trans[0]));
+  for (first = 0; first < batch->count; first += count) {
+    if (failed && batch->policy == TWOPENCE_BATCH_STOP_ON_FAILURE) {
+      for (i = first; i < batch->count; ++i)
+        batch->entries[i]->rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+      break;
+    }
+
+    trans[first] = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
+    if ((rc = twopence_transaction_send_batch(trans[first], batch, first)) < 0) {
+      twopence_transaction_free(trans[first]);
+      trans[first] = NULL;
+      for (i = first; i < batch->count; ++i)
+        batch->entries[i]->rc = rc;
+      break;
+    }
+    count = rc;
+
+    for (i = first + 1; i < first + count; ++i)
+      trans[i] = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
+
+    for (i = first; i < first + count; ++i) {
+      twopence_command_t *cmd = &batch->entries[i]->command;
+
+      trans[i]->recv = __twopence_pipe_command_recv;
+      twopence_transaction_set_command(trans[i], cmd);
+
+      // When the server runs the commands one after the other, the
+      // clock starts ticking once the previous command is done.
+      if (!sequential)
+        twopence_transaction_set_timeout(trans[i], cmd->timeout);
+
+      twopence_pipe_transaction_attach_stdout(trans[i], cmd);
+      twopence_pipe_transaction_attach_stderr(trans[i], cmd);
+
+      __twopence_pipe_transaction_add_running(handle, trans[i]);
+    }
+
+    // In sequential mode, wait for this chunk before sending the next one,
+    // so that we know whether to carry on.
+    if (sequential) {
+      for (i = first; i < first + count; ++i) {
+        twopence_transaction_set_timeout(trans[i], batch->entries[i]->command.timeout);
+        __twopence_pipe_batch_wait(handle, trans[i], batch->entries[i]);
+        trans[i] = NULL;
+        if (twopence_batch_entry_failed(batch->entries[i]))
+          failed = true;
+      }
+    }
+  }
+
+  for (i = 0; i < batch->count; ++i) {
+    if (trans[i] != NULL)
+      __twopence_pipe_batch_wait(handle, trans[i], batch->entries[i]);
+  }
+
+  free(trans);
+  return 0;
+}
+
 /*
  * Chat scripting: send some data
  */
@@ -588,11 +1162,11 @@ twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct
   return trans->stats.nbytes_received - nreceived;
 }
 
-// Inject a file into the remote host
+// Start injecting a file into the remote host
 //
-// Returns 0 if everything went fine
+// On success, returns 0 and the running transaction in *trans_ret
 static int
-__twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer, twopence_status_t *status)
+__twopence_pipe_start_inject(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer, twopence_transaction_t **trans_ret)
 {
   twopence_transaction_t *trans;
   twopence_trans_channel_t *channel;
@@ -610,10 +1184,13 @@ __twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_x
 
   trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_INJECT);
   trans->recv = __twopence_pipe_inject_recv;
+  trans->client.xfer = xfer;
 
   // Send inject command packet
-  if ((rc = twopence_transaction_send_inject(trans, xfer)) < 0)
-    goto out;
+  if ((rc = twopence_transaction_send_inject(trans, xfer)) < 0) {
+    twopence_transaction_free(trans);
+    return rc;
+  }
 
   channel = twopence_transaction_attach_local_source_stream(trans, 0, xfer->local_stream);
   if (channel) {
@@ -625,19 +1202,70 @@ __twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_x
 
   __twopence_pipe_transaction_add_running(handle, trans);
 
+  *trans_ret = trans;
+  return 0;
+}
+
+// Inject a file into the remote host
+//
+// Returns 0 if everything went fine
+static int
+__twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer, twopence_status_t *status)
+{
+  twopence_transaction_t *trans;
+  int rc;
+
+  if ((rc = __twopence_pipe_start_inject(handle, xfer, &trans)) < 0)
+    return rc;
+
   rc = __twopence_transaction_run(handle, trans, status);
 
-out:
   twopence_transaction_free(trans);
   return rc;
 }
 
-// Extract a file from the remote host
+// Perform a file operation on the remote host
 //
 // Returns 0 if everything went fine, or a negative error code if failed
 static int
-__twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer,
-				twopence_status_t *status)
+__twopence_pipe_file_op(struct twopence_pipe_target *handle, twopence_file_op_t *op, twopence_status_t *status)
+{
+  twopence_transaction_t *trans;
+  int rc;
+
+  // Check that the username is valid
+  if (_twopence_invalid_username(op->user))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  // Open communication link
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  // Older servers can only do this by running a shell command
+  if (!handle->ps.file_ops)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_FILE_OP);
+  trans->recv = __twopence_pipe_file_op_recv;
+  trans->client.file_op = op;
+
+  if ((rc = twopence_transaction_send_file_op(trans, op)) < 0)
+    goto out;
+
+  __twopence_pipe_transaction_add_running(handle, trans);
+
+  rc = __twopence_transaction_run(handle, trans, status);
+
+out:
+  twopence_transaction_free(trans);
+  return rc;
+}
+
+// Start extracting a file from the remote host
+//
+// On success, returns 0 and the running transaction in *trans_ret
+static int
+__twopence_pipe_start_extract(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer, twopence_transaction_t **trans_ret)
 {
   twopence_transaction_t *trans;
   twopence_trans_channel_t *sink;
@@ -655,10 +1283,13 @@ __twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_
 
   trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_EXTRACT);
   trans->recv = __twopence_pipe_extract_recv;
+  trans->client.xfer = xfer;
 
   // Send command packet
-  if ((rc = twopence_transaction_send_extract(trans, xfer)) < 0)
-    goto out;
+  if ((rc = twopence_transaction_send_extract(trans, xfer)) < 0) {
+    twopence_transaction_free(trans);
+    return rc;
+  }
 
   sink = twopence_transaction_attach_local_sink_stream(trans, 0, xfer->local_stream);
   if (sink) {
@@ -669,9 +1300,25 @@ __twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_
 
   __twopence_pipe_transaction_add_running(handle, trans);
 
+  *trans_ret = trans;
+  return 0;
+}
+
+// Extract a file from the remote host
+//
+// Returns 0 if everything went fine, or a negative error code if failed
+static int
+__twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer,
+				twopence_status_t *status)
+{
+  twopence_transaction_t *trans;
+  int rc;
+
+  if ((rc = __twopence_pipe_start_extract(handle, xfer, &trans)) < 0)
+    return rc;
+
   rc = __twopence_transaction_run(handle, trans, status);
 
-out:
   twopence_transaction_free(trans);
   return rc;
 }
@@ -706,6 +1353,7 @@ __twopence_pipe_exit_remote(struct twopence_pipe_target *handle)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
   // Send command
+  handle->exit_sent = true;
   if (__twopence_pipe_send(handle, twopence_protocol_build_simple_packet(TWOPENCE_PROTO_TYPE_QUIT)) < 0)
     return TWOPENCE_INTERRUPT_COMMAND_ERROR;
 
@@ -727,7 +1375,8 @@ __twopence_pipe_interrupt_command(struct twopence_pipe_target *handle)
   if (handle->connection == NULL)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  if (__twopence_pipe_send(handle, twopence_protocol_build_simple_packet_ps(&trans->ps, TWOPENCE_PROTO_TYPE_INTR)) < 0)
+  /* This goes out ahead of any data queued on the link */
+  if (twopence_transaction_send_interrupt(trans) < 0)
     return TWOPENCE_INTERRUPT_COMMAND_ERROR;
 
   return 0;
@@ -735,6 +1384,23 @@ __twopence_pipe_interrupt_command(struct twopence_pipe_target *handle)
 
 ///////////////////////////// Public interface //////////////////////////////////
 
+/*
+ * A target adopted from the connection cache looks like a new one
+ * to the caller, who may want to change options that only take effect
+ * when connecting. Drop the cached connection, so that we connect anew.
+ */
+static void
+__twopence_pipe_drop_adopted(struct twopence_pipe_target *handle)
+{
+  if (handle->adopted && handle->connection && twopence_conn_is_idle(handle->connection)) {
+    twopence_debug("%s: dropping cached connection", handle->base.ops->name);
+    twopence_conn_free(handle->connection);
+    handle->connection = NULL;
+    handle->pool = NULL;
+  }
+  handle->adopted = false;
+}
+
 int
 twopence_pipe_set_option(struct twopence_target *opaque_handle, int option, const void *value_p)
 {
@@ -742,6 +1408,7 @@ twopence_pipe_set_option(struct twopence_target *opaque_handle, int option, cons
 
   switch (option) {
   case TWOPENCE_TARGET_OPTION_KEEPALIVE:
+    __twopence_pipe_drop_adopted(handle);
     if (handle->connection != NULL) {
       twopence_log_error("%s: cannot set keepalive option; connection already established", handle->base.ops->name);
       return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR; /* not quite */
@@ -750,6 +1417,20 @@ twopence_pipe_set_option(struct twopence_target *opaque_handle, int option, cons
     handle->keepalive = *(const int *) value_p;
     break;
 
+  case TWOPENCE_TARGET_OPTION_CONNECT_TIMEOUT:
+    handle->connect_timeout = *(const int *) value_p;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_COMPRESSION:
+    __twopence_pipe_drop_adopted(handle);
+    if (handle->connection != NULL) {
+      twopence_log_error("%s: cannot set compression option; connection already established", handle->base.ops->name);
+      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR; /* not quite */
+    }
+
+    handle->compress = *(const int *) value_p? TWOPENCE_PROTO_COMPRESS_DEFLATE : 0;
+    break;
+
   default:
     return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
 
@@ -771,6 +1452,17 @@ twopence_pipe_run_test(struct twopence_target *opaque_handle, twopence_command_t
   return __twopence_pipe_command(handle, cmd, status_ret);
 }
 
+/*
+ * Run a batch of commands
+ */
+int
+twopence_pipe_run_batch(twopence_target_t *opaque_handle, twopence_batch_t *batch)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  return __twopence_pipe_batch(handle, batch);
+}
+
 /*
  * Wait for a remote command to finish
  */
@@ -809,6 +1501,8 @@ twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence
   } else {
     status->major = trans->client.status_ret.major;
     status->minor = trans->client.status_ret.minor;
+    status->rusage = trans->client.status_ret.rusage;
+    status->timing = trans->client.status_ret.timing;
     rc = trans->id;
   }
 
@@ -854,6 +1548,214 @@ twopence_pipe_extract_file(struct twopence_target *opaque_handle,
   return rc;
 }
 
+/*
+ * Asynchronous API: start a transfer and return its xid.
+ * The result is picked up by twopence_pipe_reap() later.
+ */
+int
+twopence_pipe_submit_inject(twopence_target_t *opaque_handle, twopence_file_xfer_t *xfer)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_transaction_t *trans;
+  int rc;
+
+  if ((rc = __twopence_pipe_start_inject(handle, xfer, &trans)) < 0)
+    return rc;
+
+  return trans->id;
+}
+
+int
+twopence_pipe_submit_extract(twopence_target_t *opaque_handle, twopence_file_xfer_t *xfer)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_transaction_t *trans;
+  int rc;
+
+  if ((rc = __twopence_pipe_start_extract(handle, xfer, &trans)) < 0)
+    return rc;
+
+  return trans->id;
+}
+
+/*
+ * Return the result of any transaction that has completed on this target.
+ */
+int
+twopence_pipe_reap(twopence_target_t *opaque_handle, twopence_completion_t *comp)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_transaction_t *trans;
+
+  if (handle->connection == NULL)
+    return 0;
+
+  trans = __twopence_pipe_get_completed_transaction(handle, 0);
+  if (trans == NULL)
+    return 0;
+
+  twopence_debug("%s: reaped transaction %s", __func__, twopence_transaction_describe(trans));
+  comp->id = trans->id;
+  comp->command = trans->client.command;
+  comp->xfer = trans->client.xfer;
+
+  comp->status.pid = trans->id;
+  comp->status.major = trans->client.status_ret.major;
+  comp->status.minor = trans->client.status_ret.minor;
+  comp->status.rusage = trans->client.status_ret.rusage;
+  comp->status.timing = trans->client.status_ret.timing;
+
+  comp->rc = 0;
+  if (trans->client.exception < 0)
+    comp->rc = trans->client.exception;
+  else if (comp->xfer && (comp->status.major != 0 || comp->status.minor != 0))
+    comp->rc = TWOPENCE_REMOTE_FILE_ERROR;
+
+  twopence_transaction_free(trans);
+  return 1;
+}
+
+/*
+ * Check the links of all targets, and count the ones that are
+ * still waiting for transactions to complete.
+ */
+static unsigned int
+__twopence_pipe_count_busy(twopence_target_t **targets, unsigned int count)
+{
+  unsigned int i, nbusy = 0;
+
+  for (i = 0; i < count; ++i) {
+    struct twopence_pipe_target *handle = (struct twopence_pipe_target *) targets[i];
+    twopence_conn_t *conn = handle->connection;
+
+    if (conn == NULL)
+      continue;
+
+    if (twopence_conn_is_detached(conn))
+      (void) __twopence_pipe_resume_link(handle);
+    if (twopence_conn_is_closed(conn))
+      twopence_conn_cancel_transactions(conn, TWOPENCE_TRANSPORT_ERROR);
+
+    if (twopence_conn_has_pending_transactions(conn))
+      nbusy++;
+  }
+
+  return nbusy;
+}
+
+/*
+ * Perform one round of I/O for any number of targets.
+ * All pipe targets connected by the same thread share that thread's
+ * pool, so this services the connections of virtio, serial, tcp and
+ * chroot targets alike with a single poll call.
+ * Targets connected by another thread belong to that thread's loop,
+ * and we must not touch them.
+ *
+ * Returns the number of targets that still have transactions in flight.
+ */
+int
+twopence_pipe_poll(twopence_target_t **targets, unsigned int count, const struct timeval *deadline)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; ++i) {
+    struct twopence_pipe_target *handle = (struct twopence_pipe_target *) targets[i];
+
+    if (handle->connection != NULL && handle->pool != twopence_pipe_connection_pool) {
+      twopence_log_error("%s: target is attached to the event loop of another thread", __func__);
+      return TWOPENCE_PARAMETER_ERROR;
+    }
+  }
+
+  if (__twopence_pipe_count_busy(targets, count) == 0)
+    return 0;
+
+  twopence_conn_pool_poll_deadline(twopence_pipe_connection_pool, deadline);
+  return __twopence_pipe_count_busy(targets, count);
+}
+
+/*
+ * Bring up the links to any number of targets at once.
+ * Targets that are connected already are left alone.
+ * results[i] receives 0 or the error code for targets[i].
+ *
+ * Returns 0 if all targets are connected, or the first error.
+ */
+int
+twopence_pipe_connect(twopence_target_t **targets, unsigned int count, int *results)
+{
+  twopence_pipe_dialer_t *dialers;
+  unsigned int i;
+  int rc = 0;
+
+  dialers = twopence_calloc(count, sizeof(dialers[0]));
+  for (i = 0; i < count; ++i) {
+    struct twopence_pipe_target *handle = (struct twopence_pipe_target *) targets[i];
+
+    if (handle->connection == NULL)
+      __twopence_pipe_dialer_prepare(&dialers[i], handle);
+  }
+
+  __twopence_pipe_dial(dialers, count);
+
+  for (i = 0; i < count; ++i) {
+    struct twopence_pipe_target *handle = (struct twopence_pipe_target *) targets[i];
+    int result;
+
+    if (dialers[i].handle == NULL) {
+      /* Resuming a session may take a while, but it is rare enough */
+      result = __twopence_pipe_open_link(handle);
+    } else
+    if (dialers[i].rc < 0) {
+      result = TWOPENCE_OPEN_SESSION_ERROR;
+    } else {
+      __twopence_pipe_dialer_complete(&dialers[i]);
+      result = 0;
+    }
+
+    results[i] = result;
+    if (result < 0 && rc == 0)
+      rc = result;
+  }
+
+  free(dialers);
+  return rc;
+}
+
+/*
+ * Perform a file operation on the remote host.
+ *
+ * Except for LISTDIR, the server returns a single record, which we
+ * move to op->stat (and op->link, for READLINK).
+ */
+int
+twopence_pipe_file_op(twopence_target_t *opaque_handle, twopence_file_op_t *op, twopence_status_t *status)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  unsigned int i;
+  int rc;
+
+  rc = __twopence_pipe_file_op(handle, op, status);
+  if (rc == 0 && (status->major != 0 || status->minor != 0))
+    rc = TWOPENCE_REMOTE_FILE_ERROR;
+
+  if (op->op != TWOPENCE_FILEOP_LISTDIR && op->count != 0) {
+    op->stat = op->entries[0];
+    if (op->op == TWOPENCE_FILEOP_READLINK) {
+      op->link = op->stat.name;
+      op->stat.name = NULL;
+    }
+
+    for (i = 1; i < op->count; ++i)
+      free(op->entries[i].name);
+    free(op->entries);
+    op->entries = NULL;
+    op->count = 0;
+  }
+
+  return rc;
+}
+
 // Interrupt current command
 //
 // Returns 0 if everything went fine
@@ -898,6 +1800,76 @@ twopence_pipe_exit_remote(struct twopence_target *opaque_handle)
   return __twopence_pipe_exit_remote(handle);
 }
 
+/*
+ * Prepare an idle target for the connection cache: detach its connection
+ * from this thread's event loop, and reset what the next owner should not
+ * inherit.
+ *
+ * Returns the number of seconds the target may stay parked (0 meaning
+ * no limit), or -1 if it cannot be cached.
+ */
+int
+twopence_pipe_park(twopence_target_t *opaque_handle)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_conn_t *conn = handle->connection;
+
+  if (conn == NULL || handle->exit_sent || !twopence_conn_is_idle(conn))
+    return -1;
+
+  twopence_conn_pool_remove_connection(conn);
+  handle->pool = NULL;
+  handle->current_transaction = NULL;
+  handle->connect_timeout = -1;
+
+  /* Nobody sends keepalives while the connection is parked, so the
+   * server will drop it after its keepalive timeout. Leave a margin. */
+  return twopence_conn_get_keepalive(conn) / 2;
+}
+
+/*
+ * Take a target out of the connection cache, and attach its connection
+ * to the event loop of the calling thread.
+ *
+ * Returns false if the connection died while it was parked.
+ */
+bool
+twopence_pipe_adopt(twopence_target_t *opaque_handle)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_conn_t *conn = handle->connection;
+  struct timeval now;
+
+  twopence_conn_update_recv_keepalive(conn);
+  __twopence_pipe_attach_pool(handle);
+
+  /* Pick up whatever the server sent while we were parked, including
+   * an EOF if it went away */
+  twopence_loop_clock_update(&now);
+  twopence_conn_pool_poll_deadline(handle->pool, &now);
+
+  if (twopence_conn_is_closed(conn) || twopence_conn_is_detached(conn))
+    return false;
+
+  handle->adopted = true;
+  return true;
+}
+
+/*
+ * Compression statistics of the current connection
+ */
+int
+twopence_pipe_get_compress_stats(twopence_target_t *opaque_handle, twopence_compress_stats_t *stats)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  if (handle->connection == NULL)
+    memset(stats, 0, sizeof(*stats));
+  else
+    twopence_conn_get_compress_stats(handle->connection, stats);
+  return 0;
+}
+
 // Close the library
 void
 twopence_pipe_end(struct twopence_target *opaque_handle)
@@ -906,7 +1878,7 @@ twopence_pipe_end(struct twopence_target *opaque_handle)
 
   twopence_debug("%s()", __func__);
   if (handle->connection != NULL) {
-    /* The connection may still be attached to twopence_pipe_connection_pool,
+    /* The connection may still be attached to the pool of its thread,
      * but fortunately, twopence_conn_free() takes care of this.
      */
     twopence_conn_free(handle->connection);
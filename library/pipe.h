@@ -34,20 +34,49 @@ struct twopence_pipe_target {
   /* Timeout for keepalives. Set to 0 to disable; -1 to use the default settings */
   int				keepalive;
 
+  /* How long we wait for the link to come up and the server to answer
+   * our HELLO, in milliseconds. Negative means no limit. */
+  int				connect_timeout;
+
+  /* Max packet size we ask for in the HELLO exchange. The server
+   * may pick a smaller one. */
+  unsigned int			max_packet;
+
+  /* Compression algorithms we offer in the HELLO exchange; 0 disables
+   * compression. Only worth it on slow links. */
+  unsigned int			compress;
+
   /* This holds the fd of the serial port/the socket or whatever else we use to
    * communicate with the server. */
   twopence_conn_t *		connection;
 
+  /* The event loop of the thread that opened the connection */
+  twopence_conn_pool_t *	pool;
+
   twopence_protocol_state_t	ps;
 
   /* "foreground" transaction. This is the transaction that gets
    * cancelled when twopence_interrupt() is called. */
   twopence_transaction_t *	current_transaction;
+
+  /* Set when the connection was taken from the connection cache,
+   * until the target is first used */
+  bool				adopted;
+
+  /* We told the server to exit; the connection is not worth caching */
+  bool				exit_sent;
 };
 
 
+struct addrinfo;
+
+/*
+ * Links are either opened right away by open(), or resolved to a list
+ * of addresses, which we connect to without blocking.
+ */
 struct twopence_pipe_ops {
   twopence_sock_t *		(*open)(struct twopence_pipe_target *);
+  int				(*resolve)(struct twopence_pipe_target *, struct addrinfo **);
 };
 
 extern void	twopence_pipe_target_init(struct twopence_pipe_target *, int plugin_type, const struct twopence_plugin *,
@@ -55,11 +84,21 @@ extern void	twopence_pipe_target_init(struct twopence_pipe_target *, int plugin_
 
 extern int	twopence_pipe_set_option(struct twopence_target *target, int option, const void *value_p);
 extern int	twopence_pipe_run_test(struct twopence_target *, twopence_command_t *, twopence_status_t *);
+extern int	twopence_pipe_run_batch(twopence_target_t *, twopence_batch_t *);
+extern int	twopence_pipe_file_op(twopence_target_t *, twopence_file_op_t *, twopence_status_t *);
 extern int	twopence_pipe_wait(struct twopence_target *, int, twopence_status_t *);
 extern int	twopence_pipe_chat_send(twopence_target_t *opaque_handle, int xid, twopence_iostream_t *stream);
 extern int	twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct timeval *deadline);
 extern int	twopence_pipe_inject_file (struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
 extern int	twopence_pipe_extract_file (struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
+extern int	twopence_pipe_submit_inject(twopence_target_t *, twopence_file_xfer_t *);
+extern int	twopence_pipe_submit_extract(twopence_target_t *, twopence_file_xfer_t *);
+extern int	twopence_pipe_reap(twopence_target_t *, twopence_completion_t *);
+extern int	twopence_pipe_poll(twopence_target_t **, unsigned int, const struct timeval *);
+extern int	twopence_pipe_connect(twopence_target_t **, unsigned int, int *);
+extern int	twopence_pipe_park(twopence_target_t *);
+extern bool	twopence_pipe_adopt(twopence_target_t *);
+extern int	twopence_pipe_get_compress_stats(twopence_target_t *, twopence_compress_stats_t *);
 extern int	twopence_pipe_interrupt_command(struct twopence_target *);
 extern int	twopence_pipe_exit_remote(struct twopence_target *);
 extern int	twopence_pipe_disconnect(twopence_target_t *);
@@ -45,7 +45,12 @@
 #include <ctype.h>
 #include <limits.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "protocol.h"
+#include "utils.h"
 
 
 /*
@@ -54,7 +59,7 @@
 const char *
 twopence_protocol_packet_type_to_string(unsigned int type)
 {
-	static char descbuf[64];
+	static __thread char descbuf[32];
 
 	switch (type) {
 	case TWOPENCE_PROTO_TYPE_HELLO:
@@ -81,58 +86,154 @@ twopence_protocol_packet_type_to_string(unsigned int type)
 		return "timeout";
 	case TWOPENCE_PROTO_TYPE_KEEPALIVE:
 		return "keepalive";
+	case TWOPENCE_PROTO_TYPE_CHAN_CREDIT:
+		return "credit";
+	case TWOPENCE_PROTO_TYPE_ACK:
+		return "ack";
+	case TWOPENCE_PROTO_TYPE_BATCH:
+		return "batch";
+	case TWOPENCE_PROTO_TYPE_FILE_OP:
+		return "fileop";
+	case TWOPENCE_PROTO_TYPE_FILE_INFO:
+		return "fileinfo";
+	case TWOPENCE_PROTO_TYPE_RUSAGE:
+		return "rusage";
+	case TWOPENCE_PROTO_TYPE_CHAN_STAMP:
+		return "chan_stamp";
 	default:
 		snprintf(descbuf, sizeof(descbuf), "trans-type-%d", type);
 		return descbuf;
 	}
 }
 
-void
-__twopence_protocol_build_header(twopence_buf_t *bp, unsigned char type, unsigned int cid, unsigned int xid)
+static inline unsigned int
+__twopence_protocol_header_size(bool wide)
 {
-	unsigned int len = twopence_buf_count(bp);
-	twopence_hdr_t hdr;
+	return wide? TWOPENCE_PROTO_HEADER_SIZE_V4 : TWOPENCE_PROTO_HEADER_SIZE_V3;
+}
 
-	assert(len < 65536);
+unsigned int
+twopence_protocol_header_size(const twopence_hdr_t *hdr)
+{
+	return __twopence_protocol_header_size(hdr->flags & TWOPENCE_PROTO_HDR_WIDE);
+}
 
-	hdr.type = type;
-	hdr.pad = 0;
-	hdr.cid = htons(cid);
-	hdr.xid = htons(xid);
-	hdr.len = htons(len);
+static inline unsigned int
+__twopence_protocol_packet_len(const twopence_hdr_t *hdr)
+{
+	if (hdr->flags & TWOPENCE_PROTO_HDR_WIDE)
+		return ntohl(((const twopence_hdr_v4_t *) hdr)->len);
+	return ntohs(hdr->len);
+}
 
-	memcpy((void *) twopence_buf_head(bp), &hdr, TWOPENCE_PROTO_HEADER_SIZE);
+/*
+ * Write the header at the head of the buffer. @len is the size of the
+ * packet including the header, which may be more than what's in the
+ * buffer (see twopence_protocol_build_file_data_header).
+ */
+static void
+__twopence_protocol_build_header(twopence_buf_t *bp, unsigned char type, unsigned int cid, unsigned int xid, bool wide,
+		unsigned int flags, unsigned int len)
+{
+	if (wide) {
+		twopence_hdr_v4_t hdr;
+
+		hdr.type = type;
+		hdr.flags = TWOPENCE_PROTO_HDR_WIDE | flags;
+		hdr.cid = htons(cid);
+		hdr.xid = htonl(xid);
+		hdr.len = htonl(len);
+		memcpy((void *) twopence_buf_head(bp), &hdr, sizeof(hdr));
+	} else {
+		twopence_hdr_t hdr;
+
+		assert(len < 65536);
+		assert(xid < 65536);
+		assert(flags == 0);
+
+		hdr.type = type;
+		hdr.flags = 0;
+		hdr.cid = htons(cid);
+		hdr.xid = htons(xid);
+		hdr.len = htons(len);
+		memcpy((void *) twopence_buf_head(bp), &hdr, sizeof(hdr));
+	}
 }
 
 void
 twopence_protocol_build_header(twopence_buf_t *bp, unsigned char type)
 {
-	__twopence_protocol_build_header(bp, type, 0, 0);
+	__twopence_protocol_build_header(bp, type, 0, 0, false, 0, twopence_buf_count(bp));
 }
 
-void
-__twopence_protocol_push_header(twopence_buf_t *bp, unsigned char type, unsigned int cid, unsigned int xid)
+static void
+__twopence_protocol_push_header(twopence_buf_t *bp, unsigned char type, unsigned int cid, unsigned int xid, bool wide,
+		unsigned int flags)
 {
 	/* When we post buffers to the output streams of a command, for instance,
 	 * we reserve the space needed for the header.
 	 * When we get here, we want to use that space, so we need to
-	 * change the head pointer back to the start of the buffer. */
+	 * change the head pointer back. A version 3 header is shorter
+	 * than the space we reserved, so it does not start at offset 0. */
 	assert(bp->head == TWOPENCE_PROTO_HEADER_SIZE);
-	bp->head = 0;
+	bp->head -= __twopence_protocol_header_size(wide);
 
-	__twopence_protocol_build_header(bp, type, cid, xid);
+	__twopence_protocol_build_header(bp, type, cid, xid, wide, flags, twopence_buf_count(bp));
 }
 
 void
 twopence_protocol_push_header(twopence_buf_t *bp, unsigned char type)
 {
-	__twopence_protocol_push_header(bp, type, 0, 0);
+	__twopence_protocol_push_header(bp, type, 0, 0, false, 0);
 }
 
 void
 twopence_protocol_push_header_ps(twopence_buf_t *bp, const twopence_protocol_state_t *ps, unsigned char type)
 {
-	__twopence_protocol_push_header(bp, type, ps->cid, ps->xid);
+	__twopence_protocol_push_header(bp, type, ps->cid, ps->xid, ps->wide, 0);
+}
+
+unsigned int
+twopence_protocol_max_packet(const twopence_protocol_state_t *ps)
+{
+	if (ps->max_packet == 0)
+		return TWOPENCE_PROTO_MAX_PACKET;
+	return ps->max_packet;
+}
+
+/*
+ * The max amount of data we put into a CHAN_DATA packet. We always
+ * reserve room for the larger v4 header, whichever we end up using.
+ */
+unsigned int
+twopence_protocol_max_data(const twopence_protocol_state_t *ps)
+{
+	return twopence_protocol_max_packet(ps) - TWOPENCE_PROTO_HEADER_SIZE - 2;
+}
+
+/*
+ * The amount of data the sender on a channel may have outstanding
+ * when using flow control. Both ends derive it from the negotiated
+ * max packet size.
+ */
+unsigned int
+twopence_protocol_channel_window(const twopence_protocol_state_t *ps)
+{
+	return TWOPENCE_PROTO_WINDOW_PACKETS * twopence_protocol_max_packet(ps);
+}
+
+/*
+ * Advance to the next transaction ID. With version 3, the xid is 16 bits
+ * wide and wraps around. Zero is never used as transaction ID.
+ */
+void
+twopence_protocol_next_xid(twopence_protocol_state_t *ps)
+{
+	ps->xid++;
+	if (!ps->wide)
+		ps->xid &= 0xFFFF;
+	if (ps->xid == 0)
+		ps->xid = 1;
 }
 
 twopence_buf_t *
@@ -140,7 +241,7 @@ twopence_protocol_command_buffer_new()
 {
 	twopence_buf_t *bp;
 
-	bp = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
+	bp = twopence_buf_new_pooled(TWOPENCE_PROTO_MAX_PACKET);
 	twopence_buf_reserve_tail(bp, TWOPENCE_PROTO_HEADER_SIZE);
 
 	/* Reserve head room */
@@ -149,6 +250,20 @@ twopence_protocol_command_buffer_new()
 	return bp;
 }
 
+/*
+ * Allocate a buffer for a CHAN_DATA packet of up to the negotiated
+ * max packet size, with room reserved for header and channel id.
+ */
+twopence_buf_t *
+twopence_protocol_data_buffer_new(const twopence_protocol_state_t *ps)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_buf_new_pooled(twopence_protocol_max_packet(ps));
+	bp->head = bp->tail = TWOPENCE_PROTO_HEADER_SIZE + 2;
+	return bp;
+}
+
 twopence_buf_t *
 twopence_protocol_build_simple_packet_ps(twopence_protocol_state_t *ps, unsigned char type)
 {
@@ -221,8 +336,8 @@ __decode_string(twopence_buf_t *bp)
  *  CHANNEL_EOF:	indicating EOF on this channel
  *  CHANNEL_ERROR:	indicating an error on the indicated channel.
  */
-twopence_buf_t *
-twopence_protocol_build_data_header(twopence_buf_t *bp, twopence_protocol_state_t *ps, uint16_t channel_id)
+static twopence_buf_t *
+__twopence_protocol_build_data_header(twopence_buf_t *bp, twopence_protocol_state_t *ps, uint16_t channel_id, unsigned int flags)
 {
 	assert(bp->head == TWOPENCE_PROTO_HEADER_SIZE + 2);
 
@@ -232,10 +347,269 @@ twopence_protocol_build_data_header(twopence_buf_t *bp, twopence_protocol_state_
 	bp->head -= 2;
 	memcpy((void *) twopence_buf_head(bp), &channel_id, 2);
 
-	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_CHAN_DATA);
+	__twopence_protocol_push_header(bp, TWOPENCE_PROTO_TYPE_CHAN_DATA, ps->cid, ps->xid, ps->wide, flags);
 	return bp;
 }
 
+twopence_buf_t *
+twopence_protocol_build_data_header(twopence_buf_t *bp, twopence_protocol_state_t *ps, uint16_t channel_id)
+{
+	return __twopence_protocol_build_data_header(bp, ps, channel_id, 0);
+}
+
+/*
+ * Build the header of a data packet whose payload is not in the buffer,
+ * but will be sent from a file separately (see twopence_sock_queue_file).
+ */
+twopence_buf_t *
+twopence_protocol_build_file_data_header(twopence_protocol_state_t *ps, uint16_t channel_id, unsigned int count)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	__encode_u16(bp, channel_id);
+
+	bp->head -= __twopence_protocol_header_size(ps->wide);
+	__twopence_protocol_build_header(bp, TWOPENCE_PROTO_TYPE_CHAN_DATA, ps->cid, ps->xid, ps->wide, 0,
+			twopence_buf_count(bp) + count);
+	return bp;
+}
+
+/*
+ * Compression of CHAN_DATA payloads.
+ *
+ * Every channel has a compression stream of its own, which is flushed
+ * at the end of each packet so that the receiver can decompress it right
+ * away. Later packets still refer back to data sent earlier, which makes
+ * a big difference for the small chunks of output most commands produce.
+ *
+ * Data that does not compress well is sent raw. As the compressor has
+ * already seen it, we have to reset it; the next compressed packet
+ * carries the RESTART flag to tell the receiver to do the same.
+ * If the data keeps being incompressible, we back off exponentially
+ * before trying again.
+ */
+#define TWOPENCE_PROTO_COMPRESS_MAX_BACKOFF	64
+
+struct twopence_protocol_codec {
+	unsigned int		algo;
+	bool			compress;
+
+	/* Compressor only */
+	bool			restart;
+	unsigned int		backoff;
+	unsigned int		skip;
+
+#ifdef HAVE_ZLIB
+	z_stream		zstream;
+#endif
+};
+
+unsigned int
+twopence_protocol_compress_supported(void)
+{
+#ifdef HAVE_ZLIB
+	return TWOPENCE_PROTO_COMPRESS_DEFLATE;
+#else
+	return 0;
+#endif
+}
+
+twopence_protocol_codec_t *
+twopence_protocol_codec_new(unsigned int algo, bool compress)
+{
+#ifdef HAVE_ZLIB
+	twopence_protocol_codec_t *codec;
+	int rv;
+
+	if (algo != TWOPENCE_PROTO_COMPRESS_DEFLATE)
+		return NULL;
+
+	codec = twopence_calloc(1, sizeof(*codec));
+	codec->algo = algo;
+	codec->compress = compress;
+	codec->restart = true;
+
+	/* Raw deflate without zlib header and checksum. We care about
+	 * speed rather than the last few percent, hence level 1. */
+	if (compress)
+		rv = deflateInit2(&codec->zstream, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	else
+		rv = inflateInit2(&codec->zstream, -15);
+	if (rv != Z_OK) {
+		twopence_log_error("unable to initialize %s stream: %s",
+				compress? "deflate" : "inflate",
+				codec->zstream.msg? codec->zstream.msg : zError(rv));
+		free(codec);
+		return NULL;
+	}
+	return codec;
+#else
+	return NULL;
+#endif
+}
+
+void
+twopence_protocol_codec_free(twopence_protocol_codec_t *codec)
+{
+#ifdef HAVE_ZLIB
+	if (codec->compress)
+		deflateEnd(&codec->zstream);
+	else
+		inflateEnd(&codec->zstream);
+#endif
+	free(codec);
+}
+
+#ifdef HAVE_ZLIB
+static inline unsigned long long
+__twopence_protocol_cputime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Compress the data in @bp into @zbp, using no more than @limit bytes.
+ */
+static bool
+__twopence_protocol_deflate(twopence_protocol_codec_t *codec, twopence_buf_t *bp, twopence_buf_t *zbp, unsigned int limit)
+{
+	z_stream *zs = &codec->zstream;
+
+	zs->next_in = (unsigned char *) twopence_buf_head(bp);
+	zs->avail_in = twopence_buf_count(bp);
+	zs->next_out = (unsigned char *) twopence_buf_tail(zbp);
+	zs->avail_out = limit;
+
+	/* If we run out of output space, deflate may hold back input
+	 * or output. Either way, the data did not compress well enough. */
+	if (deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in != 0 || zs->avail_out == 0)
+		return false;
+
+	twopence_buf_advance_tail(zbp, limit - zs->avail_out);
+	return true;
+}
+
+static bool
+__twopence_protocol_inflate(twopence_protocol_codec_t *codec, twopence_buf_t *payload, twopence_buf_t *bp)
+{
+	z_stream *zs = &codec->zstream;
+	unsigned int room = twopence_buf_tailroom(bp);
+
+	zs->next_in = (unsigned char *) twopence_buf_head(payload);
+	zs->avail_in = twopence_buf_count(payload);
+	zs->next_out = (unsigned char *) twopence_buf_tail(bp);
+	zs->avail_out = room;
+
+	/* The sender never compresses more than fits into a packet, so
+	 * all of the input must have been consumed. */
+	if (inflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in != 0)
+		return false;
+
+	twopence_buf_advance_head(payload, twopence_buf_count(payload));
+	twopence_buf_advance_tail(bp, room - zs->avail_out);
+	return true;
+}
+#endif
+
+/*
+ * Build a CHAN_DATA packet from the data in @bp, compressing it if
+ * that pays off. Returns the packet to transmit, which may or may
+ * not be the buffer passed in.
+ */
+twopence_buf_t *
+twopence_protocol_build_compressed_data(twopence_protocol_codec_t *codec, twopence_buf_t *bp,
+		twopence_protocol_state_t *ps, uint16_t channel_id, twopence_codec_stats_t *stats)
+{
+	unsigned int count = twopence_buf_count(bp);
+	unsigned int flags = 0;
+
+	stats->npackets++;
+	stats->raw_bytes += count;
+
+#ifdef HAVE_ZLIB
+	if (codec && count >= TWOPENCE_PROTO_COMPRESS_MIN) {
+		if (codec->skip) {
+			codec->skip--;
+		} else {
+			unsigned long long start = __twopence_protocol_cputime();
+			twopence_buf_t *zbp = twopence_protocol_data_buffer_new(ps);
+
+			/* Only bother if we save at least one eighth */
+			if (__twopence_protocol_deflate(codec, bp, zbp, count - count / 8)) {
+				flags = TWOPENCE_PROTO_HDR_COMPRESSED;
+				if (codec->restart)
+					flags |= TWOPENCE_PROTO_HDR_RESTART;
+				codec->restart = false;
+				codec->backoff = 0;
+				stats->ncompressed++;
+
+				twopence_buf_free(bp);
+				bp = zbp;
+			} else {
+				deflateReset(&codec->zstream);
+				codec->restart = true;
+
+				codec->backoff = codec->backoff? 2 * codec->backoff : 1;
+				if (codec->backoff > TWOPENCE_PROTO_COMPRESS_MAX_BACKOFF)
+					codec->backoff = TWOPENCE_PROTO_COMPRESS_MAX_BACKOFF;
+				codec->skip = codec->backoff;
+
+				twopence_buf_free(zbp);
+			}
+			stats->cpu_nsec += __twopence_protocol_cputime() - start;
+		}
+	}
+#endif
+
+	stats->wire_bytes += twopence_buf_count(bp);
+	return __twopence_protocol_build_data_header(bp, ps, channel_id, flags);
+}
+
+/*
+ * Decompress the payload of a CHAN_DATA packet (following the channel id).
+ * Returns a new buffer holding the data, or NULL if the packet is corrupt.
+ */
+twopence_buf_t *
+twopence_protocol_decompress_data(twopence_protocol_codec_t *codec, const twopence_hdr_t *hdr,
+		twopence_buf_t *payload, const twopence_protocol_state_t *ps, twopence_codec_stats_t *stats)
+{
+#ifdef HAVE_ZLIB
+	unsigned int count = twopence_buf_count(payload);
+	unsigned long long start;
+	twopence_buf_t *bp;
+
+	if (codec == NULL)
+		return NULL;
+
+	start = __twopence_protocol_cputime();
+	if (hdr->flags & TWOPENCE_PROTO_HDR_RESTART)
+		inflateReset(&codec->zstream);
+
+	/* Give inflate a little more room than the max amount of data
+	 * per packet, so that it can get past the end of the flushed block
+	 * even when the data fills an entire packet. */
+	bp = twopence_buf_new_pooled(twopence_protocol_max_packet(ps));
+	if (!__twopence_protocol_inflate(codec, payload, bp)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	stats->npackets++;
+	stats->ncompressed++;
+	stats->raw_bytes += twopence_buf_count(bp);
+	stats->wire_bytes += count;
+	stats->cpu_nsec += __twopence_protocol_cputime() - start;
+	return bp;
+#else
+	return NULL;
+#endif
+}
+
 static inline twopence_buf_t *
 twopence_protocol_build_uint32_packet(twopence_protocol_state_t *ps, unsigned char type, uint32_t value)
 {
@@ -307,6 +681,65 @@ twopence_protocol_dissect_eof_packet(twopence_buf_t *bp, uint16_t *channel_ret)
 	return __decode_u16(bp, channel_ret);
 }
 
+/*
+ * Flow control: allow the peer to send @credit more bytes of data on the channel
+ */
+twopence_buf_t *
+twopence_protocol_build_credit_packet(twopence_protocol_state_t *ps, uint16_t channel, unsigned int credit)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	__encode_u16(bp, channel);
+	__encode_u32(bp, credit);
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_CHAN_CREDIT);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_credit_packet(twopence_buf_t *payload, uint16_t *channel_ret, unsigned int *credit_ret)
+{
+	uint32_t credit;
+
+	if (!__decode_u16(payload, channel_ret)
+	 || !__decode_u32(payload, &credit))
+		return false;
+	*credit_ret = credit;
+	return true;
+}
+
+/*
+ * Session resumption: tell the peer how many packets we have received
+ */
+twopence_buf_t *
+twopence_protocol_build_ack_packet(twopence_protocol_state_t *ps, uint32_t received)
+{
+	return twopence_protocol_build_uint32_packet(ps, TWOPENCE_PROTO_TYPE_ACK, received);
+}
+
+bool
+twopence_protocol_dissect_ack_packet(twopence_buf_t *payload, uint32_t *received_ret)
+{
+	return twopence_protocol_dissect_uint32_packet(payload, received_ret);
+}
+
+/*
+ * Packets that are counted for session resumption, and retransmitted
+ * after a reconnect. The others only make sense on the transport they
+ * were sent on.
+ */
+bool
+twopence_protocol_packet_is_sequenced(unsigned int type)
+{
+	switch (type) {
+	case TWOPENCE_PROTO_TYPE_HELLO:
+	case TWOPENCE_PROTO_TYPE_KEEPALIVE:
+	case TWOPENCE_PROTO_TYPE_ACK:
+		return false;
+	}
+	return true;
+}
+
 twopence_buf_t *
 twopence_protocol_build_uint_packet(unsigned char type, unsigned int value)
 {
@@ -337,8 +770,15 @@ twopence_protocol_build_uint_packet_ps(const twopence_protocol_state_t *ps, unsi
 	return bp;
 }
 
+/*
+ * The HELLO packet always uses the version 3 header, because we do not
+ * know yet which version the other end speaks.
+ * The client sends the highest version it supports, and the server responds
+ * with the version that will be used on this connection.
+ */
 twopence_buf_t *
-twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_timeout)
+twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_timeout, unsigned int version, unsigned int max_packet,
+		unsigned int compress, const twopence_protocol_resume_t *resume)
 {
 	struct twopence_protocol_hello_pkt data;
 	twopence_buf_t *bp;
@@ -347,21 +787,33 @@ twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_ti
 	bp = twopence_protocol_command_buffer_new();
 
 	memset(&data, 0, sizeof(data));
-	data.vers_major = TWOPENCE_PROTOCOL_VERSMAJOR;
-	data.vers_minor = TWOPENCE_PROTOCOL_VERSMINOR;
+	data.vers_major = version >> 8;
+	data.vers_minor = version & 0xFF;
 	data.keepalive = htons(keepalive_timeout);
 
 	twopence_buf_append(bp, &data, sizeof(data));
 
+	/* Version 3 servers ignore any extra data after the hello packet */
+	if (data.vers_major >= 4) {
+		__encode_u32(bp, max_packet);
+		__encode_u32(bp, compress);
+	}
+	if (version >= TWOPENCE_PROTOCOL_VERSION_RESUME && resume) {
+		__encode_u32(bp, resume->grace);
+		__encode_u32(bp, resume->received);
+	}
+
 	/* Finalize the header */
-	__twopence_protocol_push_header(bp, TWOPENCE_PROTO_TYPE_HELLO, cid, 0);
+	__twopence_protocol_push_header(bp, TWOPENCE_PROTO_TYPE_HELLO, cid, 0, false, 0);
 	return bp;
 }
 
 bool
-twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *version, unsigned int *keepalive)
+twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive, unsigned int *max_packet,
+		unsigned int *compress, twopence_protocol_resume_t *resume)
 {
 	struct twopence_protocol_hello_pkt data;
+	uint32_t value;
 
 	if (!twopence_buf_get(payload, &data, sizeof(data)))
 		return false;
@@ -369,6 +821,28 @@ twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *v
 	version[0] = data.vers_major;
 	version[1] = data.vers_minor;
 	*keepalive = ntohs(data.keepalive);
+
+	*max_packet = TWOPENCE_PROTO_MAX_PACKET;
+	*compress = 0;
+	if (data.vers_major >= 4) {
+		if (!__decode_u32(payload, &value))
+			return false;
+		if (value > TWOPENCE_PROTO_MAX_PACKET)
+			*max_packet = value;
+
+		/* Early version 4 peers do not know about compression */
+		if (twopence_buf_count(payload) >= 4 && __decode_u32(payload, &value))
+			*compress = value;
+	}
+
+	memset(resume, 0, sizeof(*resume));
+	if (((data.vers_major << 8) | data.vers_minor) >= TWOPENCE_PROTOCOL_VERSION_RESUME) {
+		if (!__decode_u32(payload, &value))
+			return false;
+		resume->grace = value;
+		if (!__decode_u32(payload, &resume->received))
+			return false;
+	}
 	return true;
 }
 
@@ -409,9 +883,84 @@ twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_x
 	return true;
 }
 
+static inline uint32_t
+__twopence_protocol_command_flags(const twopence_protocol_state_t *ps, const twopence_command_t *cmd)
+{
+	uint32_t flags = 0;
+
+	if (cmd->timestamps)
+		flags |= TWOPENCE_PROTO_CMD_TIMESTAMPS;
+	/* Older servers just run the command line, which holds
+	 * the same arguments, quoted for the shell */
+	if (cmd->argv && ps->argv)
+		flags |= TWOPENCE_PROTO_CMD_ARGV;
+	return flags;
+}
+
+static inline void
+__twopence_protocol_set_command_flags(twopence_command_t *cmd, uint32_t flags)
+{
+	cmd->timestamps = (flags & TWOPENCE_PROTO_CMD_TIMESTAMPS)? TWOPENCE_TIMESTAMP_DATA : 0;
+}
+
+/*
+ * With TWOPENCE_PROTO_CMD_ARGV, the flags are followed by the
+ * argument count and the arguments.
+ */
+static bool
+__encode_command_argv(twopence_buf_t *bp, uint32_t flags, const twopence_command_t *cmd)
+{
+	unsigned int argc, i;
+
+	if (!(flags & TWOPENCE_PROTO_CMD_ARGV))
+		return true;
+
+	for (argc = 0; cmd->argv[argc]; ++argc)
+		;
+	if (!__encode_u32(bp, argc))
+		return false;
+
+	for (i = 0; i < argc; ++i) {
+		if (!__encode_string(bp, cmd->argv[i]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The command keeps a copy of the argument vector, along with
+ * a command line made up from it.
+ */
+static bool
+__decode_command_argv(twopence_buf_t *payload, uint32_t flags, twopence_command_t *cmd)
+{
+	const char **argv;
+	uint32_t argc, i;
+	bool ok = false;
+
+	if (!(flags & TWOPENCE_PROTO_CMD_ARGV))
+		return true;
+
+	/* Every argument takes up at least one byte */
+	if (!__decode_u32(payload, &argc) || argc == 0 || argc > twopence_buf_count(payload))
+		return false;
+
+	argv = twopence_calloc(argc + 1, sizeof(argv[0]));
+	for (i = 0; i < argc; ++i) {
+		if (!(argv[i] = __decode_string(payload)))
+			goto out;
+	}
+	ok = twopence_command_set_argv(cmd, argv);
+
+out:
+	free(argv);
+	return ok;
+}
+
 twopence_buf_t *
 twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, const twopence_command_t *cmd)
 {
+	uint32_t flags = __twopence_protocol_command_flags(ps, cmd);
 	twopence_buf_t *bp;
 	unsigned int i;
 
@@ -422,9 +971,11 @@ twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, cons
 	 || !__encode_string(bp, cmd->command)
 	 || !__encode_u32(bp, cmd->timeout)
 	 || !__encode_u32(bp, cmd->request_tty)
-	 /* reserve two words for future extensions */
-	 || !__encode_u32(bp, 0)
-	 || !__encode_u32(bp, 0))
+	 /* perf counters (ignored by servers older than 4.5),
+	  * and flags (ignored by servers older than 4.6) */
+	 || !__encode_u32(bp, cmd->perf_counters)
+	 || !__encode_u32(bp, flags)
+	 || !__encode_command_argv(bp, flags, cmd))
 		goto failed;
 
 	for (i = 0; i < cmd->env.count; ++i) {
@@ -448,14 +999,15 @@ bool
 twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd)
 {
 	const char *user, *command, *envar;
-	uint32_t timeout, request_tty, reserved;
+	uint32_t timeout, request_tty, perf_counters, flags;
 
 	if (!(user = __decode_string(payload))
 	 || !(command = __decode_string(payload))
 	 || !__decode_u32(payload, &timeout)
 	 || !__decode_u32(payload, &request_tty)
-	 || !__decode_u32(payload, &reserved)
-	 || !__decode_u32(payload, &reserved))
+	 || !__decode_u32(payload, &perf_counters)
+	 || !__decode_u32(payload, &flags)
+	 || !__decode_command_argv(payload, flags, cmd))
 		return false;
 
 	while ((envar = __decode_string(payload)) != NULL) {
@@ -470,9 +1022,424 @@ twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_comma
 	}
 
 	cmd->user = user;
-	cmd->command = command;
+	if (cmd->argv == NULL)
+		cmd->command = command;
+	cmd->timeout = timeout;
+	cmd->request_tty = !!request_tty;
+	cmd->perf_counters = perf_counters;
+	__twopence_protocol_set_command_flags(cmd, flags);
+	return true;
+}
+
+/*
+ * A BATCH packet carries several commands at once. The server runs each
+ * of them as a transaction of its own; the first one uses the xid of the
+ * BATCH packet, and the others the xids following it.
+ *
+ * We encode as many commands as fit into a single packet, starting with
+ * command @first, and return the number of commands encoded in @count.
+ */
+static bool
+__encode_batch_command(twopence_buf_t *bp, const twopence_protocol_state_t *ps, const twopence_command_t *cmd)
+{
+	unsigned int i;
+
+	if (!__encode_string(bp, cmd->user)
+	 || !__encode_string(bp, cmd->command)
+	 || !__encode_u32(bp, cmd->timeout)
+	 || !__encode_u32(bp, cmd->request_tty))
+		return false;
+
+	/* As of version 4.5, this is followed by the perf counters,
+	 * and as of version 4.6, by the command flags and, if the flags
+	 * say so, the argument vector */
+	if (ps->rusage && !__encode_u32(bp, cmd->perf_counters))
+		return false;
+	if (ps->timestamps) {
+		uint32_t flags = __twopence_protocol_command_flags(ps, cmd);
+
+		if (!__encode_u32(bp, flags)
+		 || !__encode_command_argv(bp, flags, cmd))
+			return false;
+	}
+
+	if (!__encode_u32(bp, cmd->env.count))
+		return false;
+
+	for (i = 0; i < cmd->env.count; ++i) {
+		if (!__encode_string(bp, cmd->env.array[i]))
+			return false;
+	}
+	return true;
+}
+
+twopence_buf_t *
+twopence_protocol_build_batch_packet(const twopence_protocol_state_t *ps, const twopence_batch_t *batch,
+		unsigned int first, unsigned int *count)
+{
+	twopence_buf_t *bp;
+	unsigned int count_offset, n;
+	uint32_t word;
+
+	bp = twopence_buf_new_pooled(twopence_protocol_max_packet(ps));
+	bp->head = bp->tail = TWOPENCE_PROTO_HEADER_SIZE;
+
+	if (!__encode_u32(bp, batch->policy))
+		goto failed;
+
+	/* The command count is filled in below */
+	count_offset = bp->tail;
+	if (!__encode_u32(bp, 0))
+		goto failed;
+
+	for (n = 0; first + n < batch->count; ++n) {
+		const twopence_command_t *cmd = &batch->entries[first + n]->command;
+		unsigned int tail = bp->tail;
+
+		if (!__encode_batch_command(bp, ps, cmd)) {
+			/* Does not fit; send it with the next packet */
+			bp->tail = tail;
+			break;
+		}
+	}
+
+	if (n == 0)
+		goto failed;
+
+	word = htonl(n);
+	memcpy(bp->base + count_offset, &word, sizeof(word));
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_BATCH);
+	*count = n;
+	return bp;
+
+failed:
+	twopence_buf_free(bp);
+	return NULL;
+}
+
+bool
+twopence_protocol_dissect_batch_packet(twopence_buf_t *payload, unsigned int *policy, unsigned int *count)
+{
+	uint32_t value;
+
+	if (!__decode_u32(payload, &value))
+		return false;
+	*policy = value;
+
+	if (!__decode_u32(payload, &value) || value == 0)
+		return false;
+	*count = value;
+	return true;
+}
+
+/*
+ * Decode the next command of a BATCH packet. As with the COMMAND packet,
+ * the strings point into the payload buffer.
+ */
+bool
+twopence_protocol_dissect_batch_command(twopence_buf_t *payload, const twopence_protocol_state_t *ps,
+		twopence_command_t *cmd)
+{
+	const char *user, *command, *envar;
+	uint32_t timeout, request_tty, perf_counters = 0, flags = 0, nenv;
+
+	if (!(user = __decode_string(payload))
+	 || !(command = __decode_string(payload))
+	 || !__decode_u32(payload, &timeout)
+	 || !__decode_u32(payload, &request_tty))
+		return false;
+
+	if (ps->rusage && !__decode_u32(payload, &perf_counters))
+		return false;
+	if (ps->timestamps
+	 && (!__decode_u32(payload, &flags) || !__decode_command_argv(payload, flags, cmd)))
+		return false;
+
+	if (!__decode_u32(payload, &nenv))
+		return false;
+
+	while (nenv--) {
+		char *value;
+
+		if (!(envar = __decode_string(payload)))
+			return false;
+
+		if (!(value = strchr(envar, '='))) {
+			twopence_log_error("ignoring invalid environment variable \"%s\"", envar);
+			continue;
+		}
+		*value++ = '\0';
+		twopence_command_setenv(cmd, envar, value);
+	}
+
+	cmd->user = user;
+	if (cmd->argv == NULL)
+		cmd->command = command;
 	cmd->timeout = timeout;
 	cmd->request_tty = !!request_tty;
+	cmd->perf_counters = perf_counters;
+	__twopence_protocol_set_command_flags(cmd, flags);
+	return true;
+}
+
+/*
+ * A FILE_OP packet asks the server to perform a file operation itself:
+ *  u32 op, string user, string path, u32 mode
+ *
+ * The server responds with zero or more FILE_INFO packets, each carrying
+ * as many stat records as fit, followed by the major and minor status.
+ * A stat record is:
+ *  string name, u32 mode, u32 uid, u32 gid, u32 nlink,
+ *  u64 size, s64 mtime
+ * with the 64bit quantities sent as two u32, most significant first.
+ */
+twopence_buf_t *
+twopence_protocol_build_file_op_packet(const twopence_protocol_state_t *ps, const twopence_file_op_t *op)
+{
+	twopence_buf_t *bp;
+
+	/* Allocate a large buffer with space reserved for the header */
+	bp = twopence_protocol_command_buffer_new();
+
+	if (!__encode_u32(bp, op->op)
+	 || !__encode_string(bp, op->user)
+	 || !__encode_string(bp, op->path)
+	 || !__encode_u32(bp, op->mode)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	/* Finalize the header */
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_FILE_OP);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_file_op_packet(twopence_buf_t *payload, twopence_file_op_t *op)
+{
+	const char *user, *path;
+	uint32_t opcode, mode;
+
+	if (!__decode_u32(payload, &opcode)
+	 || !(user = __decode_string(payload))
+	 || !(path = __decode_string(payload))
+	 || !__decode_u32(payload, &mode))
+		return false;
+
+	op->op = opcode;
+	op->user = user;
+	op->path = path;
+	op->mode = mode;
+	return true;
+}
+
+twopence_buf_t *
+twopence_protocol_file_info_buffer_new(const twopence_protocol_state_t *ps)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_buf_new_pooled(twopence_protocol_max_packet(ps));
+	bp->head = bp->tail = TWOPENCE_PROTO_HEADER_SIZE;
+	return bp;
+}
+
+static inline bool
+__encode_u64(twopence_buf_t *bp, uint64_t value)
+{
+	return __encode_u32(bp, value >> 32)
+	    && __encode_u32(bp, value & 0xffffffff);
+}
+
+static inline bool
+__decode_u64(twopence_buf_t *bp, uint64_t *value)
+{
+	uint32_t hi, lo;
+
+	if (!__decode_u32(bp, &hi) || !__decode_u32(bp, &lo))
+		return false;
+	*value = ((uint64_t) hi << 32) | lo;
+	return true;
+}
+
+/*
+ * Append a stat record to a FILE_INFO buffer. Returns false, leaving
+ * the buffer unchanged, if the record does not fit.
+ */
+bool
+twopence_protocol_encode_file_stat(twopence_buf_t *bp, const twopence_file_stat_t *st)
+{
+	unsigned int tail = bp->tail;
+
+	if (!__encode_string(bp, st->name? st->name : "")
+	 || !__encode_u32(bp, st->mode)
+	 || !__encode_u32(bp, st->uid)
+	 || !__encode_u32(bp, st->gid)
+	 || !__encode_u32(bp, st->nlink)
+	 || !__encode_u64(bp, st->size)
+	 || !__encode_u64(bp, st->mtime)) {
+		bp->tail = tail;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Decode the next stat record of a FILE_INFO packet. The name points
+ * into the payload buffer.
+ */
+bool
+twopence_protocol_dissect_file_stat(twopence_buf_t *payload, twopence_file_stat_t *st)
+{
+	const char *name;
+	uint32_t mode, uid, gid, nlink;
+	uint64_t size, mtime;
+
+	if (!(name = __decode_string(payload))
+	 || !__decode_u32(payload, &mode)
+	 || !__decode_u32(payload, &uid)
+	 || !__decode_u32(payload, &gid)
+	 || !__decode_u32(payload, &nlink)
+	 || !__decode_u64(payload, &size)
+	 || !__decode_u64(payload, &mtime))
+		return false;
+
+	st->name = (char *) name;
+	st->mode = mode;
+	st->uid = uid;
+	st->gid = gid;
+	st->nlink = nlink;
+	st->size = size;
+	st->mtime = (int64_t) mtime;
+	return true;
+}
+
+/*
+ * A RUSAGE packet is sent by the server right before the status of a
+ * command:
+ *  u64 user time (usec), u64 system time (usec), u64 max RSS (kB),
+ *  u64 minor faults, u64 major faults,
+ *  u64 voluntary and u64 involuntary context switches,
+ *  u32 mask of valid perf counters, followed by one u64 for every
+ *  counter in the mask, in ascending order.
+ */
+twopence_buf_t *
+twopence_protocol_build_rusage_packet(twopence_protocol_state_t *ps, const twopence_rusage_t *ru)
+{
+	twopence_buf_t *bp;
+	unsigned int i;
+
+	bp = twopence_protocol_command_buffer_new();
+
+	if (!__encode_u64(bp, ru->utime_usec)
+	 || !__encode_u64(bp, ru->stime_usec)
+	 || !__encode_u64(bp, ru->maxrss_kb)
+	 || !__encode_u64(bp, ru->minflt)
+	 || !__encode_u64(bp, ru->majflt)
+	 || !__encode_u64(bp, ru->nvcsw)
+	 || !__encode_u64(bp, ru->nivcsw)
+	 || !__encode_u32(bp, ru->perf_valid))
+		goto failed;
+
+	for (i = 0; i < __TWOPENCE_PERF_MAX; ++i) {
+		if ((ru->perf_valid & TWOPENCE_PERF_MASK(i))
+		 && !__encode_u64(bp, ru->perf[i]))
+			goto failed;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_RUSAGE);
+	return bp;
+
+failed:
+	twopence_buf_free(bp);
+	return NULL;
+}
+
+bool
+twopence_protocol_dissect_rusage_packet(twopence_buf_t *payload, twopence_rusage_t *ru)
+{
+	uint64_t value[7];
+	uint32_t perf_valid;
+	unsigned int i;
+
+	memset(ru, 0, sizeof(*ru));
+	for (i = 0; i < 7; ++i) {
+		if (!__decode_u64(payload, &value[i]))
+			return false;
+	}
+	if (!__decode_u32(payload, &perf_valid))
+		return false;
+
+	ru->utime_usec = value[0];
+	ru->stime_usec = value[1];
+	ru->maxrss_kb = value[2];
+	ru->minflt = value[3];
+	ru->majflt = value[4];
+	ru->nvcsw = value[5];
+	ru->nivcsw = value[6];
+
+	/* Ignore counters we do not know about */
+	for (i = 0; i < 32; ++i) {
+		uint64_t count;
+
+		if (!(perf_valid & (1U << i)))
+			continue;
+		if (!__decode_u64(payload, &count))
+			return false;
+		if (i < __TWOPENCE_PERF_MAX) {
+			ru->perf[i] = count;
+			ru->perf_valid |= TWOPENCE_PERF_MASK(i);
+		}
+	}
+
+	ru->valid = true;
+	return true;
+}
+
+/*
+ * A CHAN_STAMP packet precedes a CHAN_DATA packet of a command that asked
+ * for timestamps, and tells when the server read that data:
+ *  u16 channel id, u32 sequence number of the data packet on this channel,
+ *  u64 server CLOCK_MONOTONIC (nsec), u64 time since the command was
+ *  started (nsec)
+ */
+twopence_buf_t *
+twopence_protocol_build_stamp_packet(twopence_protocol_state_t *ps, const twopence_timestamp_t *stamp)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u16(bp, stamp->channel)
+	 || !__encode_u32(bp, stamp->seq)
+	 || !__encode_u64(bp, stamp->server_nsec)
+	 || !__encode_u64(bp, stamp->elapsed_nsec)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_CHAN_STAMP);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_stamp_packet(twopence_buf_t *payload, twopence_timestamp_t *stamp)
+{
+	uint16_t channel;
+	uint32_t seq;
+	uint64_t server_nsec, elapsed_nsec;
+
+	if (!__decode_u16(payload, &channel)
+	 || !__decode_u32(payload, &seq)
+	 || !__decode_u64(payload, &server_nsec)
+	 || !__decode_u64(payload, &elapsed_nsec))
+		return false;
+
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->channel = channel;
+	stamp->seq = seq;
+	stamp->server_nsec = server_nsec;
+	stamp->elapsed_nsec = elapsed_nsec;
+	stamp->valid = true;
 	return true;
 }
 
@@ -515,7 +1482,7 @@ twopence_protocol_recv_buffer_new(void)
 {
 	twopence_buf_t *bp;
 
-	bp = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
+	bp = twopence_buf_new_pooled(TWOPENCE_PROTO_MAX_PACKET);
 	twopence_buf_reserve_tail(bp, TWOPENCE_PROTO_HEADER_SIZE);
 	return bp;
 }
@@ -524,15 +1491,19 @@ int
 twopence_protocol_buffer_need_to_recv(const twopence_buf_t *bp)
 {
 	const twopence_hdr_t *hdr;
-	unsigned int len, total;
+	unsigned int len, total, hdrsize;
 
 	len = twopence_buf_count(bp);
-	if (len < TWOPENCE_PROTO_HEADER_SIZE)
-		return TWOPENCE_PROTO_HEADER_SIZE - len;
+	if (len < TWOPENCE_PROTO_HEADER_SIZE_V3)
+		return TWOPENCE_PROTO_HEADER_SIZE_V3 - len;
 
 	hdr = (twopence_hdr_t *) twopence_buf_head(bp);
-	total = htons(hdr->len);
-	if (total < TWOPENCE_PROTO_HEADER_SIZE)
+	hdrsize = twopence_protocol_header_size(hdr);
+	if (len < hdrsize)
+		return hdrsize - len;
+
+	total = __twopence_protocol_packet_len(hdr);
+	if (total < hdrsize)
 		return -1;
 
 	if (len < total)
@@ -551,18 +1522,23 @@ const twopence_hdr_t *
 twopence_protocol_dissect(twopence_buf_t *bp, twopence_buf_t *payload)
 {
 	twopence_hdr_t *hdr;
-	unsigned int len;
+	unsigned int len, hdrsize;
+
+	if (twopence_buf_count(bp) < TWOPENCE_PROTO_HEADER_SIZE_V3)
+		return NULL;
 
-	if (!(hdr = twopence_buf_pull(bp, TWOPENCE_PROTO_HEADER_SIZE)))
+	hdr = (twopence_hdr_t *) twopence_buf_head(bp);
+	hdrsize = twopence_protocol_header_size(hdr);
+	if (!twopence_buf_pull(bp, hdrsize))
 		return NULL;
 
-	len = ntohs(hdr->len);
-	if (len < TWOPENCE_PROTO_HEADER_SIZE) {
+	len = __twopence_protocol_packet_len(hdr);
+	if (len < hdrsize) {
 		fprintf(stderr, "%s: invalid header, len=%u\n", __func__, len);
 		return NULL;
 	}
 
-	len -= TWOPENCE_PROTO_HEADER_SIZE;
+	len -= hdrsize;
 	if (twopence_buf_count(bp) < len) {
 		fprintf(stderr, "%s: called on incomplete packet (payload: header %u buffer %u)\n",
 				__func__, len, twopence_buf_count(bp));
@@ -582,7 +1558,24 @@ twopence_protocol_dissect_ps(twopence_buf_t *bp, twopence_buf_t *payload, twopen
 	if ((hdr = twopence_protocol_dissect(bp, payload)) == NULL)
 		return hdr;
 
+	/* The caller has to fill in the max packet size, compression
+	 * algorithm and flow control settings of the connection */
+	ps->max_packet = 0;
+	ps->compress = 0;
+	ps->flow_control = false;
+	ps->resume = false;
+	ps->batch = false;
+	ps->file_ops = false;
+	ps->rusage = false;
+	ps->timestamps = false;
+	ps->argv = false;
 	ps->cid = ntohs(hdr->cid);
-	ps->xid = ntohs(hdr->xid);
+	if (hdr->flags & TWOPENCE_PROTO_HDR_WIDE) {
+		ps->xid = ntohl(((const twopence_hdr_v4_t *) hdr)->xid);
+		ps->wide = true;
+	} else {
+		ps->xid = ntohs(hdr->xid);
+		ps->wide = false;
+	}
 	return hdr;
 }
@@ -31,22 +31,86 @@
  * Increase the minor number whenever a new client
  * would stop working the the old server.
  */
-#define TWOPENCE_PROTOCOL_VERSMAJOR	3
-#define TWOPENCE_PROTOCOL_VERSMINOR	0
+#define TWOPENCE_PROTOCOL_VERSMAJOR	4
+#define TWOPENCE_PROTOCOL_VERSMINOR	7
 
 #define TWOPENCE_PROTOCOL_VERSION	((TWOPENCE_PROTOCOL_VERSMAJOR << 8) | TWOPENCE_PROTOCOL_VERSMINOR)
 
+/*
+ * The oldest major version we still talk to. Client and server agree on
+ * the version to use in the HELLO exchange, which always uses the
+ * version 3 header.
+ *
+ * Minor versions of version 4 add optional features, and the server
+ * responds with the lower of the two minor numbers:
+ *  4.1	per-channel flow control
+ *  4.2	session resumption
+ *  4.3	batched commands
+ *  4.4	native file operations
+ *  4.5	resource usage of commands
+ *  4.6	timestamped command output
+ *  4.7	commands given as an argument vector
+ */
+#define TWOPENCE_PROTOCOL_VERSMAJOR_COMPAT 3
+
+#define TWOPENCE_PROTOCOL_VERSION_FLOW_CONTROL	((4 << 8) | 1)
+#define TWOPENCE_PROTOCOL_VERSION_RESUME	((4 << 8) | 2)
+#define TWOPENCE_PROTOCOL_VERSION_BATCH	((4 << 8) | 3)
+#define TWOPENCE_PROTOCOL_VERSION_FILE_OPS	((4 << 8) | 4)
+#define TWOPENCE_PROTOCOL_VERSION_RUSAGE	((4 << 8) | 5)
+#define TWOPENCE_PROTOCOL_VERSION_TIMESTAMPS	((4 << 8) | 6)
+#define TWOPENCE_PROTOCOL_VERSION_ARGV	((4 << 8) | 7)
+
 typedef struct header twopence_hdr_t;
 struct header {
 	unsigned char	type;
-	unsigned char	pad;
+	unsigned char	flags;		/* always 0 in version 3 */
 	uint16_t	cid;		/* unique client ID assigned by server */
 	uint16_t	xid;		/* unique transaction ID */
 	uint16_t	len;
 } __attribute((packed));
-#define TWOPENCE_PROTO_HEADER_SIZE	sizeof(twopence_hdr_t)
+
+/*
+ * Version 4 header, with wider xid and len fields. It starts out like
+ * the version 3 header, and is identified by TWOPENCE_PROTO_HDR_WIDE
+ * in the flags.
+ */
+typedef struct header_v4 twopence_hdr_v4_t;
+struct header_v4 {
+	unsigned char	type;
+	unsigned char	flags;
+	uint16_t	cid;
+	uint32_t	xid;
+	uint32_t	len;
+} __attribute((packed));
+
+#define TWOPENCE_PROTO_HDR_WIDE		0x01
+#define TWOPENCE_PROTO_HDR_COMPRESSED	0x02	/* CHAN_DATA payload is compressed */
+#define TWOPENCE_PROTO_HDR_RESTART	0x04	/* ... and starts a new compression stream */
+
+#define TWOPENCE_PROTO_HEADER_SIZE_V3	sizeof(twopence_hdr_t)
+#define TWOPENCE_PROTO_HEADER_SIZE_V4	sizeof(twopence_hdr_v4_t)
+
+/* The space reserved for the header in front of the payload.
+ * A version 3 header does not use all of it. */
+#define TWOPENCE_PROTO_HEADER_SIZE	TWOPENCE_PROTO_HEADER_SIZE_V4
+
+/* Max packet size of version 3, and the default for version 4.
+ * With version 4, larger frames can be negotiated in the HELLO exchange. */
 #define TWOPENCE_PROTO_MAX_PACKET	32768
 #define TWOPENCE_PROTO_MAX_PAYLOAD	(TWOPENCE_PROTO_MAX_PACKET - TWOPENCE_PROTO_HEADER_SIZE)
+#define TWOPENCE_PROTO_DEFAULT_JUMBO	(256 * 1024)
+#define TWOPENCE_PROTO_MAX_JUMBO	(1024 * 1024)
+
+/*
+ * Compression of CHAN_DATA payloads. The client offers a bit mask of
+ * the algorithms it supports in the HELLO packet, and the server
+ * responds with the one it picked, or 0.
+ */
+#define TWOPENCE_PROTO_COMPRESS_DEFLATE	0x01
+
+/* Payloads smaller than this are always sent raw */
+#define TWOPENCE_PROTO_COMPRESS_MIN	64
 
 #define TWOPENCE_PROTO_TYPE_HELLO	'h'
 #define TWOPENCE_PROTO_TYPE_INJECT	'i'
@@ -60,12 +124,85 @@ struct header {
 #define TWOPENCE_PROTO_TYPE_MINOR	'm'
 #define TWOPENCE_PROTO_TYPE_TIMEOUT	'T'
 #define TWOPENCE_PROTO_TYPE_KEEPALIVE	'K'
+#define TWOPENCE_PROTO_TYPE_CHAN_CREDIT	'W'
+#define TWOPENCE_PROTO_TYPE_ACK		'A'
+#define TWOPENCE_PROTO_TYPE_BATCH	'b'
+#define TWOPENCE_PROTO_TYPE_FILE_OP	'f'
+#define TWOPENCE_PROTO_TYPE_FILE_INFO	'F'
+#define TWOPENCE_PROTO_TYPE_RUSAGE	'U'
+#define TWOPENCE_PROTO_TYPE_CHAN_STAMP	'S'
+
+/* Flags word of COMMAND requests */
+#define TWOPENCE_PROTO_CMD_TIMESTAMPS	0x01	/* precede output data with CHAN_STAMP packets */
+#define TWOPENCE_PROTO_CMD_ARGV		0x02	/* an argument vector follows the flags */
+
+/*
+ * With flow control, the sender of CHAN_DATA packets may have no more
+ * than this many max size packets worth of data outstanding on each
+ * channel. The receiver returns credit with CHAN_CREDIT packets
+ * as it drains the data.
+ */
+#define TWOPENCE_PROTO_WINDOW_PACKETS	4
+
+/*
+ * Session resumption. Both sides count the packets they receive, except
+ * for HELLO, KEEPALIVE and ACK packets, and keep the packets they sent
+ * until the peer acknowledges them with an ACK packet carrying its count.
+ * When the transport goes away, the server keeps the session around for
+ * a grace period. A client reconnecting within that time sends a HELLO
+ * with its old client id, and both sides tell each other how many packets
+ * they received, and retransmit the rest.
+ */
+typedef struct twopence_protocol_resume {
+	unsigned int	grace;		/* seconds the server keeps a session; 0 if not supported */
+	uint32_t	received;	/* packets received on this session */
+} twopence_protocol_resume_t;
+
+/* Acknowledge received packets once this many have accumulated,
+ * or after this many max size packets worth of data */
+#define TWOPENCE_PROTO_ACK_PACKETS	16
+#define TWOPENCE_PROTO_ACK_WINDOW	2
 
 typedef struct twopence_protocol_state {
 	uint16_t	cid;
-	uint16_t	xid;
+	uint32_t	xid;
+
+	/* Use the version 4 header */
+	bool		wide;
+
+	/* The max packet size we may send; 0 means TWOPENCE_PROTO_MAX_PACKET */
+	unsigned int	max_packet;
+
+	/* Compression algorithm for CHAN_DATA packets, or 0 */
+	unsigned int	compress;
+
+	/* Per-channel flow control (version 4.1) */
+	bool		flow_control;
+
+	/* Session resumption (version 4.2) */
+	bool		resume;
+
+	/* Server accepts BATCH requests (version 4.3) */
+	bool		batch;
+
+	/* Server accepts FILE_OP requests (version 4.4) */
+	bool		file_ops;
+
+	/* Server reports resource usage of commands (version 4.5) */
+	bool		rusage;
+
+	/* Server timestamps command output (version 4.6) */
+	bool		timestamps;
+
+	/* Server executes argument vectors directly (version 4.7) */
+	bool		argv;
 } twopence_protocol_state_t;
 
+/*
+ * Per-channel compression state
+ */
+typedef struct twopence_protocol_codec twopence_protocol_codec_t;
+
 #define TWOPENCE_PROTO_DEFAULT_KEEPALIVE 60
 
 struct twopence_protocol_hello_pkt {
@@ -74,31 +211,72 @@ struct twopence_protocol_hello_pkt {
 	uint16_t	keepalive;
 } __attribute((packed));
 
+/* As of version 4, this is followed by the max packet size (uint32_t),
+ * optionally followed by the compression algorithms (uint32_t).
+ * As of version 4.2, this is followed by the grace period (uint32_t) and
+ * the number of packets received (uint32_t), see twopence_protocol_resume_t */
+
 extern const char *	twopence_protocol_packet_type_to_string(unsigned int type);
 extern void		twopence_protocol_build_header(twopence_buf_t *bp, unsigned char type);
 extern void		twopence_protocol_push_header(twopence_buf_t *bp, unsigned char type);
 extern void		twopence_protocol_push_header_ps(twopence_buf_t *bp, const twopence_protocol_state_t *ps, unsigned char type);
 extern twopence_buf_t *	twopence_protocol_command_buffer_new();
+extern twopence_buf_t *	twopence_protocol_data_buffer_new(const twopence_protocol_state_t *);
+extern unsigned int	twopence_protocol_max_packet(const twopence_protocol_state_t *);
+extern unsigned int	twopence_protocol_max_data(const twopence_protocol_state_t *);
+extern unsigned int	twopence_protocol_channel_window(const twopence_protocol_state_t *);
+extern void		twopence_protocol_next_xid(twopence_protocol_state_t *);
 extern twopence_buf_t *	twopence_protocol_build_simple_packet(unsigned char type);
 extern twopence_buf_t *	twopence_protocol_build_simple_packet_ps(twopence_protocol_state_t *, unsigned char);
 extern twopence_buf_t *	twopence_protocol_build_major_packet(twopence_protocol_state_t *ps, int status);
 extern twopence_buf_t *	twopence_protocol_build_minor_packet(twopence_protocol_state_t *ps, int status);
-extern twopence_buf_t *	twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_interval);
+extern twopence_buf_t *	twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_interval,
+					unsigned int version, unsigned int max_packet, unsigned int compress,
+					const twopence_protocol_resume_t *);
 extern twopence_buf_t *	twopence_protocol_build_data_header(twopence_buf_t *, twopence_protocol_state_t *, uint16_t);
+extern twopence_buf_t *	twopence_protocol_build_compressed_data(twopence_protocol_codec_t *, twopence_buf_t *,
+					twopence_protocol_state_t *, uint16_t, twopence_codec_stats_t *);
+extern twopence_buf_t *	twopence_protocol_decompress_data(twopence_protocol_codec_t *, const twopence_hdr_t *,
+					twopence_buf_t *, const twopence_protocol_state_t *, twopence_codec_stats_t *);
+extern unsigned int	twopence_protocol_compress_supported(void);
+extern twopence_protocol_codec_t *twopence_protocol_codec_new(unsigned int algo, bool compress);
+extern void		twopence_protocol_codec_free(twopence_protocol_codec_t *);
+extern twopence_buf_t *	twopence_protocol_build_file_data_header(twopence_protocol_state_t *, uint16_t, unsigned int);
 extern twopence_buf_t *	twopence_protocol_build_eof_packet(twopence_protocol_state_t *, uint16_t);
+extern twopence_buf_t *	twopence_protocol_build_credit_packet(twopence_protocol_state_t *, uint16_t, unsigned int);
+extern twopence_buf_t *	twopence_protocol_build_ack_packet(twopence_protocol_state_t *, uint32_t);
+extern bool		twopence_protocol_packet_is_sequenced(unsigned int type);
 extern twopence_buf_t *	twopence_protocol_build_inject_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *);
 extern twopence_buf_t *	twopence_protocol_build_extract_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *);
 extern twopence_buf_t *	twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, const twopence_command_t *);
+extern twopence_buf_t *	twopence_protocol_build_batch_packet(const twopence_protocol_state_t *ps, const twopence_batch_t *,
+					unsigned int first, unsigned int *count);
+extern twopence_buf_t *	twopence_protocol_build_file_op_packet(const twopence_protocol_state_t *ps, const twopence_file_op_t *);
+extern twopence_buf_t *	twopence_protocol_file_info_buffer_new(const twopence_protocol_state_t *ps);
+extern bool		twopence_protocol_encode_file_stat(twopence_buf_t *bp, const twopence_file_stat_t *);
+extern twopence_buf_t *	twopence_protocol_build_rusage_packet(twopence_protocol_state_t *ps, const twopence_rusage_t *);
+extern twopence_buf_t *	twopence_protocol_build_stamp_packet(twopence_protocol_state_t *ps, const twopence_timestamp_t *);
 extern twopence_buf_t *	twopence_protocol_recv_buffer_new(void);
 extern int		twopence_protocol_buffer_need_to_recv(const twopence_buf_t *bp);
+extern unsigned int	twopence_protocol_header_size(const twopence_hdr_t *hdr);
 extern bool		twopence_protocol_buffer_complete(const twopence_buf_t *bp);
 extern const twopence_hdr_t *twopence_protocol_dissect(twopence_buf_t *bp, twopence_buf_t *payload);
 extern const twopence_hdr_t *twopence_protocol_dissect_ps(twopence_buf_t *bp, twopence_buf_t *payload, twopence_protocol_state_t *ps);
 extern bool		twopence_protocol_dissect_major_packet(twopence_buf_t *payload, int *status_ret);
 extern bool		twopence_protocol_dissect_minor_packet(twopence_buf_t *payload, int *status_ret);
-extern bool		twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive);
+extern bool		twopence_protocol_dissect_credit_packet(twopence_buf_t *payload, uint16_t *channel_ret, unsigned int *credit_ret);
+extern bool		twopence_protocol_dissect_ack_packet(twopence_buf_t *payload, uint32_t *received_ret);
+extern bool		twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive,
+					unsigned int *max_packet, unsigned int *compress, twopence_protocol_resume_t *);
 extern bool		twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer);
 extern bool		twopence_protocol_dissect_extract_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer);
 extern bool		twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd);
+extern bool		twopence_protocol_dissect_batch_packet(twopence_buf_t *payload, unsigned int *policy, unsigned int *count);
+extern bool		twopence_protocol_dissect_batch_command(twopence_buf_t *payload, const twopence_protocol_state_t *ps,
+					twopence_command_t *cmd);
+extern bool		twopence_protocol_dissect_file_op_packet(twopence_buf_t *payload, twopence_file_op_t *op);
+extern bool		twopence_protocol_dissect_file_stat(twopence_buf_t *payload, twopence_file_stat_t *st);
+extern bool		twopence_protocol_dissect_rusage_packet(twopence_buf_t *payload, twopence_rusage_t *);
+extern bool		twopence_protocol_dissect_stamp_packet(twopence_buf_t *payload, twopence_timestamp_t *);
 
 #endif /* PROTOCOL_H */
@@ -51,6 +51,12 @@ __twopence_serial_init(struct twopence_serial_target *handle, const char *devnam
 {
   twopence_pipe_target_init(&handle->pipe, TWOPENCE_PLUGIN_SERIAL, &twopence_serial_ops, &twopence_serial_link_ops);
 
+  // Large frames would only hurt latency on a serial line
+  handle->pipe.max_packet = TWOPENCE_PROTO_MAX_PACKET;
+
+  // Command output tends to compress well, and we're short of bandwidth
+  handle->pipe.compress = TWOPENCE_PROTO_COMPRESS_DEFLATE;
+
   // Initialize the device name
   // FIXME: use PATH_MAX
   if (strlen(devname) >= PATH_MAX)
@@ -133,14 +139,24 @@ const struct twopence_plugin twopence_serial_ops = {
 	.init = twopence_serial_init,
 	.set_option = twopence_pipe_set_option,
 	.run_test = twopence_pipe_run_test,
+	.run_batch = twopence_pipe_run_batch,
 	.wait = twopence_pipe_wait,
 	.chat_send = twopence_pipe_chat_send,
 	.chat_recv = twopence_pipe_chat_recv,
 	.inject_file = twopence_pipe_inject_file,
 	.extract_file = twopence_pipe_extract_file,
+	.file_op = twopence_pipe_file_op,
 	.exit_remote = twopence_pipe_exit_remote,
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
 	.end = twopence_pipe_end,
+	.submit_inject = twopence_pipe_submit_inject,
+	.submit_extract = twopence_pipe_submit_extract,
+	.reap = twopence_pipe_reap,
+	.poll = twopence_pipe_poll,
+	.connect = twopence_pipe_connect,
+	.park = twopence_pipe_park,
+	.adopt = twopence_pipe_adopt,
+	.get_compress_stats = twopence_pipe_get_compress_stats,
 };
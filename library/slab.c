@@ -0,0 +1,194 @@
+/*
+ * Object caches for frequently allocated objects
+ *
+ * Copyright (C) 2014-2016 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Every command we run, and every chunk of data we move, creates and
+ * destroys a handful of objects of always the same size: a transaction,
+ * its channels, the 32K packet buffers and the packet wrappers that queue
+ * them on a socket. Rather than going through malloc/free every time, we
+ * keep freed objects on a per-type free list, and hand them out again on
+ * the next allocation.
+ *
+ * The free lists are bounded, so that a burst of traffic does not leave us
+ * sitting on a lot of memory forever. They are shared by all threads; the
+ * lock of a slab is held just long enough to push or pop one object.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "twopence.h"
+
+struct twopence_slab_object {
+	struct twopence_slab_object *next;
+};
+
+static twopence_slab_t *	__twopence_slab_list;
+static pthread_mutex_t		__twopence_slab_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Called with the slab locked. Nobody walking the list can be holding
+ * that lock, because the slab is not on the list yet.
+ */
+static void
+__twopence_slab_register(twopence_slab_t *slab)
+{
+	twopence_slab_t **pos;
+
+	pthread_mutex_lock(&__twopence_slab_list_lock);
+
+	/* Keep the list sorted in order of registration */
+	for (pos = &__twopence_slab_list; *pos; pos = &(*pos)->next)
+		;
+	*pos = slab;
+	slab->registered = true;
+
+	pthread_mutex_unlock(&__twopence_slab_list_lock);
+}
+
+void *
+twopence_slab_alloc(twopence_slab_t *slab)
+{
+	struct twopence_slab_object *obj;
+
+	assert(slab->object_size >= sizeof(*obj));
+
+	pthread_mutex_lock(&slab->lock);
+	if (!slab->registered)
+		__twopence_slab_register(slab);
+
+	slab->stats.nalloc++;
+	if ((obj = slab->free_list) != NULL) {
+		slab->free_list = obj->next;
+		slab->stats.cached--;
+		slab->stats.nreused++;
+	}
+	pthread_mutex_unlock(&slab->lock);
+
+	if (obj == NULL)
+		obj = twopence_malloc(slab->object_size);
+	return obj;
+}
+
+void *
+twopence_slab_zalloc(twopence_slab_t *slab)
+{
+	void *obj;
+
+	obj = twopence_slab_alloc(slab);
+	memset(obj, 0, slab->object_size);
+	return obj;
+}
+
+void
+twopence_slab_free(twopence_slab_t *slab, void *p)
+{
+	struct twopence_slab_object *obj = p;
+
+	if (obj == NULL)
+		return;
+
+	pthread_mutex_lock(&slab->lock);
+	slab->stats.nfree++;
+	if (slab->stats.cached < slab->max_cached) {
+		obj->next = slab->free_list;
+		slab->free_list = obj;
+		slab->stats.cached++;
+		obj = NULL;
+	}
+	pthread_mutex_unlock(&slab->lock);
+
+	free(obj);
+}
+
+/*
+ * Release all cached objects
+ */
+void
+twopence_slab_shrink(twopence_slab_t *slab)
+{
+	struct twopence_slab_object *obj, *next;
+
+	pthread_mutex_lock(&slab->lock);
+	obj = slab->free_list;
+	slab->free_list = NULL;
+	slab->stats.cached = 0;
+	pthread_mutex_unlock(&slab->lock);
+
+	for (; obj; obj = next) {
+		next = obj->next;
+		free(obj);
+	}
+}
+
+void
+twopence_slab_shrink_all(void)
+{
+	twopence_slab_t *slab;
+
+	pthread_mutex_lock(&__twopence_slab_list_lock);
+	for (slab = __twopence_slab_list; slab; slab = slab->next)
+		twopence_slab_shrink(slab);
+	pthread_mutex_unlock(&__twopence_slab_list_lock);
+}
+
+/*
+ * Report allocation statistics of all object caches that have been used so far.
+ * Returns the number of caches; at most @max entries are copied to @stats.
+ */
+unsigned int
+twopence_slab_get_stats(twopence_slab_stats_t *stats, unsigned int max)
+{
+	twopence_slab_t *slab;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&__twopence_slab_list_lock);
+	for (slab = __twopence_slab_list; slab; slab = slab->next, ++count) {
+		if (count < max) {
+			pthread_mutex_lock(&slab->lock);
+			stats[count] = slab->stats;
+			pthread_mutex_unlock(&slab->lock);
+			stats[count].name = slab->name;
+			stats[count].object_size = slab->object_size;
+		}
+	}
+	pthread_mutex_unlock(&__twopence_slab_list_lock);
+	return count;
+}
+
+void
+twopence_slab_dump_stats(unsigned int debuglevel)
+{
+	twopence_slab_t *slab;
+
+	if (twopence_debug_level < debuglevel)
+		return;
+
+	pthread_mutex_lock(&__twopence_slab_list_lock);
+	for (slab = __twopence_slab_list; slab; slab = slab->next) {
+		__twopence_debug(debuglevel, "slab %-12s size %6u: %lu allocs (%lu reused), %lu frees, %u cached",
+				slab->name, slab->object_size,
+				slab->stats.nalloc, slab->stats.nreused,
+				slab->stats.nfree, slab->stats.cached);
+	}
+	pthread_mutex_unlock(&__twopence_slab_list_lock);
+}
@@ -19,6 +19,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <sys/un.h>
 #include <sys/time.h>
 
@@ -39,6 +41,7 @@
 
 typedef struct twopence_packet twopence_packet_t;
 typedef struct twopence_queue twopence_queue_t;
+typedef struct twopence_flow twopence_flow_t;
 
 struct twopence_queue {
 	unsigned int		seq_head;
@@ -50,6 +53,22 @@ struct twopence_queue {
 	twopence_packet_t **	tail;
 };
 
+/*
+ * Data queued by a transaction goes to a per-transaction flow first.
+ * The flows are served in deficit round robin order, and packets move
+ * from there to the xmit queue, which holds what actually goes out on
+ * the wire next. This way, a large file transfer cannot hog the
+ * connection while other transactions are trying to send a few bytes
+ * of output.
+ */
+struct twopence_flow {
+	twopence_flow_t *	next;
+	unsigned int		id;
+	unsigned int		deficit;
+	bool			active;		/* deficit has been topped up for this round */
+	twopence_queue_t	queue;
+};
+
 struct twopence_socket {
 	int			fd;
 	bool			closeit;
@@ -57,6 +76,17 @@ struct twopence_socket {
 	unsigned int		bytes_sent;
 
 	twopence_queue_t	xmit_queue;
+
+	/* Control packets (interrupts, keepalives, status) that overtake
+	 * everything on the xmit queue at the next packet boundary */
+	twopence_queue_t	ctrl_queue;
+
+	/* Flows with data waiting to be scheduled, head is served next */
+	twopence_flow_t *	flows;
+	twopence_flow_t **	flows_tail;
+	unsigned int		flow_bytes;	/* queued on all flows together */
+	unsigned int		flow_quantum;	/* the connection's max packet size */
+
 	struct {
 		bool		enabled;
 		struct timeval	when;	/* time stamp of last xmit */
@@ -67,7 +97,23 @@ struct twopence_socket {
 	bool			read_eof;
 	unsigned char		write_eof;
 
+	/* Set when the kernel refused to sendfile() or splice() to this socket */
+	bool			no_splice;
+
+	/* Session resumption: sequenced packets that have been sent, but
+	 * not been acknowledged by the peer yet. seq_head of the queue is
+	 * the number of packets the peer has acknowledged, seq_tail the
+	 * number of packets we have sent. */
+	struct {
+		bool		enabled;
+		twopence_queue_t queue;
+	} replay;
+
 	struct pollfd *		poll_data;
+
+	/* With epoll: whoever polls this socket, so that they notice when
+	 * there is something to send */
+	twopence_ready_t *	owner;
 };
 
 struct twopence_packet {
@@ -76,19 +122,61 @@ struct twopence_packet {
 	unsigned int		seq;
 	unsigned int		bytes;
 	twopence_buf_t *	buffer;
+
+	/* Set once part of the packet has gone out. From then on,
+	 * nothing may be inserted in front of it. */
+	bool			started;
+
+	/* The flow this packet was queued to, if any */
+	bool			in_flow;
+	unsigned int		flow_id;
+
+	/* For control packets, when the packet was queued */
+	bool			ctrl;
+	struct timeval		queued;
+
+	/* Kept for retransmission after it has been sent, see replay above */
+	bool			sequenced;
+
+	/* Payload that follows the buffer, and is sent straight
+	 * from a file using sendfile(), or from a pipe using splice() */
+	struct {
+		int		fd;
+		int		source;		/* the caller's fd, see twopence_sock_xmit_queue_file_bytes */
+		off_t		offset;		/* -1 for pipes */
+		unsigned int	count;
+	} file;
 };
 
 #define SHUTDOWN_WANTED		1
 #define SHUTDOWN_SENT		2
 
+/* Max number of queued packets we try to transmit in a single writev() */
+#define TWOPENCE_SOCK_XMIT_IOV_MAX	64
+
+/* Flow scheduling: each flow may send one quantum, the largest packet
+ * of the connection, per round. We only move packets to the xmit queue
+ * while it holds less than XMIT_LOWAT_QUANTA, so that a newly queued
+ * packet from another flow does not have to wait for more than that.
+ * Each flow may queue up to FLOW_MAX_QUANTA, and all flows together
+ * up to MAX_QUANTA; except that a flow may always queue one quantum,
+ * so that a busy flow cannot lock out the others. */
+#define TWOPENCE_SOCK_FLOW_MAX_QUANTA	8
+#define TWOPENCE_SOCK_MAX_QUANTA	32
+#define TWOPENCE_SOCK_XMIT_LOWAT_QUANTA	2
+
+static twopence_slab_t	__twopence_packet_slab = TWOPENCE_SLAB_INIT("packet", sizeof(twopence_packet_t), 256);
+static twopence_slab_t	__twopence_flow_slab = TWOPENCE_SLAB_INIT("flow", sizeof(twopence_flow_t), 64);
+
 static twopence_packet_t *
 twopence_packet_new(twopence_buf_t *bp)
 {
 	twopence_packet_t *pkt;
 
-	pkt = twopence_calloc(1, sizeof(*pkt));
+	pkt = twopence_slab_zalloc(&__twopence_packet_slab);
 	pkt->buffer = bp;
 	pkt->bytes = twopence_buf_count(bp);
+	pkt->file.fd = -1;
 	return pkt;
 }
 
@@ -97,7 +185,27 @@ twopence_packet_free(twopence_packet_t *pkt)
 {
 	if (pkt->buffer)
 		twopence_buf_free(pkt->buffer);
-	free(pkt);
+	if (pkt->file.fd >= 0)
+		close(pkt->file.fd);
+	twopence_slab_free(&__twopence_packet_slab, pkt);
+}
+
+/*
+ * Report how long a control packet had to wait before it went out,
+ * and how much data was still queued behind it.
+ */
+static void
+twopence_packet_trace_ctrl(const twopence_packet_t *pkt, const twopence_queue_t *queue)
+{
+	struct timeval now, delta;
+
+	if (twopence_debug_level < 2)
+		return;
+
+	twopence_loop_clock_get(&now);
+	timersub(&now, &pkt->queued, &delta);
+	twopence_debug2("control packet sent after %ld.%06ld sec, %u bytes still queued",
+			(long) delta.tv_sec, (long) delta.tv_usec, queue->bytes);
 }
 
 static void
@@ -135,6 +243,32 @@ twopence_queue_append(twopence_queue_t *queue, twopence_packet_t *pkt)
 	pkt->seq = queue->seq_tail++;
 }
 
+/*
+ * Insert @pkt at position @pos, which must point to the head pointer
+ * of @queue or to the next pointer of a packet on @queue.
+ * The caller has to renumber the queue afterwards.
+ */
+static void
+twopence_queue_insert(twopence_queue_t *queue, twopence_packet_t **pos, twopence_packet_t *pkt)
+{
+	pkt->next = *pos;
+	*pos = pkt;
+	if (queue->tail == pos)
+		queue->tail = &pkt->next;
+	queue->bytes += pkt->bytes;
+}
+
+static void
+twopence_queue_renumber(twopence_queue_t *queue)
+{
+	twopence_packet_t *pkt;
+	unsigned int seq = queue->seq_head;
+
+	for (pkt = queue->head; pkt; pkt = pkt->next)
+		pkt->seq = seq++;
+	queue->seq_tail = seq;
+}
+
 static twopence_packet_t *
 twopence_queue_head(const twopence_queue_t *queue)
 {
@@ -165,6 +299,248 @@ twopence_queue_dequeue(twopence_queue_t *queue)
 	return pkt;
 }
 
+/*
+ * Fill an iovec array with the data of the packets at the head of the queue
+ */
+static unsigned int
+twopence_queue_gather(const twopence_queue_t *queue, struct iovec *iov, unsigned int max_iov)
+{
+	twopence_packet_t *pkt;
+	unsigned int niov = 0;
+
+	for (pkt = queue->head; pkt && niov < max_iov; pkt = pkt->next) {
+		unsigned int count = twopence_buf_count(pkt->buffer);
+
+		if (count != 0) {
+			iov[niov].iov_base = (void *) twopence_buf_head(pkt->buffer);
+			iov[niov].iov_len = count;
+			niov++;
+		}
+
+		/* File payload has to go out via sendfile(), so this
+		 * is where the writev() has to stop. */
+		if (pkt->file.count)
+			break;
+	}
+	return niov;
+}
+
+/*
+ * We transmitted @count bytes from the head of the queue.
+ * Advance the buffers accordingly, and release all packets that
+ * have been sent completely. The last packet may have been sent
+ * only partially, in which case it remains at the head of the queue.
+ * If @sent is given, sequenced packets are moved there rather than
+ * being released.
+ */
+static void
+twopence_queue_consume(twopence_queue_t *queue, unsigned int count, twopence_queue_t *sent)
+{
+	twopence_packet_t *pkt;
+
+	while ((pkt = twopence_queue_head(queue)) != NULL) {
+		unsigned int avail = twopence_buf_count(pkt->buffer);
+
+		if (count < avail) {
+			twopence_buf_advance_head(pkt->buffer, count);
+			pkt->started = true;
+			break;
+		}
+
+		twopence_buf_advance_head(pkt->buffer, avail);
+		count -= avail;
+
+		if (pkt->file.count) {
+			pkt->started = true;
+			break;
+		}
+
+		twopence_queue_dequeue(queue);
+		if (pkt->ctrl)
+			twopence_packet_trace_ctrl(pkt, queue);
+		if (sent && pkt->sequenced) {
+			pkt->next = NULL;
+			twopence_queue_append(sent, pkt);
+		} else {
+			twopence_packet_free(pkt);
+		}
+	}
+}
+
+/*
+ * Prepare a packet that has been sent (partially or completely) for
+ * being sent again.
+ */
+static void
+twopence_packet_rewind(twopence_packet_t *pkt)
+{
+	twopence_buf_rewind_head(pkt->buffer, pkt->bytes - twopence_buf_count(pkt->buffer));
+	pkt->started = false;
+}
+
+static twopence_flow_t *
+twopence_flow_find(const twopence_sock_t *sock, unsigned int id)
+{
+	twopence_flow_t *flow;
+
+	for (flow = sock->flows; flow; flow = flow->next) {
+		if (flow->id == id)
+			return flow;
+	}
+	return NULL;
+}
+
+static twopence_flow_t *
+twopence_flow_get(twopence_sock_t *sock, unsigned int id)
+{
+	twopence_flow_t *flow;
+
+	if ((flow = twopence_flow_find(sock, id)) != NULL)
+		return flow;
+
+	flow = twopence_slab_zalloc(&__twopence_flow_slab);
+	flow->id = id;
+	twopence_queue_init(&flow->queue);
+	flow->queue.max_bytes = TWOPENCE_SOCK_FLOW_MAX_QUANTA * sock->flow_quantum;
+
+	*sock->flows_tail = flow;
+	sock->flows_tail = &flow->next;
+	return flow;
+}
+
+static void
+twopence_flow_free(twopence_flow_t *flow)
+{
+	twopence_queue_destroy(&flow->queue);
+	twopence_slab_free(&__twopence_flow_slab, flow);
+}
+
+static void
+twopence_flow_enqueue(twopence_sock_t *sock, unsigned int id, twopence_packet_t *pkt)
+{
+	twopence_queue_append(&twopence_flow_get(sock, id)->queue, pkt);
+	sock->flow_bytes += pkt->bytes;
+}
+
+/*
+ * Take the flow at the head of the list off the list.
+ */
+static twopence_flow_t *
+twopence_flow_pop(twopence_sock_t *sock)
+{
+	twopence_flow_t *flow;
+
+	if ((flow = sock->flows) != NULL) {
+		sock->flows = flow->next;
+		if (sock->flows == NULL)
+			sock->flows_tail = &sock->flows;
+		flow->next = NULL;
+	}
+	return flow;
+}
+
+/*
+ * Move packets from the flows to the xmit queue, using deficit round robin.
+ * Every time a flow gets its turn, its deficit is topped up by one quantum,
+ * and it may send packets as long as they fit into its deficit.
+ * A flow that has been drained is released, so it does not carry any
+ * credit over to the next burst of data.
+ */
+static void
+twopence_sock_schedule(twopence_sock_t *sock)
+{
+	twopence_flow_t *flow;
+
+	while ((flow = sock->flows) != NULL) {
+		twopence_packet_t *pkt;
+
+		if (!flow->active) {
+			flow->deficit += sock->flow_quantum;
+			flow->active = true;
+		}
+
+		while ((pkt = twopence_queue_head(&flow->queue)) != NULL && pkt->bytes <= flow->deficit) {
+			/* Keep the flow at the head of the list, with the
+			 * remainder of its deficit, until we come back. */
+			if (sock->xmit_queue.bytes >= TWOPENCE_SOCK_XMIT_LOWAT_QUANTA * sock->flow_quantum)
+				return;
+
+			twopence_queue_dequeue(&flow->queue);
+			sock->flow_bytes -= pkt->bytes;
+			flow->deficit -= pkt->bytes;
+			pkt->next = NULL;
+			twopence_queue_append(&sock->xmit_queue, pkt);
+		}
+
+		twopence_flow_pop(sock);
+		if (twopence_queue_empty(&flow->queue)) {
+			twopence_flow_free(flow);
+		} else {
+			flow->active = false;
+			*sock->flows_tail = flow;
+			sock->flows_tail = &flow->next;
+		}
+	}
+}
+
+/*
+ * Check whether there's anything left to transmit, either on the
+ * xmit queue or on any of the flows.
+ */
+static bool
+twopence_sock_xmit_pending(const twopence_sock_t *sock)
+{
+	return !twopence_queue_empty(&sock->xmit_queue)
+	    || !twopence_queue_empty(&sock->ctrl_queue)
+	    || sock->flows != NULL;
+}
+
+/*
+ * Check whether there's any data of the given flow that has not been sent yet
+ */
+bool
+twopence_sock_flow_pending(const twopence_sock_t *sock, unsigned int flow_id)
+{
+	twopence_packet_t *pkt;
+
+	if (twopence_flow_find(sock, flow_id) != NULL)
+		return true;
+
+	for (pkt = sock->xmit_queue.head; pkt; pkt = pkt->next) {
+		if (pkt->in_flow && pkt->flow_id == flow_id)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Move all control packets to the xmit queue, in front of everything
+ * except a packet that has been transmitted partially.
+ * Returns the sequence number following the last control packet.
+ */
+static unsigned int
+twopence_sock_promote_ctrl(twopence_sock_t *sock)
+{
+	twopence_queue_t *queue = &sock->xmit_queue;
+	twopence_packet_t **pos, *pkt, *last = NULL;
+
+	if (twopence_queue_empty(&sock->ctrl_queue))
+		return queue->seq_head;
+
+	pos = &queue->head;
+	if ((pkt = *pos) != NULL && pkt->started)
+		pos = &pkt->next;
+
+	while ((pkt = twopence_queue_dequeue(&sock->ctrl_queue)) != NULL) {
+		twopence_queue_insert(queue, pos, pkt);
+		pos = &pkt->next;
+		last = pkt;
+	}
+
+	twopence_queue_renumber(queue);
+	return last->seq + 1;
+}
+
 static twopence_sock_t *
 __twopence_socket_new(int fd, int oflags)
 {
@@ -183,6 +559,10 @@ __twopence_socket_new(int fd, int oflags)
 	}
 
 	twopence_queue_init(&sock->xmit_queue);
+	twopence_queue_init(&sock->ctrl_queue);
+	twopence_queue_init(&sock->replay.queue);
+	sock->flows_tail = &sock->flows;
+	sock->flow_quantum = TWOPENCE_PROTO_MAX_PACKET;
 	return sock;
 }
 
@@ -224,11 +604,18 @@ twopence_sock_set_noclose(twopence_sock_t *sock)
 void
 twopence_sock_free(twopence_sock_t *sock)
 {
+	twopence_flow_t *flow;
+
 	twopence_debug("%s(%d)\n", __func__, sock->fd);
+	twopence_epoll_forget_fd(sock->fd);
 	if (sock->closeit && sock->fd >= 0)
 		close(sock->fd);
 
 	twopence_queue_destroy(&sock->xmit_queue);
+	twopence_queue_destroy(&sock->ctrl_queue);
+	twopence_queue_destroy(&sock->replay.queue);
+	while ((flow = twopence_flow_pop(sock)) != NULL)
+		twopence_flow_free(flow);
 	if (sock->recv_buf)
 		twopence_buf_free(sock->recv_buf);
 	free(sock);
@@ -321,7 +708,10 @@ twopence_sock_post_recvbuf_if_needed(twopence_sock_t *sock, unsigned int size)
 	if (sock->read_eof || sock->recv_buf != NULL)
 		return NULL;
 
-	sock->recv_buf = twopence_buf_new(size);
+	/* This is used for the transport socket, where a packet may be
+	 * split across several reads. Use a ring buffer so that we never
+	 * have to move partial packets around. */
+	sock->recv_buf = twopence_buf_new_ring(size);
 	return sock->recv_buf;
 }
 
@@ -339,7 +729,7 @@ twopence_sock_write(twopence_sock_t *sock, twopence_buf_t *bp, unsigned int coun
 	n = write(sock->fd, twopence_buf_head(bp), count);
 	if (n > 0) {
 		if (sock->xmit_ts.enabled)
-			gettimeofday(&sock->xmit_ts.when, NULL);
+			twopence_loop_clock_get(&sock->xmit_ts.when);
 		sock->bytes_sent += n;
 	}
 	return n;
@@ -366,7 +756,7 @@ twopence_sock_xmit_queue_flush(twopence_sock_t *sock)
 	f = fcntl(sock->fd, F_GETFL);
 	fcntl(sock->fd, F_SETFL, f & ~O_NONBLOCK);
 
-	while (twopence_queue_head(&sock->xmit_queue) != NULL) {
+	while (twopence_sock_xmit_pending(sock)) {
 		n = twopence_sock_send_queued(sock);
 		if (n < 0)
 			break;
@@ -384,16 +774,136 @@ twopence_sock_xmit_queue_flush(twopence_sock_t *sock)
  *
  * Independent of the above
  *  unshare:     create a clone of the buffer object before queuing it
+ *  flow:        queue the buffer to the flow given by @flow_id rather than
+ *               directly to the xmit queue
+ *  control:     the buffer overtakes all queued data at the next packet
+ *               boundary. If combined with flow, this only happens if the
+ *               flow has no data pending. Combined with synchronous, we
+ *               only wait for the control packet to go out.
  */
 #define TWOPENCE_SOCK_XMIT_TRYTOWRITE	0x0001
 #define TWOPENCE_SOCK_XMIT_SYNCHRONOUS	0x0002
 #define TWOPENCE_SOCK_XMIT_CLONEBUF	0x0004
+#define TWOPENCE_SOCK_XMIT_FLOW		0x0008
+#define TWOPENCE_SOCK_XMIT_CONTROL	0x0010
 
+/*
+ * With session resumption, every packet has to go through the queue, so
+ * that we can hang on to it until the peer has acknowledged it.
+ * A write error does not lose any data. We just stop reading, so that
+ * the connection notices the transport is gone, and the data goes out
+ * again once the session has been resumed on a new transport.
+ */
 static int
-__socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
+__socket_queue_replay(twopence_sock_t *sock, twopence_buf_t *bp, int flags, unsigned int flow_id)
 {
+	twopence_queue_t *queue = &sock->xmit_queue;
+	const twopence_hdr_t *hdr;
+	twopence_packet_t *pkt;
+	bool idle, attached;
+	int n = 0, f = 0;
+
+	if (sock->write_eof) {
+		twopence_log_error("%s: attempt to queue data after write shutdown", __func__);
+		if (!(flags & TWOPENCE_SOCK_XMIT_CLONEBUF))
+			twopence_buf_free(bp);
+		return 0;
+	}
+
+	if (flags & TWOPENCE_SOCK_XMIT_CLONEBUF)
+		bp = twopence_buf_clone(bp);
+
+	/* Transport is gone, wait for the session to be resumed */
+	attached = sock->fd >= 0 && !sock->read_eof;
+
+	if (attached && (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS)) {
+		f = fcntl(sock->fd, F_GETFL);
+		fcntl(sock->fd, F_SETFL, f & ~O_NONBLOCK);
+
+		/* Flush out all queued packets first, so that we do not
+		 * overtake data still waiting in the flow queues */
+		if (!(flags & TWOPENCE_SOCK_XMIT_CONTROL)) {
+			while (twopence_sock_xmit_pending(sock)
+			    && (n = twopence_sock_send_queued(sock)) >= 0)
+				;
+		}
+	}
+
+	idle = !twopence_sock_xmit_pending(sock);
+
+	pkt = twopence_packet_new(bp);
+	hdr = (const twopence_hdr_t *) twopence_buf_head(bp);
+	pkt->sequenced = twopence_protocol_packet_is_sequenced(hdr->type);
+	if (flags & TWOPENCE_SOCK_XMIT_FLOW) {
+		pkt->in_flow = true;
+		pkt->flow_id = flow_id;
+	}
+	if (flags & TWOPENCE_SOCK_XMIT_CONTROL) {
+		pkt->ctrl = true;
+		twopence_loop_clock_get(&pkt->queued);
+		queue = &sock->ctrl_queue;
+	} else
+	if (flags & TWOPENCE_SOCK_XMIT_FLOW) {
+		queue = NULL;
+	}
+
+	if (queue)
+		twopence_queue_append(queue, pkt);
+	else
+		twopence_flow_enqueue(sock, flow_id, pkt);
+
+	if (!attached || n < 0)
+		goto out;
+
+	if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS) {
+		if (flags & TWOPENCE_SOCK_XMIT_CONTROL) {
+			unsigned int seq = twopence_sock_promote_ctrl(sock);
+
+			while ((int) (seq - sock->xmit_queue.seq_head) > 0
+			    && (n = twopence_sock_send_queued(sock)) >= 0)
+				;
+		} else {
+			while (twopence_sock_xmit_pending(sock)
+			    && (n = twopence_sock_send_queued(sock)) >= 0)
+				;
+		}
+	} else
+	if ((flags & TWOPENCE_SOCK_XMIT_TRYTOWRITE) && idle) {
+		n = twopence_sock_send_queued(sock);
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+	}
+
+out:
+	if (attached && (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS))
+		fcntl(sock->fd, F_SETFL, f);
+
+	if (n < 0) {
+		twopence_debug("%s(%d): write error, waiting for the session to be resumed: %m", __func__, sock->fd);
+		sock->read_eof = true;
+	}
+	return 0;
+}
+
+static int
+__socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags, unsigned int flow_id)
+{
+	twopence_queue_t *queue = &sock->xmit_queue;
+	twopence_packet_t *pkt;
+	unsigned int len;
 	int n = 0, f;
 
+	if (sock->owner)
+		twopence_ready_mark(sock->owner);
+
+	/* A status packet must never overtake the data of its own transaction */
+	if ((flags & TWOPENCE_SOCK_XMIT_CONTROL) && (flags & TWOPENCE_SOCK_XMIT_FLOW)
+	 && twopence_sock_flow_pending(sock, flow_id))
+		flags &= ~TWOPENCE_SOCK_XMIT_CONTROL;
+
+	if (sock->replay.enabled)
+		return __socket_queue_replay(sock, bp, flags, flow_id);
+
 	f = fcntl(sock->fd, F_GETFL);
 	if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS)
 		fcntl(sock->fd, F_SETFL, f & ~O_NONBLOCK);
@@ -403,9 +913,9 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 		goto out_drop_buffer;
 	}
 
-	if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS) {
+	if ((flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS) && !(flags & TWOPENCE_SOCK_XMIT_CONTROL)) {
 		/* Flush out all queued packets first */
-		while (twopence_queue_head(&sock->xmit_queue) != NULL) {
+		while (twopence_sock_xmit_pending(sock)) {
 			n = twopence_sock_send_queued(sock);
 			if (n < 0)
 				goto out_drop_buffer;
@@ -414,7 +924,8 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 
 	/* If nothing is queued to the socket, we might as well try to
 	 * send this data directly. */
-	if (twopence_queue_empty(&sock->xmit_queue)) {
+	len = twopence_buf_count(bp);
+	if (!twopence_sock_xmit_pending(sock)) {
 		if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS) {
 			/* fully synchronous */
 			while (twopence_buf_count(bp) != 0) {
@@ -433,7 +944,43 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 	if (twopence_buf_count(bp) != 0) {
 		if (flags & TWOPENCE_SOCK_XMIT_CLONEBUF)
 			bp = twopence_buf_clone(bp);
-		twopence_queue_append(&sock->xmit_queue, twopence_packet_new(bp));
+
+		pkt = twopence_packet_new(bp);
+		if (flags & TWOPENCE_SOCK_XMIT_FLOW) {
+			pkt->in_flow = true;
+			pkt->flow_id = flow_id;
+		}
+
+		if (twopence_buf_count(bp) != len) {
+			/* We sent part of it already, so the rest has to
+			 * follow right away. */
+			pkt->started = true;
+		} else
+		if (flags & TWOPENCE_SOCK_XMIT_CONTROL) {
+			pkt->ctrl = true;
+			twopence_loop_clock_get(&pkt->queued);
+			queue = &sock->ctrl_queue;
+		} else
+		if (flags & TWOPENCE_SOCK_XMIT_FLOW) {
+			queue = NULL;
+		}
+
+		if (queue)
+			twopence_queue_append(queue, pkt);
+		else
+			twopence_flow_enqueue(sock, flow_id, pkt);
+
+		if ((flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS) && (flags & TWOPENCE_SOCK_XMIT_CONTROL)) {
+			unsigned int seq = twopence_sock_promote_ctrl(sock);
+
+			/* Send until our packet is gone; anything queued
+			 * behind it can go out asynchronously. */
+			while ((int) (seq - sock->xmit_queue.seq_head) > 0) {
+				n = twopence_sock_send_queued(sock);
+				if (n < 0)
+					break;
+			}
+		}
 		goto out;
 	}
 
@@ -446,38 +993,193 @@ out:
 	return n;
 }
 
+/*
+ * Queue a packet consisting of a header in @bp, followed by @count bytes
+ * of @fd starting at @offset. The data is sent using sendfile(), so it
+ * never has to be copied to user space.
+ * If @fd is a pipe, pass an offset of -1; the data is then moved with
+ * splice(). The caller must make sure that this many bytes are available
+ * in the pipe, and that nobody else reads from it in the meantime.
+ * The socket takes a reference on @fd; the caller retains its own.
+ * The packet is queued to the flow given by @flow_id.
+ */
+int
+twopence_sock_queue_file(twopence_sock_t *sock, unsigned int flow_id, twopence_buf_t *bp, int fd, off_t offset, unsigned int count)
+{
+	twopence_packet_t *pkt;
+
+	if (sock->write_eof) {
+		twopence_log_error("%s: attempt to queue data after write shutdown", __func__);
+		twopence_buf_free(bp);
+		return TWOPENCE_TRANSPORT_ERROR;
+	}
+
+	pkt = twopence_packet_new(bp);
+	if ((pkt->file.fd = dup(fd)) < 0) {
+		twopence_log_error("%s: unable to dup file descriptor: %m", __func__);
+		twopence_packet_free(pkt);
+		return TWOPENCE_TRANSPORT_ERROR;
+	}
+	pkt->file.source = fd;
+	pkt->file.offset = offset;
+	pkt->file.count = count;
+	pkt->bytes += count;
+	pkt->in_flow = true;
+	pkt->flow_id = flow_id;
+
+	twopence_flow_enqueue(sock, flow_id, pkt);
+	if (sock->owner)
+		twopence_ready_mark(sock->owner);
+	return 0;
+}
+
 void
 twopence_sock_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp)
 {
-	__socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE);
+	__socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE, 0);
+}
+
+void
+twopence_sock_queue_xmit_flow(twopence_sock_t *sock, unsigned int flow_id, twopence_buf_t *bp)
+{
+	__socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_FLOW, flow_id);
+}
+
+void
+twopence_sock_queue_ctrl(twopence_sock_t *sock, twopence_buf_t *bp)
+{
+	__socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_CONTROL, 0);
+}
+
+void
+twopence_sock_queue_ctrl_flow(twopence_sock_t *sock, unsigned int flow_id, twopence_buf_t *bp)
+{
+	__socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_CONTROL | TWOPENCE_SOCK_XMIT_FLOW, flow_id);
+}
+
+int
+twopence_sock_xmit_ctrl(twopence_sock_t *sock, twopence_buf_t *bp)
+{
+	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_SYNCHRONOUS | TWOPENCE_SOCK_XMIT_CONTROL, 0);
 }
 
 int
 twopence_sock_xmit_shared(twopence_sock_t *sock, twopence_buf_t *bp)
 {
-	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_CLONEBUF);
+	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_CLONEBUF, 0);
 }
 
 int
 twopence_sock_xmit(twopence_sock_t *sock, twopence_buf_t *bp)
 {
-	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_SYNCHRONOUS);
+	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_SYNCHRONOUS, 0);
+}
+
+static int
+twopence_sock_send_file(twopence_sock_t *sock, twopence_packet_t *pkt)
+{
+	ssize_t n = -1;
+
+	if (!sock->no_splice) {
+		if (pkt->file.offset < 0)
+			n = splice(pkt->file.fd, NULL, sock->fd, NULL, pkt->file.count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			n = sendfile(sock->fd, pkt->file.fd, &pkt->file.offset, pkt->file.count);
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			twopence_debug("%s(%d): transport does not support sendfile/splice: %m", __func__, sock->fd);
+			sock->no_splice = true;
+		}
+	}
+
+	if (sock->no_splice) {
+		twopence_buf_t *bp = pkt->buffer;
+
+		/* Read the data into the packet buffer instead, and let the
+		 * caller send it the usual way. */
+		twopence_buf_reset(bp);
+		twopence_buf_ensure_tailroom(bp, pkt->file.count);
+		if (pkt->file.offset < 0)
+			n = read(pkt->file.fd, twopence_buf_tail(bp), pkt->file.count);
+		else
+			n = pread(pkt->file.fd, twopence_buf_tail(bp), pkt->file.count, pkt->file.offset);
+		if (n == 0)
+			goto truncated;
+		if (n > 0) {
+			twopence_buf_advance_tail(bp, n);
+			if (pkt->file.offset >= 0)
+				pkt->file.offset += n;
+			pkt->file.count -= n;
+			return 0;
+		}
+	}
+
+	if (n < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		return -1;
+	}
+
+	if (n == 0)
+		goto truncated;
+
+	twopence_debug2("%s(%d): sent %u bytes from fd %d\n", __func__, sock->fd, (unsigned int) n, pkt->file.source);
+	if (sock->xmit_ts.enabled)
+		twopence_loop_clock_get(&sock->xmit_ts.when);
+	sock->bytes_sent += n;
+
+	pkt->file.count -= n;
+	if (pkt->file.count == 0) {
+		twopence_queue_dequeue(&sock->xmit_queue);
+		twopence_packet_free(pkt);
+	}
+	return n;
+
+truncated:
+	/* We've already sent the packet header, so there is no way to recover */
+	twopence_log_error("%s: file shrank while being transmitted", __func__);
+	errno = EIO;
+	return -1;
 }
 
+/*
+ * Transmit as much of the xmit queue as the socket will take.
+ * Rather than writing one packet at a time, we gather up to
+ * TWOPENCE_SOCK_XMIT_IOV_MAX packets into a single writev() call.
+ */
 int
 twopence_sock_send_queued(twopence_sock_t *sock)
 {
+	struct iovec iov[TWOPENCE_SOCK_XMIT_IOV_MAX];
 	twopence_packet_t *pkt;
+	unsigned int niov;
 	int n;
 
-	if ((pkt = twopence_queue_head(&sock->xmit_queue)) == NULL)
+	twopence_sock_promote_ctrl(sock);
+	twopence_sock_schedule(sock);
+
+	/* If the header of a file packet has gone out, send the file data.
+	 * If we had to fall back to reading the data into the packet buffer,
+	 * go on and send it along with the packets that follow. */
+	pkt = twopence_queue_head(&sock->xmit_queue);
+	if (pkt && pkt->file.count && twopence_buf_count(pkt->buffer) == 0) {
+		if ((n = twopence_sock_send_file(sock, pkt)) != 0
+		 || twopence_buf_count(pkt->buffer) == 0)
+			return n;
+	}
+
+	niov = twopence_queue_gather(&sock->xmit_queue, iov, TWOPENCE_SOCK_XMIT_IOV_MAX);
+	if (niov == 0)
 		return 0;
 
-	n = twopence_sock_send_buffer(sock, pkt->buffer);
-	if (twopence_buf_count(pkt->buffer) == 0) {
-		/* Sent the complete buffer */
-		twopence_queue_dequeue(&sock->xmit_queue);
-		twopence_packet_free(pkt);
+	n = writev(sock->fd, iov, niov);
+	if (n > 0) {
+		twopence_debug2("%s(%d): wrote %u bytes from %u packets\n", __func__, sock->fd, n, niov);
+		if (sock->xmit_ts.enabled)
+			twopence_loop_clock_get(&sock->xmit_ts.when);
+		sock->bytes_sent += n;
+
+		twopence_queue_consume(&sock->xmit_queue, n,
+				sock->replay.enabled? &sock->replay.queue : NULL);
 	}
 
 	return n;
@@ -486,7 +1188,31 @@ twopence_sock_send_queued(twopence_sock_t *sock)
 unsigned int
 twopence_sock_xmit_queue_bytes(twopence_sock_t *sock)
 {
-	return sock->xmit_queue.bytes;
+	return sock->xmit_queue.bytes + sock->ctrl_queue.bytes + sock->flow_bytes;
+}
+
+/*
+ * Return the number of bytes from @fd that have been queued
+ * using twopence_sock_queue_file but not been sent yet.
+ */
+unsigned int
+twopence_sock_xmit_queue_file_bytes(twopence_sock_t *sock, int fd)
+{
+	twopence_packet_t *pkt;
+	twopence_flow_t *flow;
+	unsigned int count = 0;
+
+	for (pkt = sock->xmit_queue.head; pkt; pkt = pkt->next) {
+		if (pkt->file.count && pkt->file.source == fd)
+			count += pkt->file.count;
+	}
+	for (flow = sock->flows; flow; flow = flow->next) {
+		for (pkt = flow->queue.head; pkt; pkt = pkt->next) {
+			if (pkt->file.count && pkt->file.source == fd)
+				count += pkt->file.count;
+		}
+	}
+	return count;
 }
 
 bool
@@ -510,6 +1236,45 @@ twopence_sock_xmit_queue_allowed(const twopence_sock_t *sock)
 	return true;
 }
 
+/*
+ * Check whether the flow given by @flow_id may queue more data.
+ * Each flow is limited separately, so that one busy transaction
+ * does not keep the others from making progress, and all of them
+ * together are limited by the socket-wide cap.
+ */
+bool
+twopence_sock_xmit_flow_allowed(const twopence_sock_t *sock, unsigned int flow_id)
+{
+	twopence_flow_t *flow;
+
+	if (sock->write_eof)
+		return false;
+
+	if ((flow = twopence_flow_find(sock, flow_id)) == NULL
+	 || flow->queue.bytes < sock->flow_quantum)
+		return true;
+
+	if (twopence_queue_full(&flow->queue)
+	 || sock->flow_bytes >= TWOPENCE_SOCK_MAX_QUANTA * sock->flow_quantum)
+		return false;
+
+	return true;
+}
+
+/*
+ * Scale flow scheduling to the max packet size negotiated for the
+ * connection, so that a flow can send a full-sized packet every round.
+ */
+void
+twopence_sock_set_max_packet(twopence_sock_t *sock, unsigned int max_packet)
+{
+	twopence_flow_t *flow;
+
+	sock->flow_quantum = max_packet;
+	for (flow = sock->flows; flow; flow = flow->next)
+		flow->queue.max_bytes = TWOPENCE_SOCK_FLOW_MAX_QUANTA * max_packet;
+}
+
 twopence_sock_t *
 twopence_sock_accept(twopence_sock_t *sock)
 {
@@ -534,7 +1299,7 @@ twopence_sock_accept(twopence_sock_t *sock)
 static bool
 __socket_try_shutdown(twopence_sock_t *sock)
 {
-	if (twopence_queue_empty(&sock->xmit_queue)) {
+	if (!twopence_sock_xmit_pending(sock)) {
 		shutdown(sock->fd, SHUT_WR);
 		sock->write_eof = SHUTDOWN_SENT;
 		return true;
@@ -550,6 +1315,8 @@ twopence_sock_shutdown_write(twopence_sock_t *sock)
 
 	sock->write_eof = SHUTDOWN_WANTED;
 	__socket_try_shutdown(sock);
+	if (sock->owner)
+		twopence_ready_mark(sock->owner);
 	return true;
 }
 
@@ -558,6 +1325,17 @@ twopence_sock_mark_dead(twopence_sock_t *sock)
 {
 	sock->read_eof = true;
 	sock->write_eof = SHUTDOWN_SENT;
+	if (sock->owner)
+		twopence_ready_mark(sock->owner);
+}
+
+/*
+ * With epoll, tell the owner of the socket when we have something to send
+ */
+void
+twopence_sock_set_owner(twopence_sock_t *sock, twopence_ready_t *owner)
+{
+	sock->owner = owner;
 }
 
 bool
@@ -578,6 +1356,120 @@ twopence_sock_is_dead(twopence_sock_t *sock)
 	return sock->read_eof && sock->write_eof == SHUTDOWN_SENT;
 }
 
+/*
+ * Session resumption: keep sent packets until the peer acknowledges
+ * them, so that we can send them again over a new transport.
+ */
+void
+twopence_sock_enable_replay(twopence_sock_t *sock)
+{
+	sock->replay.enabled = true;
+}
+
+/*
+ * The peer has received @received packets so far; release those.
+ * Returns false if the peer claims to have received packets we never sent.
+ */
+bool
+twopence_sock_replay_ack(twopence_sock_t *sock, uint32_t received)
+{
+	twopence_queue_t *queue = &sock->replay.queue;
+	twopence_packet_t *pkt;
+
+	if ((int) (received - queue->seq_head) < 0
+	 || (int) (queue->seq_tail - received) < 0)
+		return false;
+
+	while ((int) (received - queue->seq_head) > 0) {
+		pkt = twopence_queue_dequeue(queue);
+		twopence_packet_free(pkt);
+	}
+	return true;
+}
+
+/*
+ * The transport is gone. Close the file descriptor, but keep everything
+ * that is queued, and wait for the session to be resumed.
+ */
+void
+twopence_sock_detach(twopence_sock_t *sock)
+{
+	twopence_debug("%s(%d)\n", __func__, sock->fd);
+	twopence_epoll_forget_fd(sock->fd);
+	if (sock->closeit && sock->fd >= 0)
+		close(sock->fd);
+	sock->fd = -1;
+	sock->poll_data = NULL;
+
+	/* A partial packet in the receive buffer will be sent again */
+	if (sock->recv_buf) {
+		twopence_buf_free(sock->recv_buf);
+		sock->recv_buf = NULL;
+	}
+	sock->read_eof = false;
+}
+
+bool
+twopence_sock_is_detached(const twopence_sock_t *sock)
+{
+	return sock->fd < 0;
+}
+
+/*
+ * Resume a session on a new transport. Take over the file descriptor of
+ * @from, along with anything it has received already, and retransmit
+ * everything beyond the first @received packets ahead of all other data.
+ */
+bool
+twopence_sock_reattach(twopence_sock_t *sock, twopence_sock_t *from, uint32_t received)
+{
+	twopence_queue_t *queue = &sock->xmit_queue;
+	twopence_packet_t **pos, *pkt;
+	unsigned int count = 0;
+
+	if (!twopence_sock_replay_ack(sock, received)) {
+		twopence_log_error("cannot resume session: peer received %u packets, we sent %u..%u",
+				received, sock->replay.queue.seq_head, sock->replay.queue.seq_tail);
+		return false;
+	}
+
+	if (sock->fd >= 0)
+		twopence_sock_detach(sock);
+
+	/* The fd may still be registered on behalf of the connection
+	 * that accepted the new transport */
+	twopence_epoll_forget_fd(from->fd);
+
+	sock->fd = from->fd;
+	sock->closeit = from->closeit;
+	sock->recv_buf = from->recv_buf;
+	sock->read_eof = false;
+	sock->write_eof = 0;
+
+	from->fd = -1;
+	from->recv_buf = NULL;
+	twopence_sock_mark_dead(from);
+
+	/* Whatever was in flight on the old transport is lost */
+	if ((pkt = twopence_queue_head(queue)) != NULL && pkt->started)
+		twopence_packet_rewind(pkt);
+
+	pos = &queue->head;
+	while ((pkt = twopence_queue_dequeue(&sock->replay.queue)) != NULL) {
+		twopence_packet_rewind(pkt);
+		twopence_queue_insert(queue, pos, pkt);
+		pos = &pkt->next;
+		count++;
+	}
+	twopence_queue_renumber(queue);
+
+	/* These packets will be counted again as they go out */
+	sock->replay.queue.seq_head = sock->replay.queue.seq_tail = received;
+
+	twopence_debug("%s(%d): retransmitting %u packets", __func__, sock->fd, count);
+	return true;
+}
+
 void
 twopence_sock_enable_xmit_ts(twopence_sock_t *sock)
 {
@@ -619,27 +1511,27 @@ twopence_sock_state_desc(const twopence_sock_t *sock)
 }
 
 static const char *
-twopence_sock_queue_desc(const twopence_sock_t *sock)
+twopence_sock_queue_desc(const twopence_sock_t *sock, char *buffer, size_t size)
 {
-	static char buffer[60];
 	unsigned int recv_bytes = sock->recv_buf? twopence_buf_count(sock->recv_buf) : 0;
-	unsigned int send_bytes = sock->xmit_queue.bytes;
+	unsigned int send_bytes = twopence_sock_xmit_queue_bytes((twopence_sock_t *) sock);
 
 	if (recv_bytes == 0 && send_bytes == 0)
 		return "";
 
 	if (recv_bytes == 0)
-		snprintf(buffer, sizeof(buffer), ", pending send=%u", send_bytes);
+		snprintf(buffer, size, ", pending send=%u", send_bytes);
 	else
 	if (send_bytes == 0)
-		snprintf(buffer, sizeof(buffer), ", pending recv=%u", recv_bytes);
+		snprintf(buffer, size, ", pending recv=%u", recv_bytes);
 	else
-		snprintf(buffer, sizeof(buffer), ", pending recv=%u send=%u", recv_bytes, send_bytes);
+		snprintf(buffer, size, ", pending recv=%u send=%u", recv_bytes, send_bytes);
 	return buffer;
 }
 
+/* The buffer must hold at least 48 bytes */
 static const char *
-poll_bit_string(int events)
+poll_bit_string(int events, char *buffer)
 {
 	static struct {
 		int bit; const char *name;
@@ -651,7 +1543,6 @@ poll_bit_string(int events)
 		{ POLLNVAL, "POLLNVAL" },
 		{ 0, NULL }
 	};
-	static char buffer[60];
 	char sepa = '<';
 	int k, len = 0;
 
@@ -678,6 +1569,7 @@ twopence_sock_prepare_poll(twopence_sock_t *sock)
 bool
 twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
 {
+	char qbuf[60], ebuf[48];
 	int events = 0;
 
 	sock->poll_data = NULL;
@@ -686,7 +1578,7 @@ twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
 		return false;
 
 	if (sock->write_eof != SHUTDOWN_SENT) {
-		if (!twopence_queue_empty(&sock->xmit_queue))
+		if (twopence_sock_xmit_pending(sock))
 			events |= POLLOUT;
 	}
 	if (!sock->read_eof) {
@@ -697,7 +1589,8 @@ twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
 	if (events == 0)
 		return false;
 
-	twopence_debug2("%s(fd=%d, %s%s): events=%s\n", __func__, sock->fd, twopence_sock_state_desc(sock), twopence_sock_queue_desc(sock), poll_bit_string(events));
+	twopence_debug2("%s(fd=%d, %s%s): events=%s\n", __func__, sock->fd, twopence_sock_state_desc(sock),
+			twopence_sock_queue_desc(sock, qbuf, sizeof(qbuf)), poll_bit_string(events, ebuf));
 	if (!(sock->poll_data = twopence_pollinfo_update(pinfo, sock->fd, events, NULL)))
 		return false;
 
@@ -708,6 +1601,7 @@ int
 twopence_sock_doio(twopence_sock_t *sock)
 {
 	struct pollfd *pfd;
+	char ebuf[48];
 	int n;
 
 	if ((pfd = sock->poll_data) == NULL)
@@ -716,7 +1610,7 @@ twopence_sock_doio(twopence_sock_t *sock)
 	sock->poll_data = NULL;
 
 	if (pfd->revents != 0)
-		twopence_debug2("twopence_sock_doio(%d, pfd=<fd=%d, revents=%s)\n", sock->fd, pfd->fd, poll_bit_string(pfd->revents));
+		twopence_debug2("twopence_sock_doio(%d, pfd=<fd=%d, revents=%s)\n", sock->fd, pfd->fd, poll_bit_string(pfd->revents, ebuf));
 
 	if (pfd->revents & POLLNVAL) {
 		twopence_sock_mark_dead(sock);
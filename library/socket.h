@@ -37,15 +37,25 @@ extern int		twopence_sock_recv_buffer_blocking(twopence_sock_t *sock, twopence_b
 extern int		twopence_sock_write(twopence_sock_t *sock, twopence_buf_t *bp, unsigned int count);
 extern int		twopence_sock_send_buffer(twopence_sock_t *sock, twopence_buf_t *bp);
 extern void		twopence_sock_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp);
+extern void		twopence_sock_queue_xmit_flow(twopence_sock_t *sock, unsigned int flow_id, twopence_buf_t *bp);
 extern int		twopence_sock_xmit(twopence_sock_t *sock, twopence_buf_t *bp);
+extern void		twopence_sock_queue_ctrl(twopence_sock_t *sock, twopence_buf_t *bp);
+extern void		twopence_sock_queue_ctrl_flow(twopence_sock_t *sock, unsigned int flow_id, twopence_buf_t *bp);
+extern int		twopence_sock_xmit_ctrl(twopence_sock_t *sock, twopence_buf_t *bp);
+extern int		twopence_sock_queue_file(twopence_sock_t *sock, unsigned int flow_id, twopence_buf_t *bp, int fd, off_t offset, unsigned int count);
 extern int		twopence_sock_xmit_shared(twopence_sock_t *sock, twopence_buf_t *bp);
 extern int		twopence_sock_send_queued(twopence_sock_t *sock);
 extern unsigned int	twopence_sock_xmit_queue_bytes(twopence_sock_t *sock);
+extern unsigned int	twopence_sock_xmit_queue_file_bytes(twopence_sock_t *sock, int fd);
 extern bool		twopence_sock_xmit_queue_allowed(const twopence_sock_t *sock);
+extern bool		twopence_sock_xmit_flow_allowed(const twopence_sock_t *sock, unsigned int flow_id);
+extern bool		twopence_sock_flow_pending(const twopence_sock_t *sock, unsigned int flow_id);
+extern void		twopence_sock_set_max_packet(twopence_sock_t *sock, unsigned int max_packet);
 extern int		twopence_sock_xmit_queue_flush(twopence_sock_t *sock);
 extern twopence_sock_t *twopence_sock_accept(twopence_sock_t *);
 extern bool		twopence_sock_shutdown_write(twopence_sock_t *sock);
 extern void		twopence_sock_mark_dead(twopence_sock_t *sock);
+extern void		twopence_sock_set_owner(twopence_sock_t *sock, twopence_ready_t *owner);
 extern bool		twopence_sock_is_read_eof(const twopence_sock_t *);
 extern bool		twopence_sock_is_write_eof(const twopence_sock_t *);
 extern bool		twopence_sock_is_dead(twopence_sock_t *sock);
@@ -57,6 +67,12 @@ extern void		twopence_sock_post_recvbuf(twopence_sock_t *sock, twopence_buf_t *b
 extern twopence_buf_t *	twopence_sock_take_recvbuf(twopence_sock_t *);
 extern twopence_buf_t *	twopence_sock_get_recvbuf(twopence_sock_t *);
 
+extern void		twopence_sock_enable_replay(twopence_sock_t *);
+extern bool		twopence_sock_replay_ack(twopence_sock_t *, uint32_t received);
+extern void		twopence_sock_detach(twopence_sock_t *);
+extern bool		twopence_sock_is_detached(const twopence_sock_t *);
+extern bool		twopence_sock_reattach(twopence_sock_t *, twopence_sock_t *from, uint32_t received);
+
 extern void		twopence_sock_enable_xmit_ts(twopence_sock_t *);
 extern bool		twopence_sock_get_xmit_ts(const twopence_sock_t *, struct timeval *);
 
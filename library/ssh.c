@@ -101,6 +101,9 @@ struct twopence_ssh_transaction {
   /* This is where we store the command's status */
   twopence_status_t	status;
 
+  /* The command we're executing */
+  twopence_command_t *	command;
+
   struct {
     twopence_iostream_t *stream;
     int			fd;
@@ -150,11 +153,12 @@ struct twopence_scp_transaction {
 
 extern const struct twopence_plugin twopence_ssh_ops;
 
-static bool		__twopence_ssh_interrupted;
+static __thread bool	__twopence_ssh_interrupted;
 
 static ssh_session	__twopence_ssh_open_session(const struct twopence_ssh_target *, const char *);
 static void		__twopence_ssh_transaction_detach_stdin(twopence_ssh_transaction_t *trans);
 static int		__twopence_ssh_interrupt_ssh(struct twopence_ssh_target *);
+static int		__twopence_ssh_reap_completed(struct twopence_ssh_target *);
 
 ///////////////////////////// Lower layer ///////////////////////////////////////
 
@@ -256,7 +260,7 @@ __twopence_ssh_transaction_new(struct twopence_ssh_target *handle, unsigned long
 
   trans->handle = handle;
 
-  gettimeofday(&trans->command_timeout, NULL);
+  twopence_loop_clock_update(&trans->command_timeout);
   trans->command_timeout.tv_sec += timeout;
 
   trans->stdin.fd = -1;
@@ -666,10 +670,36 @@ __twopence_ssh_transaction_enable_poll(ssh_event event, twopence_ssh_transaction
   return 0;
 }
 
+static int
+__twopence_ssh_dopoll(struct twopence_ssh_target *handle, twopence_timeout_t *timeout)
+{
+  int rc;
+
+  twopence_timers_update_timeout(timeout);
+
+  twopence_debug("polling for events; timeout=%ld\n", twopence_timeout_msec(timeout));
+  rc = ssh_event_dopoll(handle->event, twopence_timeout_msec(timeout));
+
+  if (__twopence_ssh_interrupted) {
+    twopence_debug("ssh_event_dopoll() interrupted by signal");
+    __twopence_ssh_interrupted = false;
+    return 0;
+  }
+
+  if (rc == SSH_ERROR) {
+    twopence_debug("ssh_event_dopoll() returns error");
+    return TWOPENCE_INTERNAL_ERROR;
+  }
+
+  /* We do this as the last thing before returning, in order to minimize the
+   * risk of harmful user behavior */
+  twopence_timers_run();
+  return 0;
+}
+
 static int
 __twopence_ssh_poll(struct twopence_ssh_target *handle)
 {
-  ssh_event event = handle->event;
   twopence_ssh_transaction_t *trans;
 
   fflush(stdout);
@@ -715,29 +745,49 @@ __twopence_ssh_poll(struct twopence_ssh_target *handle)
       }
     }
 
-    twopence_timers_update_timeout(&timeout);
+    if ((rc = __twopence_ssh_dopoll(handle, &timeout)) < 0)
+      return rc;
+  } while (true);
 
-    twopence_debug("polling for events; timeout=%ld\n", twopence_timeout_msec(&timeout));
-    rc = ssh_event_dopoll(event, twopence_timeout_msec(&timeout));
+  return 0;
+}
 
-    if (__twopence_ssh_interrupted) {
-      twopence_debug("ssh_event_dopoll() interrupted by signal");
-      __twopence_ssh_interrupted = false;
-      continue;
-    }
+/*
+ * Perform one round of I/O for the asynchronous API, waiting no
+ * longer than the given deadline.
+ */
+static int
+__twopence_ssh_poll_once(struct twopence_ssh_target *handle, const struct timeval *deadline)
+{
+  twopence_ssh_transaction_t *trans;
+  twopence_timeout_t timeout;
+  int rc;
 
-    if (rc == SSH_ERROR) {
-      twopence_debug("ssh_event_dopoll() returns error");
-      return TWOPENCE_INTERNAL_ERROR;
-    }
+  for (trans = handle->transactions.running; trans; trans = trans->next) {
+    if (trans->eof_seen && trans->have_exit_status)
+      trans->done = true;
 
-    /* We do this as the last thing before returning, in order to minimize the
-     * risk of harmful user behavior */
-    twopence_timers_run();
+    if (trans->done && (rc = __twopence_ssh_transaction_get_exit_status(trans)) < 0)
+      __twopence_ssh_transaction_fail(trans, rc);
+  }
 
-  } while (true);
+  if (__twopence_ssh_reap_completed(handle))
+    return 0;
 
-  return 0;
+  twopence_timeout_init(&timeout);
+
+  for (trans = handle->transactions.running; trans; trans = trans->next) {
+    if (!twopence_timeout_update(&timeout, &trans->command_timeout)) {
+      __twopence_ssh_transaction_fail(trans, TWOPENCE_COMMAND_TIMEOUT_ERROR);
+      (void) __twopence_ssh_reap_completed(handle);
+      return 0;
+    }
+  }
+
+  if (deadline)
+    (void) twopence_timeout_update(&timeout, deadline);
+
+  return __twopence_ssh_dopoll(handle, &timeout);
 }
 
 static void
@@ -979,6 +1029,7 @@ __twopence_ssh_command_ssh
     return TWOPENCE_OPEN_SESSION_ERROR;
 
   status_ret->pid = trans->pid;
+  trans->command = cmd;
 
   rc = __twopence_ssh_transaction_open_session(trans, cmd->user);
   if (rc != 0) {
@@ -1393,6 +1444,83 @@ twopence_ssh_wait(struct twopence_target *opaque_handle, int want_pid, twopence_
   return rc;
 }
 
+/*
+ * Asynchronous API: return the result of any command that has completed
+ */
+static int
+twopence_ssh_reap(twopence_target_t *opaque_handle, twopence_completion_t *comp)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+
+  (void) __twopence_ssh_reap_completed(handle);
+
+  trans = __twopence_ssh_get_completed_transaction(handle, 0);
+  if (trans == NULL)
+    return 0;
+
+  comp->id = trans->pid;
+  comp->command = trans->command;
+  comp->status.pid = trans->pid;
+  if (trans->exception < 0) {
+    comp->rc = trans->exception;
+  } else {
+    comp->status.major = trans->status.major;
+    comp->status.minor = trans->status.minor;
+    comp->rc = 0;
+  }
+
+  __twopence_ssh_transaction_free(trans);
+  return 1;
+}
+
+/*
+ * Perform I/O for any number of SSH targets.
+ * Each target has its own libssh event loop, so we cannot wait for all of
+ * them at once. When several of them are busy, we service them in turn,
+ * giving each one a short time slice.
+ */
+#define TWOPENCE_SSH_POLL_SLICE_MSEC	10
+
+static int
+twopence_ssh_poll(twopence_target_t **targets, unsigned int count, const struct timeval *deadline)
+{
+  struct timeval slice;
+  unsigned int i, nbusy = 0;
+  int rc;
+
+  for (i = 0; i < count; ++i) {
+    if (((struct twopence_ssh_target *) targets[i])->transactions.running)
+      nbusy++;
+  }
+
+  if (nbusy > 1) {
+    twopence_loop_clock_update(&slice);
+    slice.tv_usec += 1000 * TWOPENCE_SSH_POLL_SLICE_MSEC / nbusy;
+    if (slice.tv_usec >= 1000000) {
+      slice.tv_sec++;
+      slice.tv_usec -= 1000000;
+    }
+    if (deadline == NULL || timercmp(&slice, deadline, <))
+      deadline = &slice;
+  }
+
+  for (i = 0, nbusy = 0; i < count; ++i) {
+    struct twopence_ssh_target *handle = (struct twopence_ssh_target *) targets[i];
+
+    if (handle->transactions.running == NULL)
+      continue;
+
+    if ((rc = __twopence_ssh_poll_once(handle, deadline)) < 0)
+      return rc;
+
+    if (handle->transactions.running)
+      nbusy++;
+  }
+
+  return nbusy;
+}
+
 static int
 twopence_ssh_chat_send(twopence_target_t *opaque_handle, int pid, twopence_iostream_t *stream)
 {
@@ -1622,4 +1750,6 @@ const struct twopence_plugin twopence_ssh_ops = {
 	.cancel_transactions = twopence_ssh_cancel_transactions,
 	.disconnect = twopence_ssh_disconnect,
 	.end = twopence_ssh_end,
+	.reap = twopence_ssh_reap,
+	.poll = twopence_ssh_poll,
 };
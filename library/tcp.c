@@ -59,18 +59,18 @@ __twopence_tcp_init(struct twopence_tcp_target *handle, const char *server_spec)
 }
 
 /*
- * Open the TCP socket
+ * Resolve the server address. There may be several, e.g. one IPv6
+ * and one IPv4 address; the pipe code connects to them without blocking,
+ * and uses whichever answers first.
  *
- * Returns the file descriptor if successful, or -1 if failed
+ * Returns 0 if successful, or -1 if failed
  */
-static twopence_sock_t *
-__twopence_tcp_open(struct twopence_pipe_target *pipe_handle)
+static int
+__twopence_tcp_resolve(struct twopence_pipe_target *pipe_handle, struct addrinfo **ai_list)
 {
   struct twopence_tcp_target *handle = (struct twopence_tcp_target *) pipe_handle;
   char *copy, *hostname, *portname = NULL;
   struct addrinfo hints;
-  struct addrinfo *ai_list, *ai;
-  int socket_fd = -1;
   int res;
 
   copy = hostname = twopence_strdup(handle->server_spec);
@@ -82,7 +82,7 @@ __twopence_tcp_open(struct twopence_pipe_target *pipe_handle)
       if (*s == '\0') {
         twopence_log_error("tcp: cannot parse \"%s\"", handle->server_spec);
 	free(copy);
-        return NULL;
+        return -1;
       }
     }
     *s++ = '\0';
@@ -98,40 +98,22 @@ __twopence_tcp_open(struct twopence_pipe_target *pipe_handle)
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_socktype = SOCK_STREAM;
-  res = getaddrinfo(hostname, portname, &hints, &ai_list);
+  res = getaddrinfo(hostname, portname, &hints, ai_list);
 
   free(copy);
   copy = hostname = portname = NULL;
 
   if (res != 0) {
     twopence_log_error("tcp: cannot resolve \"%s\": %s", handle->server_spec, gai_strerror(res));
-    return NULL;
+    return -1;
   }
 
   twopence_debug("trying to open connection to %s", handle->server_spec);
-  for (ai = ai_list; ai && socket_fd < 0; ai = ai->ai_next) {
-    socket_fd = socket(ai->ai_family, SOCK_STREAM, 0);
-    if (socket_fd <= 0)
-      break;
-
-    // Open the connection
-    if (connect(socket_fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-      /* Okay, this address didn't work. Try the next one */
-      close(socket_fd);
-      socket_fd = -1;
-    }
-  }
-
-  freeaddrinfo(ai_list);
-  if (socket_fd <= 0)
-    return NULL;
-
-  /* Note, we do not pass O_NONBLOCK here, but we do set O_CLOEXEC */
-  return twopence_sock_new_flags(socket_fd, O_RDWR | O_CLOEXEC);
+  return 0;
 }
 
 const struct twopence_pipe_ops twopence_tcp_link_ops = {
-  .open = __twopence_tcp_open,
+  .resolve = __twopence_tcp_resolve,
 };
 
 ///////////////////////////// Public interface //////////////////////////////////
@@ -170,14 +152,24 @@ const struct twopence_plugin twopence_tcp_ops = {
 	.init = twopence_tcp_init,
 	.set_option = twopence_pipe_set_option,
 	.run_test = twopence_pipe_run_test,
+	.run_batch = twopence_pipe_run_batch,
 	.wait = twopence_pipe_wait,
 	.chat_send = twopence_pipe_chat_send,
 	.chat_recv = twopence_pipe_chat_recv,
 	.inject_file = twopence_pipe_inject_file,
 	.extract_file = twopence_pipe_extract_file,
+	.file_op = twopence_pipe_file_op,
 	.exit_remote = twopence_pipe_exit_remote,
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
 	.end = twopence_pipe_end,
+	.submit_inject = twopence_pipe_submit_inject,
+	.submit_extract = twopence_pipe_submit_extract,
+	.reap = twopence_pipe_reap,
+	.poll = twopence_pipe_poll,
+	.connect = twopence_pipe_connect,
+	.park = twopence_pipe_park,
+	.adopt = twopence_pipe_adopt,
+	.get_compress_stats = twopence_pipe_get_compress_stats,
 };
@@ -33,34 +33,131 @@
 #include "utils.h"
 #include "twopence.h"
 
+/*
+ * Every thread runs its own event loop, and has its own set of timers.
+ * A timer fires in the thread that created it, while that thread is
+ * polling for I/O.
+ *
+ * Active timers are kept in a binary min-heap ordered by expiry time,
+ * so finding the next timer to fire is O(1), and adding or removing
+ * a timer is O(log n). All times are taken from the loop clock, which
+ * is monotonic.
+ *
+ * The timer set holds one reference to each timer that is active,
+ * paused or expired; it is dropped when the timer is cancelled, or
+ * after its callback was invoked.
+ */
+typedef struct twopence_timer_heap {
+	twopence_timer_t **	items;
+	unsigned int		count;
+	unsigned int		size;
+
+	/* Timers that have expired, but whose callbacks have not been
+	 * invoked yet */
+	twopence_timer_t *	expired;
+	twopence_timer_t **	expired_tail;
+} twopence_timer_heap_t;
+
 static unsigned int		__global_timer_id = 1;
-static twopence_timer_list_t	__global_timer_list;
+static __thread twopence_timer_heap_t	__thread_timers;
 
 /*
- * List helper functions
+ * Heap helper functions.
+ * timer->heap_index is the timer's position in the heap plus one, so
+ * that 0 means "not on the heap".
  */
-static inline void
-__twopence_timer_insert(twopence_timer_t **pos, twopence_timer_t *timer)
+static inline bool
+__twopence_timer_before(const twopence_timer_t *a, const twopence_timer_t *b)
 {
-	timer->next = *pos;
-	timer->prev = pos;
-	*pos = timer;
+	return timercmp(&a->expires, &b->expires, <);
 }
 
 static inline void
-__twopence_timer_unlink(twopence_timer_t *timer)
+__twopence_timer_heap_set(twopence_timer_heap_t *heap, unsigned int pos, twopence_timer_t *timer)
 {
-	twopence_timer_t **pos, *next;
+	heap->items[pos] = timer;
+	timer->heap_index = pos + 1;
+}
+
+static void
+__twopence_timer_heap_sift_up(twopence_timer_heap_t *heap, unsigned int pos)
+{
+	twopence_timer_t *timer = heap->items[pos];
 
-	next = timer->next;
-	if ((pos = timer->prev) != NULL) {
-		*pos = next;
-		if (next)
-			next->prev = pos;
+	while (pos > 0) {
+		unsigned int parent = (pos - 1) / 2;
 
-		timer->prev = NULL;
-		timer->next = NULL;
+		if (!__twopence_timer_before(timer, heap->items[parent]))
+			break;
+		__twopence_timer_heap_set(heap, pos, heap->items[parent]);
+		pos = parent;
 	}
+	__twopence_timer_heap_set(heap, pos, timer);
+}
+
+static void
+__twopence_timer_heap_sift_down(twopence_timer_heap_t *heap, unsigned int pos)
+{
+	twopence_timer_t *timer = heap->items[pos];
+
+	while (true) {
+		unsigned int child = 2 * pos + 1;
+
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count
+		 && __twopence_timer_before(heap->items[child + 1], heap->items[child]))
+			child++;
+		if (!__twopence_timer_before(heap->items[child], timer))
+			break;
+		__twopence_timer_heap_set(heap, pos, heap->items[child]);
+		pos = child;
+	}
+	__twopence_timer_heap_set(heap, pos, timer);
+}
+
+static void
+__twopence_timer_heap_insert(twopence_timer_heap_t *heap, twopence_timer_t *timer)
+{
+	assert(timer->heap_index == 0);
+	assert(timerisset(&timer->expires));
+
+	if (heap->count >= heap->size) {
+		heap->size = heap->size? 2 * heap->size : 16;
+		heap->items = twopence_realloc(heap->items, heap->size * sizeof(heap->items[0]));
+	}
+
+	heap->items[heap->count++] = timer;
+	__twopence_timer_heap_sift_up(heap, heap->count - 1);
+}
+
+static void
+__twopence_timer_heap_remove(twopence_timer_heap_t *heap, twopence_timer_t *timer)
+{
+	unsigned int pos;
+
+	if (timer->heap_index == 0)
+		return;
+
+	pos = timer->heap_index - 1;
+	assert(pos < heap->count && heap->items[pos] == timer);
+	timer->heap_index = 0;
+
+	if (pos == --(heap->count))
+		return;
+
+	/* Move the last timer into the hole, and restore the heap order */
+	heap->items[pos] = heap->items[heap->count];
+	if (pos > 0 && __twopence_timer_before(heap->items[pos], heap->items[(pos - 1) / 2]))
+		__twopence_timer_heap_sift_up(heap, pos);
+	else
+		__twopence_timer_heap_sift_down(heap, pos);
+}
+
+static inline twopence_timer_t *
+__twopence_timer_heap_top(const twopence_timer_heap_t *heap)
+{
+	return heap->count? heap->items[0] : NULL;
 }
 
 
@@ -72,15 +169,15 @@ twopence_timer_create(unsigned long timeout_ms, twopence_timer_t **timer_ret)
 
 	timer = twopence_calloc(1, sizeof(*timer));
 	timer->refcount = 1;
-	timer->id = __global_timer_id++;
+	timer->id = __sync_fetch_and_add(&__global_timer_id, 1);
 
-	gettimeofday(&now, NULL);
+	twopence_loop_clock_update(&now);
 	timer->runtime.tv_sec = timeout_ms / 1000;
 	timer->runtime.tv_usec = (timeout_ms % 1000) * 1000;
 	timeradd(&now, &timer->runtime, &timer->expires);
 
 	timer->state = TWOPENCE_TIMER_STATE_ACTIVE;
-	twopence_timer_list_insert(&__global_timer_list, timer);
+	__twopence_timer_heap_insert(&__thread_timers, timer);
 
 	twopence_debug("Created timer %u", timer->id);
 	*timer_ret = timer;
@@ -98,7 +195,7 @@ twopence_timer_set_callback(twopence_timer_t *timer, void (*callback)(twopence_t
 static void
 __twopence_timer_free(twopence_timer_t *timer)
 {
-	assert(timer->prev == NULL);
+	assert(timer->heap_index == 0);
 	free(timer);
 }
 
@@ -121,10 +218,15 @@ void
 twopence_timer_cancel(twopence_timer_t *timer)
 {
 	if (timer->state == TWOPENCE_TIMER_STATE_ACTIVE
-	 || timer->state == TWOPENCE_TIMER_STATE_PAUSED
-	 || timer->state == TWOPENCE_TIMER_STATE_CANCELLED) {
+	 || timer->state == TWOPENCE_TIMER_STATE_PAUSED) {
+		timer->state = TWOPENCE_TIMER_STATE_CANCELLED;
+		__twopence_timer_heap_remove(&__thread_timers, timer);
+		twopence_timer_release(timer);
+	} else
+	if (timer->state == TWOPENCE_TIMER_STATE_EXPIRED) {
+		/* Still on the list of expired timers, which holds on to it.
+		 * Make sure the callback is not invoked. */
 		timer->state = TWOPENCE_TIMER_STATE_CANCELLED;
-		__twopence_timer_unlink(timer);
 	}
 }
 
@@ -138,11 +240,12 @@ twopence_timer_pause(twopence_timer_t *timer)
 	if (timer->state == TWOPENCE_TIMER_STATE_ACTIVE) {
 		struct timeval now;
 
-		gettimeofday(&now, NULL);
+		twopence_loop_clock_update(&now);
 		if (timercmp(&now, &timer->expires, <))
 			timersub(&timer->expires, &now, &timer->runtime);
 		else
 			timerclear(&timer->runtime);
+		__twopence_timer_heap_remove(&__thread_timers, timer);
 		timerclear(&timer->expires);
 
 		timer->state = TWOPENCE_TIMER_STATE_PAUSED;
@@ -155,9 +258,10 @@ twopence_timer_unpause(twopence_timer_t *timer)
 	if (timer->state == TWOPENCE_TIMER_STATE_PAUSED) {
 		struct timeval now;
 
-		gettimeofday(&now, NULL);
+		twopence_loop_clock_update(&now);
 		timeradd(&timer->runtime, &now, &timer->expires);
 		timer->state = TWOPENCE_TIMER_STATE_ACTIVE;
+		__twopence_timer_heap_insert(&__thread_timers, timer);
 	}
 }
 
@@ -168,7 +272,7 @@ twopence_timer_remaining(const twopence_timer_t *timer)
 
 	switch (timer->state) {
 	case TWOPENCE_TIMER_STATE_ACTIVE:
-		gettimeofday(&now, NULL);
+		twopence_loop_clock_update(&now);
 		if (timercmp(&now, &timer->expires, <)) {
 			timersub(&timer->expires, &now, &delta);
 			return 1000 * delta.tv_sec + delta.tv_usec / 1000;
@@ -181,130 +285,56 @@ twopence_timer_remaining(const twopence_timer_t *timer)
 	}
 }
 
-void
-twopence_timer_kill(twopence_timer_t *timer)
-{
-	timer->state = TWOPENCE_TIMER_STATE_DEAD;
-	timer->callback = NULL;
-
-	__twopence_timer_unlink(timer);
-	twopence_timer_release(timer);
-}
-
 static void
-__twopence_timer_mark_expired(twopence_timer_t *timer)
+__twopence_timer_mark_expired(twopence_timer_heap_t *heap, twopence_timer_t *timer)
 {
 	twopence_debug("Timer %u expired", timer->id);
+	__twopence_timer_heap_remove(heap, timer);
 	timer->state = TWOPENCE_TIMER_STATE_EXPIRED;
 	timerclear(&timer->expires);
 
 	/* Do /not/ invoke the callback yet - we may be deep inside
 	 * some transport code, which may or may not be re-entrant.
-	 * We do this at a later point, from twopence_timer_list_reap()
+	 * We do this at a later point, from twopence_timers_run()
 	 */
-}
-
-void
-twopence_timer_list_insert(twopence_timer_list_t *list, twopence_timer_t *timer)
-{
-	assert(timerisset(&timer->expires));
-	assert(timer->prev == NULL);
-	__twopence_timer_insert(&list->head, timer);
-}
-
-void
-twopence_timer_list_move(twopence_timer_list_t *list, twopence_timer_t *timer)
-{
-	__twopence_timer_unlink(timer);
-	__twopence_timer_insert(&list->head, timer);
+	if (heap->expired_tail == NULL)
+		heap->expired_tail = &heap->expired;
+	timer->next = NULL;
+	*heap->expired_tail = timer;
+	heap->expired_tail = &timer->next;
 }
 
 /*
- * Walk the list of timers, and update the twopence_timeout_t to reflect the
- * point in time when the next timer expires.
- * If a timer has already expired, this will result in a timeout of 0,
- * and the respective time is moved to state TWOPENCE_TIMER_STATE_EXPIRED.
+ * Move all timers that expired at tmo->now to the list of expired
+ * timers, and update the twopence_timeout_t to reflect the point in
+ * time when the next timer expires.
+ * If a timer has expired and is waiting for its callback to be run,
+ * this will result in a timeout of 0.
  */
 void
-twopence_timer_list_update_timeout(twopence_timer_list_t *list, twopence_timeout_t *tmo)
-{
-	twopence_timer_t *t;
-
-	for (t = list->head; t; t = t->next) {
-		/* If the timer's expiry time is in the past,
-		 * twopence_timeout_update() will return false
-		 * and set tmo->expired = true;
-		 */
-		if (t->state == TWOPENCE_TIMER_STATE_ACTIVE
-		 && !twopence_timeout_update(tmo, &t->expires))
-			__twopence_timer_mark_expired(t);
-	}
-}
-
-void
-twopence_timer_list_expire(twopence_timer_list_t *list)
-{
-	twopence_timeout_t tmo;
-
-	twopence_timeout_init(&tmo);
-	twopence_timer_list_update_timeout(list, &tmo);
-}
-
-void
-twopence_timer_list_reap(twopence_timer_list_t *list, twopence_timer_list_t *expired)
-{
-	twopence_timer_t *t, *next;
-
-	for (t = list->head; t; t = next) {
-		next = t->next;
-
-		if (t->state == TWOPENCE_TIMER_STATE_EXPIRED
-		 || t->state == TWOPENCE_TIMER_STATE_CANCELLED) {
-			twopence_debug("Reaping timer %u (state %d)", t->id, t->state);
-			twopence_timer_list_move(expired, t);
-		}
-	}
-}
-
-void
-twopence_timer_list_invoke(twopence_timer_list_t *list)
-{
-	twopence_timer_t *t;
-
-	while ((t = list->head) != NULL) {
-		if (t->state == TWOPENCE_TIMER_STATE_EXPIRED && t->callback) {
-			twopence_debug("Invoking timer %u", t->id);
-			t->callback(t, t->user_data);
-		}
-
-		twopence_timer_kill(t);
-	}
-}
-
-
-void
-twopence_timer_list_destroy(twopence_timer_list_t *list)
+twopence_timers_update_timeout(twopence_timeout_t *tmo)
 {
+	twopence_timer_heap_t *heap = &__thread_timers;
 	twopence_timer_t *t;
 
-	while ((t = list->head) != NULL)
-		twopence_timer_kill(t);
-}
+	while ((t = __twopence_timer_heap_top(heap)) != NULL
+	    && !timercmp(&tmo->now, &t->expires, <))
+		__twopence_timer_mark_expired(heap, t);
 
-void
-twopence_timers_update_timeout(twopence_timeout_t *tmo)
-{
-	twopence_timer_list_update_timeout(&__global_timer_list, tmo);
+	if (heap->expired)
+		(void) twopence_timeout_update(tmo, &tmo->now);
+	if (t != NULL)
+		(void) twopence_timeout_update(tmo, &t->expires);
 }
 
 void
 twopence_timers_run(void)
 {
-	twopence_timer_list_t expired = { .head = NULL };
+	twopence_timer_heap_t *heap = &__thread_timers;
 	twopence_timeout_t timeout;
+	twopence_timer_t *t;
 
-	/* Do another pass over the list, and catch timers that have
-	 * expired since the last inspection.
+	/* Catch timers that have expired since the last inspection.
 	 *
 	 * We do this because the usual approach is
 	 *
@@ -316,9 +346,26 @@ twopence_timers_run(void)
 	 * inside poll()
 	 */
 	twopence_timeout_init(&timeout);
-	twopence_timer_list_update_timeout(&__global_timer_list, &timeout);
+	twopence_timers_update_timeout(&timeout);
+
+	/* Callbacks may create or cancel timers, so take the whole list
+	 * before invoking any of them. */
+	t = heap->expired;
+	heap->expired = NULL;
+	heap->expired_tail = NULL;
+
+	while (t != NULL) {
+		twopence_timer_t *next = t->next;
 
-	twopence_timer_list_reap(&__global_timer_list, &expired);
-	twopence_timer_list_invoke(&expired);
-	twopence_timer_list_destroy(&expired);
+		t->next = NULL;
+		if (t->state == TWOPENCE_TIMER_STATE_EXPIRED && t->callback) {
+			twopence_debug("Invoking timer %u", t->id);
+			t->callback(t, t->user_data);
+		}
+
+		t->state = TWOPENCE_TIMER_STATE_DEAD;
+		t->callback = NULL;
+		twopence_timer_release(t);
+		t = next;
+	}
 }
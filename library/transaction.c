@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h> /* for htons */
 
 #include <pwd.h>
@@ -43,6 +44,7 @@
 
 #include "protocol.h"
 #include "transaction.h"
+#include "fileio.h"
 
 
 struct twopence_trans_channel {
@@ -50,12 +52,53 @@ struct twopence_trans_channel {
 
 	uint16_t		id;		/* The channel ID is a 16bit number; usually 0, 1, 2 for commands */
 	const char *		name;		/* The channel'S name for debugging purposes */
+	char			namebuf[16];	/* Default name, if none was set */
 
 	bool			sync;		/* if true, all writes are fully synchronous */
 
 	twopence_sock_t *	socket;
 	twopence_iostream_t *	stream;
 
+	/* For source sockets: the size of the receive buffers we post.
+	 * This is the max packet size negotiated for the connection. */
+	unsigned int		buffer_size;
+
+	/* Compression state, if the connection uses compression */
+	twopence_protocol_codec_t *codec;
+
+	/* Per-channel flow control. For a source, this is the amount of data
+	 * we may still send. For a sink, it's the amount of data the peer may
+	 * still send before it has to wait for us to grant more credit. */
+	struct {
+	    bool		enabled;
+	    unsigned int	credit;
+	} flow;
+
+	/* Timestamps of command output. For a source, the number of data
+	 * packets sent so far. For a sink, the number of data packets
+	 * received, the CHAN_STAMP for the next one, and whether the
+	 * last one ended in the middle of a line. */
+	struct {
+	    unsigned int	seq;
+	    twopence_timestamp_t next;
+	    bool		mid_line;
+	} stamp;
+
+	/* Regular file sent with sendfile(), or pipe spliced to the transport.
+	 * See twopence_transaction_attach_local_source_{file,pipe} */
+	struct {
+	    int			fd;
+	    bool		pipe;
+	    bool		eof;
+	    off_t		offset;
+	    off_t		size;
+	    struct pollfd *	poll_data;
+	} file;
+
+	/* Regular file read or written by the file I/O threads.
+	 * See twopence_transaction_attach_local_{source,sink}_file */
+	twopence_fileio_t *	fileio;
+
 	/* This is needed by the client side "inject" code:
 	 * Before we start sending the actual file data, we want confirmation from
 	 * the server that it was able to open the destination file.
@@ -72,6 +115,9 @@ struct twopence_trans_channel {
 
 static void	twopence_transaction_channel_trace_io_eof(twopence_transaction_t *trans);
 
+static twopence_slab_t	__twopence_transaction_slab = TWOPENCE_SLAB_INIT("transaction", sizeof(twopence_transaction_t), 64);
+static twopence_slab_t	__twopence_channel_slab = TWOPENCE_SLAB_INIT("channel", sizeof(twopence_trans_channel_t), 256);
+
 /*
  * Transaction channel primitives
  */
@@ -83,8 +129,9 @@ twopence_transaction_channel_from_fd(int fd, int flags)
 
 	sock = twopence_sock_new_flags(fd, flags);
 
-	sink = twopence_calloc(1, sizeof(*sink));
+	sink = twopence_slab_zalloc(&__twopence_channel_slab);
 	sink->socket = sock;
+	sink->file.fd = -1;
 
 	return sink;
 }
@@ -94,8 +141,9 @@ twopence_transaction_channel_from_stream(twopence_iostream_t *stream, int flags)
 {
 	twopence_trans_channel_t *sink;
 
-	sink = twopence_calloc(1, sizeof(*sink));
+	sink = twopence_slab_zalloc(&__twopence_channel_slab);
 	sink->stream = stream;
+	sink->file.fd = -1;
 
 	return sink;
 }
@@ -107,24 +155,24 @@ twopence_transaction_channel_set_name(twopence_trans_channel_t *channel, const c
 }
 
 static const char *
-__twopence_transaction_channel_name(uint16_t id)
+__twopence_transaction_channel_name(uint16_t id, char *namebuf, size_t size)
 {
-	static char namebuf[16];
-
 	if (id == TWOPENCE_TRANSACTION_CHANNEL_ID_ALL)
 		return "all";
 
-	snprintf(namebuf, sizeof(namebuf), "chan%u", id);
+	snprintf(namebuf, size, "chan%u", id);
 	return namebuf;
 }
 
 const char *
 twopence_transaction_channel_name(const twopence_trans_channel_t *channel)
 {
+	twopence_trans_channel_t *ch = (twopence_trans_channel_t *) channel;
+
 	if (channel->name)
 		return channel->name;
 
-	return __twopence_transaction_channel_name(channel->id);
+	return __twopence_transaction_channel_name(channel->id, ch->namebuf, sizeof(ch->namebuf));
 }
 
 static void
@@ -134,10 +182,18 @@ twopence_transaction_channel_free(twopence_trans_channel_t *sink)
 	if (sink->socket)
 		twopence_sock_free(sink->socket);
 	sink->socket = NULL;
+	if (sink->file.fd >= 0) {
+		twopence_epoll_forget_fd(sink->file.fd);
+		close(sink->file.fd);
+	}
+	if (sink->fileio)
+		twopence_fileio_free(sink->fileio);
+	if (sink->codec)
+		twopence_protocol_codec_free(sink->codec);
 
 	/* Do NOT free the iostream */
 
-	free(sink);
+	twopence_slab_free(&__twopence_channel_slab, sink);
 }
 
 bool
@@ -149,6 +205,12 @@ twopence_transaction_channel_is_read_eof(const twopence_trans_channel_t *channel
 		return twopence_sock_is_read_eof(sock);
 	if (channel->stream)
 		return twopence_iostream_eof(channel->stream);
+	if (channel->fileio)
+		return channel->file.offset >= channel->file.size && twopence_fileio_pending(channel->fileio) == 0;
+	if (channel->file.pipe)
+		return channel->file.eof;
+	if (channel->file.fd >= 0)
+		return channel->file.offset >= channel->file.size;
 	return false;
 }
 
@@ -170,19 +232,49 @@ twopence_transaction_channel_set_callback_write_eof(twopence_trans_channel_t *ch
 	channel->callbacks.write_eof = fn;
 }
 
+/*
+ * Rebuild the table of the channels with small ids. If there are several
+ * channels with the same id, the one added last wins, just like
+ * a linear search of the list would find it first.
+ */
 static void
+twopence_transaction_channel_index(twopence_trans_channel_t **index, twopence_trans_channel_t *list)
+{
+	twopence_trans_channel_t *channel;
+
+	memset(index, 0, TWOPENCE_TRANSACTION_FAST_CHANNELS * sizeof(index[0]));
+	for (channel = list; channel; channel = channel->next) {
+		if (channel->id < TWOPENCE_TRANSACTION_FAST_CHANNELS && index[channel->id] == NULL)
+			index[channel->id] = channel;
+	}
+}
+
+static inline void
+twopence_transaction_channel_reindex(twopence_transaction_t *trans)
+{
+	twopence_transaction_channel_index(trans->sink_by_id, trans->local_sink);
+	twopence_transaction_channel_index(trans->source_by_id, trans->local_source);
+}
+
+/*
+ * Returns true if any channels were removed
+ */
+static bool
 twopence_transaction_channel_list_purge(twopence_trans_channel_t **list)
 {
 	twopence_trans_channel_t *channel;
+	bool removed = false;
 
 	while ((channel = *list) != NULL) {
 		if (channel->socket && twopence_sock_is_dead(channel->socket)) {
 			*list = channel->next;
 			twopence_transaction_channel_free(channel);
+			removed = true;
 		} else {
 			list = &channel->next;
 		}
 	}
+	return removed;
 }
 
 static void
@@ -200,6 +292,29 @@ twopence_transaction_channel_list_close(twopence_trans_channel_t **list, uint16_
 	}
 }
 
+static void
+twopence_transaction_channel_list_add(twopence_transaction_t *trans, twopence_trans_channel_t **list, twopence_trans_channel_t *channel)
+{
+	if (trans->ps.flow_control) {
+		channel->flow.enabled = true;
+		channel->flow.credit = twopence_protocol_channel_window(&trans->ps);
+	}
+
+	channel->next = *list;
+	*list = channel;
+
+	if (channel->socket)
+		twopence_sock_set_owner(channel->socket, &trans->ready);
+	twopence_ready_mark(&trans->ready);
+
+	if (channel->id < TWOPENCE_TRANSACTION_FAST_CHANNELS) {
+		if (list == &trans->local_sink)
+			trans->sink_by_id[channel->id] = channel;
+		else if (list == &trans->local_source)
+			trans->source_by_id[channel->id] = channel;
+	}
+}
+
 /*
  * twopence transactions as used by our own on-the-wire protocol
  */
@@ -208,12 +323,19 @@ twopence_transaction_new(twopence_sock_t *transport, unsigned int type, const tw
 {
 	twopence_transaction_t *trans;
 
-	trans = twopence_calloc(1, sizeof(*trans));
+	trans = twopence_slab_zalloc(&__twopence_transaction_slab);
 	trans->ps = *ps;
 	trans->id = ps->xid;
 	trans->type = type;
 	trans->socket = transport;
 
+	twopence_ready_init(&trans->ready, trans);
+	twopence_ready_init(&trans->xmit_wait, trans);
+	twopence_pollgroup_init(&trans->poll, &trans->ready);
+
+	snprintf(trans->desc, sizeof(trans->desc), "%s/%u",
+			twopence_protocol_packet_type_to_string(trans->type), trans->ps.xid);
+
 	twopence_debug("%s: created new transaction", twopence_transaction_describe(trans));
 	return trans;
 }
@@ -225,34 +347,83 @@ twopence_transaction_free(twopence_transaction_t *trans)
 
 	twopence_transaction_channel_trace_io_eof(trans);
 
+	if (trans->client.timer) {
+		twopence_timer_cancel(trans->client.timer);
+		trans->client.timer = NULL;
+	}
+
+	twopence_ready_detach(&trans->ready);
+	twopence_ready_detach(&trans->xmit_wait);
+	twopence_pollgroup_destroy(&trans->poll);
+
 	/* Do not free trans->socket, we don't own it */
 
 	twopence_transaction_channel_list_close(&trans->local_sink, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
 	twopence_transaction_channel_list_close(&trans->local_source, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
 
+	if (trans->perf_fds) {
+		unsigned int i;
+
+		for (i = 0; i < __TWOPENCE_PERF_MAX; ++i) {
+			if (trans->perf_fds[i] >= 0)
+				close(trans->perf_fds[i]);
+		}
+		free(trans->perf_fds);
+	}
+
 	memset(trans, 0, sizeof(*trans));
-	free(trans);
+	twopence_slab_free(&__twopence_transaction_slab, trans);
 }
 
 const char *
 twopence_transaction_describe(const twopence_transaction_t *trans)
 {
-	static char descbuf[64];
+	return trans->desc;
+}
 
-	snprintf(descbuf, sizeof(descbuf), "%s/%u",
-			twopence_protocol_packet_type_to_string(trans->type), trans->ps.xid);
-	return descbuf;
+/*
+ * The timeout of a transaction is a timer on the heap of the thread
+ * running its event loop, so that the loop doesn't have to check the
+ * deadline of every transaction on every round.
+ */
+static void
+twopence_transaction_timeout(twopence_timer_t *timer, void *user_data)
+{
+	twopence_transaction_t *trans = user_data;
+
+	trans->client.timer = NULL;
+	twopence_transaction_set_error(trans, TWOPENCE_COMMAND_TIMEOUT_ERROR);
 }
 
 void
 twopence_transaction_set_timeout(twopence_transaction_t *trans, long timeout)
 {
+	if (trans->client.timer) {
+		twopence_timer_cancel(trans->client.timer);
+		trans->client.timer = NULL;
+	}
+
 	if (timeout > 0) {
-		gettimeofday(&trans->client.deadline, NULL);
+		twopence_loop_clock_update(&trans->client.deadline);
 		trans->client.deadline.tv_sec += timeout;
+
+		if (twopence_timer_create(timeout * 1000, &trans->client.timer) < 0)
+			return;
+		twopence_timer_set_callback(trans->client.timer, twopence_transaction_timeout, trans);
 	}
 }
 
+/*
+ * Tell the transaction which command's output it receives. This is
+ * needed for timestamping the output, and for timing it.
+ */
+void
+twopence_transaction_set_command(twopence_transaction_t *trans, twopence_command_t *cmd)
+{
+	trans->client.command = cmd;
+	trans->client.start_nsec = twopence_monotonic_nsec();
+}
+
 bool
 twopence_transaction_update_timeout(const twopence_transaction_t *trans, twopence_timeout_t *tmo)
 {
@@ -287,6 +458,7 @@ twopence_transaction_set_error(twopence_transaction_t *trans, int rc)
 	twopence_debug("%s: set client side error to %d", twopence_transaction_describe(trans), rc);
 	trans->client.exception = rc;
 	trans->done = true;
+	twopence_ready_mark(&trans->ready);
 }
 
 unsigned int
@@ -302,15 +474,32 @@ twopence_transaction_num_channels(const twopence_transaction_t *trans)
 	return count;
 }
 
+/*
+ * Queue a request packet to the socket. This does not wait for the packet
+ * to go out; the event loop takes care of that, so that submitting a
+ * request never blocks on a slow or congested transport.
+ * Data sent on the transaction's channels is queued behind it, and can
+ * never overtake the request.
+ */
+static int
+__twopence_transaction_send_request(twopence_transaction_t *trans, twopence_buf_t *bp)
+{
+	if (twopence_sock_is_write_eof(trans->socket)) {
+		twopence_buf_free(bp);
+		return TWOPENCE_SEND_COMMAND_ERROR;
+	}
+
+	twopence_sock_queue_xmit(trans->socket, bp);
+	return 0;
+}
+
 int
 twopence_transaction_send_extract(twopence_transaction_t *trans, const twopence_file_xfer_t *xfer)
 {
 	twopence_buf_t *bp;
 
 	bp = twopence_protocol_build_extract_packet(&trans->ps, xfer);
-	if (twopence_sock_xmit(trans->socket, bp) < 0)
-		return TWOPENCE_SEND_COMMAND_ERROR;
-	return 0;
+	return __twopence_transaction_send_request(trans, bp);
 }
 
 int
@@ -319,9 +508,7 @@ twopence_transaction_send_inject(twopence_transaction_t *trans, const twopence_f
 	twopence_buf_t *bp;
 
 	bp = twopence_protocol_build_inject_packet(&trans->ps, xfer);
-	if (twopence_sock_xmit(trans->socket, bp) < 0)
-		return TWOPENCE_SEND_COMMAND_ERROR;
-	return 0;
+	return __twopence_transaction_send_request(trans, bp);
 }
 
 int
@@ -330,9 +517,39 @@ twopence_transaction_send_command(twopence_transaction_t *trans, const twopence_
 	twopence_buf_t *bp;
 
 	bp = twopence_protocol_build_command_packet(&trans->ps, cmd);
-	if (twopence_sock_xmit(trans->socket, bp) < 0)
+	return __twopence_transaction_send_request(trans, bp);
+}
+
+/*
+ * Send a BATCH request containing as many commands of @batch as fit into
+ * a single packet, starting with command @first.
+ * Returns the number of commands sent, or a negative error code.
+ */
+int
+twopence_transaction_send_batch(twopence_transaction_t *trans, const twopence_batch_t *batch, unsigned int first)
+{
+	twopence_buf_t *bp;
+	unsigned int count;
+
+	bp = twopence_protocol_build_batch_packet(&trans->ps, batch, first, &count);
+	if (bp == NULL) {
+		twopence_log_error("batch command %u is too large to send", first);
+		return TWOPENCE_PARAMETER_ERROR;
+	}
+	if (__twopence_transaction_send_request(trans, bp) < 0)
 		return TWOPENCE_SEND_COMMAND_ERROR;
-	return 0;
+	return count;
+}
+
+int
+twopence_transaction_send_file_op(twopence_transaction_t *trans, const twopence_file_op_t *op)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_build_file_op_packet(&trans->ps, op);
+	if (bp == NULL)
+		return TWOPENCE_PARAMETER_ERROR;
+	return __twopence_transaction_send_request(trans, bp);
 }
 
 int
@@ -341,7 +558,7 @@ twopence_transaction_send_interrupt(twopence_transaction_t *trans)
 	twopence_buf_t *bp;
 
 	bp = twopence_protocol_build_simple_packet_ps(&trans->ps, TWOPENCE_PROTO_TYPE_INTR);
-	if (twopence_sock_xmit(trans->socket, bp) < 0)
+	if (twopence_sock_xmit_ctrl(trans->socket, bp) < 0)
 		return TWOPENCE_SEND_COMMAND_ERROR;
 	return 0;
 }
@@ -357,8 +574,7 @@ twopence_transaction_attach_local_sink(twopence_transaction_t *trans, uint16_t i
 	sink = twopence_transaction_channel_from_fd(fd, O_WRONLY);
 	sink->id = id;
 
-	sink->next = trans->local_sink;
-	trans->local_sink = sink;
+	twopence_transaction_channel_list_add(trans, &trans->local_sink, sink);
 	return sink;
 }
 
@@ -378,16 +594,49 @@ twopence_transaction_attach_local_sink_stream(twopence_transaction_t *trans, uin
 	sink = twopence_transaction_channel_from_stream(stream, O_WRONLY);
 	sink->id = id;
 
-	sink->next = trans->local_sink;
-	trans->local_sink = sink;
+	twopence_transaction_channel_list_add(trans, &trans->local_sink, sink);
+	return sink;
+}
+
+/*
+ * Attach a regular file as local sink. If file I/O threads are enabled,
+ * writing to it is left to them, so that a slow disk does not hold up
+ * the event loop.
+ *
+ * The writes queued for the threads are bounded by the credit we grant
+ * the peer. Peers without flow control send as fast as they can, so
+ * for them, we write to the file from the event loop, as before.
+ */
+twopence_trans_channel_t *
+twopence_transaction_attach_local_sink_file(twopence_transaction_t *trans, uint16_t id, int fd)
+{
+	twopence_trans_channel_t *sink;
+	twopence_fileio_t *io;
+
+	if (!trans->ps.flow_control
+	 || !twopence_fileio_enabled()
+	 || (io = twopence_fileio_new(fd)) == NULL)
+		return twopence_transaction_attach_local_sink(trans, id, fd);
+
+	sink = twopence_slab_zalloc(&__twopence_channel_slab);
+	sink->id = id;
+	sink->file.fd = -1;
+	sink->fileio = io;
+
+	twopence_transaction_channel_list_add(trans, &trans->local_sink, sink);
 	return sink;
 }
 
 void
 twopence_transaction_close_sink(twopence_transaction_t *trans, uint16_t id)
 {
-	twopence_debug("%s: close sink %s\n", twopence_transaction_describe(trans), __twopence_transaction_channel_name(id));
+	char namebuf[16];
+
+	twopence_debug("%s: close sink %s\n", twopence_transaction_describe(trans),
+			__twopence_transaction_channel_name(id, namebuf, sizeof(namebuf)));
 	twopence_transaction_channel_list_close(&trans->local_sink, id);
+	twopence_transaction_channel_reindex(trans);
+	twopence_ready_mark(&trans->ready);
 }
 
 twopence_trans_channel_t *
@@ -400,9 +649,9 @@ twopence_transaction_attach_local_source(twopence_transaction_t *trans, uint16_t
 
 	source = twopence_transaction_channel_from_fd(fd, O_RDONLY);
 	source->id = channel_id;
+	source->buffer_size = twopence_protocol_max_packet(&trans->ps);
 
-	source->next = trans->local_source;
-	trans->local_source = source;
+	twopence_transaction_channel_list_add(trans, &trans->local_source, source);
 	return source;
 }
 
@@ -422,16 +671,83 @@ twopence_transaction_attach_local_source_stream(twopence_transaction_t *trans, u
 	source = twopence_transaction_channel_from_stream(stream, O_RDONLY);
 	source->id = id;
 
-	source->next = trans->local_source;
-	trans->local_source = source;
+	twopence_transaction_channel_list_add(trans, &trans->local_source, source);
+	return source;
+}
+
+/*
+ * Attach a regular file as local source. Rather than reading it into
+ * our buffers, we queue file regions to the transport socket, which
+ * sends them using sendfile().
+ *
+ * sendfile() blocks when the data is not in the page cache, though.
+ * If file I/O threads are enabled, we have them read the file instead.
+ */
+twopence_trans_channel_t *
+twopence_transaction_attach_local_source_file(twopence_transaction_t *trans, uint16_t channel_id, int fd, off_t size)
+{
+	twopence_trans_channel_t *source;
+	twopence_fileio_t *io = NULL;
+
+	if (size && twopence_fileio_enabled())
+		io = twopence_fileio_new(fd);
+
+	/* Data that is compressed has to pass through our buffers anyway,
+	 * and so does data we may have to retransmit after a reconnect */
+	if (io == NULL && (trans->ps.compress || trans->ps.resume))
+		return twopence_transaction_attach_local_source(trans, channel_id, fd);
+
+	source = twopence_slab_zalloc(&__twopence_channel_slab);
+	source->id = channel_id;
+	source->file.size = size;
+	if (io) {
+		source->file.fd = -1;
+		source->fileio = io;
+	} else {
+		source->file.fd = fd;
+	}
+
+	twopence_transaction_channel_list_add(trans, &trans->local_source, source);
+	return source;
+}
+
+/*
+ * Attach a pipe (such as the stdout of a command) as local source.
+ * Data is moved from the pipe to the transport socket using splice(),
+ * without passing through our buffers.
+ */
+twopence_trans_channel_t *
+twopence_transaction_attach_local_source_pipe(twopence_transaction_t *trans, uint16_t channel_id, int fd)
+{
+	twopence_trans_channel_t *source;
+	int f;
+
+	if (trans->ps.compress || trans->ps.resume)
+		return twopence_transaction_attach_local_source(trans, channel_id, fd);
+
+	/* Do not clobber the other file status flags of the descriptor */
+	if ((f = fcntl(fd, F_GETFL)) < 0
+	 || fcntl(fd, F_SETFL, f | O_NONBLOCK) < 0) {
+		twopence_log_error("%s: unable to make fd %d non-blocking: %m",
+				twopence_transaction_describe(trans), fd);
+		return NULL;
+	}
+
+	source = twopence_transaction_attach_local_source_file(trans, channel_id, fd, 0);
+	source->file.pipe = true;
 	return source;
 }
 
 void
 twopence_transaction_close_source(twopence_transaction_t *trans, uint16_t id)
 {
-	twopence_debug("%s: close source %s\n", twopence_transaction_describe(trans), __twopence_transaction_channel_name(id));
+	char namebuf[16];
+
+	twopence_debug("%s: close source %s\n", twopence_transaction_describe(trans),
+			__twopence_transaction_channel_name(id, namebuf, sizeof(namebuf)));
 	twopence_transaction_channel_list_close(&trans->local_source, id);
+	twopence_transaction_channel_reindex(trans);
+	twopence_ready_mark(&trans->ready);
 }
 
 /*
@@ -448,6 +764,10 @@ twopence_transaction_channel_write_data(twopence_transaction_t *trans, twopence_
 	twopence_sock_t *sock;
 
 	twopence_debug("About to write %u bytes of data to local sink\n", count);
+	if (sink->fileio) {
+		twopence_fileio_write(sink->fileio, twopence_buf_clone(payload));
+		twopence_buf_advance_head(payload, count);
+	} else
 	if ((sock = sink->socket) != NULL) {
 		if (twopence_sock_xmit_shared(sock, payload) < 0)
 			return false;
@@ -461,6 +781,111 @@ twopence_transaction_channel_write_data(twopence_transaction_t *trans, twopence_
 	return true;
 }
 
+/*
+ * Write a chunk of command output to the sink, prefixing every
+ * line with the time elapsed since the command was started.
+ */
+static bool
+twopence_transaction_channel_write_lines(twopence_transaction_t *trans, twopence_trans_channel_t *sink, twopence_buf_t *payload,
+		const twopence_timestamp_t *stamp)
+{
+	unsigned long long nsec = stamp->valid? stamp->elapsed_nsec : stamp->received_nsec;
+	const char *data = twopence_buf_head(payload);
+	unsigned int count = twopence_buf_count(payload);
+	unsigned int i, nlines = 1;
+	twopence_buf_t *bp;
+	char prefix[32];
+	int plen;
+	bool ok;
+
+	plen = snprintf(prefix, sizeof(prefix), "[%5llu.%06llu] ",
+			nsec / 1000000000ULL, (nsec / 1000ULL) % 1000000ULL);
+
+	for (i = 0; i < count; ++i) {
+		if (data[i] == '\n')
+			nlines++;
+	}
+
+	bp = twopence_buf_new(count + nlines * plen);
+	while (count) {
+		const char *nl;
+		unsigned int len = count;
+
+		if (!sink->stamp.mid_line)
+			twopence_buf_append(bp, prefix, plen);
+
+		if ((nl = memchr(data, '\n', count)) != NULL)
+			len = nl + 1 - data;
+		twopence_buf_append(bp, data, len);
+		data += len;
+		count -= len;
+
+		sink->stamp.mid_line = (nl == NULL);
+	}
+	twopence_buf_advance_head(payload, twopence_buf_count(payload));
+
+	ok = twopence_transaction_channel_write_data(trans, sink, bp);
+	twopence_buf_free(bp);
+	return ok;
+}
+
+/*
+ * Record when the first and last byte of a command's output
+ * arrived, and when the server read them.
+ */
+static void
+twopence_transaction_record_timing(twopence_transaction_t *trans, const twopence_timestamp_t *stamp, unsigned int count)
+{
+	twopence_timing_t *timing = &trans->client.status_ret.timing;
+
+	if (timing->nbytes == 0)
+		timing->first_byte_nsec = stamp->received_nsec;
+	timing->last_byte_nsec = stamp->received_nsec;
+	timing->nbytes += count;
+
+	if (stamp->valid) {
+		if (!timing->server_valid)
+			timing->server_first_byte_nsec = stamp->elapsed_nsec;
+		timing->server_last_byte_nsec = stamp->elapsed_nsec;
+		timing->server_valid = true;
+	}
+}
+
+/*
+ * Deliver data received from the peer to a local sink. For the output
+ * of a command, record its timing, and pass it on to the command's
+ * timestamp callback.
+ */
+static bool
+twopence_transaction_channel_recv_data(twopence_transaction_t *trans, twopence_trans_channel_t *sink, twopence_buf_t *payload)
+{
+	twopence_command_t *cmd = trans->client.command;
+	unsigned int count = twopence_buf_count(payload);
+	twopence_timestamp_t stamp;
+
+	if (cmd == NULL || count == 0)
+		return twopence_transaction_channel_write_data(trans, sink, payload);
+
+	stamp = sink->stamp.next;
+	if (!stamp.valid) {
+		memset(&stamp, 0, sizeof(stamp));
+		stamp.channel = sink->id;
+		stamp.seq = sink->stamp.seq;
+	}
+	sink->stamp.next.valid = false;
+	sink->stamp.seq = stamp.seq + 1;
+	stamp.received_nsec = twopence_monotonic_nsec() - trans->client.start_nsec;
+
+	twopence_transaction_record_timing(trans, &stamp, count);
+
+	if (cmd->timestamp_fn)
+		cmd->timestamp_fn(cmd, &stamp, twopence_buf_head(payload), count);
+
+	if (cmd->timestamps & TWOPENCE_TIMESTAMP_LINES)
+		return twopence_transaction_channel_write_lines(trans, sink, payload, &stamp);
+	return twopence_transaction_channel_write_data(trans, sink, payload);
+}
+
 int
 twopence_transaction_channel_flush(twopence_trans_channel_t *sink)
 {
@@ -490,6 +915,7 @@ twopence_transaction_channel_write_eof(twopence_trans_channel_t *sink)
 
 	if (sock)
 		twopence_sock_shutdown_write(sock);
+	sink->file.eof = true;
 }
 
 int
@@ -497,6 +923,14 @@ twopence_transaction_channel_poll(twopence_trans_channel_t *channel, twopence_po
 {
 	twopence_sock_t *sock = channel->socket;
 
+	/* Wait for the file I/O threads to complete our requests */
+	if (channel->fileio) {
+		if (twopence_fileio_pending(channel->fileio) == 0)
+			return 0;
+		twopence_pollinfo_update(pinfo, twopence_fileio_poll_fd(channel->fileio), POLLIN, NULL);
+		return 1;
+	}
+
 	if (sock && !twopence_sock_is_dead(sock)) {
 		twopence_buf_t *bp;
 
@@ -509,13 +943,20 @@ twopence_transaction_channel_poll(twopence_trans_channel_t *channel, twopence_po
 		 */
 		if (!channel->plugged
 		 && !twopence_sock_is_read_eof(sock)
+		 && (!channel->flow.enabled || channel->flow.credit)
 		 && (bp = twopence_sock_get_recvbuf(sock)) == NULL) {
+			unsigned int size = channel->buffer_size;
+
+			/* Do not read more than the peer is willing to accept */
+			if (channel->flow.enabled && channel->flow.credit < size - TWOPENCE_PROTO_HEADER_SIZE - 2)
+				size = channel->flow.credit + TWOPENCE_PROTO_HEADER_SIZE + 2;
+
 			/* When we receive data from a command's output stream, or from
 			 * a file that is being extracted, we do not want to copy
 			 * the entire packet - instead, we reserve some room for the
 			 * protocol header, which we just tack on once we have the data.
 			 */
-			bp = twopence_buf_new(TWOPENCE_PROTO_MAX_PACKET);
+			bp = twopence_buf_new_pooled(size);
 			twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
 
 			twopence_sock_post_recvbuf(sock, bp);
@@ -528,28 +969,351 @@ twopence_transaction_channel_poll(twopence_trans_channel_t *channel, twopence_po
 	return 0;
 }
 
+/*
+ * Flow control, sending end: how much data are we allowed to send?
+ */
+static inline unsigned int
+twopence_transaction_channel_send_window(const twopence_trans_channel_t *channel, unsigned int max_count)
+{
+	if (channel->flow.enabled && channel->flow.credit < max_count)
+		return channel->flow.credit;
+	return max_count;
+}
+
+static inline void
+twopence_transaction_channel_consume_credit(twopence_trans_channel_t *channel, unsigned int count)
+{
+	if (channel->flow.enabled) {
+		assert(count <= channel->flow.credit);
+		channel->flow.credit -= count;
+	}
+}
+
+/*
+ * Flow control, receiving end. The peer may have no more than a window's
+ * worth of data in flight or queued to the sink. Whenever at least half
+ * of the window has become available again, grant more credit.
+ */
+static void
+twopence_transaction_channel_update_window(twopence_transaction_t *trans, twopence_trans_channel_t *sink)
+{
+	unsigned int window = twopence_protocol_channel_window(&trans->ps);
+	unsigned int used;
+
+	if (!sink->flow.enabled || trans->done)
+		return;
+
+	used = sink->flow.credit;
+	if (sink->socket)
+		used += twopence_sock_xmit_queue_bytes(sink->socket);
+
+	/* Let the file I/O threads lag up to a window behind. Otherwise,
+	 * every grant would have to wait for the disk, and a thread wakeup. */
+	if (sink->fileio && twopence_fileio_pending_bytes(sink->fileio) > window)
+		used += twopence_fileio_pending_bytes(sink->fileio) - window;
+	if (used > window / 2)
+		return;
+
+	twopence_debug2("%s: granting %u bytes of credit on channel %s", twopence_transaction_describe(trans),
+			window - used, twopence_transaction_channel_name(sink));
+	twopence_transaction_send_client(trans,
+			twopence_protocol_build_credit_packet(&trans->ps, sink->id, window - used));
+	sink->flow.credit += window - used;
+}
+
+/*
+ * If the client asked for timestamps, tell it when we read the data
+ * we are about to send on this channel. The CHAN_STAMP packet goes
+ * through the same flow as the data, so it arrives right before it.
+ */
+static void
+twopence_transaction_channel_send_stamp(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	twopence_timestamp_t stamp;
+
+	if (!trans->timestamps)
+		return;
+
+	memset(&stamp, 0, sizeof(stamp));
+	stamp.channel = channel->id;
+	stamp.seq = channel->stamp.seq++;
+	stamp.server_nsec = twopence_monotonic_nsec();
+	stamp.elapsed_nsec = stamp.server_nsec - trans->start_nsec;
+	twopence_transaction_send_client(trans, twopence_protocol_build_stamp_packet(&trans->ps, &stamp));
+}
+
+/*
+ * Turn a buffer holding data read from a source channel into a
+ * CHAN_DATA packet, compressing it if the connection asks for it.
+ */
+static twopence_buf_t *
+twopence_transaction_channel_build_data(twopence_transaction_t *trans, twopence_trans_channel_t *channel, twopence_buf_t *bp)
+{
+	twopence_transaction_channel_consume_credit(channel, twopence_buf_count(bp));
+	twopence_transaction_channel_send_stamp(trans, channel);
+
+	if (trans->ps.compress == 0)
+		return twopence_protocol_build_data_header(bp, &trans->ps, channel->id);
+
+	if (channel->codec == NULL)
+		channel->codec = twopence_protocol_codec_new(trans->ps.compress, true);
+	return twopence_protocol_build_compressed_data(channel->codec, bp, &trans->ps, channel->id,
+			&trans->stats.compress->deflate);
+}
+
+static void
+twopence_transaction_channel_forward_file(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	unsigned int max_count = twopence_protocol_max_data(&trans->ps);
+
+	if (channel->plugged)
+		return;
+
+	while (twopence_sock_xmit_flow_allowed(trans->socket, trans->id) && channel->file.offset < channel->file.size) {
+		unsigned int count = twopence_transaction_channel_send_window(channel, max_count);
+		twopence_buf_t *bp;
+		int rc;
+
+		if (count == 0)
+			return;
+		if (count > channel->file.size - channel->file.offset)
+			count = channel->file.size - channel->file.offset;
+
+		twopence_transaction_channel_send_stamp(trans, channel);
+		bp = twopence_protocol_build_file_data_header(&trans->ps, channel->id, count);
+		if ((rc = twopence_sock_queue_file(trans->socket, trans->id, bp, channel->file.fd, channel->file.offset, count)) < 0) {
+			twopence_transaction_set_error(trans, rc);
+			return;
+		}
+		twopence_transaction_channel_consume_credit(channel, count);
+		channel->file.offset += count;
+		trans->stats.nbytes_sent += count;
+	}
+
+	if (channel->file.offset >= channel->file.size && channel->callbacks.read_eof) {
+		twopence_debug("%s: EOF on channel %s", twopence_transaction_describe(trans),
+				twopence_transaction_channel_name(channel));
+		channel->callbacks.read_eof(trans, channel);
+		channel->callbacks.read_eof = NULL;
+	}
+}
+
+/*
+ * Have the file I/O threads read ahead of what we are allowed to send,
+ * but no further than the peer's credit, and never more than a few
+ * packets at a time.
+ */
+static void
+twopence_transaction_channel_poll_file(twopence_transaction_t *trans, twopence_trans_channel_t *channel, twopence_pollinfo_t *pinfo)
+{
+	unsigned int max_count = twopence_protocol_max_data(&trans->ps);
+	twopence_fileio_t *io = channel->fileio;
+
+	while (!channel->plugged && twopence_fileio_pending(io) < TWOPENCE_FILEIO_MAX_INFLIGHT) {
+		unsigned int requested = twopence_fileio_pending_bytes(io);
+		off_t next = channel->file.offset + requested;
+		unsigned int count = max_count;
+		twopence_buf_t *bp;
+
+		if (next >= channel->file.size)
+			break;
+		if (channel->flow.enabled) {
+			if (channel->flow.credit <= requested)
+				break;
+			if (count > channel->flow.credit - requested)
+				count = channel->flow.credit - requested;
+		}
+		if (count > channel->file.size - next)
+			count = channel->file.size - next;
+
+		bp = twopence_buf_new_pooled(twopence_protocol_max_packet(&trans->ps));
+		twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
+		twopence_fileio_read(io, bp, count);
+	}
+
+	twopence_transaction_channel_poll(channel, pinfo);
+}
+
+/*
+ * Send the data read by the file I/O threads, in order.
+ */
+static void
+twopence_transaction_channel_read_file(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	twopence_buf_t *bp;
+	int rc;
+
+	while (twopence_fileio_reap(channel->fileio, &bp, &rc)) {
+		if (rc < 0) {
+			twopence_log_error("%s: unable to read file on channel %s: %s",
+					twopence_transaction_describe(trans),
+					twopence_transaction_channel_name(channel), strerror(-rc));
+			twopence_buf_free(bp);
+			twopence_transaction_fail(trans, -rc);
+			return;
+		}
+
+		bp = twopence_transaction_channel_build_data(trans, channel, bp);
+		twopence_sock_queue_xmit_flow(trans->socket, trans->id, bp);
+		channel->file.offset += rc;
+		trans->stats.nbytes_sent += rc;
+
+		twopence_transaction_channel_trace_io_data(trans);
+	}
+
+	if (twopence_transaction_channel_is_read_eof(channel) && channel->callbacks.read_eof) {
+		twopence_debug("%s: EOF on channel %s", twopence_transaction_describe(trans),
+				twopence_transaction_channel_name(channel));
+		channel->callbacks.read_eof(trans, channel);
+		channel->callbacks.read_eof = NULL;
+	}
+}
+
+/*
+ * Collect the writes completed by the file I/O threads. Once the peer
+ * has sent EOF and everything is on disk, tell the owner.
+ */
+static void
+twopence_transaction_channel_write_file(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	twopence_buf_t *bp;
+	int rc;
+
+	while (twopence_fileio_reap(channel->fileio, &bp, &rc)) {
+		twopence_buf_free(bp);
+		if (rc < 0) {
+			twopence_log_error("%s: unable to write file on channel %s: %s",
+					twopence_transaction_describe(trans),
+					twopence_transaction_channel_name(channel), strerror(-rc));
+			twopence_transaction_fail(trans, -rc);
+			return;
+		}
+	}
+
+	if (channel->file.eof && twopence_fileio_pending(channel->fileio) == 0 && channel->callbacks.write_eof) {
+		channel->callbacks.write_eof(trans, channel);
+		channel->callbacks.write_eof = NULL;
+	}
+}
+
+/*
+ * Queue as much data from a pipe as we can. We cannot tell how much data
+ * there is without reading it, so we ask the kernel using FIONREAD, and
+ * subtract what we have already queued but not yet spliced.
+ * If there is nothing left, poll the pipe for more data.
+ */
+static void
+twopence_transaction_channel_poll_pipe(twopence_transaction_t *trans, twopence_trans_channel_t *channel, twopence_pollinfo_t *pinfo)
+{
+	unsigned int max_count = twopence_protocol_max_data(&trans->ps);
+	unsigned int queued;
+	int avail = 0;
+
+	channel->file.poll_data = NULL;
+	if (channel->plugged || channel->file.eof)
+		return;
+
+	/* Leave the data in the pipe until the peer grants more credit.
+	 * Eventually, this will cause the writer to block. */
+	if (twopence_transaction_channel_send_window(channel, max_count) == 0)
+		return;
+
+	if (ioctl(channel->file.fd, FIONREAD, &avail) < 0)
+		avail = 0;
+
+	queued = twopence_sock_xmit_queue_file_bytes(trans->socket, channel->file.fd);
+	if (avail <= queued) {
+		/* Only poll when everything has been spliced. Otherwise, the pipe
+		 * would report POLLIN all the time, and we would spin until the
+		 * transport has caught up. */
+		if (queued == 0)
+			channel->file.poll_data = twopence_pollinfo_update(pinfo, channel->file.fd, POLLIN, NULL);
+		return;
+	}
+
+	avail -= queued;
+	while (avail && twopence_sock_xmit_flow_allowed(trans->socket, trans->id)) {
+		unsigned int count = twopence_transaction_channel_send_window(channel, max_count);
+		twopence_buf_t *bp;
+		int rc;
+
+		if (count == 0)
+			break;
+		if (count > avail)
+			count = avail;
+
+		twopence_transaction_channel_send_stamp(trans, channel);
+		bp = twopence_protocol_build_file_data_header(&trans->ps, channel->id, count);
+		if ((rc = twopence_sock_queue_file(trans->socket, trans->id, bp, channel->file.fd, -1, count)) < 0) {
+			twopence_transaction_set_error(trans, rc);
+			return;
+		}
+		twopence_transaction_channel_consume_credit(channel, count);
+		avail -= count;
+		trans->stats.nbytes_sent += count;
+
+		twopence_transaction_channel_trace_io_data(trans);
+	}
+}
+
+static void
+twopence_transaction_channel_doio_pipe(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
+{
+	struct pollfd *pfd;
+	int avail = 0;
+
+	if ((pfd = channel->file.poll_data) == NULL)
+		return;
+	channel->file.poll_data = NULL;
+
+	/* When the writer closes the pipe, we get POLLHUP. There may
+	 * still be data in the pipe, though. */
+	if (!(pfd->revents & (POLLHUP | POLLERR | POLLNVAL)))
+		return;
+
+	if (!(pfd->revents & POLLNVAL) && ioctl(channel->file.fd, FIONREAD, &avail) == 0 && avail)
+		return;
+
+	twopence_debug("%s: EOF on channel %s", twopence_transaction_describe(trans),
+			twopence_transaction_channel_name(channel));
+	channel->file.eof = true;
+
+	twopence_transaction_channel_trace_io_eof(trans);
+	if (channel->callbacks.read_eof) {
+		channel->callbacks.read_eof(trans, channel);
+		channel->callbacks.read_eof = NULL;
+	}
+}
+
 /* This should be executed for source channels only! */
 static void
 twopence_transaction_channel_forward(twopence_transaction_t *trans, twopence_trans_channel_t *channel)
 {
 	twopence_iostream_t *stream = channel->stream;
 
+	if (channel->file.fd >= 0) {
+		twopence_transaction_channel_forward_file(trans, channel);
+		return;
+	}
+
 	if (!channel->plugged && stream != NULL) {
-		while (twopence_sock_xmit_queue_allowed(trans->socket) && !twopence_iostream_eof(stream)) {
+		while (twopence_sock_xmit_flow_allowed(trans->socket, trans->id) && !twopence_iostream_eof(stream)) {
 			twopence_buf_t *bp;
+			unsigned int room;
 			int count;
 
-			bp = twopence_protocol_command_buffer_new();
-			twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2); /* ugly */
+			room = twopence_transaction_channel_send_window(channel, twopence_protocol_max_data(&trans->ps));
+			if (room == 0)
+				break;
+
+			bp = twopence_protocol_data_buffer_new(&trans->ps);
 			do {
-				count = twopence_iostream_read(stream,
-						twopence_buf_tail(bp),
-						twopence_buf_tailroom(bp));
+				count = twopence_iostream_read(stream, twopence_buf_tail(bp), room);
 			} while (count < 0 && errno == EINTR);
 
 			if (count > 0) {
 				twopence_buf_advance_tail(bp, count);
-				twopence_protocol_build_data_header(bp, &trans->ps, channel->id);
+				bp = twopence_transaction_channel_build_data(trans, channel, bp);
 				twopence_transaction_send_client(trans, bp);
 
 				twopence_transaction_channel_trace_io_data(trans);
@@ -586,6 +1350,11 @@ twopence_transaction_channel_doio(twopence_transaction_t *trans, twopence_trans_
 {
 	twopence_sock_t *sock = channel->socket;
 
+	if (channel->file.pipe) {
+		twopence_transaction_channel_doio_pipe(trans, channel);
+		return;
+	}
+
 	if (sock) {
 		twopence_buf_t *bp;
 
@@ -601,8 +1370,8 @@ twopence_transaction_channel_doio(twopence_transaction_t *trans, twopence_trans_
 		if ((bp = twopence_sock_take_recvbuf(sock)) != NULL) {
 			twopence_debug2("%s: %u bytes from local source %s", twopence_transaction_describe(trans),
 					twopence_buf_count(bp), twopence_transaction_channel_name(channel));
-			twopence_protocol_build_data_header(bp, &trans->ps, channel->id);
-			twopence_sock_queue_xmit(trans->socket, bp);
+			bp = twopence_transaction_channel_build_data(trans, channel, bp);
+			twopence_sock_queue_xmit_flow(trans->socket, trans->id, bp);
 
 			twopence_transaction_channel_trace_io_data(trans);
 		}
@@ -619,11 +1388,39 @@ twopence_transaction_channel_doio(twopence_transaction_t *trans, twopence_trans_
 	}
 }
 
+/*
+ * Forget the pollfds of the last round. With epoll, a transaction is
+ * not serviced after every round, and the channels it skips when
+ * filling in the pollinfo must not hold on to them.
+ */
+static void
+twopence_transaction_prepare_poll(twopence_transaction_t *trans)
+{
+	twopence_trans_channel_t *channel;
+
+	for (channel = trans->local_sink; channel; channel = channel->next) {
+		if (channel->socket)
+			twopence_sock_prepare_poll(channel->socket);
+		channel->file.poll_data = NULL;
+	}
+	for (channel = trans->local_source; channel; channel = channel->next) {
+		if (channel->socket)
+			twopence_sock_prepare_poll(channel->socket);
+		channel->file.poll_data = NULL;
+	}
+}
+
 int
 twopence_transaction_fill_poll(twopence_transaction_t *trans, twopence_pollinfo_t *pinfo)
 {
-	if (!twopence_timeout_update(&pinfo->timeout, &trans->client.deadline))
-		return TWOPENCE_COMMAND_TIMEOUT_ERROR;
+	twopence_transaction_prepare_poll(trans);
+
+	/* The timer of the transaction may have gone off. Don't wait for
+	 * anything, so that it is completed right away. */
+	if (trans->done) {
+		(void) twopence_timeout_update(&pinfo->timeout, &pinfo->timeout.now);
+		return 0;
+	}
 
 	if (trans->local_sink != NULL) {
 		twopence_trans_channel_t *sink;
@@ -632,12 +1429,21 @@ twopence_transaction_fill_poll(twopence_transaction_t *trans, twopence_pollinfo_
 			twopence_transaction_channel_poll(sink, pinfo);
 	}
 
-	/* If the client socket's write queue is already bursting with data,
-	 * refrain from queuing more until some of it has been drained */
-	if (twopence_sock_xmit_queue_allowed(trans->socket)) {
+	/* If this transaction's share of the client socket's write queue is
+	 * already bursting with data, refrain from queuing more until some of
+	 * it has been drained. Other transactions are not affected by this. */
+	if (twopence_sock_xmit_flow_allowed(trans->socket, trans->id)) {
 		twopence_trans_channel_t *source;
 
 		for (source = trans->local_source; source; source = source->next) {
+			if (source->fileio) {
+				twopence_transaction_channel_poll_file(trans, source, pinfo);
+				continue;
+			}
+			if (source->file.pipe) {
+				twopence_transaction_channel_poll_pipe(trans, source, pinfo);
+				continue;
+			}
 			if (!twopence_transaction_channel_poll(source, pinfo)) {
 				/* This is a source not backed by a file descriptor but
 				 * something else (such as a buffer).
@@ -657,12 +1463,22 @@ twopence_transaction_doio(twopence_transaction_t *trans)
 	twopence_trans_channel_t *channel;
 
 	twopence_debug2("%s: twopence_transaction_doio()\n", twopence_transaction_describe(trans));
-	for (channel = trans->local_sink; channel; channel = channel->next)
-		twopence_transaction_channel_doio(trans, channel);
-	twopence_transaction_channel_list_purge(&trans->local_sink);
+	for (channel = trans->local_sink; channel; channel = channel->next) {
+		if (channel->fileio)
+			twopence_transaction_channel_write_file(trans, channel);
+		else
+			twopence_transaction_channel_doio(trans, channel);
+		twopence_transaction_channel_update_window(trans, channel);
+	}
+	if (twopence_transaction_channel_list_purge(&trans->local_sink))
+		twopence_transaction_channel_reindex(trans);
 
-	for (channel = trans->local_source; channel; channel = channel->next)
-		twopence_transaction_channel_doio(trans, channel);
+	for (channel = trans->local_source; channel; channel = channel->next) {
+		if (channel->fileio)
+			twopence_transaction_channel_read_file(trans, channel);
+		else
+			twopence_transaction_channel_doio(trans, channel);
+	}
 
 	twopence_debug2("twopence_transaction_doio(): calling trans->send()\n");
 	if (trans->send)
@@ -673,7 +1489,8 @@ twopence_transaction_doio(twopence_transaction_t *trans)
 	 * the EOF condition on the source file and send an EOF packet.
 	 * Once we wrap this inside the twopence_trans_channel handling,
 	 * then this requirement goes away. */
-	twopence_transaction_channel_list_purge(&trans->local_source);
+	if (twopence_transaction_channel_list_purge(&trans->local_source))
+		twopence_transaction_channel_reindex(trans);
 }
 
 /*
@@ -690,6 +1507,9 @@ twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_h
 		return;
 	}
 
+	/* Whatever the packet is, it may change what we are waiting for */
+	twopence_ready_mark(&trans->ready);
+
 	if (hdr->type == TWOPENCE_PROTO_TYPE_CHAN_DATA) {
 		uint16_t channel_id;
 
@@ -700,13 +1520,54 @@ twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_h
 		channel_id = ntohs(channel_id);
 		sink = twopence_transaction_find_sink(trans, channel_id);
 		if (sink != NULL) {
+			twopence_buf_t *raw = NULL;
+
+			if (hdr->flags & TWOPENCE_PROTO_HDR_COMPRESSED) {
+				if (sink->codec == NULL && trans->ps.compress)
+					sink->codec = twopence_protocol_codec_new(trans->ps.compress, false);
+
+				raw = twopence_protocol_decompress_data(sink->codec, hdr, payload, &trans->ps,
+						&trans->stats.compress->inflate);
+				if (raw == NULL) {
+					twopence_log_error("%s: unable to decompress data on channel %s",
+							twopence_transaction_describe(trans),
+							twopence_transaction_channel_name(sink));
+					twopence_transaction_fail(trans, EPROTO);
+					return;
+				}
+				payload = raw;
+			} else if (trans->ps.compress) {
+				twopence_codec_stats_t *stats = &trans->stats.compress->inflate;
+
+				stats->npackets++;
+				stats->raw_bytes += twopence_buf_count(payload);
+				stats->wire_bytes += twopence_buf_count(payload);
+			}
+
 			twopence_debug("%s: received %u bytes of data on channel %s\n",
 					twopence_transaction_describe(trans), twopence_buf_count(payload),
 					twopence_transaction_channel_name(sink));
 
+			if (sink->flow.enabled) {
+				if (twopence_buf_count(payload) > sink->flow.credit) {
+					twopence_log_error("%s: peer exceeded window on channel %s",
+							twopence_transaction_describe(trans),
+							twopence_transaction_channel_name(sink));
+					twopence_transaction_fail(trans, EPROTO);
+					goto out;
+				}
+				sink->flow.credit -= twopence_buf_count(payload);
+			}
+
 			trans->stats.nbytes_received += twopence_buf_count(payload);
-			if (!twopence_transaction_channel_write_data(trans, sink, payload))
+			if (!twopence_transaction_channel_recv_data(trans, sink, payload))
 				twopence_transaction_fail(trans, errno);
+			else
+				twopence_transaction_channel_update_window(trans, sink);
+
+out:
+			if (raw)
+				twopence_buf_free(raw);
 			return;
 		}
 
@@ -716,6 +1577,19 @@ twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_h
 		return;
 	}
 
+	if (hdr->type == TWOPENCE_PROTO_TYPE_CHAN_STAMP) {
+		twopence_timestamp_t stamp;
+
+		if (!twopence_protocol_dissect_stamp_packet(payload, &stamp))
+			return;
+
+		/* Hold on to it until the data packet arrives */
+		sink = twopence_transaction_find_sink(trans, stamp.channel);
+		if (sink != NULL)
+			sink->stamp.next = stamp;
+		return;
+	}
+
 	if (hdr->type == TWOPENCE_PROTO_TYPE_CHAN_EOF) {
 		uint16_t channel_id;
 
@@ -736,8 +1610,17 @@ twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_h
 				twopence_transaction_describe(trans),
 				twopence_transaction_channel_name(sink));
 
+		/* The peer will not send any more data */
+		sink->flow.enabled = false;
+
 		twopence_transaction_channel_trace_io_eof(trans);
 		twopence_transaction_channel_write_eof(sink);
+
+		/* If the file I/O threads are still writing, the callback
+		 * is invoked once they are done. */
+		if (sink->fileio && twopence_fileio_pending(sink->fileio))
+			return;
+
 		if (sink->callbacks.write_eof) {
 			sink->callbacks.write_eof(trans, sink);
 			sink->callbacks.write_eof = NULL;
@@ -749,9 +1632,28 @@ twopence_transaction_recv_packet(twopence_transaction_t *trans, const twopence_h
 		return;
 	}
 
+	if (hdr->type == TWOPENCE_PROTO_TYPE_CHAN_CREDIT) {
+		twopence_trans_channel_t *source;
+		unsigned int credit;
+		uint16_t channel_id;
+
+		if (!twopence_protocol_dissect_credit_packet(payload, &channel_id, &credit))
+			return;
+
+		/* The source may be gone already */
+		source = twopence_transaction_find_source(trans, channel_id);
+		if (source != NULL && source->flow.enabled) {
+			twopence_debug2("%s: received %u bytes of credit on channel %s\n",
+					twopence_transaction_describe(trans), credit,
+					twopence_transaction_channel_name(source));
+			source->flow.credit += credit;
+		}
+		return;
+	}
+
 	if (trans->recv == NULL) {
-		twopence_log_error("%s: unexpected %s packet\n", twopence_transaction_describe(trans),
-				twopence_protocol_packet_type_to_string(hdr->type));
+		twopence_log_error("%s: unexpected %s packet (type %u)\n", twopence_transaction_describe(trans),
+				twopence_protocol_packet_type_to_string(hdr->type), hdr->type);
 		twopence_transaction_fail(trans, EPROTO);
 		return;
 	}
@@ -770,8 +1672,24 @@ twopence_transaction_send_client(twopence_transaction_t *trans, twopence_buf_t *
 
 	twopence_debug("%s: sending packet type=%s, payload=%u\n", twopence_transaction_describe(trans),
 			twopence_protocol_packet_type_to_string(h->type),
-			ntohs(h->len) - TWOPENCE_PROTO_HEADER_SIZE);
-	twopence_sock_queue_xmit(trans->socket, bp);
+			twopence_buf_count(bp) - twopence_protocol_header_size(h));
+
+	switch (h->type) {
+	case TWOPENCE_PROTO_TYPE_MAJOR:
+	case TWOPENCE_PROTO_TYPE_MINOR:
+	case TWOPENCE_PROTO_TYPE_TIMEOUT:
+		/* Status packets overtake the bulk data of other transactions */
+		twopence_sock_queue_ctrl_flow(trans->socket, trans->id, bp);
+		break;
+
+	case TWOPENCE_PROTO_TYPE_CHAN_CREDIT:
+		/* The peer may be waiting for this, so let it overtake everything */
+		twopence_sock_queue_ctrl(trans->socket, bp);
+		break;
+
+	default:
+		twopence_sock_queue_xmit_flow(trans->socket, trans->id, bp);
+	}
 }
 
 void
@@ -845,6 +1763,17 @@ twopence_transaction_send_timeout(twopence_transaction_t *trans)
 	trans->done = 1;
 }
 
+/*
+ * Send a buffer of stat records, as built by the server in response
+ * to a FILE_OP request.
+ */
+void
+twopence_transaction_send_file_info(twopence_transaction_t *trans, twopence_buf_t *bp)
+{
+	twopence_protocol_push_header_ps(bp, &trans->ps, TWOPENCE_PROTO_TYPE_FILE_INFO);
+	twopence_transaction_send_client(trans, bp);
+}
+
 /*
  * Find the local sink corresponding to the given id.
  * For now, the "id" is a packet type, such as '0' or 'd'
@@ -854,6 +1783,9 @@ twopence_transaction_find_sink(twopence_transaction_t *trans, uint16_t id)
 {
 	twopence_trans_channel_t *sink;
 
+	if (id < TWOPENCE_TRANSACTION_FAST_CHANNELS)
+		return trans->sink_by_id[id];
+
 	for (sink = trans->local_sink; sink; sink = sink->next) {
 		if (sink->id == id)
 			return sink;
@@ -866,6 +1798,9 @@ twopence_transaction_find_source(twopence_transaction_t *trans, uint16_t id)
 {
 	twopence_trans_channel_t *channel;
 
+	if (id < TWOPENCE_TRANSACTION_FAST_CHANNELS)
+		return trans->source_by_id[id];
+
 	for (channel = trans->local_source; channel; channel = channel->next) {
 		if (channel->id == id)
 			return channel;
@@ -876,6 +1811,45 @@ twopence_transaction_find_source(twopence_transaction_t *trans, uint16_t id)
 /*
  * Transaction list primitives
  */
+static inline unsigned int
+twopence_transaction_hash(const twopence_transaction_list_t *list, unsigned int xid)
+{
+	/* xids are handed out sequentially, so the low bits spread
+	 * them evenly */
+	return xid & (list->hash_size - 1);
+}
+
+static void
+twopence_transaction_hash_insert(twopence_transaction_list_t *list, twopence_transaction_t *trans)
+{
+	twopence_transaction_t **bucket = &list->hash[twopence_transaction_hash(list, trans->id)];
+
+	if ((trans->hash_next = *bucket) != NULL)
+		trans->hash_next->hash_prev = &trans->hash_next;
+	trans->hash_prev = bucket;
+	*bucket = trans;
+}
+
+/*
+ * Keep the load factor below 2, so that a lookup touches no more than
+ * a couple of transactions no matter how many there are.
+ */
+static void
+twopence_transaction_hash_grow(twopence_transaction_list_t *list)
+{
+	twopence_transaction_t *trans;
+	unsigned int new_size;
+
+	new_size = list->hash_size? 2 * list->hash_size : 16;
+
+	free(list->hash);
+	list->hash = twopence_calloc(new_size, sizeof(list->hash[0]));
+	list->hash_size = new_size;
+
+	for (trans = list->head; trans; trans = trans->next)
+		twopence_transaction_hash_insert(list, trans);
+}
+
 void
 twopence_transaction_list_insert(twopence_transaction_list_t *list, twopence_transaction_t *trans)
 {
@@ -888,6 +1862,40 @@ twopence_transaction_list_insert(twopence_transaction_list_t *list, twopence_tra
 	trans->next = next;
 	trans->prev = &list->head;
 	list->head = trans;
+
+	trans->list = list;
+	list->count++;
+	if (list->count >= 2 * list->hash_size)
+		twopence_transaction_hash_grow(list);
+	else
+		twopence_transaction_hash_insert(list, trans);
+}
+
+/*
+ * Find the transaction with the given xid. If there are several (which
+ * would be a protocol violation), this finds the one added last.
+ */
+twopence_transaction_t *
+twopence_transaction_list_find(const twopence_transaction_list_t *list, unsigned int xid)
+{
+	twopence_transaction_t *trans;
+
+	if (list->hash == NULL)
+		return NULL;
+
+	for (trans = list->hash[twopence_transaction_hash(list, xid)]; trans; trans = trans->hash_next) {
+		if (trans->id == xid)
+			return trans;
+	}
+	return NULL;
+}
+
+void
+twopence_transaction_list_destroy(twopence_transaction_list_t *list)
+{
+	assert(list->head == NULL);
+	free(list->hash);
+	memset(list, 0, sizeof(*list));
 }
 
 void
@@ -899,4 +1907,15 @@ twopence_transaction_unlink(twopence_transaction_t *trans)
 		trans->next->prev = trans->prev;
 	trans->prev = NULL;
 	trans->next = NULL;
+
+	if (trans->hash_prev) {
+		if ((*(trans->hash_prev) = trans->hash_next) != NULL)
+			trans->hash_next->hash_prev = trans->hash_prev;
+		trans->hash_prev = NULL;
+		trans->hash_next = NULL;
+	}
+	if (trans->list) {
+		trans->list->count--;
+		trans->list = NULL;
+	}
 }
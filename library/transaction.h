@@ -28,13 +28,32 @@
 typedef struct twopence_transaction twopence_transaction_t;
 typedef struct twopence_trans_channel twopence_trans_channel_t;
 
+/* Channels with an id below this are found through a table rather
+ * than by walking the channel list. This covers stdin/stdout/stderr. */
+#define TWOPENCE_TRANSACTION_FAST_CHANNELS	4
+
 struct twopence_transaction {
 	twopence_transaction_t **prev;
 	twopence_transaction_t *next;
 
+	/* The list we're on, and our hash chain in that list */
+	struct twopence_transaction_list *list;
+	twopence_transaction_t **hash_prev;
+	twopence_transaction_t *hash_next;
+
+	/* With epoll: our place on the ready list of the connection, on
+	 * its list of transactions waiting for the transport to drain,
+	 * and the fds we are waiting for */
+	twopence_ready_t	ready;
+	twopence_ready_t	xmit_wait;
+	twopence_pollgroup_t	poll;
+
 	unsigned int		type;
 	unsigned int		id;
 
+	/* What twopence_transaction_describe() returns */
+	char			desc[32];
+
 	/* These are really server side only */
 	bool			major_sent;
 	bool			minor_sent;
@@ -51,11 +70,24 @@ struct twopence_transaction {
 	pid_t			pid;
 	int			status;
 
+	/* Resource usage of the command, and the perf_event counters
+	 * attached to it (NULL if none were requested) */
+	twopence_rusage_t	rusage;
+	int *			perf_fds;
+
+	/* Precede the command's output with CHAN_STAMP packets, and
+	 * when the command was started */
+	bool			timestamps;
+	unsigned long long	start_nsec;
+
 	twopence_trans_channel_t *local_sink;
 	twopence_trans_channel_t *local_source;
+	twopence_trans_channel_t *sink_by_id[TWOPENCE_TRANSACTION_FAST_CHANNELS];
+	twopence_trans_channel_t *source_by_id[TWOPENCE_TRANSACTION_FAST_CHANNELS];
 
 	struct {
 		struct timeval		deadline;
+		twopence_timer_t *	timer;		/* goes off at the deadline */
 		const struct timeval *	chat_deadline;
 
 		twopence_status_t	status_ret;
@@ -63,16 +95,38 @@ struct twopence_transaction {
 
 		bool			print_dots;
 		unsigned int		dots_printed;
+
+		/* Receives the results of a FILE_OP request */
+		twopence_file_op_t *	file_op;
+
+		/* The transfer started by twopence_submit_inject/extract */
+		twopence_file_xfer_t *	xfer;
+
+		/* The command whose output we receive, and when we sent it */
+		twopence_command_t *	command;
+		unsigned long long	start_nsec;
 	} client;
 
 	struct {
 		unsigned int	nbytes_received;
 		unsigned int	nbytes_sent;
+
+		/* Compression stats of the connection */
+		twopence_compress_stats_t *compress;
 	} stats;
 };
 
+/*
+ * A list of transactions, indexed by xid. Every incoming packet needs
+ * to be matched to its transaction, so lookups must not get slower
+ * with the number of commands running in the background.
+ */
 typedef struct twopence_transaction_list {
 	twopence_transaction_t *head;
+
+	unsigned int		count;
+	unsigned int		hash_size;	/* always a power of 2 */
+	twopence_transaction_t **hash;
 } twopence_transaction_list_t;
 
 extern twopence_transaction_t *	twopence_transaction_new(twopence_sock_t *client, unsigned int type, const twopence_protocol_state_t *ps);
@@ -81,10 +135,15 @@ extern const char *		twopence_transaction_describe(const twopence_transaction_t
 extern int			twopence_transaction_send_extract(twopence_transaction_t *, const twopence_file_xfer_t *);
 extern int			twopence_transaction_send_inject(twopence_transaction_t *, const twopence_file_xfer_t *);
 extern int			twopence_transaction_send_command(twopence_transaction_t *, const twopence_command_t *);
+extern int			twopence_transaction_send_batch(twopence_transaction_t *, const twopence_batch_t *, unsigned int first);
+extern int			twopence_transaction_send_file_op(twopence_transaction_t *, const twopence_file_op_t *);
 extern int			twopence_transaction_send_interrupt(twopence_transaction_t *);
 extern twopence_trans_channel_t *twopence_transaction_attach_local_sink(twopence_transaction_t *trans, uint16_t id, int fd);
 extern twopence_trans_channel_t *twopence_transaction_attach_local_source(twopence_transaction_t *trans, uint16_t id, int fd);
 extern twopence_trans_channel_t *twopence_transaction_attach_local_sink_stream(twopence_transaction_t *trans, uint16_t id, twopence_iostream_t *);
+extern twopence_trans_channel_t *twopence_transaction_attach_local_sink_file(twopence_transaction_t *trans, uint16_t id, int fd);
+extern twopence_trans_channel_t *twopence_transaction_attach_local_source_file(twopence_transaction_t *trans, uint16_t id, int fd, off_t size);
+extern twopence_trans_channel_t *twopence_transaction_attach_local_source_pipe(twopence_transaction_t *trans, uint16_t id, int fd);
 extern twopence_trans_channel_t *twopence_transaction_attach_local_source_stream(twopence_transaction_t *trans, uint16_t id, twopence_iostream_t *);
 extern void			twopence_transaction_close_sink(twopence_transaction_t *trans, uint16_t id);
 extern void			twopence_transaction_close_source(twopence_transaction_t *trans, uint16_t id);
@@ -99,12 +158,14 @@ extern void			twopence_transaction_fail2(twopence_transaction_t *trans, int majo
 extern void			twopence_transaction_send_major(twopence_transaction_t *trans, unsigned int code);
 extern void			twopence_transaction_send_minor(twopence_transaction_t *trans, unsigned int code);
 extern void			twopence_transaction_send_timeout(twopence_transaction_t *trans);
+extern void			twopence_transaction_send_file_info(twopence_transaction_t *trans, twopence_buf_t *bp);
 extern twopence_trans_channel_t *twopence_transaction_find_sink(twopence_transaction_t *trans, uint16_t channel);
 extern twopence_trans_channel_t *twopence_transaction_find_source(twopence_transaction_t *trans, uint16_t channel);
 
 /* Client side functions */
 extern void			twopence_transaction_set_error(twopence_transaction_t *, int);
 extern void			twopence_transaction_set_timeout(twopence_transaction_t *, long timeout);
+extern void			twopence_transaction_set_command(twopence_transaction_t *, twopence_command_t *);
 extern bool			twopence_transaction_update_timeout(const twopence_transaction_t *, twopence_timeout_t *);
 
 #define TWOPENCE_TRANSACTION_CHANNEL_ID_ALL	0xFFFF
@@ -119,6 +180,8 @@ extern void			twopence_transaction_channel_set_name(twopence_trans_channel_t *,
 extern const char *		twopence_transaction_channel_name(const twopence_trans_channel_t *);
 
 extern void			twopence_transaction_list_insert(twopence_transaction_list_t *, twopence_transaction_t *);
+extern twopence_transaction_t *	twopence_transaction_list_find(const twopence_transaction_list_t *, unsigned int xid);
+extern void			twopence_transaction_list_destroy(twopence_transaction_list_t *);
 extern void			twopence_transaction_unlink(twopence_transaction_t *);
 
 static inline bool
@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "twopence.h"
 #include "utils.h"
@@ -150,22 +151,266 @@ __twopence_target_new(char *target_spec, struct twopence_target **ret)
   return 0;
 }
 
+/*
+ * Connection cache.
+ *
+ * Scripts and language bindings tend to create and free targets all the
+ * time. With the cache enabled, twopence_target_free() parks idle targets
+ * rather than destroying them, and twopence_target_new() hands them out
+ * again. The cache is shared by all threads; a parked target has been
+ * detached from the event loop of its previous owner, and is attached to
+ * the loop of the thread adopting it.
+ */
+struct twopence_cached_target {
+  struct twopence_cached_target *next;
+  twopence_target_t *	target;
+  struct timeval	expires;	/* unset means never */
+};
+
+static struct {
+  pthread_mutex_t	lock;
+  bool			configured;
+  unsigned int		idle_timeout;
+  struct twopence_cached_target *head;
+  twopence_target_cache_stats_t stats;
+} twopence_target_cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void			__twopence_target_destroy(twopence_target_t *);
+
+/* Call with the cache lock held */
+static unsigned int
+__twopence_target_cache_idle_timeout(void)
+{
+  if (!twopence_target_cache.configured) {
+    const char *env = getenv("TWOPENCE_TARGET_CACHE");
+
+    if (env)
+      twopence_target_cache.idle_timeout = strtoul(env, NULL, 0);
+    twopence_target_cache.configured = true;
+  }
+  return twopence_target_cache.idle_timeout;
+}
+
+/*
+ * Take expired targets (or all of them) off the cache, and return
+ * them in a list, so that they can be destroyed without holding the lock.
+ * Call with the cache lock held.
+ */
+static struct twopence_cached_target *
+__twopence_target_cache_expire(bool all)
+{
+  struct twopence_cached_target *ct, **pos, *expired = NULL;
+  struct timeval now;
+
+  twopence_loop_clock_update(&now);
+  for (pos = &twopence_target_cache.head; (ct = *pos) != NULL; ) {
+    if (all || (timerisset(&ct->expires) && timercmp(&now, &ct->expires, >=))) {
+      *pos = ct->next;
+      ct->next = expired;
+      expired = ct;
+      twopence_target_cache.stats.cached--;
+      if (all)
+        twopence_target_cache.stats.flushed++;
+      else
+        twopence_target_cache.stats.expired++;
+    } else {
+      pos = &ct->next;
+    }
+  }
+
+  return expired;
+}
+
+static void
+__twopence_target_cache_destroy_list(struct twopence_cached_target *list)
+{
+  struct twopence_cached_target *ct;
+
+  while ((ct = list) != NULL) {
+    list = ct->next;
+    __twopence_target_destroy(ct->target);
+    free(ct);
+  }
+}
+
+/*
+ * Look for a cached target with the given spec
+ */
+static twopence_target_t *
+__twopence_target_cache_lookup(const char *target_spec)
+{
+  struct twopence_cached_target *ct, **pos, *expired;
+  twopence_target_t *target = NULL;
+  bool enabled;
+
+  pthread_mutex_lock(&twopence_target_cache.lock);
+  enabled = __twopence_target_cache_idle_timeout() != 0;
+  expired = __twopence_target_cache_expire(false);
+  for (pos = &twopence_target_cache.head; enabled && (ct = *pos) != NULL; pos = &ct->next) {
+    if (!strcmp(ct->target->spec, target_spec)) {
+      *pos = ct->next;
+      twopence_target_cache.stats.cached--;
+      target = ct->target;
+      free(ct);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&twopence_target_cache.lock);
+
+  __twopence_target_cache_destroy_list(expired);
+
+  if (target && !target->ops->adopt(target)) {
+    twopence_debug("cached connection to %s died, reconnecting", target_spec);
+    __twopence_target_destroy(target);
+    target = NULL;
+
+    pthread_mutex_lock(&twopence_target_cache.lock);
+    twopence_target_cache.stats.expired++;
+    pthread_mutex_unlock(&twopence_target_cache.lock);
+  }
+
+  if (enabled) {
+    pthread_mutex_lock(&twopence_target_cache.lock);
+    if (target)
+      twopence_target_cache.stats.hits++;
+    else
+      twopence_target_cache.stats.misses++;
+    pthread_mutex_unlock(&twopence_target_cache.lock);
+  }
+
+  return target;
+}
+
+/*
+ * Try to park the target in the cache
+ */
+static bool
+__twopence_target_cache_park(twopence_target_t *target)
+{
+  struct twopence_cached_target *ct, *expired;
+  unsigned int idle_timeout;
+  int lifetime;
+
+  pthread_mutex_lock(&twopence_target_cache.lock);
+  idle_timeout = __twopence_target_cache_idle_timeout();
+  pthread_mutex_unlock(&twopence_target_cache.lock);
+
+  if (idle_timeout == 0 || target->spec == NULL || target->ops->park == NULL)
+    return false;
+
+  if ((lifetime = target->ops->park(target)) < 0)
+    return false;
+  if (lifetime == 0 || (unsigned int) lifetime > idle_timeout)
+    lifetime = idle_timeout;
+
+  /* The next owner starts out with a clean slate */
+  twopence_env_destroy(&target->env);
+  twopence_target_set_completion_callback(target, NULL, NULL);
+
+  ct = twopence_calloc(1, sizeof(*ct));
+  ct->target = target;
+  twopence_loop_clock_update(&ct->expires);
+  ct->expires.tv_sec += lifetime;
+
+  pthread_mutex_lock(&twopence_target_cache.lock);
+  expired = __twopence_target_cache_expire(false);
+  ct->next = twopence_target_cache.head;
+  twopence_target_cache.head = ct;
+  twopence_target_cache.stats.cached++;
+  twopence_target_cache.stats.parked++;
+  pthread_mutex_unlock(&twopence_target_cache.lock);
+
+  __twopence_target_cache_destroy_list(expired);
+  return true;
+}
+
+void
+twopence_target_cache_set_idle_timeout(unsigned int seconds)
+{
+  struct twopence_cached_target *expired = NULL;
+
+  pthread_mutex_lock(&twopence_target_cache.lock);
+  twopence_target_cache.idle_timeout = seconds;
+  twopence_target_cache.configured = true;
+  if (seconds == 0)
+    expired = __twopence_target_cache_expire(true);
+  pthread_mutex_unlock(&twopence_target_cache.lock);
+
+  __twopence_target_cache_destroy_list(expired);
+}
+
+void
+twopence_target_cache_get_stats(twopence_target_cache_stats_t *stats)
+{
+  struct twopence_cached_target *expired;
+
+  pthread_mutex_lock(&twopence_target_cache.lock);
+  expired = __twopence_target_cache_expire(false);
+  *stats = twopence_target_cache.stats;
+  pthread_mutex_unlock(&twopence_target_cache.lock);
+
+  __twopence_target_cache_destroy_list(expired);
+}
+
+void
+twopence_target_cache_flush(void)
+{
+  struct twopence_cached_target *expired;
+
+  pthread_mutex_lock(&twopence_target_cache.lock);
+  expired = __twopence_target_cache_expire(true);
+  pthread_mutex_unlock(&twopence_target_cache.lock);
+
+  __twopence_target_cache_destroy_list(expired);
+}
+
+/*
+ * Compression statistics of a target's connection
+ */
+int
+twopence_target_get_compress_stats(twopence_target_t *target, twopence_compress_stats_t *stats)
+{
+  if (stats == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (target->ops->get_compress_stats == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+  }
+
+  return target->ops->get_compress_stats(target, stats);
+}
+
 int
 twopence_target_new(const char *target_spec, struct twopence_target **ret)
 {
   char *spec_copy;
   int rv;
 
+  if ((*ret = __twopence_target_cache_lookup(target_spec)) != NULL)
+    return 0;
+
   spec_copy = twopence_strdup(target_spec);
   rv = __twopence_target_new(spec_copy, ret);
   free(spec_copy);
 
+  if (rv == 0)
+    (*ret)->spec = twopence_strdup(target_spec);
+
   return rv;
 }
 
-void
-twopence_target_free(struct twopence_target *target)
+static void			__twopence_completions_destroy(twopence_target_t *);
+
+static void
+__twopence_target_destroy(twopence_target_t *target)
 {
+  __twopence_completions_destroy(target);
+  twopence_env_destroy(&target->env);
+  twopence_strfree(&target->spec);
+
   if (target->ops->end == NULL) {
     free(target);
   } else {
@@ -173,6 +418,15 @@ twopence_target_free(struct twopence_target *target)
   }
 }
 
+void
+twopence_target_free(struct twopence_target *target)
+{
+  __twopence_completions_destroy(target);
+
+  if (!__twopence_target_cache_park(target))
+    __twopence_target_destroy(target);
+}
+
 /*
  * Set target specific options
  */
@@ -240,6 +494,78 @@ twopence_wait(struct twopence_target *target, int pid, twopence_status_t *status
   return target->ops->wait(target, pid, status);
 }
 
+/*
+ * Run a batch of commands.
+ * If the plugin cannot do this natively, fall back to running the
+ * commands one at a time.
+ */
+static int
+__twopence_run_batch_fallback(struct twopence_target *target, twopence_batch_t *batch)
+{
+  bool failed = false;
+  unsigned int i;
+
+  for (i = 0; i < batch->count; ++i) {
+    twopence_batch_entry_t *entry = batch->entries[i];
+
+    if (failed && batch->policy == TWOPENCE_BATCH_STOP_ON_FAILURE) {
+      entry->rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+      continue;
+    }
+
+    entry->rc = target->ops->run_test(target, &entry->command, &entry->status);
+    if (twopence_batch_entry_failed(entry))
+      failed = true;
+  }
+
+  return 0;
+}
+
+int
+twopence_run_batch(struct twopence_target *target, twopence_batch_t *batch)
+{
+  unsigned int i;
+  int rc;
+
+  if (target->ops->run_test == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (batch->policy != TWOPENCE_BATCH_SEQUENTIAL
+   && batch->policy != TWOPENCE_BATCH_PARALLEL
+   && batch->policy != TWOPENCE_BATCH_STOP_ON_FAILURE)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  for (i = 0; i < batch->count; ++i) {
+    twopence_batch_entry_t *entry = batch->entries[i];
+    twopence_command_t *cmd = &entry->command;
+
+    if (cmd->timeout == 0)
+      cmd->timeout = 60;
+    if (cmd->user == NULL)
+      cmd->user = "root";
+    cmd->background = false;
+
+    /* Commands in a batch do not get any input */
+    twopence_iostream_destroy(&cmd->iostream[TWOPENCE_STDIN]);
+
+    twopence_command_merge_default_env(cmd, &target->env);
+
+    entry->rc = 0;
+    memset(&entry->status, 0, sizeof(entry->status));
+  }
+
+  if (batch->count == 0)
+    return 0;
+
+  if (target->ops->run_batch) {
+    rc = target->ops->run_batch(target, batch);
+    if (rc != TWOPENCE_UNSUPPORTED_FUNCTION_ERROR)
+      return rc;
+  }
+
+  return __twopence_run_batch_fallback(target, batch);
+}
+
 /*
  * Chat script support
  */
@@ -315,7 +641,7 @@ twopence_chat_expect(twopence_target_t *target, twopence_chat_t *chat, const two
 
   deadline = NULL;
   if (args->timeout >= 0) {
-    gettimeofday(&__deadline, NULL);
+    twopence_loop_clock_update(&__deadline);
     __deadline.tv_sec += args->timeout;
     deadline = &__deadline;
   }
@@ -408,7 +734,7 @@ twopence_chat_gets(twopence_target_t *target, twopence_chat_t *chat, char *buf,
     /* We don't have a complete line yet, so wait for input */
     deadline = NULL;
     if (timeout >= 0) {
-      gettimeofday(&__deadline, NULL);
+      twopence_loop_clock_update(&__deadline);
       __deadline.tv_sec += timeout;
       deadline = &__deadline;
     }
@@ -580,23 +906,59 @@ twopence_inject_file
   return rv;
 }
 
+/*
+ * Check a file transfer and populate its defaults
+ */
+static int
+__twopence_file_xfer_prepare(twopence_file_xfer_t *xfer)
+{
+  if (xfer->local_stream == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (xfer->user == NULL)
+    xfer->user = "root";
+  if (xfer->remote.mode == 0)
+    xfer->remote.mode = 0644;
+
+  return 0;
+}
+
 int
 twopence_send_file(struct twopence_target *target, twopence_file_xfer_t *xfer, twopence_status_t *status)
 {
+  int rc;
+
   memset(status, 0, sizeof(*status));
 
   if (target->ops->inject_file == NULL)
     return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
 
-  if (xfer->local_stream == NULL)
+  if ((rc = __twopence_file_xfer_prepare(xfer)) < 0)
+    return rc;
+
+  return target->ops->inject_file(target, xfer, status);
+}
+
+int
+twopence_file_op(twopence_target_t *target, twopence_file_op_t *op, twopence_status_t *status)
+{
+  memset(status, 0, sizeof(*status));
+
+  if (target->ops->file_op == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (op->path == NULL || op->path[0] == '\0')
+    return TWOPENCE_PARAMETER_ERROR;
+  if (twopence_file_op_name(op->op) == NULL)
     return TWOPENCE_PARAMETER_ERROR;
 
-  if (xfer->user == NULL)
-    xfer->user = "root";
-  if (xfer->remote.mode == 0)
-    xfer->remote.mode = 0644;
+  if (op->user == NULL)
+    op->user = "root";
 
-  return target->ops->inject_file(target, xfer, status);
+  /* Drop the results of any previous call */
+  twopence_file_op_destroy(op);
+
+  return target->ops->file_op(target, op, status);
 }
 
 int
@@ -631,20 +993,475 @@ twopence_extract_file
 int
 twopence_recv_file(struct twopence_target *target, twopence_file_xfer_t *xfer, twopence_status_t *status)
 {
+  int rc;
+
   memset(status, 0, sizeof(*status));
 
   if (target->ops->inject_file == NULL)
     return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
 
-  if (xfer->local_stream == NULL)
+  if ((rc = __twopence_file_xfer_prepare(xfer)) < 0)
+    return rc;
+
+  return target->ops->extract_file(target, xfer, status);
+}
+
+/*
+ * Asynchronous API
+ *
+ * Completions that have not been picked up yet are queued on the target.
+ * These are the results of transfers that the plugin could only perform
+ * synchronously, and completions that twopence_wait_any() came across
+ * while waiting for something else.
+ *
+ * Synchronous transfers get ids from a range of their own, so that they
+ * do not clash with the xids or pids the plugin hands out.
+ */
+#define TWOPENCE_SYNC_COMPLETION_ID_BASE	0x40000000
+
+struct twopence_queued_completion {
+  struct twopence_queued_completion *next;
+  twopence_completion_t	completion;
+};
+
+static void
+__twopence_completion_queue(twopence_target_t *target, const twopence_completion_t *comp)
+{
+  struct twopence_queued_completion *qc, **pos;
+
+  qc = twopence_calloc(1, sizeof(*qc));
+  qc->completion = *comp;
+
+  /* Report them in the order they completed */
+  for (pos = &target->done.head; *pos; pos = &(*pos)->next)
+    ;
+  *pos = qc;
+}
+
+static bool
+__twopence_completion_match(const twopence_completion_t *comp, const int *ids, unsigned int nids)
+{
+  unsigned int i;
+
+  if (nids == 0)
+    return true;
+  for (i = 0; i < nids; ++i) {
+    if (comp->id == ids[i])
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Take the first queued completion matching one of @ids (or any, if
+ * @nids is 0) off the queue.
+ */
+static int
+__twopence_completion_dequeue(twopence_target_t *target, twopence_completion_t *comp,
+		const int *ids, unsigned int nids)
+{
+  struct twopence_queued_completion *qc, **pos;
+
+  for (pos = &target->done.head; (qc = *pos) != NULL; pos = &qc->next) {
+    if (__twopence_completion_match(&qc->completion, ids, nids)) {
+      *pos = qc->next;
+      *comp = qc->completion;
+      free(qc);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void
+__twopence_completions_destroy(twopence_target_t *target)
+{
+  struct twopence_queued_completion *qc;
+
+  while ((qc = target->done.head) != NULL) {
+    target->done.head = qc->next;
+    free(qc);
+  }
+}
+
+static int
+__twopence_sync_completion_add(twopence_target_t *target, int rc, const twopence_status_t *status,
+		twopence_file_xfer_t *xfer)
+{
+  twopence_completion_t comp;
+
+  memset(&comp, 0, sizeof(comp));
+  comp.target = target;
+  comp.id = TWOPENCE_SYNC_COMPLETION_ID_BASE + target->done.next_sync_id++;
+  comp.rc = rc;
+  comp.status = *status;
+  comp.xfer = xfer;
+
+  __twopence_completion_queue(target, &comp);
+  return comp.id;
+}
+
+/*
+ * Get the next completion of the target, queued or fresh from the plugin
+ */
+static int
+__twopence_completion_reap(twopence_target_t *target, twopence_completion_t *comp)
+{
+  memset(comp, 0, sizeof(*comp));
+  if (!__twopence_completion_dequeue(target, comp, NULL, 0)
+   && (target->ops->reap == NULL || target->ops->reap(target, comp) <= 0))
+    return 0;
+
+  comp->target = target;
+  return 1;
+}
+
+/*
+ * Hand the completion to the target's callback, if it has one.
+ * Returns true if the completion was consumed.
+ */
+static bool
+__twopence_completion_deliver(twopence_target_t *target, const twopence_completion_t *comp)
+{
+  if (target->completion_cb.fn == NULL)
+    return false;
+
+  target->completion_cb.fn(comp, target->completion_cb.user_data);
+  return true;
+}
+
+void
+twopence_target_set_completion_callback(twopence_target_t *target,
+		twopence_completion_fn_t *fn, void *user_data)
+{
+  target->completion_cb.fn = fn;
+  target->completion_cb.user_data = user_data;
+}
+
+int
+twopence_submit_command(twopence_target_t *target, twopence_command_t *cmd)
+{
+  twopence_status_t status;
+  int rc;
+
+  if (target->ops->reap == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  cmd->background = true;
+
+  rc = twopence_run_test(target, cmd, &status);
+  if (rc == 0)
+    return TWOPENCE_SEND_COMMAND_ERROR;
+  return rc;
+}
+
+int
+twopence_submit_inject(twopence_target_t *target, twopence_file_xfer_t *xfer)
+{
+  twopence_status_t status;
+  int rc;
+
+  if (target->ops->inject_file == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if ((rc = __twopence_file_xfer_prepare(xfer)) < 0)
+    return rc;
+
+  if (target->ops->submit_inject == NULL) {
+    rc = twopence_send_file(target, xfer, &status);
+    return __twopence_sync_completion_add(target, rc, &status, xfer);
+  }
+
+  return target->ops->submit_inject(target, xfer);
+}
+
+int
+twopence_submit_extract(twopence_target_t *target, twopence_file_xfer_t *xfer)
+{
+  twopence_status_t status;
+  int rc;
+
+  if (target->ops->extract_file == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if ((rc = __twopence_file_xfer_prepare(xfer)) < 0)
+    return rc;
+
+  if (target->ops->submit_extract == NULL) {
+    rc = twopence_recv_file(target, xfer, &status);
+    return __twopence_sync_completion_add(target, rc, &status, xfer);
+  }
+
+  return target->ops->submit_extract(target, xfer);
+}
+
+/*
+ * Collect the completions of all targets, up to @max of them
+ */
+static unsigned int
+__twopence_poll_reap(twopence_target_t **targets, unsigned int ntargets,
+		twopence_completion_t *completions, unsigned int max)
+{
+  unsigned int i, count = 0;
+
+  for (i = 0; i < ntargets && count < max; ++i) {
+    twopence_target_t *target = targets[i];
+
+    while (count < max && __twopence_completion_reap(target, &completions[count])) {
+      if (!__twopence_completion_deliver(target, &completions[count]))
+        count++;
+    }
+  }
+
+  return count;
+}
+
+/*
+ * Drive the event loops of all targets.
+ * Targets are grouped by their poll function, so that, for instance, all
+ * targets talking the pipe protocol are serviced by one call to ppoll().
+ * When there is more than one group, none of them gets to block
+ * for longer than TWOPENCE_POLL_SLICE_MSEC.
+ *
+ * Returns 1 if any of the targets still has operations in flight,
+ * 0 if none has, or a negative error.
+ */
+#define TWOPENCE_POLL_SLICE_MSEC	20
+
+static int
+__twopence_poll_doio(twopence_target_t **targets, unsigned int ntargets, twopence_target_t **group,
+		const struct timeval *deadline)
+{
+  int (*poll_fn)(twopence_target_t **, unsigned int, const struct timeval *);
+  unsigned int i, j, count, ngroups = 0;
+  struct timeval slice;
+  bool busy = false;
+  int rc;
+
+  for (i = 0; i < ntargets; ++i) {
+    if ((poll_fn = targets[i]->ops->poll) == NULL)
+      continue;
+    for (j = 0; j < i && targets[j]->ops->poll != poll_fn; ++j)
+      ;
+    if (j == i)
+      ngroups++;
+  }
+
+  if (ngroups > 1) {
+    twopence_loop_clock_update(&slice);
+    slice.tv_usec += 1000 * TWOPENCE_POLL_SLICE_MSEC;
+    if (slice.tv_usec >= 1000000) {
+      slice.tv_sec++;
+      slice.tv_usec -= 1000000;
+    }
+    if (deadline == NULL || timercmp(&slice, deadline, <))
+      deadline = &slice;
+  }
+
+  for (i = 0; i < ntargets; ++i) {
+    if ((poll_fn = targets[i]->ops->poll) == NULL)
+      continue;
+
+    /* Skip this one if we've serviced its group already */
+    for (j = 0; j < i && targets[j]->ops->poll != poll_fn; ++j)
+      ;
+    if (j < i)
+      continue;
+
+    for (j = i, count = 0; j < ntargets; ++j) {
+      if (targets[j]->ops->poll == poll_fn)
+        group[count++] = targets[j];
+    }
+
+    if ((rc = poll_fn(group, count, deadline)) < 0)
+      return rc;
+    if (rc > 0)
+      busy = true;
+  }
+
+  return busy;
+}
+
+int
+twopence_poll(twopence_target_t **targets, unsigned int ntargets, long timeout_ms,
+		twopence_completion_t *completions, unsigned int max)
+{
+  struct timeval __deadline, *deadline = NULL, now;
+  twopence_target_t **group;
+  int rc;
+
+  if (max == 0 || completions == NULL)
     return TWOPENCE_PARAMETER_ERROR;
 
-  if (xfer->user == NULL)
-    xfer->user = "root";
-  if (xfer->remote.mode == 0)
-    xfer->remote.mode = 0644;
+  if (timeout_ms >= 0) {
+    struct timeval delta;
 
-  return target->ops->extract_file(target, xfer, status);
+    delta.tv_sec = timeout_ms / 1000;
+    delta.tv_usec = 1000 * (timeout_ms % 1000);
+
+    twopence_loop_clock_update(&now);
+    timeradd(&now, &delta, &__deadline);
+    deadline = &__deadline;
+  }
+
+  group = twopence_calloc(ntargets? ntargets : 1, sizeof(group[0]));
+  while (true) {
+    if ((rc = __twopence_poll_reap(targets, ntargets, completions, max)) != 0)
+      break;
+
+    if ((rc = __twopence_poll_doio(targets, ntargets, group, deadline)) < 0)
+      break;
+
+    /* Nothing in flight anymore, or we ran out of time. Pick up
+     * whatever completed during the last round of I/O */
+    if (rc == 0) {
+      rc = __twopence_poll_reap(targets, ntargets, completions, max);
+      break;
+    }
+
+    if (deadline) {
+      twopence_loop_clock_get(&now);
+      if (timercmp(&now, deadline, >=)) {
+        rc = __twopence_poll_reap(targets, ntargets, completions, max);
+        break;
+      }
+    }
+  }
+
+  free(group);
+  return rc;
+}
+
+/*
+ * Connect to many targets at once. Targets are grouped by their plugin's
+ * connect function, just like twopence_poll() groups them.
+ */
+int
+twopence_connect(twopence_target_t **targets, unsigned int ntargets, int *results)
+{
+  int (*connect_fn)(twopence_target_t **, unsigned int, int *);
+  twopence_target_t **group;
+  int *group_results, *all_results = results;
+  unsigned int i, j, count;
+  int rc = 0;
+
+  if (ntargets == 0)
+    return 0;
+
+  if (all_results == NULL)
+    all_results = twopence_calloc(ntargets, sizeof(all_results[0]));
+  group = twopence_calloc(ntargets, sizeof(group[0]));
+  group_results = twopence_calloc(ntargets, sizeof(group_results[0]));
+
+  for (i = 0; i < ntargets; ++i)
+    all_results[i] = 0;
+
+  for (i = 0; i < ntargets; ++i) {
+    if ((connect_fn = targets[i]->ops->connect) == NULL)
+      continue;
+
+    /* Skip this one if we've connected its group already */
+    for (j = 0; j < i && targets[j]->ops->connect != connect_fn; ++j)
+      ;
+    if (j < i)
+      continue;
+
+    for (j = i, count = 0; j < ntargets; ++j) {
+      if (targets[j]->ops->connect == connect_fn)
+        group[count++] = targets[j];
+    }
+
+    connect_fn(group, count, group_results);
+
+    for (j = i, count = 0; j < ntargets; ++j) {
+      if (targets[j]->ops->connect == connect_fn)
+        all_results[j] = group_results[count++];
+    }
+  }
+
+  for (i = 0; i < ntargets && rc == 0; ++i)
+    rc = all_results[i];
+
+  free(group);
+  free(group_results);
+  if (all_results != results)
+    free(all_results);
+  return rc;
+}
+
+/*
+ * Wait for any of the given operations of one target to complete.
+ * Other completions that come in while we wait are handed to the
+ * completion callback, or queued for later.
+ */
+static int
+__twopence_wait_any_reap(twopence_target_t *target, const int *ids, unsigned int nids,
+		twopence_completion_t *comp)
+{
+  twopence_completion_t other;
+
+  if (__twopence_completion_dequeue(target, comp, ids, nids)) {
+    comp->target = target;
+    return 1;
+  }
+
+  while (target->ops->reap) {
+    memset(&other, 0, sizeof(other));
+    if (target->ops->reap(target, &other) <= 0)
+      break;
+
+    other.target = target;
+    if (__twopence_completion_match(&other, ids, nids)) {
+      *comp = other;
+      return 1;
+    }
+    if (!__twopence_completion_deliver(target, &other))
+      __twopence_completion_queue(target, &other);
+  }
+
+  return 0;
+}
+
+int
+twopence_wait_any(twopence_target_t *target, const int *ids, unsigned int nids, long timeout_ms,
+		twopence_completion_t *comp)
+{
+  struct timeval __deadline, *deadline = NULL, now;
+  int rc;
+
+  if (comp == NULL || (nids != 0 && ids == NULL))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (timeout_ms >= 0) {
+    struct timeval delta;
+
+    delta.tv_sec = timeout_ms / 1000;
+    delta.tv_usec = 1000 * (timeout_ms % 1000);
+
+    twopence_loop_clock_update(&now);
+    timeradd(&now, &delta, &__deadline);
+    deadline = &__deadline;
+  }
+
+  while (true) {
+    if (__twopence_wait_any_reap(target, ids, nids, comp))
+      return 1;
+
+    if ((rc = __twopence_poll_doio(&target, 1, &target, deadline)) < 0)
+      return rc;
+
+    if (rc == 0)
+      break;
+
+    if (deadline) {
+      twopence_loop_clock_get(&now);
+      if (timercmp(&now, deadline, >=))
+        break;
+    }
+  }
+
+  /* Pick up whatever completed during the last round of I/O */
+  return __twopence_wait_any_reap(target, ids, nids, comp);
 }
 
 int
@@ -855,6 +1672,120 @@ twopence_command_destroy(twopence_command_t *cmd)
     twopence_iostream_destroy(&cmd->iostream[i]);
   }
   twopence_env_destroy(&cmd->env);
+
+  if (cmd->argv) {
+    free(cmd->argv);
+    cmd->argv = NULL;
+  }
+}
+
+/*
+ * Quote a command argument for the shell, unless it's harmless
+ */
+static char *
+__twopence_command_quote_arg(char *pos, const char *arg)
+{
+  if (*arg && arg[strspn(arg, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_@%+=:,./-")] == '\0')
+    return stpcpy(pos, arg);
+
+  *pos++ = '\'';
+  for (; *arg; ++arg) {
+    if (*arg == '\'')
+      pos = stpcpy(pos, "'\\''");
+    else
+      *pos++ = *arg;
+  }
+  *pos++ = '\'';
+  return pos;
+}
+
+/*
+ * Give the command as an argument vector. Servers that support it
+ * execute it directly; for all others, this also sets the command
+ * line to the arguments, quoted for the shell.
+ *
+ * The argument vector, its strings and the command line are copied
+ * into a single allocation, which twopence_command_destroy() frees.
+ */
+bool
+twopence_command_set_argv(twopence_command_t *cmd, const char * const *argv)
+{
+  unsigned int argc, i;
+  size_t size;
+  char *pos;
+
+  if (argv == NULL || argv[0] == NULL)
+    return false;
+
+  /* Quoting makes every argument up to four times as long */
+  size = 0;
+  for (argc = 0; argv[argc]; ++argc)
+    size += 5 * strlen(argv[argc]) + 4;
+
+  if (cmd->argv)
+    free(cmd->argv);
+  cmd->argv = twopence_calloc(1, (argc + 1) * sizeof(char *) + size);
+
+  pos = (char *) (cmd->argv + argc + 1);
+  for (i = 0; i < argc; ++i) {
+    cmd->argv[i] = pos;
+    pos = stpcpy(pos, argv[i]) + 1;
+  }
+
+  cmd->command = pos;
+  for (i = 0; i < argc; ++i) {
+    if (i)
+      *pos++ = ' ';
+    pos = __twopence_command_quote_arg(pos, argv[i]);
+  }
+  *pos = '\0';
+  return true;
+}
+
+/*
+ * Batch handling functions
+ */
+void
+twopence_batch_init(twopence_batch_t *batch, unsigned int policy)
+{
+  memset(batch, 0, sizeof(*batch));
+  batch->policy = policy;
+}
+
+void
+twopence_batch_destroy(twopence_batch_t *batch)
+{
+  unsigned int i;
+
+  for (i = 0; i < batch->count; ++i) {
+    twopence_command_destroy(&batch->entries[i]->command);
+    free(batch->entries[i]);
+  }
+  free(batch->entries);
+  memset(batch, 0, sizeof(*batch));
+}
+
+/*
+ * Add a command to the batch. The command struct is initialized just
+ * like twopence_command_init() does; the caller can modify it afterwards.
+ */
+twopence_command_t *
+twopence_batch_add_command(twopence_batch_t *batch, const char *cmdline)
+{
+  twopence_batch_entry_t *entry;
+
+  entry = twopence_calloc(1, sizeof(*entry));
+  twopence_command_init(&entry->command, cmdline);
+
+  batch->entries = twopence_realloc(batch->entries, (batch->count + 1) * sizeof(batch->entries[0]));
+  batch->entries[batch->count++] = entry;
+  return &entry->command;
+}
+
+bool
+twopence_batch_entry_failed(const twopence_batch_entry_t *entry)
+{
+  return entry->rc < 0 || entry->status.major != 0 || entry->status.minor != 0;
 }
 
 /*
@@ -994,3 +1925,93 @@ twopence_file_xfer_destroy(twopence_file_xfer_t *xfer)
     xfer->local_stream = NULL;
   }
 }
+
+/*
+ * File operation object
+ */
+void
+twopence_file_op_init(twopence_file_op_t *op, unsigned int opcode, const char *path)
+{
+  memset(op, 0, sizeof(*op));
+  op->op = opcode;
+  op->path = path;
+  op->mode = 0755;
+}
+
+void
+twopence_file_op_destroy(twopence_file_op_t *op)
+{
+  unsigned int i;
+
+  for (i = 0; i < op->count; ++i)
+    free(op->entries[i].name);
+  free(op->entries);
+  free(op->stat.name);
+  free(op->link);
+
+  op->entries = NULL;
+  op->count = 0;
+  op->stat.name = NULL;
+  op->link = NULL;
+}
+
+const char *
+twopence_file_op_name(unsigned int opcode)
+{
+  switch (opcode) {
+  case TWOPENCE_FILEOP_STAT:
+    return "stat";
+  case TWOPENCE_FILEOP_LSTAT:
+    return "lstat";
+  case TWOPENCE_FILEOP_MKDIR:
+    return "mkdir";
+  case TWOPENCE_FILEOP_RMDIR:
+    return "rmdir";
+  case TWOPENCE_FILEOP_UNLINK:
+    return "unlink";
+  case TWOPENCE_FILEOP_CHMOD:
+    return "chmod";
+  case TWOPENCE_FILEOP_READLINK:
+    return "readlink";
+  case TWOPENCE_FILEOP_LISTDIR:
+    return "listdir";
+  }
+  return NULL;
+}
+
+/*
+ * Resource usage reporting
+ */
+const char *
+twopence_perf_counter_name(unsigned int counter)
+{
+  static const char *names[__TWOPENCE_PERF_MAX] = {
+    [TWOPENCE_PERF_TASK_CLOCK]		= "task-clock",
+    [TWOPENCE_PERF_CONTEXT_SWITCHES]	= "context-switches",
+    [TWOPENCE_PERF_CPU_MIGRATIONS]	= "cpu-migrations",
+    [TWOPENCE_PERF_PAGE_FAULTS]		= "page-faults",
+    [TWOPENCE_PERF_CYCLES]		= "cycles",
+    [TWOPENCE_PERF_INSTRUCTIONS]	= "instructions",
+    [TWOPENCE_PERF_CACHE_MISSES]	= "cache-misses",
+    [TWOPENCE_PERF_BRANCH_MISSES]	= "branch-misses",
+  };
+
+  if (counter >= __TWOPENCE_PERF_MAX)
+    return NULL;
+  return names[counter];
+}
+
+/*
+ * Record a result of a file operation. The name is copied.
+ */
+void
+twopence_file_op_add_entry(twopence_file_op_t *op, const twopence_file_stat_t *st)
+{
+  twopence_file_stat_t *entry;
+
+  op->entries = twopence_realloc(op->entries, (op->count + 1) * sizeof(op->entries[0]));
+  entry = &op->entries[op->count++];
+
+  *entry = *st;
+  entry->name = st->name? twopence_strdup(st->name) : NULL;
+}
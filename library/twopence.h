@@ -80,10 +80,80 @@ typedef struct twopence_target twopence_target_t;
  * FIXME2: we should probably rename these members to something like
  * plugin_code and exit_code.
  */
+/*
+ * Resource usage of a command, as reported by the twopence server.
+ * This is only valid if the server supports it (protocol 4.5 and later).
+ *
+ * In addition, commands may ask for a number of perf_event counters
+ * to be measured; see the perf_counters member of twopence_command_t.
+ * Counters that the SUT does not support (for instance, hardware
+ * counters inside a virtual machine) are not flagged in perf_valid.
+ */
+enum {
+	TWOPENCE_PERF_TASK_CLOCK = 0,		/* nanoseconds */
+	TWOPENCE_PERF_CONTEXT_SWITCHES,
+	TWOPENCE_PERF_CPU_MIGRATIONS,
+	TWOPENCE_PERF_PAGE_FAULTS,
+	TWOPENCE_PERF_CYCLES,
+	TWOPENCE_PERF_INSTRUCTIONS,
+	TWOPENCE_PERF_CACHE_MISSES,
+	TWOPENCE_PERF_BRANCH_MISSES,
+
+	__TWOPENCE_PERF_MAX
+};
+
+#define TWOPENCE_PERF_MASK(n)		(1U << (n))
+#define TWOPENCE_PERF_SOFTWARE		(TWOPENCE_PERF_MASK(TWOPENCE_PERF_TASK_CLOCK) | \
+					 TWOPENCE_PERF_MASK(TWOPENCE_PERF_CONTEXT_SWITCHES) | \
+					 TWOPENCE_PERF_MASK(TWOPENCE_PERF_CPU_MIGRATIONS) | \
+					 TWOPENCE_PERF_MASK(TWOPENCE_PERF_PAGE_FAULTS))
+#define TWOPENCE_PERF_HARDWARE		(TWOPENCE_PERF_MASK(TWOPENCE_PERF_CYCLES) | \
+					 TWOPENCE_PERF_MASK(TWOPENCE_PERF_INSTRUCTIONS) | \
+					 TWOPENCE_PERF_MASK(TWOPENCE_PERF_CACHE_MISSES) | \
+					 TWOPENCE_PERF_MASK(TWOPENCE_PERF_BRANCH_MISSES))
+
+typedef struct twopence_rusage {
+	bool			valid;
+	unsigned long long	utime_usec;
+	unsigned long long	stime_usec;
+	unsigned long long	maxrss_kb;
+	unsigned long long	minflt;
+	unsigned long long	majflt;
+	unsigned long long	nvcsw;
+	unsigned long long	nivcsw;
+
+	unsigned int		perf_valid;
+	unsigned long long	perf[__TWOPENCE_PERF_MAX];
+} twopence_rusage_t;
+
+/*
+ * Timing of a command's output. The client records when the first and
+ * last byte of output arrived, relative to when it sent the command.
+ * If the command asked for TWOPENCE_TIMESTAMP_DATA and the server supports
+ * it, the server_* members tell when the server read these bytes from
+ * the command, relative to when it started the command. The difference
+ * is the time the data spent in transit.
+ */
+typedef struct twopence_timing {
+	unsigned long long	nbytes;
+	unsigned long long	first_byte_nsec;
+	unsigned long long	last_byte_nsec;
+
+	bool			server_valid;
+	unsigned long long	server_first_byte_nsec;
+	unsigned long long	server_last_byte_nsec;
+} twopence_timing_t;
+
 typedef struct twopence_status {
 	int			major;
 	int			minor;
 	int			pid;
+
+	/* Resource usage of the command, if available */
+	twopence_rusage_t	rusage;
+
+	/* Timing of the command's output */
+	twopence_timing_t	timing;
 } twopence_status_t;
 
 /* Forward decls for the plugin functions */
@@ -93,6 +163,10 @@ typedef struct twopence_file_xfer twopence_file_xfer_t;
 typedef struct twopence_chat twopence_chat_t;
 typedef struct twopence_expect twopence_expect_t;
 typedef struct twopence_timer twopence_timer_t;
+typedef struct twopence_batch twopence_batch_t;
+typedef struct twopence_file_op twopence_file_op_t;
+typedef struct twopence_completion twopence_completion_t;
+typedef struct twopence_compress_stats twopence_compress_stats_t;
 
 struct twopence_plugin {
 	const char *		name;
@@ -102,16 +176,52 @@ struct twopence_plugin {
 
 	int			(*run_test)(struct twopence_target *, struct twopence_command *, twopence_status_t *);
 	int			(*wait)(struct twopence_target *, int, twopence_status_t *);
+	int			(*run_batch)(twopence_target_t *, twopence_batch_t *);
 	int			(*chat_recv)(twopence_target_t *, int, const struct timeval *);
 	int			(*chat_send)(twopence_target_t *, int, twopence_iostream_t *);
 
 	int			(*inject_file)(struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
 	int			(*extract_file)(struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
+	int			(*file_op)(twopence_target_t *, twopence_file_op_t *, twopence_status_t *);
 	int			(*exit_remote)(struct twopence_target *);
 	int			(*interrupt_command)(struct twopence_target *);
 	int			(*cancel_transactions)(twopence_target_t *);
 	int			(*disconnect)(twopence_target_t *);
 	void			(*end)(struct twopence_target *);
+
+	/* Asynchronous API.
+	 * submit_inject/submit_extract start a transfer and return its id.
+	 * Plugins that do not provide them get their transfers performed
+	 * synchronously.
+	 * reap returns 1 and fills in the completion if an operation of the
+	 * target has finished, and 0 otherwise. It never blocks.
+	 * poll is called with all targets that share the same poll function,
+	 * and performs one round of I/O on them, waiting no longer than the
+	 * deadline (which may be NULL). It returns the number of targets that
+	 * still have operations in flight, or a negative error.
+	 */
+	int			(*submit_inject)(twopence_target_t *, twopence_file_xfer_t *);
+	int			(*submit_extract)(twopence_target_t *, twopence_file_xfer_t *);
+	int			(*reap)(twopence_target_t *, twopence_completion_t *);
+	int			(*poll)(twopence_target_t **, unsigned int, const struct timeval *);
+
+	/* connect is called with all targets that share the same connect
+	 * function, and brings up their links concurrently. Plugins without
+	 * it connect on first use.
+	 */
+	int			(*connect)(twopence_target_t **, unsigned int, int *results);
+
+	/* Connection cache. park prepares an idle target to be cached, and
+	 * returns how many seconds it may stay in the cache (0 for no limit),
+	 * or -1 if it cannot be cached. adopt hands it to a new owner, and
+	 * returns false if the connection died in the meantime.
+	 * Plugins without these do not have their targets cached.
+	 */
+	int			(*park)(twopence_target_t *);
+	bool			(*adopt)(twopence_target_t *);
+
+	/* Plugins without this do not compress */
+	int			(*get_compress_stats)(twopence_target_t *, twopence_compress_stats_t *);
 };
 
 enum {
@@ -161,6 +271,35 @@ typedef struct twopence_env {
 	char **			array;
 } twopence_env_t;
 
+/*
+ * Timestamps of command output.
+ *
+ * With TWOPENCE_TIMESTAMP_DATA, the server records when it read each chunk
+ * of output from the command, and the client passes these timestamps along
+ * with the data to the command's timestamp_fn, if set.
+ * TWOPENCE_TIMESTAMP_LINES implies TWOPENCE_TIMESTAMP_DATA; in addition, the
+ * client prefixes every line of output with the time elapsed since the command was started, like
+ * "[    1.234567] ". If the server does not support timestamps, the time
+ * the data arrived at the client is used instead.
+ */
+#define TWOPENCE_TIMESTAMP_DATA		0x01
+#define TWOPENCE_TIMESTAMP_LINES	0x02
+
+typedef struct twopence_timestamp {
+	unsigned int		channel;	/* TWOPENCE_STDOUT or TWOPENCE_STDERR */
+	unsigned int		seq;		/* number of the chunk on this channel */
+
+	/* false if the server did not send a timestamp for this chunk */
+	bool			valid;
+	unsigned long long	server_nsec;	/* CLOCK_MONOTONIC on the server */
+	unsigned long long	elapsed_nsec;	/* since the server started the command */
+
+	unsigned long long	received_nsec;	/* since the client sent the command */
+} twopence_timestamp_t;
+
+typedef void		twopence_timestamp_fn_t(twopence_command_t *, const twopence_timestamp_t *,
+				const void *data, unsigned int count);
+
 struct twopence_command {
 	/* Specify the command as a single string.
 	 * This gets passed to /bin/sh on the remote end, so wildcards,
@@ -168,6 +307,13 @@ struct twopence_command {
 	 */
 	const char *		command;
 
+	/* Alternatively, the command and its arguments, which the
+	 * server executes without involving a shell. Set this with
+	 * twopence_command_set_argv(), which also fills in a command
+	 * line for servers that do not support this.
+	 */
+	char **			argv;
+
 	/* The user to run this as. Default to root */
 	const char *		user;
 
@@ -193,6 +339,19 @@ struct twopence_command {
 	 */
 	twopence_env_t		env;
 
+	/* The perf_event counters to measure while the command runs,
+	 * as a mask of TWOPENCE_PERF_MASK() values. Default to none.
+	 */
+	unsigned int		perf_counters;
+
+	/* Timestamping of the command's output, as a mask of
+	 * TWOPENCE_TIMESTAMP_* flags. If timestamp_fn is set, it is called
+	 * for every chunk of output before it is written to the ostream.
+	 */
+	unsigned int		timestamps;
+	twopence_timestamp_fn_t *timestamp_fn;
+	void *			timestamp_data;
+
 	/* How to handle the command's standard I/O.
 	 * stdin defaults to no input, stdout and stderr default to
 	 * the standard output fds
@@ -202,6 +361,38 @@ struct twopence_command {
 	twopence_buf_t		buffer[__TWOPENCE_IO_MAX];
 };
 
+/*
+ * A batch of commands, which are submitted to the target all at once.
+ * Depending on the policy, the server runs them one after the other, or
+ * all at the same time. With TWOPENCE_BATCH_STOP_ON_FAILURE, commands are
+ * run one after the other, and the first command that fails causes all
+ * remaining commands to be skipped.
+ */
+enum {
+	TWOPENCE_BATCH_SEQUENTIAL = 0,
+	TWOPENCE_BATCH_PARALLEL = 1,
+	TWOPENCE_BATCH_STOP_ON_FAILURE = 2,
+};
+
+typedef struct twopence_batch_entry {
+	twopence_command_t	command;
+
+	/* The result of running this command. rc is 0 if the command
+	 * was executed, in which case status holds its exit status.
+	 * Commands that were skipped have an rc of
+	 * TWOPENCE_COMMAND_CANCELED_ERROR.
+	 */
+	int			rc;
+	twopence_status_t	status;
+} twopence_batch_entry_t;
+
+struct twopence_batch {
+	unsigned int		policy;
+
+	unsigned int		count;
+	twopence_batch_entry_t **entries;
+};
+
 typedef struct twopence_remote_file twopence_remote_file_t;
 struct twopence_remote_file {
 	const char *		name;
@@ -220,6 +411,55 @@ struct twopence_file_xfer {
 	bool			print_dots;
 };
 
+/*
+ * File operations that the server performs itself, without running
+ * a shell command.
+ */
+enum {
+	TWOPENCE_FILEOP_STAT = 1,
+	TWOPENCE_FILEOP_LSTAT,
+	TWOPENCE_FILEOP_MKDIR,
+	TWOPENCE_FILEOP_RMDIR,
+	TWOPENCE_FILEOP_UNLINK,
+	TWOPENCE_FILEOP_CHMOD,
+	TWOPENCE_FILEOP_READLINK,
+	TWOPENCE_FILEOP_LISTDIR,
+};
+
+typedef struct twopence_file_stat {
+	char *			name;
+	unsigned int		mode;		/* including the S_IFMT bits */
+	unsigned int		uid;
+	unsigned int		gid;
+	unsigned int		nlink;
+	unsigned long long	size;
+	long long		mtime;
+} twopence_file_stat_t;
+
+struct twopence_file_op {
+	unsigned int		op;
+	const char *		path;
+
+	/* remote user account to use for this operation.
+	 * If NULL, defaults to root */
+	const char *		user;
+
+	/* permissions for MKDIR and CHMOD */
+	unsigned int		mode;
+
+	/* The results.
+	 * STAT, LSTAT:	the file's stat information in stat.
+	 * READLINK:	the link target in link, and the lstat information
+	 *		of the symlink in stat.
+	 * LISTDIR:	one entry per directory entry, without "." and "..".
+	 *		The stat information is that of lstat.
+	 */
+	twopence_file_stat_t	stat;
+	char *			link;
+	unsigned int		count;
+	twopence_file_stat_t *	entries;
+};
+
 struct twopence_chat {
 	int			pid;
 
@@ -258,8 +498,8 @@ enum {
 };
 
 struct twopence_timer {
-	struct twopence_timer **prev;
-	struct twopence_timer *	next;
+	struct twopence_timer *	next;		/* on the list of expired timers */
+	unsigned int		heap_index;	/* position in the timer heap + 1; 0 if not queued */
 
 	unsigned int		refcount;
 
@@ -288,6 +528,22 @@ struct twopence_target {
 	 * being passed to the server on all
 	 * remote command executions. */
 	twopence_env_t		env;
+
+	/* Completions waiting to be picked up by twopence_poll() or
+	 * twopence_wait_any() */
+	struct {
+		struct twopence_queued_completion *head;
+		int		next_sync_id;
+	} done;
+
+	/* Set by twopence_target_set_completion_callback() */
+	struct {
+		void		(*fn)(const struct twopence_completion *, void *);
+		void *		user_data;
+	} completion_cb;
+	/* The spec the target was created from; this is what the
+	 * connection cache is keyed on */
+	char *			spec;
 };
 
 /*
@@ -310,18 +566,37 @@ extern int		twopence_target_new(const char *target_spec, struct twopence_target
 /*
  * Set target-specific options
  *
- * Currently, the only use we have for this is to tune the keepalive
+ * Originally, the only use we had for this was to tune the keepalive
  * values; and the only reason we want to do this is to test keepalive :-)
  * Not sure whether this warrant a first-class interface, but I had
  * no better idea.
+ *
+ * The compression option enables or disables compression of command
+ * output and file data on links using the twopence protocol. It is on
+ * by default for serial and virtio targets.
+ *
+ * The connect timeout limits how long we wait for the link to come up
+ * and the server to answer, in milliseconds. By default, there is no
+ * limit.
  */
 extern int		twopence_target_set_option(struct twopence_target *,
 					int option, const void *value_p);
 
 enum {
 	TWOPENCE_TARGET_OPTION_KEEPALIVE = 0,	/* value_p is an int pointer */
+	TWOPENCE_TARGET_OPTION_COMPRESSION = 1,	/* value_p is an int pointer */
+	TWOPENCE_TARGET_OPTION_CONNECT_TIMEOUT = 2, /* value_p is an int pointer */
 };
 
+/*
+ * Connect to all of the given targets at once, rather than one after
+ * the other on first use. If results is not NULL, results[i] receives 0
+ * or the error code for targets[i].
+ *
+ * Returns 0 if all targets are connected, or the first error.
+ */
+extern int		twopence_connect(twopence_target_t **targets, unsigned int ntargets, int *results);
+
 /*
  * Set default environment variables passed to each command executed
  */
@@ -350,6 +625,39 @@ extern void		twopence_target_passenv(twopence_target_t *target,
  */
 extern int		twopence_run_test(struct twopence_target *, twopence_command_t *, twopence_status_t *);
 
+/*
+ * Run a batch of commands.
+ *
+ * All commands of the batch are sent to the server in as few requests
+ * as possible, rather than one round trip per command. Commands in a batch
+ * do not receive any standard input, and their background flag is ignored.
+ * Output of each command goes to the command's own stdout/stderr
+ * streams, and its result is stored in the batch entry.
+ *
+ * If the target does not support batches natively, the commands are
+ * executed one by one; in this case, parallel batches are executed
+ * sequentially.
+ *
+ * Returns 0 if the batch was processed, or a negative error code if
+ * it could not be submitted at all. Failures of individual commands
+ * are reported in the batch entries only.
+ */
+extern int		twopence_run_batch(twopence_target_t *, twopence_batch_t *);
+
+/*
+ * Perform a file operation on the remote host.
+ *
+ * The server executes these directly, as the requested user, rather than
+ * spawning a shell command. This makes checks like "does this file exist"
+ * a lot cheaper.
+ *
+ * Returns 0 on success. If the operation failed on the remote host,
+ * TWOPENCE_REMOTE_FILE_ERROR is returned, and status->major holds the
+ * remote errno (e.g. ENOENT). Targets that do not support native file
+ * operations return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR.
+ */
+extern int		twopence_file_op(twopence_target_t *, twopence_file_op_t *, twopence_status_t *);
+
 /*
  * Wait for a previously backgrounded command to complete.
  *
@@ -360,6 +668,66 @@ extern int		twopence_run_test(struct twopence_target *, twopence_command_t *, tw
  */
 extern int		twopence_wait(struct twopence_target *, int, twopence_status_t *);
 
+/*
+ * Asynchronous API.
+ *
+ * twopence_submit_command(), twopence_submit_inject() and
+ * twopence_submit_extract() start an operation on the target and return
+ * right away. On success, they return a positive id that identifies the
+ * operation on this target.
+ *
+ * twopence_poll() performs I/O on all of the given targets from one event
+ * loop, and waits for up to @timeout_ms milliseconds (forever, if negative)
+ * for operations to complete. It stores up to @max completions in the
+ * array provided, and returns their number. It returns 0 if the timeout
+ * expired, or if none of the targets has any operations in flight.
+ *
+ * The command or xfer object must remain valid until its completion has
+ * been returned. Completions of background commands started with
+ * twopence_run_test() are reported by twopence_poll() as well; do not mix
+ * twopence_poll() and twopence_wait() on the same target.
+ */
+struct twopence_completion {
+	twopence_target_t *	target;
+	int			id;
+
+	/* 0 if the operation was carried out, in which case status holds
+	 * its result. A failed transfer is reported as TWOPENCE_REMOTE_FILE_ERROR,
+	 * like twopence_send_file() and twopence_recv_file() do. */
+	int			rc;
+	twopence_status_t	status;
+
+	/* The object passed to twopence_submit_*; one of them is NULL */
+	twopence_command_t *	command;
+	twopence_file_xfer_t *	xfer;
+};
+
+extern int		twopence_submit_command(twopence_target_t *, twopence_command_t *);
+extern int		twopence_submit_inject(twopence_target_t *, twopence_file_xfer_t *);
+extern int		twopence_submit_extract(twopence_target_t *, twopence_file_xfer_t *);
+extern int		twopence_poll(twopence_target_t **targets, unsigned int ntargets, long timeout_ms,
+					twopence_completion_t *completions, unsigned int max);
+
+/*
+ * twopence_wait_any() waits for up to @timeout_ms milliseconds (forever,
+ * if negative) for one of the operations listed in @ids to complete; if
+ * @nids is 0, any operation of the target will do. It returns 1 and fills
+ * in @comp when one did, and 0 if the timeout expired or none of them
+ * is in flight.
+ *
+ * Once a completion callback has been installed on a target, all its
+ * completions are passed to the callback instead of being returned by
+ * twopence_poll() - except the ones twopence_wait_any() is waiting for.
+ * The callback is invoked from within twopence_poll() or twopence_wait_any(),
+ * in the calling thread, never from inside a transport.
+ */
+typedef void		twopence_completion_fn_t(const twopence_completion_t *, void *user_data);
+
+extern int		twopence_wait_any(twopence_target_t *, const int *ids, unsigned int nids,
+					long timeout_ms, twopence_completion_t *comp);
+extern void		twopence_target_set_completion_callback(twopence_target_t *,
+					twopence_completion_fn_t *fn, void *user_data);
+
 /*
  * Initialize a chat object
  */
@@ -572,6 +940,77 @@ extern int		twopence_interrupt_command(struct twopence_target *target);
  */
 extern int		twopence_timer_create(unsigned long timeout_ms, twopence_timer_t **timer_ret);
 
+/*
+ * Statistics of the library's internal object caches (packet buffers,
+ * transactions etc). Fills in at most @max entries, and returns the
+ * number of caches in use.
+ */
+typedef struct twopence_slab_stats {
+	const char *		name;
+	unsigned int		object_size;
+	unsigned long		nalloc;		/* objects handed out */
+	unsigned long		nreused;	/* ... of which came from the free list */
+	unsigned long		nfree;		/* objects returned */
+	unsigned int		cached;		/* objects currently on the free list */
+} twopence_slab_stats_t;
+
+extern unsigned int	twopence_slab_get_stats(twopence_slab_stats_t *stats, unsigned int max);
+
+/*
+ * Release all memory held by the library's object caches
+ */
+extern void		twopence_slab_shrink_all(void);
+
+/*
+ * Connection cache.
+ *
+ * When enabled, twopence_target_free() does not close the connection of
+ * an idle target, but parks the target for up to @seconds. A subsequent
+ * twopence_target_new() with the same spec picks it up again, saving the
+ * handshake with the server (and for chroot and local targets, starting
+ * a new server process). A timeout of 0 disables the cache, and destroys
+ * all cached targets.
+ *
+ * The cache is off by default, unless the TWOPENCE_TARGET_CACHE
+ * environment variable is set to the number of seconds. Only targets using
+ * the twopence protocol are cached.
+ */
+typedef struct twopence_target_cache_stats {
+	unsigned long		hits;		/* twopence_target_new() reused a cached target */
+	unsigned long		misses;		/* ... had to create a new one */
+	unsigned long		parked;		/* targets cached by twopence_target_free() */
+	unsigned long		expired;	/* cached targets destroyed because they were idle too long,
+						 * or their connection died */
+	unsigned long		flushed;	/* cached targets destroyed by twopence_target_cache_flush(),
+						 * or by disabling the cache */
+	unsigned int		cached;		/* targets currently in the cache */
+} twopence_target_cache_stats_t;
+
+extern void		twopence_target_cache_set_idle_timeout(unsigned int seconds);
+extern void		twopence_target_cache_get_stats(twopence_target_cache_stats_t *);
+extern void		twopence_target_cache_flush(void);
+
+/*
+ * Compression statistics of a target's connection. The counters cover
+ * the data packets sent (deflate) and received (inflate) since the
+ * target connected, including those that were not worth compressing.
+ * For a target that is not connected, all counters are zero.
+ */
+typedef struct twopence_codec_stats {
+	unsigned long		npackets;	/* data packets sent/received */
+	unsigned long		ncompressed;	/* ... of which were compressed */
+	unsigned long long	raw_bytes;	/* payload bytes before compression */
+	unsigned long long	wire_bytes;	/* payload bytes on the wire */
+	unsigned long long	cpu_nsec;	/* CPU time spent in the codec */
+} twopence_codec_stats_t;
+
+struct twopence_compress_stats {
+	twopence_codec_stats_t	deflate;
+	twopence_codec_stats_t	inflate;
+};
+
+extern int		twopence_target_get_compress_stats(twopence_target_t *, twopence_compress_stats_t *);
+
 /*
  * Close the library
  *
@@ -591,6 +1030,7 @@ extern void		twopence_perror(const char *, int rc);
  */
 extern void		twopence_command_init(twopence_command_t *cmd, const char *cmdline);
 extern void		twopence_command_destroy(twopence_command_t *cmd);
+extern bool		twopence_command_set_argv(twopence_command_t *cmd, const char * const *argv);
 extern void		twopence_command_setenv(twopence_command_t *cmd, const char *name, const char *value);
 extern void		twopence_command_passenv(twopence_command_t *cmd, const char *name);
 extern void		twopence_command_merge_default_env(twopence_command_t *cmd, const twopence_env_t *def_env);
@@ -600,6 +1040,14 @@ extern void		twopence_command_ostream_reset(twopence_command_t *, twopence_iofd_
 extern void		twopence_command_ostream_capture(twopence_command_t *, twopence_iofd_t, twopence_buf_t *);
 extern void		twopence_command_iostream_redirect(twopence_command_t *, twopence_iofd_t, int, bool closeit);
 
+/*
+ * Handling for the batch struct
+ */
+extern void		twopence_batch_init(twopence_batch_t *batch, unsigned int policy);
+extern void		twopence_batch_destroy(twopence_batch_t *batch);
+extern twopence_command_t *twopence_batch_add_command(twopence_batch_t *batch, const char *cmdline);
+extern bool		twopence_batch_entry_failed(const twopence_batch_entry_t *entry);
+
 extern void		twopence_env_init(twopence_env_t *env);
 extern void		twopence_env_set(twopence_env_t *, const char *name, const char *value);
 extern void		twopence_env_unset(twopence_env_t *, const char *name);
@@ -614,6 +1062,19 @@ extern void		twopence_env_destroy(twopence_env_t *);
 extern void		twopence_file_xfer_init(twopence_file_xfer_t *xfer);
 extern void		twopence_file_xfer_destroy(twopence_file_xfer_t *xfer);
 
+/*
+ * Utility functions for the file_op struct
+ */
+extern void		twopence_file_op_init(twopence_file_op_t *op, unsigned int opcode, const char *path);
+extern void		twopence_file_op_destroy(twopence_file_op_t *op);
+extern const char *	twopence_file_op_name(unsigned int opcode);
+extern void		twopence_file_op_add_entry(twopence_file_op_t *op, const twopence_file_stat_t *st);
+
+/*
+ * Name of a perf counter, such as "instructions"
+ */
+extern const char *	twopence_perf_counter_name(unsigned int counter);
+
 /*
  * Output handling functions
  */
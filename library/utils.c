@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <sys/time.h>
+#include <time.h>
 #include <string.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -51,21 +52,70 @@ ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *ts, const sigset_t
     else
         timeout_ms = -1;
 
+    /* Not atomic, but better than ignoring the mask altogether. Callers
+     * rely on this to receive SIGCHLD while waiting. */
+    if (sigmask) {
+        sigset_t omask;
+        int rv, saved_errno;
+
+        sigprocmask(SIG_SETMASK, sigmask, &omask);
+        rv = poll(fds, nfds, timeout_ms);
+        saved_errno = errno;
+        sigprocmask(SIG_SETMASK, &omask, NULL);
+        errno = saved_errno;
+        return rv;
+    }
+
     return poll(fds, nfds, timeout_ms);
 }
 #endif
 
+/*
+ * The loop clock.
+ * All timeouts and deadlines in the library (timers, transaction timeouts,
+ * keepalives, resume grace periods) are measured on CLOCK_MONOTONIC, so
+ * that the wall clock being set, e.g. by NTP on a freshly booted guest,
+ * does not make them fire early or late.
+ *
+ * The event loop reads the clock once before it goes to sleep, and once
+ * when it wakes up. Code that runs in between, such as processing
+ * incoming packets, uses the cached value from twopence_loop_clock_get()
+ * rather than asking the kernel over and over again.
+ */
+static __thread struct timeval	__twopence_loop_now;
+
+void
+twopence_loop_clock_update(struct timeval *now)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		__twopence_loop_now.tv_sec = ts.tv_sec;
+		__twopence_loop_now.tv_usec = ts.tv_nsec / 1000;
+	}
+	if (now)
+		*now = __twopence_loop_now;
+}
+
+void
+twopence_loop_clock_get(struct timeval *now)
+{
+	if (!timerisset(&__twopence_loop_now))
+		twopence_loop_clock_update(NULL);
+	*now = __twopence_loop_now;
+}
+
 void
 twopence_timeout_init(twopence_timeout_t *tmo)
 {
-	gettimeofday(&tmo->now, NULL);
+	twopence_loop_clock_update(&tmo->now);
 	timerclear(&tmo->until);
 }
 
 bool
 twopence_timeout_update(twopence_timeout_t *tmo, const struct timeval *deadline)
 {
-	if (deadline->tv_sec == 0)
+	if (!timerisset(deadline))
 		return true;
 
 	if (timercmp(&tmo->now, deadline, >=)) {
@@ -92,19 +142,31 @@ twopence_timeout_msec(const twopence_timeout_t *tmo)
 }
 
 struct timespec *
-twopence_timeout_timespec(const twopence_timeout_t *tmo)
+twopence_timeout_timespec(const twopence_timeout_t *tmo, struct timespec *value)
 {
-	static struct timespec value;
 	struct timeval delta;
 
 	if (!timerisset(&tmo->until))
 		return NULL;
 
 	timersub(&tmo->until, &tmo->now, &delta);
-	value.tv_sec = delta.tv_sec;
-	value.tv_nsec = delta.tv_usec * 1000;
+	value->tv_sec = delta.tv_sec;
+	value->tv_nsec = delta.tv_usec * 1000;
 
-	return &value;
+	return value;
+}
+
+/*
+ * Nanoseconds on the monotonic clock, for measuring intervals
+ */
+unsigned long long
+twopence_monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 void
@@ -131,6 +193,7 @@ twopence_pollinfo_update(twopence_pollinfo_t *pinfo, int fd, int events, const s
 
 	pfd = pinfo->pfd + pinfo->num_fds++;
 	pfd->events = events;
+	pfd->revents = 0;
 	pfd->fd = fd;
 
 	return pfd;
@@ -139,17 +202,162 @@ twopence_pollinfo_update(twopence_pollinfo_t *pinfo, int fd, int events, const s
 int
 twopence_pollinfo_poll(const twopence_pollinfo_t *pinfo)
 {
+	int rv;
+
 	if (pinfo->num_fds == 0)
 		twopence_debug("No events to wait for?!\n");
-	return poll(pinfo->pfd, pinfo->num_fds, twopence_timeout_msec(&pinfo->timeout));
+	rv = poll(pinfo->pfd, pinfo->num_fds, twopence_timeout_msec(&pinfo->timeout));
+	twopence_loop_clock_update(NULL);
+	return rv;
 }
 
 int
 twopence_pollinfo_ppoll(const twopence_pollinfo_t *pinfo, const sigset_t *mask)
 {
+	struct timespec ts;
+	int rv;
+
 	if (pinfo->num_fds == 0)
 		twopence_debug("No events to wait for?!\n");
-	return ppoll(pinfo->pfd, pinfo->num_fds, twopence_timeout_timespec(&pinfo->timeout), mask);
+	rv = ppoll(pinfo->pfd, pinfo->num_fds, twopence_timeout_timespec(&pinfo->timeout, &ts), mask);
+	twopence_loop_clock_update(NULL);
+	return rv;
+}
+
+/*
+ * Ready lists
+ */
+void
+twopence_ready_init(twopence_ready_t *node, void *owner)
+{
+	memset(node, 0, sizeof(*node));
+	node->owner = owner;
+}
+
+void
+twopence_ready_list_init(twopence_ready_list_t *list, twopence_ready_t *parent)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+	list->parent = parent;
+}
+
+static void
+__twopence_ready_append(twopence_ready_list_t *list, twopence_ready_t *node)
+{
+	assert(node->prev == NULL);
+	node->next = NULL;
+	node->prev = list->tail;
+	*list->tail = node;
+	list->tail = &node->next;
+}
+
+void
+twopence_ready_unlink(twopence_ready_t *node)
+{
+	if (node->prev == NULL)
+		return;
+
+	*node->prev = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		node->list->tail = node->prev;
+	node->next = NULL;
+	node->prev = NULL;
+}
+
+/*
+ * From now on, marking the node puts it on the given list
+ */
+void
+twopence_ready_attach(twopence_ready_t *node, twopence_ready_list_t *list)
+{
+	twopence_ready_unlink(node);
+	node->list = list;
+}
+
+void
+twopence_ready_detach(twopence_ready_t *node)
+{
+	twopence_ready_unlink(node);
+	node->list = NULL;
+}
+
+/*
+ * Ask the event loop to look at this object. If it is already on its
+ * list, so is its parent.
+ */
+void
+twopence_ready_mark(twopence_ready_t *node)
+{
+	while (node != NULL && node->list != NULL && node->prev == NULL) {
+		__twopence_ready_append(node->list, node);
+		node = node->list->parent;
+	}
+}
+
+/*
+ * Walking a ready list: objects may be freed, or put back on the list,
+ * while we're processing them. So put a marker at the end, and pop
+ * entries off the head until we get to the marker.
+ */
+void
+twopence_ready_list_mark_end(twopence_ready_list_t *list, twopence_ready_t *marker)
+{
+	twopence_ready_init(marker, NULL);
+	marker->list = list;
+	__twopence_ready_append(list, marker);
+}
+
+twopence_ready_t *
+twopence_ready_list_pop(twopence_ready_list_t *list)
+{
+	twopence_ready_t *node;
+
+	if ((node = list->head) != NULL)
+		twopence_ready_unlink(node);
+	return node;
+}
+
+/*
+ * Poll groups
+ */
+void
+twopence_pollgroup_init(twopence_pollgroup_t *group, twopence_ready_t *owner)
+{
+	memset(group, 0, sizeof(*group));
+	group->owner = owner;
+}
+
+/*
+ * Start filling in the group. The pollfds handed out by
+ * twopence_pollinfo_update must not move while the owner holds on to
+ * them, so the caller has to tell us how many it will need.
+ */
+twopence_pollinfo_t *
+twopence_pollgroup_prepare(twopence_pollgroup_t *group, unsigned int max_fds)
+{
+	twopence_pollinfo_t *pinfo = &group->pinfo;
+	struct pollfd *pfd = pinfo->pfd;
+
+	if (max_fds > pinfo->max_fds) {
+		pfd = twopence_realloc(pfd, max_fds * sizeof(pfd[0]));
+	} else {
+		max_fds = pinfo->max_fds;
+	}
+
+	twopence_pollinfo_init(pinfo, pfd, max_fds);
+	return pinfo;
+}
+
+void
+twopence_pollgroup_destroy(twopence_pollgroup_t *group)
+{
+	twopence_epoll_unwatch(group);
+	free(group->pinfo.pfd);
+	free(group->registered);
+	memset(group, 0, sizeof(*group));
 }
 
 /*
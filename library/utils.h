@@ -25,6 +25,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <poll.h>
 #include <signal.h>
 #include <limits.h>
+#include <pthread.h>
+
+#include "twopence.h"
 
 typedef struct twopence_timeout {
 	struct timeval		now;
@@ -38,23 +41,108 @@ typedef struct twopence_pollinfo {
 	twopence_timeout_t	timeout;
 } twopence_pollinfo_t;
 
-typedef struct twopence_timer_list {
-	struct twopence_timer *		head;
-} twopence_timer_list_t;
+typedef struct twopence_epoll twopence_epoll_t;
+
+/*
+ * With epoll, the event loop only looks at the connections and
+ * transactions that have something to do. They put themselves on a
+ * ready list when one of their fds fires, or when something happens
+ * that changes what they are waiting for; putting a transaction on
+ * the list of its connection puts the connection on the list of its
+ * pool, too.
+ */
+typedef struct twopence_ready twopence_ready_t;
+typedef struct twopence_ready_list twopence_ready_list_t;
+
+struct twopence_ready {
+	twopence_ready_t *	next;
+	twopence_ready_t **	prev;		/* NULL if not on the list */
+	twopence_ready_list_t *	list;		/* NULL unless using epoll */
+	void *			owner;
+};
+
+struct twopence_ready_list {
+	twopence_ready_t *	head;
+	twopence_ready_t **	tail;
+	twopence_ready_t *	parent;
+};
+
+/*
+ * The fds a connection or transaction waits for. With epoll, they stay
+ * registered until the owner fills in the group again.
+ */
+typedef struct twopence_pollgroup {
+	twopence_pollinfo_t	pinfo;
+	twopence_ready_t *	owner;
+
+	twopence_epoll_t *	epoll;
+	unsigned int		nregistered, max_registered;
+	int *			registered;
+} twopence_pollgroup_t;
+
+/*
+ * Simple object cache with a bounded free list. Define these as static
+ * variables using TWOPENCE_SLAB_INIT; they register themselves on first use.
+ * The cache is shared by all threads, and protected by its own lock.
+ */
+typedef struct twopence_slab twopence_slab_t;
+struct twopence_slab {
+	twopence_slab_t *	next;
+	const char *		name;
+	unsigned int		object_size;
+	unsigned int		max_cached;
+	bool			registered;
+
+	pthread_mutex_t		lock;
+	struct twopence_slab_object *free_list;
+	twopence_slab_stats_t	stats;
+};
+
+#define TWOPENCE_SLAB_INIT(_name, _size, _max_cached) \
+	{ .name = _name, .object_size = _size, .max_cached = _max_cached, .lock = PTHREAD_MUTEX_INITIALIZER }
 
 #ifndef HAVE_PPOLL
 extern int      ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *ts, const sigset_t *sigmask);
 #endif
 
+extern void		twopence_loop_clock_update(struct timeval *);
+extern void		twopence_loop_clock_get(struct timeval *);
 extern void		twopence_timeout_init(twopence_timeout_t *);
 extern bool		twopence_timeout_update(twopence_timeout_t *, const struct timeval *deadline);
 extern long		twopence_timeout_msec(const twopence_timeout_t *);
+extern unsigned long long twopence_monotonic_nsec(void);
 
 extern void		twopence_pollinfo_init(twopence_pollinfo_t *, struct pollfd *, unsigned int);
 extern struct pollfd *	twopence_pollinfo_update(twopence_pollinfo_t *, int fd, int events, const struct timeval *deadline);
 extern int		twopence_pollinfo_poll(const twopence_pollinfo_t *);
 extern int		twopence_pollinfo_ppoll(const twopence_pollinfo_t *, const sigset_t *);
 
+extern void		twopence_ready_init(twopence_ready_t *, void *owner);
+extern void		twopence_ready_list_init(twopence_ready_list_t *, twopence_ready_t *parent);
+extern void		twopence_ready_attach(twopence_ready_t *, twopence_ready_list_t *);
+extern void		twopence_ready_detach(twopence_ready_t *);
+extern void		twopence_ready_mark(twopence_ready_t *);
+extern void		twopence_ready_unlink(twopence_ready_t *);
+extern void		twopence_ready_list_mark_end(twopence_ready_list_t *, twopence_ready_t *marker);
+extern twopence_ready_t *twopence_ready_list_pop(twopence_ready_list_t *);
+
+static inline bool
+twopence_ready_is_queued(const twopence_ready_t *node)
+{
+	return node->prev != NULL;
+}
+
+extern void		twopence_pollgroup_init(twopence_pollgroup_t *, twopence_ready_t *owner);
+extern twopence_pollinfo_t *twopence_pollgroup_prepare(twopence_pollgroup_t *, unsigned int max_fds);
+extern void		twopence_pollgroup_destroy(twopence_pollgroup_t *);
+
+extern twopence_epoll_t *twopence_epoll_new(void);
+extern void		twopence_epoll_free(twopence_epoll_t *);
+extern bool		twopence_epoll_watch(twopence_epoll_t *, twopence_pollgroup_t *);
+extern void		twopence_epoll_unwatch(twopence_pollgroup_t *);
+extern int		twopence_epoll_wait(twopence_epoll_t *, long timeout, const sigset_t *);
+extern void		twopence_epoll_forget_fd(int fd);
+
 extern int		twopence_name_to_signal(const char *signal_name);
 
 extern void *		twopence_malloc(size_t size);
@@ -63,12 +151,11 @@ extern void *		twopence_calloc(size_t nmemb, size_t size);
 extern char *		twopence_strdup(const char *s);
 extern void		twopence_strfree(char **sp);
 
-extern void		twopence_timer_list_insert(twopence_timer_list_t *list, struct twopence_timer *timer);
-extern void		twopence_timer_list_update_timeout(twopence_timer_list_t *, twopence_timeout_t *);
-extern void		twopence_timer_list_expire(twopence_timer_list_t *list);
-extern void		twopence_timer_list_reap(twopence_timer_list_t *list, twopence_timer_list_t *expired);
-extern void		twopence_timer_list_invoke(twopence_timer_list_t *list);
-extern void		twopence_timer_list_destroy(twopence_timer_list_t *list);
+extern void *		twopence_slab_alloc(twopence_slab_t *);
+extern void *		twopence_slab_zalloc(twopence_slab_t *);
+extern void		twopence_slab_free(twopence_slab_t *, void *);
+extern void		twopence_slab_shrink(twopence_slab_t *);
+extern void		twopence_slab_dump_stats(unsigned int debuglevel);
 
 extern void		twopence_timers_update_timeout(twopence_timeout_t *tmo);
 extern void		twopence_timers_run(void);
@@ -51,6 +51,9 @@ __twopence_virtio_init(struct twopence_virtio_target *handle, const char *sockna
 {
   twopence_pipe_target_init(&handle->pipe, TWOPENCE_PLUGIN_VIRTIO, &twopence_virtio_ops, &twopence_virtio_link_ops);
 
+  // virtio serial links are often throttled; compress data where it pays off
+  handle->pipe.compress = TWOPENCE_PROTO_COMPRESS_DEFLATE;
+
   // Initialize the socket address
   handle->address.sun_family = AF_LOCAL;
   if (strlen(sockname) >= sizeof(handle->address.sun_path))
@@ -129,14 +132,24 @@ const struct twopence_plugin twopence_virtio_ops = {
 	.init = twopence_virtio_init,
 	.set_option = twopence_pipe_set_option,
 	.run_test = twopence_pipe_run_test,
+	.run_batch = twopence_pipe_run_batch,
 	.wait = twopence_pipe_wait,
 	.chat_send = twopence_pipe_chat_send,
 	.chat_recv = twopence_pipe_chat_recv,
 	.inject_file = twopence_pipe_inject_file,
 	.extract_file = twopence_pipe_extract_file,
+	.file_op = twopence_pipe_file_op,
 	.exit_remote = twopence_pipe_exit_remote,
 	.interrupt_command = twopence_pipe_interrupt_command,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
 	.end = twopence_pipe_end,
+	.submit_inject = twopence_pipe_submit_inject,
+	.submit_extract = twopence_pipe_submit_extract,
+	.reap = twopence_pipe_reap,
+	.poll = twopence_pipe_poll,
+	.connect = twopence_pipe_connect,
+	.park = twopence_pipe_park,
+	.adopt = twopence_pipe_adopt,
+	.get_compress_stats = twopence_pipe_get_compress_stats,
 };
@@ -117,6 +117,8 @@ Command_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->useTty = 0;
 	self->background = false;
 	self->softfail = false;
+	self->perfCounters = 0;
+	self->timestamps = 0;
 	self->pid = 0;
 
 	twopence_env_init(&self->environ);
@@ -146,6 +148,8 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 		"quiet",
 		"background",
 		"softfail",
+		"perfCounters",
+		"timestamps",
 		NULL
 	};
 	PyObject *stdinObject = NULL, *stdoutObject = NULL, *stderrObject = NULL;
@@ -154,11 +158,13 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 	int quiet = 0;
 	int background = 0;
 	int softfail = 0;
+	unsigned int perfCounters = 0;
+	unsigned int timestamps = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|slOOOiiii", kwlist,
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|slOOOiiiiII", kwlist,
 				&command, &user, &timeout, &stdinObject, &stdoutObject, &stderrObject,
 				&quiet, &quiet,
-				&background, &softfail))
+				&background, &softfail, &perfCounters, &timestamps))
 		return -1;
 
 	self->command = twopence_strdup(command);
@@ -171,6 +177,8 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 	self->quiet = quiet;
 	self->background = background;
 	self->softfail = softfail;
+	self->perfCounters = perfCounters;
+	self->timestamps = timestamps;
 
 	if (stdoutObject == NULL) {
 		stdoutObject = twopence_callType(&PyByteArray_Type, NULL, NULL);
@@ -281,6 +289,8 @@ Command_build(twopence_Command *self, twopence_command_t *cmd)
 	cmd->timeout = self->timeout;
 	cmd->request_tty = self->useTty;
 	cmd->background = self->background;
+	cmd->perf_counters = self->perfCounters;
+	cmd->timestamps = self->timestamps;
 
 	twopence_command_ostreams_reset(cmd);
 	if (self->quiet || self->stdout == Py_None) {
@@ -447,6 +457,10 @@ Command_getattr(twopence_Command *self, char *name)
 		return return_bool(self->background);
 	if (!strcmp(name, "softfail"))
 		return return_bool(self->softfail);
+	if (!strcmp(name, "perfCounters"))
+		return PyInt_FromLong(self->perfCounters);
+	if (!strcmp(name, "timestamps"))
+		return PyInt_FromLong(self->timestamps);
 	if (!strcmp(name, "environ")) {
 		twopence_env_t *env = &self->environ;
 		PyObject *rv = PyTuple_New(env->count);
@@ -522,6 +536,18 @@ Command_setattr(twopence_Command *self, char *name, PyObject *v)
 		self->softfail = !!(PyObject_IsTrue(v));
 		return 0;
 	}
+	if (!strcmp(name, "perfCounters")) {
+		if (!PyInt_Check(v))
+			goto bad_attr;
+		self->perfCounters = PyInt_AsLong(v);
+		return 0;
+	}
+	if (!strcmp(name, "timestamps")) {
+		if (!PyInt_Check(v))
+			goto bad_attr;
+		self->timestamps = PyInt_AsLong(v);
+		return 0;
+	}
 
 	(void) PyErr_Format(PyExc_AttributeError, "Unknown attribute: %s", name);
 	return -1;
@@ -160,4 +160,20 @@ inittwopence(void)
 	twopence_registerType(m, "Timer", &twopence_TimerType);
 
 	twopence_registerErrorConstants(m);
+
+	PyModule_AddIntConstant(m, "BATCH_SEQUENTIAL", TWOPENCE_BATCH_SEQUENTIAL);
+	PyModule_AddIntConstant(m, "BATCH_PARALLEL", TWOPENCE_BATCH_PARALLEL);
+	PyModule_AddIntConstant(m, "BATCH_STOP_ON_FAILURE", TWOPENCE_BATCH_STOP_ON_FAILURE);
+	PyModule_AddIntConstant(m, "TIMESTAMP_DATA", TWOPENCE_TIMESTAMP_DATA);
+	PyModule_AddIntConstant(m, "TIMESTAMP_LINES", TWOPENCE_TIMESTAMP_LINES);
+	PyModule_AddIntConstant(m, "PERF_SOFTWARE", TWOPENCE_PERF_SOFTWARE);
+	PyModule_AddIntConstant(m, "PERF_HARDWARE", TWOPENCE_PERF_HARDWARE);
+	PyModule_AddIntConstant(m, "PERF_TASK_CLOCK", TWOPENCE_PERF_MASK(TWOPENCE_PERF_TASK_CLOCK));
+	PyModule_AddIntConstant(m, "PERF_CONTEXT_SWITCHES", TWOPENCE_PERF_MASK(TWOPENCE_PERF_CONTEXT_SWITCHES));
+	PyModule_AddIntConstant(m, "PERF_CPU_MIGRATIONS", TWOPENCE_PERF_MASK(TWOPENCE_PERF_CPU_MIGRATIONS));
+	PyModule_AddIntConstant(m, "PERF_PAGE_FAULTS", TWOPENCE_PERF_MASK(TWOPENCE_PERF_PAGE_FAULTS));
+	PyModule_AddIntConstant(m, "PERF_CYCLES", TWOPENCE_PERF_MASK(TWOPENCE_PERF_CYCLES));
+	PyModule_AddIntConstant(m, "PERF_INSTRUCTIONS", TWOPENCE_PERF_MASK(TWOPENCE_PERF_INSTRUCTIONS));
+	PyModule_AddIntConstant(m, "PERF_CACHE_MISSES", TWOPENCE_PERF_MASK(TWOPENCE_PERF_CACHE_MISSES));
+	PyModule_AddIntConstant(m, "PERF_BRANCH_MISSES", TWOPENCE_PERF_MASK(TWOPENCE_PERF_BRANCH_MISSES));
 }
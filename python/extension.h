@@ -54,6 +54,8 @@ typedef struct {
 	bool		useTty;
 	bool		background;
 	bool		softfail;
+	unsigned int	perfCounters;
+	unsigned int	timestamps;
 
 	twopence_env_t	environ;
 
@@ -92,6 +94,8 @@ typedef struct {
 	PyObject *	stdout;
 	PyObject *	stderr;
 	PyObject *	command;
+	twopence_rusage_t rusage;
+	twopence_timing_t timing;
 
 	/* for xfer operations */
 	PyObject *	buffer;
@@ -85,6 +85,8 @@ Status_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->stderr = NULL;
 	self->command = NULL;
 	self->buffer = NULL;
+	memset(&self->rusage, 0, sizeof(self->rusage));
+	memset(&self->timing, 0, sizeof(self->timing));
 
 	return (PyObject *)self;
 }
@@ -189,6 +191,87 @@ Status_message(twopence_Status *self)
 	return PyString_FromString(message);
 }
 
+/*
+ * Build a dict describing the resource usage of the remote command,
+ * or return None if the server did not report any.
+ */
+static void
+Status_dict_set_ull(PyObject *dict, const char *key, unsigned long long value)
+{
+	PyObject *obj = PyLong_FromUnsignedLongLong(value);
+
+	PyDict_SetItemString(dict, key, obj);
+	Py_DECREF(obj);
+}
+
+static PyObject *
+Status_rusage(twopence_Status *self)
+{
+	const twopence_rusage_t *ru = &self->rusage;
+	PyObject *result, *perf;
+	unsigned int n;
+
+	if (!ru->valid) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	result = PyDict_New();
+	Status_dict_set_ull(result, "utime", ru->utime_usec);
+	Status_dict_set_ull(result, "stime", ru->stime_usec);
+	Status_dict_set_ull(result, "maxrss", ru->maxrss_kb);
+	Status_dict_set_ull(result, "minflt", ru->minflt);
+	Status_dict_set_ull(result, "majflt", ru->majflt);
+	Status_dict_set_ull(result, "nvcsw", ru->nvcsw);
+	Status_dict_set_ull(result, "nivcsw", ru->nivcsw);
+
+	perf = PyDict_New();
+	for (n = 0; n < __TWOPENCE_PERF_MAX; ++n) {
+		if (ru->perf_valid & TWOPENCE_PERF_MASK(n))
+			Status_dict_set_ull(perf, twopence_perf_counter_name(n), ru->perf[n]);
+	}
+	PyDict_SetItemString(result, "perf", perf);
+	Py_DECREF(perf);
+
+	return result;
+}
+
+/*
+ * Build a dict describing when the command's output was produced
+ * and received, in seconds, or return None if there was none.
+ */
+static void
+Status_dict_set_seconds(PyObject *dict, const char *key, unsigned long long nsec)
+{
+	PyObject *obj = PyFloat_FromDouble(nsec * 1e-9);
+
+	PyDict_SetItemString(dict, key, obj);
+	Py_DECREF(obj);
+}
+
+static PyObject *
+Status_timing(twopence_Status *self)
+{
+	const twopence_timing_t *timing = &self->timing;
+	PyObject *result;
+
+	if (timing->nbytes == 0) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	result = PyDict_New();
+	Status_dict_set_ull(result, "nbytes", timing->nbytes);
+	Status_dict_set_seconds(result, "firstByte", timing->first_byte_nsec);
+	Status_dict_set_seconds(result, "lastByte", timing->last_byte_nsec);
+	if (timing->server_valid) {
+		Status_dict_set_seconds(result, "serverFirstByte", timing->server_first_byte_nsec);
+		Status_dict_set_seconds(result, "serverLastByte", timing->server_last_byte_nsec);
+	}
+
+	return result;
+}
+
 static PyObject *
 Status_getattr(twopence_Status *self, char *name)
 {
@@ -221,6 +304,10 @@ Status_getattr(twopence_Status *self, char *name)
 	}
 	if (!strcmp(name, "message"))
 		return Status_message(self);
+	if (!strcmp(name, "rusage"))
+		return Status_rusage(self);
+	if (!strcmp(name, "timing"))
+		return Status_timing(self);
 
 	PyErr_Format(PyExc_AttributeError, "%s", name);
 	return NULL;
@@ -31,6 +31,7 @@ static PyObject *	Target_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 static int		Target_init(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_getattr(twopence_Target *self, char *name);
 static PyObject *	Target_run(twopence_Target *self, PyObject *args, PyObject *kwds);
+static PyObject *	Target_runBatch(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_wait(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_waitAll(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_property(twopence_Target *self, PyObject *args, PyObject *kwds);
@@ -43,6 +44,14 @@ static PyObject *	Target_unsetenv(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_disconnect(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_cancel_transactions(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_chat(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_stat(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_exists(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_listdir(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_readlink(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_mkdir(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_rmdir(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_unlink(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_chmod(twopence_Target *, PyObject *, PyObject *);
 
 /*
  * Define the python bindings of class "Target"
@@ -63,6 +72,9 @@ static PyMethodDef twopence_targetMethods[] = {
       {	"run", (PyCFunction) Target_run, METH_VARARGS | METH_KEYWORDS,
 	"Run a command on the SUT"
       },
+      {	"runBatch", (PyCFunction) Target_runBatch, METH_VARARGS | METH_KEYWORDS,
+	"Run a list of commands on the SUT in a single request"
+      },
       {	"wait", (PyCFunction) Target_wait, METH_VARARGS | METH_KEYWORDS,
 	"Wait for a backgrounded command to finish",
       },
@@ -81,6 +93,30 @@ static PyMethodDef twopence_targetMethods[] = {
       {	"recvfile", (PyCFunction) Target_recvfile, METH_VARARGS | METH_KEYWORDS,
 	"Transfer a file from the SUT to the local node"
       },
+      {	"stat", (PyCFunction) Target_stat, METH_VARARGS | METH_KEYWORDS,
+	"Get information on a file on the SUT"
+      },
+      {	"exists", (PyCFunction) Target_exists, METH_VARARGS | METH_KEYWORDS,
+	"Check whether a file exists on the SUT"
+      },
+      {	"listdir", (PyCFunction) Target_listdir, METH_VARARGS | METH_KEYWORDS,
+	"List a directory on the SUT"
+      },
+      {	"readlink", (PyCFunction) Target_readlink, METH_VARARGS | METH_KEYWORDS,
+	"Get the target of a symbolic link on the SUT"
+      },
+      {	"mkdir", (PyCFunction) Target_mkdir, METH_VARARGS | METH_KEYWORDS,
+	"Create a directory on the SUT"
+      },
+      {	"rmdir", (PyCFunction) Target_rmdir, METH_VARARGS | METH_KEYWORDS,
+	"Remove a directory on the SUT"
+      },
+      {	"unlink", (PyCFunction) Target_unlink, METH_VARARGS | METH_KEYWORDS,
+	"Remove a file on the SUT"
+      },
+      {	"chmod", (PyCFunction) Target_chmod, METH_VARARGS | METH_KEYWORDS,
+	"Change the permissions of a file on the SUT"
+      },
       {	"setenv", (PyCFunction) Target_setenv, METH_VARARGS | METH_KEYWORDS,
 	"Set an environment variable to be passed to all commands by default"
       },
@@ -300,13 +336,10 @@ Target_findBackgrounded(twopence_Target *tgtObject, pid_t pid)
  * Given a command and its status, build a status object
  */
 static PyObject *
-Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc)
+__Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc)
 {
 	twopence_Status *statusObject;
 
-	if (rc < 0 && !cmdObject->softfail)
-		return twopence_Exception("command execution failed", rc);
-
 	/* Now funnel the captured data to the respective buffer objects */
 	if (twopence_AppendBuffer(cmdObject->stdout, &cmd->buffer[TWOPENCE_STDOUT]) < 0)
 		return NULL;
@@ -335,10 +368,21 @@ Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd,
 	}
 	statusObject->command = (PyObject *) cmdObject;
 	Py_INCREF(cmdObject);
+	statusObject->rusage = status->rusage;
+	statusObject->timing = status->timing;
 
 	return (PyObject *) statusObject;
 }
 
+static PyObject *
+Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc)
+{
+	if (rc < 0 && !cmdObject->softfail)
+		return twopence_Exception("command execution failed", rc);
+
+	return __Target_buildCommandStatus(cmdObject, cmd, status, rc);
+}
+
 static twopence_Status *
 Target_buildCommandStatusShort(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status)
 {
@@ -449,6 +493,101 @@ out:
 	return result;
 }
 
+/*
+ * Run a list of commands on the SUT in one go
+ *
+ *   results = target.runBatch(["ls /tmp", cmd], policy = twopence.BATCH_STOP_ON_FAILURE)
+ *
+ * The list may contain Command objects and strings. This returns a list
+ * of Status objects, one for each command. Errors executing an individual
+ * command, such as a timeout, do not raise an exception; they are
+ * reported through the Status object's localError attribute instead.
+ */
+static PyObject *
+Target_runBatch(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"commands",
+		"policy",
+		NULL
+	};
+	PyObject *listObject, *seq = NULL, *result = NULL;
+	twopence_Command **cmdObjects = NULL;
+	twopence_batch_t batch;
+	int policy = TWOPENCE_BATCH_SEQUENTIAL;
+	Py_ssize_t i, count = 0;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &listObject, &policy))
+		return NULL;
+
+	twopence_batch_init(&batch, policy);
+
+	if ((seq = PySequence_Fast(listObject, "Target.runBatch() expects a list of commands")) == NULL)
+		return NULL;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	cmdObjects = twopence_calloc(count? count : 1, sizeof(cmdObjects[0]));
+
+	for (i = 0; i < count; ++i) {
+		PyObject *object = PySequence_Fast_GET_ITEM(seq, i);
+		twopence_command_t *cmd;
+
+		if (Command_Check(object)) {
+			Py_INCREF(object);
+		} else {
+			PyObject *cmdArgs = Py_BuildValue("(O)", object);
+
+			object = twopence_callType(&twopence_CommandType, cmdArgs, NULL);
+			Py_DECREF(cmdArgs);
+			if (object == NULL)
+				goto out;
+		}
+		cmdObjects[i] = (twopence_Command *) object;
+
+		if (cmdObjects[i]->pid != 0) {
+			PyErr_SetString(PyExc_SystemError, "Command already executing");
+			goto out;
+		}
+
+		cmd = twopence_batch_add_command(&batch, NULL);
+		twopence_command_destroy(cmd);
+		if (Command_build(cmdObjects[i], cmd) < 0)
+			goto out;
+	}
+
+	rc = twopence_run_batch(self->handle, &batch);
+	if (rc < 0) {
+		twopence_Exception("runBatch", rc);
+		goto out;
+	}
+
+	result = PyList_New(count);
+	for (i = 0; i < count; ++i) {
+		twopence_batch_entry_t *entry = batch.entries[i];
+		PyObject *statusObject;
+
+		statusObject = __Target_buildCommandStatus(cmdObjects[i], &entry->command, &entry->status, entry->rc);
+		if (statusObject == NULL) {
+			Py_DECREF(result);
+			result = NULL;
+			goto out;
+		}
+		PyList_SET_ITEM(result, i, statusObject);
+	}
+
+out:
+	for (i = 0; i < count; ++i) {
+		if (cmdObjects[i]) {
+			Py_DECREF(cmdObjects[i]);
+		}
+	}
+	free(cmdObjects);
+	Py_XDECREF(seq);
+	twopence_batch_destroy(&batch);
+	return result;
+}
+
 /*
  * Wait for command(s) to complete
  */
@@ -748,6 +887,270 @@ Target_extract(twopence_Target *self, PyObject *args, PyObject *kwds)
 	return PyInt_FromLong(remoteRc);
 }
 
+/*
+ * Native file operations.
+ * These are performed by the server directly, without running a shell.
+ * Errors on the remote end are raised as OSError with the remote errno.
+ */
+static bool
+Target_fileOp(twopence_Target *self, twopence_file_op_t *op)
+{
+	twopence_status_t status;
+	int rc;
+
+	rc = twopence_file_op(self->handle, op, &status);
+	if (rc == TWOPENCE_REMOTE_FILE_ERROR && status.major != 0) {
+		errno = status.major;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *) op->path);
+		return false;
+	}
+	if (rc < 0) {
+		twopence_Exception(twopence_file_op_name(op->op), rc);
+		return false;
+	}
+	return true;
+}
+
+static PyObject *
+Target_buildFileStat(const twopence_file_stat_t *st)
+{
+	PyObject *result, *value;
+
+	if ((result = PyDict_New()) == NULL)
+		return NULL;
+
+#define SETITEM(name, expr) do { \
+		if ((value = (expr)) == NULL || PyDict_SetItemString(result, name, value) < 0) \
+			goto failed; \
+		Py_DECREF(value); \
+	} while (0)
+
+	SETITEM("mode", PyInt_FromLong(st->mode));
+	SETITEM("uid", PyInt_FromLong(st->uid));
+	SETITEM("gid", PyInt_FromLong(st->gid));
+	SETITEM("nlink", PyInt_FromLong(st->nlink));
+	SETITEM("size", PyLong_FromUnsignedLongLong(st->size));
+	SETITEM("mtime", PyLong_FromLongLong(st->mtime));
+#undef SETITEM
+
+	return result;
+
+failed:
+	Py_XDECREF(value);
+	Py_DECREF(result);
+	return NULL;
+}
+
+/*
+ * Common argument handling for file operations that take a path and a user
+ */
+static bool
+Target_parseFileOp(PyObject *args, PyObject *kwds, twopence_file_op_t *op, unsigned int opcode)
+{
+	static char *kwlist[] = {
+		"path",
+		"user",
+		NULL
+	};
+	char *path, *user = "root";
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|s", kwlist, &path, &user))
+		return false;
+
+	twopence_file_op_init(op, opcode, path);
+	op->user = user;
+	return true;
+}
+
+static PyObject *
+Target_stat(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"path",
+		"user",
+		"follow",
+		NULL
+	};
+	twopence_file_op_t op;
+	char *path, *user = "root";
+	int follow = 1;
+	PyObject *result = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|si", kwlist, &path, &user, &follow))
+		return NULL;
+
+	twopence_file_op_init(&op, follow? TWOPENCE_FILEOP_STAT : TWOPENCE_FILEOP_LSTAT, path);
+	op.user = user;
+
+	if (Target_fileOp(self, &op))
+		result = Target_buildFileStat(&op.stat);
+
+	twopence_file_op_destroy(&op);
+	return result;
+}
+
+static PyObject *
+Target_exists(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	twopence_file_op_t op;
+	twopence_status_t status;
+	PyObject *result = NULL;
+	int rc;
+
+	if (!Target_parseFileOp(args, kwds, &op, TWOPENCE_FILEOP_LSTAT))
+		return NULL;
+
+	rc = twopence_file_op(self->handle, &op, &status);
+	if (rc == 0) {
+		result = Py_True;
+	} else
+	if (rc == TWOPENCE_REMOTE_FILE_ERROR && (status.major == ENOENT || status.major == ENOTDIR)) {
+		result = Py_False;
+	} else
+	if (rc == TWOPENCE_REMOTE_FILE_ERROR) {
+		errno = status.major;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *) op.path);
+	} else {
+		twopence_Exception("exists", rc);
+	}
+
+	twopence_file_op_destroy(&op);
+	Py_XINCREF(result);
+	return result;
+}
+
+/*
+ * Returns a dict mapping the names of all directory entries to their
+ * (lstat) information
+ */
+static PyObject *
+Target_listdir(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	twopence_file_op_t op;
+	PyObject *result = NULL;
+	unsigned int i;
+
+	if (!Target_parseFileOp(args, kwds, &op, TWOPENCE_FILEOP_LISTDIR))
+		return NULL;
+
+	if (!Target_fileOp(self, &op))
+		goto out;
+
+	if ((result = PyDict_New()) == NULL)
+		goto out;
+
+	for (i = 0; i < op.count; ++i) {
+		PyObject *entry;
+
+		if ((entry = Target_buildFileStat(&op.entries[i])) == NULL
+		 || PyDict_SetItemString(result, op.entries[i].name, entry) < 0) {
+			Py_XDECREF(entry);
+			Py_DECREF(result);
+			result = NULL;
+			goto out;
+		}
+		Py_DECREF(entry);
+	}
+
+out:
+	twopence_file_op_destroy(&op);
+	return result;
+}
+
+static PyObject *
+Target_readlink(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	twopence_file_op_t op;
+	PyObject *result = NULL;
+
+	if (!Target_parseFileOp(args, kwds, &op, TWOPENCE_FILEOP_READLINK))
+		return NULL;
+
+	if (Target_fileOp(self, &op))
+		result = PyString_FromString(op.link? op.link : "");
+
+	twopence_file_op_destroy(&op);
+	return result;
+}
+
+static PyObject *
+Target_simpleFileOp(twopence_Target *self, twopence_file_op_t *op)
+{
+	bool ok;
+
+	ok = Target_fileOp(self, op);
+	twopence_file_op_destroy(op);
+	if (!ok)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+Target_mkdir(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"path",
+		"mode",
+		"user",
+		NULL
+	};
+	twopence_file_op_t op;
+	char *path, *user = "root";
+	int mode = 0755;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|is", kwlist, &path, &mode, &user))
+		return NULL;
+
+	twopence_file_op_init(&op, TWOPENCE_FILEOP_MKDIR, path);
+	op.user = user;
+	op.mode = mode;
+	return Target_simpleFileOp(self, &op);
+}
+
+static PyObject *
+Target_rmdir(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	twopence_file_op_t op;
+
+	if (!Target_parseFileOp(args, kwds, &op, TWOPENCE_FILEOP_RMDIR))
+		return NULL;
+	return Target_simpleFileOp(self, &op);
+}
+
+static PyObject *
+Target_unlink(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	twopence_file_op_t op;
+
+	if (!Target_parseFileOp(args, kwds, &op, TWOPENCE_FILEOP_UNLINK))
+		return NULL;
+	return Target_simpleFileOp(self, &op);
+}
+
+static PyObject *
+Target_chmod(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"path",
+		"mode",
+		"user",
+		NULL
+	};
+	twopence_file_op_t op;
+	char *path, *user = "root";
+	int mode;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "si|s", kwlist, &path, &mode, &user))
+		return NULL;
+
+	twopence_file_op_init(&op, TWOPENCE_FILEOP_CHMOD, path);
+	op.user = user;
+	op.mode = mode;
+	return Target_simpleFileOp(self, &op);
+}
+
 /*
  * Common functionality for sendfile/recvfile
  */
@@ -166,8 +166,10 @@ __Timer_callback(twopence_timer_t *t, void *user_data)
 static void
 Timer_dealloc(twopence_Timer *self)
 {
-	if (self->timer)
+	if (self->timer) {
+		twopence_timer_cancel(self->timer);
 		twopence_timer_release(self->timer);
+	}
 	self->timer = NULL;
 
 	drop_object(&self->callback);
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "target.h"
+#include "twopence/twopence.h"
 
 // The ruby module
 VALUE Twopence = Qnil;
@@ -36,12 +37,17 @@ void Init_twopence()
 
   Twopence = rb_define_module("Twopence");
   rb_define_singleton_method(Twopence, "init", method_init, 1);
+  rb_define_const(Twopence, "BATCH_SEQUENTIAL", INT2NUM(TWOPENCE_BATCH_SEQUENTIAL));
+  rb_define_const(Twopence, "BATCH_PARALLEL", INT2NUM(TWOPENCE_BATCH_PARALLEL));
+  rb_define_const(Twopence, "BATCH_STOP_ON_FAILURE", INT2NUM(TWOPENCE_BATCH_STOP_ON_FAILURE));
+  rb_define_const(Twopence, "COMMAND_CANCELED_ERROR", INT2NUM(TWOPENCE_COMMAND_CANCELED_ERROR));
 
   ruby_target_class = rb_define_class_under(Twopence, "Target", rb_cObject);
   rb_define_method(ruby_target_class, "test_and_print_results", method_test_and_print_results, -2);
   rb_define_method(ruby_target_class, "test_and_drop_results", method_test_and_drop_results, -2);
   rb_define_method(ruby_target_class, "test_and_store_results_separately", method_test_and_store_results_separately, -2);
   rb_define_method(ruby_target_class, "test_and_store_results_together", method_test_and_store_results_together, -2);
+  rb_define_method(ruby_target_class, "run_batch", method_run_batch, -2);
   rb_define_method(ruby_target_class, "inject_file", method_inject_file, -2);
   rb_define_method(ruby_target_class, "extract_file", method_extract_file, -2);
   rb_define_method(ruby_target_class, "interrupt_command", method_interrupt_command, 0);
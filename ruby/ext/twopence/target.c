@@ -301,6 +301,105 @@ VALUE method_test_and_store_results_separately(VALUE self, VALUE ruby_args)
                      INT2NUM(rc), INT2NUM(status.major), INT2NUM(status.minor));
 }
 
+// Run a list of test commands in a single request
+//
+// Example:
+//   results = target.run_batch(["ls /tmp", "false", "id"], Twopence::BATCH_STOP_ON_FAILURE)
+//   results.each { |out, err, rc, major, minor| ... }
+// Input:
+//   commands: an array of commands to run
+//   policy: Twopence::BATCH_SEQUENTIAL, BATCH_PARALLEL or BATCH_STOP_ON_FAILURE
+//           (optional, defaults to BATCH_SEQUENTIAL)
+//   user: the user under which to run the commands
+//         (optional, defaults to "root")
+//   timeout: the time in seconds after which each command is aborted
+//            (optional, defaults to 60L)
+// Output:
+//   an array with one [out, err, rc, major, minor] array per command,
+//   as returned by test_and_store_results_separately.
+//   If the batch cannot be submitted, all commands report the error in rc.
+//   Commands skipped because of an earlier failure have an rc of
+//   Twopence::COMMAND_CANCELED_ERROR.
+VALUE method_run_batch(VALUE self, VALUE ruby_args)
+{
+  long len, i;
+  VALUE ruby_commands,
+        ruby_policy,
+        ruby_user,
+        ruby_timeout,
+        ruby_results;
+  struct twopence_target *target;
+  twopence_batch_t batch;
+  int rc;
+
+  Check_Type(ruby_args, T_ARRAY);
+  len = RARRAY_LEN(ruby_args);
+  if (len < 1 || len > 4)
+    rb_raise(rb_eArgError, "wrong number of arguments");
+  ruby_commands = rb_ary_entry(ruby_args, 0);
+  Check_Type(ruby_commands, T_ARRAY);
+  if (len >= 2)
+  {
+    ruby_policy = rb_ary_entry(ruby_args, 1);
+    Check_Type(ruby_policy, T_FIXNUM);
+  }
+  else ruby_policy = INT2NUM(TWOPENCE_BATCH_SEQUENTIAL);
+  if (len >= 3)
+  {
+    ruby_user = rb_ary_entry(ruby_args, 2);
+    Check_Type(ruby_user, T_STRING);
+  }
+  else ruby_user = rb_str_new2("root");
+  if (len >= 4)
+  {
+    ruby_timeout = rb_ary_entry(ruby_args, 3);
+    Check_Type(ruby_timeout, T_FIXNUM);
+  }
+  else ruby_timeout = LONG2NUM(60L);
+  Data_Get_Struct(self, struct twopence_target, target);
+
+  for (i = 0; i < RARRAY_LEN(ruby_commands); i++)
+    Check_Type(rb_ary_entry(ruby_commands, i), T_STRING);
+
+  twopence_batch_init(&batch, NUM2INT(ruby_policy));
+  for (i = 0; i < RARRAY_LEN(ruby_commands); i++)
+  {
+    VALUE ruby_command = rb_ary_entry(ruby_commands, i);
+    twopence_command_t *cmd;
+
+    cmd = twopence_batch_add_command(&batch, StringValueCStr(ruby_command));
+    cmd->user = StringValueCStr(ruby_user);
+    cmd->timeout = NUM2LONG(ruby_timeout);
+
+    twopence_command_ostreams_reset(cmd);
+    twopence_command_ostream_capture(cmd, TWOPENCE_STDOUT, twopence_command_alloc_buffer(cmd, TWOPENCE_STDOUT, 65536));
+    twopence_command_ostream_capture(cmd, TWOPENCE_STDERR, twopence_command_alloc_buffer(cmd, TWOPENCE_STDERR, 65536));
+  }
+
+  // If the batch could not be submitted at all, report this for every command
+  rc = twopence_run_batch(target, &batch);
+  if (rc < 0)
+  {
+    for (i = 0; i < batch.count; i++)
+      batch.entries[i]->rc = rc;
+  }
+
+  ruby_results = rb_ary_new2(batch.count);
+  for (i = 0; i < batch.count; i++)
+  {
+    twopence_batch_entry_t *entry = batch.entries[i];
+
+    rb_ary_push(ruby_results,
+                rb_ary_new3(5,
+                            buffer_value(&entry->command.buffer[TWOPENCE_STDOUT]),
+                            buffer_value(&entry->command.buffer[TWOPENCE_STDERR]),
+                            INT2NUM(entry->rc), INT2NUM(entry->status.major), INT2NUM(entry->status.minor)));
+  }
+
+  twopence_batch_destroy(&batch);
+  return ruby_results;
+}
+
 // Inject a file into the system under test
 //
 // Example:
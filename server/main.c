@@ -46,6 +46,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h>
 
 #include "server.h"
+#include "fileio.h"
 #include "version.h"
 
 #define TWOPENCE_SERIAL_PORT_DEFAULT	"/dev/virtio-ports/org.opensuse.twopence.0"
@@ -60,6 +61,7 @@ static void		server_daemonize(void);
 
 bool			server_audit = true;
 unsigned int		server_audit_seq;
+unsigned int		server_grace_period = DEFAULT_GRACE_PERIOD;
 
 struct server_port {
 	const char *	type;
@@ -275,7 +277,7 @@ server_set_port(struct server_port *port, const char *type, const char *name)
 //////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[])
 {
-  enum { OPT_ONESHOT, OPT_AUDIT, OPT_NOAUDIT, OPT_PORT_STDIO, OPT_ROOT_DIRECTORY };
+  enum { OPT_ONESHOT, OPT_AUDIT, OPT_NOAUDIT, OPT_PORT_STDIO, OPT_ROOT_DIRECTORY, OPT_GRACE_PERIOD, OPT_IO_THREADS };
   static struct option long_opts[] = {
     { "one-shot", no_argument, NULL, OPT_ONESHOT },
     { "port-serial", required_argument, NULL, 'S' },
@@ -288,12 +290,15 @@ int main(int argc, char *argv[])
     { "audit", no_argument, NULL, OPT_AUDIT },
     { "no-audit", no_argument, NULL, OPT_NOAUDIT },
     { "root-directory", required_argument, NULL, OPT_ROOT_DIRECTORY },
+    { "grace-period", required_argument, NULL, OPT_GRACE_PERIOD },
+    { "io-threads", required_argument, NULL, OPT_IO_THREADS },
     { NULL }
   };
   int opt_oneshot = 0;
   struct server_port opt_port;
   bool opt_daemon = false;
   char *opt_root_directory = NULL;
+  unsigned int opt_io_threads = DEFAULT_IO_THREADS;
   int c;
 
   // Welcome message, check arguments
@@ -354,6 +359,30 @@ int main(int argc, char *argv[])
       opt_root_directory = optarg;
       break;
 
+    case OPT_GRACE_PERIOD:
+      {
+	char *end;
+
+	server_grace_period = strtoul(optarg, &end, 0);
+	if (*end != '\0') {
+	  fprintf(stderr, "Unable to parse grace period \"%s\"\n", optarg);
+	  goto usage;
+	}
+      }
+      break;
+
+    case OPT_IO_THREADS:
+      {
+	char *end;
+
+	opt_io_threads = strtoul(optarg, &end, 0);
+	if (*end != '\0') {
+	  fprintf(stderr, "Unable to parse number of I/O threads \"%s\"\n", optarg);
+	  goto usage;
+	}
+      }
+      break;
+
     default:
     usage:
 	fprintf(stderr,
@@ -391,9 +420,19 @@ int main(int argc, char *argv[])
 		"--root-directory path\n"
 		"    Perform a chroot operation to the specified directory before\n"
 		"    starting to service requests.\n"
+		"--grace-period seconds\n"
+		"    When the link to a client is lost, keep its commands running\n"
+		"    for this long, so that the client can reconnect and resume\n"
+		"    the session (default %u, which disables this; resumable sessions\n"
+		"    copy file and command output through buffers instead of\n"
+		"    using sendfile and splice)\n"
+		"--io-threads count\n"
+		"    Number of threads that read and write the files being transferred,\n"
+		"    so that a slow disk does not hold up other requests\n"
+		"    (default %u; 0 does all file I/O from the main loop)\n"
 		"\n"
 		"The default serial port is %s\n"
-		, argv[0], TWOPENCE_SERIAL_PORT_DEFAULT);
+		, argv[0], DEFAULT_GRACE_PERIOD, DEFAULT_IO_THREADS, TWOPENCE_SERIAL_PORT_DEFAULT);
         exit(TWOPENCE_SERVER_PARAMETER_ERROR);
     }
   }
@@ -409,6 +448,8 @@ int main(int argc, char *argv[])
     goto usage;
   }
 
+  twopence_fileio_set_threads(opt_io_threads);
+
   if (opt_root_directory) {
     if (chroot(opt_root_directory) < 0) {
       fprintf(stderr, "Unable to change root directory to \"%s\": chroot failed: %m\n", opt_root_directory);
@@ -490,7 +531,9 @@ int main(int argc, char *argv[])
     alen = sizeof(addr);
     if (getpeername(0, (struct sockaddr *) &addr, &alen) == 0) {
       /* Connected mode implies one-shot behavior - when the client
-       * goes away and closes the socket, then it's gone for good. */
+       * goes away and closes the socket, then it's gone for good.
+       * There is nobody who could resume the session, either. */
+      server_grace_period = 0;
       server_run(twopence_sock_new(0));
     } else {
       if (errno == ENOTSOCK) {
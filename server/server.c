@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h> /* for htons */
@@ -31,6 +32,8 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <dirent.h>
 #include <poll.h>
 #include <time.h>
 #include <termios.h>
@@ -51,6 +54,11 @@
 #include "server.h"
 #include "utils.h"
 
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+#endif
+
 
 static twopence_conn_t *	server_new_connection(twopence_sock_t *, twopence_conn_semantics_t *);
 
@@ -130,44 +138,6 @@ server_change_hats_temporarily(const struct passwd *user, struct saved_ids *save
 	return true;
 }
 
-static bool
-server_change_hats_permanently(const struct passwd *user, int *status)
-{
-	/* Do nothing for the root user */
-	if (!strcmp(user->pw_name, "root"))
-		return true;
-
-	if (initgroups(user->pw_name, user->pw_gid) < 0
-	 || setgid(user->pw_gid) < 0
-	 || setuid(user->pw_uid) < 0) {
-		*status = errno;
-		twopence_log_error("Unable to drop privileges to become user %s: %m", user->pw_name);
-		return false;
-	}
-
-	return true;
-}
-
-static bool
-server_change_to_home(const struct passwd *user)
-{
-	const char *homedir;
-
-	if ((homedir = user->pw_dir) == NULL || homedir[0] != '/') {
-		twopence_debug("user %s has a home directory of \"%s\", substituting \"/\"",
-				user->pw_name, user->pw_dir);
-		homedir = "/";
-	}
-
-	if (chdir(homedir) < 0) {
-		twopence_log_error("Cannot change to user %s's home directory: chdir(%s) failed: %m",
-				user->pw_name, user->pw_dir);
-		return false;
-	}
-
-	return true;
-}
-
 int
 server_open_file_as(const char *username, const char *filename, unsigned int filemode, int oflags, int *status)
 {
@@ -286,10 +256,15 @@ server_build_shell_argv(const char *cmdline)
 	int argc = 0;
 
 	twopence_debug("%s(\"%s\")\n", __func__, cmdline);
-	argv = twopence_calloc(4, sizeof(argv[0]));
+
+	/* The command line points into the connection's receive buffer,
+	 * which is shared with the child process and may be overwritten
+	 * before the child gets to call execve(). Keep a private copy,
+	 * allocated along with argv so it gets freed with it. */
+	argv = twopence_calloc(1, 4 * sizeof(argv[0]) + strlen(cmdline) + 1);
 	argv[argc++] = "/bin/sh";
 	argv[argc++] = "-c";
-	argv[argc++] = (char *) cmdline;
+	argv[argc++] = strcpy((char *) (argv + 4), cmdline);
 	argv[argc] = NULL;
 	return argv;
 }
@@ -309,20 +284,426 @@ server_build_shell_env(twopence_env_t *env, const struct passwd *pw)
 	return env->array;
 }
 
+/*
+ * perf_event counters of a command.
+ * The counters are attached to the child process before it executes the
+ * command, and count the command and all of its descendants.
+ */
+#ifdef __linux__
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} server_perf_events[__TWOPENCE_PERF_MAX] = {
+	[TWOPENCE_PERF_TASK_CLOCK]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	[TWOPENCE_PERF_CONTEXT_SWITCHES]= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[TWOPENCE_PERF_CPU_MIGRATIONS]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	[TWOPENCE_PERF_PAGE_FAULTS]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	[TWOPENCE_PERF_CYCLES]		= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[TWOPENCE_PERF_INSTRUCTIONS]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[TWOPENCE_PERF_CACHE_MISSES]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[TWOPENCE_PERF_BRANCH_MISSES]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static void
+server_perf_open(pid_t pid, unsigned int mask, int *perf_fds)
+{
+	struct perf_event_attr attr;
+	unsigned int i;
+
+	for (i = 0; i < __TWOPENCE_PERF_MAX; ++i) {
+		perf_fds[i] = -1;
+		if (!(mask & TWOPENCE_PERF_MASK(i)))
+			continue;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = server_perf_events[i].type;
+		attr.config = server_perf_events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = 1;
+		attr.enable_on_exec = 1;
+		attr.inherit = 1;
+
+		perf_fds[i] = syscall(__NR_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (perf_fds[i] < 0)
+			twopence_debug("unable to open perf counter %s: %m", twopence_perf_counter_name(i));
+	}
+}
+
+static void
+server_perf_read(int *perf_fds, twopence_rusage_t *ru)
+{
+	struct {
+		uint64_t	value;
+		uint64_t	enabled;
+		uint64_t	running;
+	} data;
+	unsigned int i;
+
+	for (i = 0; i < __TWOPENCE_PERF_MAX; ++i) {
+		if (perf_fds[i] < 0)
+			continue;
+
+		/* If the PMU was shared with other events, scale the count */
+		if (read(perf_fds[i], &data, sizeof(data)) == sizeof(data) && data.running != 0) {
+			if (data.running < data.enabled)
+				data.value = (double) data.value * data.enabled / data.running;
+			ru->perf[i] = data.value;
+			ru->perf_valid |= TWOPENCE_PERF_MASK(i);
+		}
+
+		close(perf_fds[i]);
+		perf_fds[i] = -1;
+	}
+}
+#else
+static void
+server_perf_open(pid_t pid, unsigned int mask, int *perf_fds)
+{
+	unsigned int i;
+
+	for (i = 0; i < __TWOPENCE_PERF_MAX; ++i)
+		perf_fds[i] = -1;
+}
+
+static void
+server_perf_read(int *perf_fds, twopence_rusage_t *ru)
+{
+}
+#endif
+
+static void
+server_rusage_init(twopence_rusage_t *ru, const struct rusage *r)
+{
+	memset(ru, 0, sizeof(*ru));
+	ru->utime_usec = r->ru_utime.tv_sec * 1000000ULL + r->ru_utime.tv_usec;
+	ru->stime_usec = r->ru_stime.tv_sec * 1000000ULL + r->ru_stime.tv_usec;
+	ru->maxrss_kb = r->ru_maxrss;
+	ru->minflt = r->ru_minflt;
+	ru->majflt = r->ru_majflt;
+	ru->nvcsw = r->ru_nvcsw;
+	ru->nivcsw = r->ru_nivcsw;
+	ru->valid = true;
+}
+
+/*
+ * Starting commands.
+ *
+ * fork() has to copy the page tables of the server, and the child then
+ * used to close every fd up to the fd limit, one syscall at a time. On
+ * Linux, we start the child with clone(CLONE_VM|CLONE_VFORK) instead,
+ * so that it borrows our memory until it calls execve(), and close all
+ * fds with a single close_range().
+ *
+ * The child shares our memory, including the state of our threads and
+ * of the C library. So everything it needs is looked up beforehand, and
+ * all it does is a handful of system calls; no logging, no malloc. If
+ * something fails, it tells us how through the shared struct, and exits
+ * with the same codes as before: 125 for the pty, 126 for the user's
+ * credentials and home directory, 127 for everything else. Commands
+ * that cannot be executed, or not found, get 126 and 127, as with the
+ * shell.
+ */
+typedef struct server_spawn {
+	const char *	path;		/* NULL until the child looks up name */
+	char **		argv;
+	char **		env;
+
+	/* Argument vectors without a slash in argv[0] are looked up in
+	 * search_path by the child, in a buffer we allocate beforehand */
+	const char *	name;
+	const char *	search_path;
+	char *		pathbuf;
+
+	/* Only set for users other than root */
+	bool		change_ids;
+	uid_t		uid;
+	gid_t		gid;
+	gid_t *		groups;
+	int		ngroups;
+	const char *	homedir;
+
+	const char *	tty;
+	int		child_fds[3];
+	int		syncfds[2];
+	unsigned int	timeout;
+	sigset_t	sigmask;
+
+	/* Set by the child if it fails */
+	const char *	failed;
+	int		error;
+} server_spawn_t;
+
+/*
+ * glibc's setuid() and friends apply the change to all threads of the
+ * process, by signalling them. That won't work in a child sharing our
+ * memory; the system calls only change the calling process.
+ */
+#ifdef __linux__
+# ifdef SYS_setresuid32
+#  define server_sys_setgroups(n, list)	syscall(SYS_setgroups32, n, list)
+#  define server_sys_setgid(gid)		syscall(SYS_setresgid32, gid, gid, gid)
+#  define server_sys_setuid(uid)		syscall(SYS_setresuid32, uid, uid, uid)
+# else
+#  define server_sys_setgroups(n, list)	syscall(SYS_setgroups, n, list)
+#  define server_sys_setgid(gid)		syscall(SYS_setresgid, gid, gid, gid)
+#  define server_sys_setuid(uid)		syscall(SYS_setresuid, uid, uid, uid)
+# endif
+#else
+# define server_sys_setgroups(n, list)	setgroups(n, list)
+# define server_sys_setgid(gid)		setgid(gid)
+# define server_sys_setuid(uid)		setuid(uid)
+#endif
+
+static gid_t *
+server_get_groups(const struct passwd *user, int *ngroups)
+{
+	gid_t *groups = NULL;
+	int size = 16, count;
+
+	while (true) {
+		groups = twopence_realloc(groups, size * sizeof(groups[0]));
+
+		count = size;
+		if (getgrouplist(user->pw_name, user->pw_gid, groups, &count) >= 0)
+			break;
+
+		/* If the list is too short, count is the size needed */
+		if (count <= size) {
+			free(groups);
+			return NULL;
+		}
+		size = count;
+	}
+
+	*ngroups = count;
+	return groups;
+}
+
+static const char *
+server_get_homedir(const struct passwd *user)
+{
+	const char *homedir;
+
+	if ((homedir = user->pw_dir) == NULL || homedir[0] != '/') {
+		twopence_debug("user %s has a home directory of \"%s\", substituting \"/\"",
+				user->pw_name, user->pw_dir);
+		homedir = "/";
+	}
+	return homedir;
+}
+
+/*
+ * Prepare looking up the command in the PATH of its environment.
+ * Whether the user may execute a file can only be checked once we are
+ * that user, so the child does the actual lookup.
+ */
+static void
+server_spawn_prepare_lookup(server_spawn_t *sp, const char *name)
+{
+	const char *path = "/usr/local/bin:/bin:/usr/bin";
+	char **env;
+
+	for (env = sp->env; *env; ++env) {
+		if (!strncmp(*env, "PATH=", 5))
+			path = *env + 5;
+	}
+
+	sp->name = name;
+	sp->search_path = path;
+	sp->pathbuf = twopence_malloc(strlen(path) + strlen(name) + 2);
+}
+
+/*
+ * Executed by the child, after changing to the user's identity.
+ * Look up the command as the shell would: the first regular file in
+ * the PATH the user may execute. If there are only files the user
+ * may not execute, this fails with EACCES rather than ENOENT.
+ */
+static const char *
+server_spawn_find_executable(server_spawn_t *sp)
+{
+	size_t namelen = strlen(sp->name);
+	const char *dir, *end;
+	bool denied = false;
+
+	for (dir = sp->search_path; ; dir = end + 1) {
+		struct stat stb;
+
+		end = strchrnul(dir, ':');
+
+		/* Ignore empty entries, which would refer to the current directory */
+		if (end != dir) {
+			char *p = sp->pathbuf;
+
+			memcpy(p, dir, end - dir);
+			p += end - dir;
+			*p++ = '/';
+			memcpy(p, sp->name, namelen + 1);
+
+			if (stat(sp->pathbuf, &stb) == 0 && S_ISREG(stb.st_mode)) {
+				if (faccessat(AT_FDCWD, sp->pathbuf, X_OK, AT_EACCESS) == 0)
+					return sp->pathbuf;
+				denied = true;
+			}
+		}
+
+		if (*end == '\0')
+			break;
+	}
+
+	errno = denied? EACCES : ENOENT;
+	return NULL;
+}
+
+static int
+server_spawn_failed(server_spawn_t *sp, const char *what, int exit_code)
+{
+	sp->failed = what;
+	sp->error = errno;
+	return exit_code;
+}
+
+static void
+server_spawn_close_fds(void)
+{
+	int fd, numfds;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, 3, ~0U, 0) == 0)
+		return;
+#endif
+
+	/* Kernels older than 5.9 */
+	numfds = getdtablesize();
+	for (fd = 3; fd < numfds; ++fd)
+		close(fd);
+}
+
+/*
+ * Executed by the child
+ */
+static int
+server_spawn_child(void *arg)
+{
+	server_spawn_t *sp = arg;
+	char dummy;
+	int fd;
+
+	if (setsid() < 0)
+		return server_spawn_failed(sp, "unable to set session id", 127);
+
+	if (sp->change_ids
+	 && (server_sys_setgroups(sp->ngroups, sp->groups) < 0
+	  || server_sys_setgid(sp->gid) < 0
+	  || server_sys_setuid(sp->uid) < 0))
+		return server_spawn_failed(sp, "unable to drop privileges", 126);
+
+	if (chdir(sp->homedir) < 0)
+		return server_spawn_failed(sp, "unable to change to home directory", 126);
+
+	if (sp->tty) {
+		if ((fd = open(sp->tty, O_RDWR | O_NOCTTY)) < 0)
+			return server_spawn_failed(sp, "unable to open slave pty", 125);
+
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+	} else {
+		dup2(sp->child_fds[0], 0);
+		dup2(sp->child_fds[1], 1);
+		dup2(sp->child_fds[2], 2);
+	}
+
+	if (sp->syncfds[0] >= 0) {
+		close(sp->syncfds[1]);
+		while (read(sp->syncfds[0], &dummy, 1) < 0 && errno == EINTR)
+			;
+	}
+
+	server_spawn_close_fds();
+
+	alarm(sp->timeout);
+	sigprocmask(SIG_SETMASK, &sp->sigmask, NULL);
+
+	if (sp->path == NULL
+	 && (sp->path = server_spawn_find_executable(sp)) == NULL) {
+		if (errno == EACCES)
+			return server_spawn_failed(sp, "permission denied", 126);
+		return server_spawn_failed(sp, "command not found", 127);
+	}
+
+	execve(sp->path, sp->argv, sp->env);
+	if (errno == ENOENT || errno == ENOTDIR)
+		return server_spawn_failed(sp, "command not found", 127);
+	return server_spawn_failed(sp, "unable to execute command", 126);
+}
+
+static pid_t
+server_spawn(server_spawn_t *sp)
+{
+	/* Only the thread running the event loop starts commands, and it
+	 * is suspended until the child is done with the stack */
+	static char child_stack[64 * 1024] __attribute__((aligned(16)));
+	sigset_t all;
+	pid_t pid;
+
+	/* Our signal handlers must not run in the child */
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &sp->sigmask);
+
+#ifdef __linux__
+	/* With perf counters, the child has to wait for us to attach them
+	 * before it executes the command, so we cannot wait for it */
+	if (sp->syncfds[0] < 0)
+		pid = clone(server_spawn_child, child_stack + sizeof(child_stack),
+				CLONE_VM | CLONE_VFORK | SIGCHLD, sp);
+	else
+#endif
+	if ((pid = fork()) == 0)
+		_exit(server_spawn_child(sp));
+
+	sigprocmask(SIG_SETMASK, &sp->sigmask, NULL);
+	return pid;
+}
+
+/*
+ * Start a command. If perf_fds is not NULL, the perf counters requested
+ * by the command are attached to the child process before it executes
+ * the command.
+ */
 int
-server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
+server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *perf_fds, int *status)
 {
-	int pipefds[6], child_fds[3];
+	server_spawn_t sp;
+	int pipefds[6];
 	int pty_master = -1;
-	char **argv = NULL, **env = NULL;
+	char tty[PATH_MAX];
+	char **argv = NULL;
 	struct passwd *user;
-	const char *argv0;
 	int nfds = 0;
 	pid_t pid = -1;
 
 	if (!(user = server_get_user(cmd->user, status)))
 		return -1;
 
+	memset(&sp, 0, sizeof(sp));
+	sp.syncfds[0] = sp.syncfds[1] = -1;
+	__init_fds(parent_fds, -1, -1, -1);
+
+	/* Do nothing for the root user */
+	if (strcmp(user->pw_name, "root")) {
+		if (!(sp.groups = server_get_groups(user, &sp.ngroups))) {
+			*status = EPERM;
+			twopence_log_error("Unable to get the groups of user %s", user->pw_name);
+			return -1;
+		}
+		sp.change_ids = true;
+		sp.uid = user->pw_uid;
+		sp.gid = user->pw_gid;
+	}
+	sp.homedir = server_get_homedir(user);
+
 	memset(pipefds, 0xa5, sizeof(pipefds));
 	if (cmd->request_tty) {
 		pty_master = posix_openpt(O_RDWR | O_NOCTTY);
@@ -332,7 +713,16 @@ server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
 			goto failed;
 		}
 
-		child_fds[0] = child_fds[1] = child_fds[2] = -1;
+		if (grantpt(pty_master) < 0
+		 || unlockpt(pty_master) < 0
+		 || (errno = ptsname_r(pty_master, tty, sizeof(tty))) != 0) {
+			*status = errno;
+			twopence_log_error("unable to get slave pty: %m");
+			goto failed;
+		}
+		twopence_debug("%s: pty slave is %s", __func__, tty);
+		sp.tty = tty;
+
 		parent_fds[0] = dup(pty_master);
 		parent_fds[1] = dup(pty_master);
 		parent_fds[2] = -1;
@@ -344,105 +734,96 @@ server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
 			}
 		}
 
-		__init_fds(child_fds,  pipefds[0], pipefds[3], pipefds[5]); /* read-write-write */
-		__init_fds(parent_fds, pipefds[1], pipefds[2], pipefds[4]); /* write-read-read */
+		__init_fds(sp.child_fds, pipefds[0], pipefds[3], pipefds[5]); /* read-write-write */
+		__init_fds(parent_fds,   pipefds[1], pipefds[2], pipefds[4]); /* write-read-read */
 	}
 
-	argv = server_build_shell_argv(cmd->command);
-	if (argv == NULL) {
-		*status = EINVAL;
-		goto failed;
-	}
+	sp.env = server_build_shell_env(&cmd->env, user);
 
-	env = server_build_shell_env(&cmd->env, user);
+	/* Argument vectors are executed directly, command lines by the shell */
+	if (cmd->argv) {
+		sp.argv = cmd->argv;
+		if (strchr(cmd->argv[0], '/'))
+			sp.path = cmd->argv[0];
+		else
+			server_spawn_prepare_lookup(&sp, cmd->argv[0]);
+	} else {
+		argv = server_build_shell_argv(cmd->command);
+		if (argv == NULL) {
+			*status = EINVAL;
+			goto failed;
+		}
+		sp.argv = argv;
+		sp.path = argv[0];
+	}
 
 	{
 		int n;
 
-		twopence_debug("command argv[] =\n");
-		for (n = 0; argv[n]; ++n)
-			twopence_debug("   [%d] = \"%s\"\n", n, argv[n]);
+		twopence_debug("command %s, argv[] =\n", sp.path? sp.path : sp.name);
+		for (n = 0; sp.argv[n]; ++n)
+			twopence_debug("   [%d] = \"%s\"\n", n, sp.argv[n]);
 
 		twopence_debug("command env[] =\n");
-		for (n = 0; env[n]; ++n)
-			twopence_debug("   %s", env[n]);
+		for (n = 0; sp.env[n]; ++n)
+			twopence_debug("   %s", sp.env[n]);
 	}
 
-	argv0 = argv[0];
-
-	pid = fork();
-	if (pid < 0) {
+	/* The child must not execute the command before we've
+	 * attached the perf counters */
+	if (perf_fds && pipe(sp.syncfds) < 0) {
 		*status = errno;
-		twopence_log_error("unable to fork: %m\n");
 		goto failed;
 	}
-	if (pid == 0) {
-		int fd, numfds;
-
-		/* Child */
-		if (setsid() < 0) {
-			twopence_log_error("unable to set session id of child process: %m");
-			exit(127);
-		}
-
-		if (!server_change_hats_permanently(user, status)
-		 || !server_change_to_home(user))
-			exit(126);
 
-		if (pty_master >= 0) {
-			const char *tty;
+	sp.timeout = cmd->timeout? cmd->timeout : DEFAULT_COMMAND_TIMEOUT;
 
-			if (grantpt(pty_master) < 0
-			 || !(tty = ptsname(pty_master))
-			 || unlockpt(pty_master) < 0) {
-				twopence_log_error("unable to get slave pty: %m");
-				exit(125);
-			}
-
-			twopence_debug("%s: pty slave is %s", __func__, tty);
-			if ((fd = open(tty, O_RDWR | O_NOCTTY)) < 0) {
-				twopence_debug("unable to open slave pty %s: %m", tty);
-				twopence_log_error("unable to open slave pty %s: %m", tty);
-				exit(125);
-			}
-
-			twopence_debug("%s: pty slave is %d %s", __func__, fd, tty);
-			dup2(fd, 0);
-			dup2(fd, 1);
-			dup2(fd, 2);
-		} else {
-			dup2(child_fds[0], 0);
-			dup2(child_fds[1], 1);
-			dup2(child_fds[2], 2);
-		}
+	pid = server_spawn(&sp);
+	if (pid < 0) {
+		*status = errno;
+		twopence_log_error("unable to start child process: %m\n");
+		goto failed;
+	}
 
-		numfds = getdtablesize();
-		for (fd = 3; fd < numfds; ++fd)
-			close(fd);
+	/* We only learn about this if the child shared our memory */
+	if (sp.failed)
+		twopence_log_error("unable to run %s: %s: %s", sp.argv[0], sp.failed, strerror(sp.error));
 
-		alarm(cmd->timeout? cmd->timeout : DEFAULT_COMMAND_TIMEOUT);
+	if (!cmd->request_tty)
+		__close_fds(sp.child_fds);
 
-		/* Note: we may want to pass a standard environment, too */
-		execve(argv0, argv, env);
+	if (perf_fds) {
+		server_perf_open(pid, cmd->perf_counters, perf_fds);
 
-		twopence_log_error("unable to run %s: %m", argv0);
-		exit(127);
+		/* Let the child go ahead */
+		close(sp.syncfds[0]);
+		close(sp.syncfds[1]);
 	}
 
-	__close_fds(child_fds);
-
 out:
 	if (argv)
 		free(argv);
+	if (sp.pathbuf)
+		free(sp.pathbuf);
+	if (sp.groups)
+		free(sp.groups);
 	if (pty_master >= 0)
 		close(pty_master);
 	return pid;
 
 failed:
+	if (pty_master >= 0 && parent_fds[0] >= 0) {
+		close(parent_fds[0]);
+		close(parent_fds[1]);
+	}
 	while (nfds--) {
 		close(pipefds[2 * nfds]);
 		close(pipefds[2 * nfds + 1]);
 	}
+	if (sp.syncfds[0] >= 0) {
+		close(sp.syncfds[0]);
+		close(sp.syncfds[1]);
+	}
 	goto out;
 }
 
@@ -472,7 +853,7 @@ server_inject_file(twopence_transaction_t *trans, const twopence_file_xfer_t *xf
 		return false;
 	}
 
-	sink = twopence_transaction_attach_local_sink(trans, 0, fd);
+	sink = twopence_transaction_attach_local_sink_file(trans, 0, fd);
 	if (sink == NULL) {
 		/* Something is wrong */
 		close(fd);
@@ -504,6 +885,7 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 	twopence_trans_channel_t *source;
 	const char *username = xfer->user;
 	const char *filename = xfer->remote.name;
+	struct stat stb;
 	int status;
 	int fd;
 
@@ -513,7 +895,14 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 		return false;
 	}
 
-	source = twopence_transaction_attach_local_source(trans, 0, fd);
+	/* Regular files are sent straight from the page cache using sendfile().
+	 * Everything else is read chunk by chunk. This includes files in /proc
+	 * and /sys, whose st_size cannot be trusted; they do not occupy any
+	 * blocks, which is how we tell them apart. */
+	if (fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode) && stb.st_size != 0 && stb.st_blocks != 0)
+		source = twopence_transaction_attach_local_source_file(trans, 0, fd, stb.st_size);
+	else
+		source = twopence_transaction_attach_local_source(trans, 0, fd);
 	if (source == NULL) {
 		/* Something is wrong */
 		twopence_transaction_fail(trans, EIO);
@@ -527,10 +916,188 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 	return true;
 }
 
+/*
+ * Native file operations.
+ * These are executed by the server process itself, with the privileges of
+ * the requested user, so that checking for a file or creating a directory
+ * does not require spawning a shell.
+ */
+static void
+server_file_stat_init(twopence_file_stat_t *st, const char *name, const struct stat *stb)
+{
+	memset(st, 0, sizeof(*st));
+	st->name = (char *) name;
+	st->mode = stb->st_mode;
+	st->uid = stb->st_uid;
+	st->gid = stb->st_gid;
+	st->nlink = stb->st_nlink;
+	st->size = stb->st_size;
+	st->mtime = stb->st_mtime;
+}
+
+static void
+server_send_file_stat(twopence_transaction_t *trans, const char *name, const struct stat *stb)
+{
+	twopence_file_stat_t st;
+	twopence_buf_t *bp;
+
+	server_file_stat_init(&st, name, stb);
+
+	bp = twopence_protocol_file_info_buffer_new(&trans->ps);
+	if (!twopence_protocol_encode_file_stat(bp, &st)) {
+		/* Cannot happen, a name is never longer than a packet */
+		twopence_log_error("%s: stat record for \"%s\" does not fit into a packet", __func__, name);
+		twopence_buf_free(bp);
+		return;
+	}
+	twopence_transaction_send_file_info(trans, bp);
+}
+
+/*
+ * List a directory. The stat records of all entries are sent in as
+ * few packets as possible.
+ */
+static int
+server_list_directory(twopence_transaction_t *trans, const char *path)
+{
+	twopence_file_stat_t st;
+	twopence_buf_t *bp;
+	struct dirent *de;
+	struct stat stb;
+	DIR *dir;
+
+	if ((dir = opendir(path)) == NULL)
+		return errno;
+
+	bp = twopence_protocol_file_info_buffer_new(&trans->ps);
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		/* The entry may have gone away in the meantime */
+		if (fstatat(dirfd(dir), de->d_name, &stb, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+
+		server_file_stat_init(&st, de->d_name, &stb);
+		if (twopence_protocol_encode_file_stat(bp, &st))
+			continue;
+
+		/* Packet is full */
+		twopence_transaction_send_file_info(trans, bp);
+		bp = twopence_protocol_file_info_buffer_new(&trans->ps);
+		twopence_protocol_encode_file_stat(bp, &st);
+	}
+	closedir(dir);
+
+	if (twopence_buf_count(bp))
+		twopence_transaction_send_file_info(trans, bp);
+	else
+		twopence_buf_free(bp);
+	return 0;
+}
+
+static int
+__server_file_op(twopence_transaction_t *trans, const twopence_file_op_t *op, const char *path)
+{
+	char linkbuf[PATH_MAX];
+	struct stat stb;
+	ssize_t len;
+
+	switch (op->op) {
+	case TWOPENCE_FILEOP_STAT:
+		if (stat(path, &stb) < 0)
+			return errno;
+		server_send_file_stat(trans, op->path, &stb);
+		break;
+
+	case TWOPENCE_FILEOP_LSTAT:
+		if (lstat(path, &stb) < 0)
+			return errno;
+		server_send_file_stat(trans, op->path, &stb);
+		break;
+
+	case TWOPENCE_FILEOP_MKDIR:
+		if (mkdir(path, op->mode & 07777) < 0)
+			return errno;
+		break;
+
+	case TWOPENCE_FILEOP_RMDIR:
+		if (rmdir(path) < 0)
+			return errno;
+		break;
+
+	case TWOPENCE_FILEOP_UNLINK:
+		if (unlink(path) < 0)
+			return errno;
+		break;
+
+	case TWOPENCE_FILEOP_CHMOD:
+		if (chmod(path, op->mode & 07777) < 0)
+			return errno;
+		break;
+
+	case TWOPENCE_FILEOP_READLINK:
+		if (lstat(path, &stb) < 0)
+			return errno;
+		if ((len = readlink(path, linkbuf, sizeof(linkbuf) - 1)) < 0)
+			return errno;
+		linkbuf[len] = '\0';
+		server_send_file_stat(trans, linkbuf, &stb);
+		break;
+
+	case TWOPENCE_FILEOP_LISTDIR:
+		return server_list_directory(trans, path);
+
+	default:
+		twopence_log_error("unknown file operation %u", op->op);
+		return EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+bool
+server_file_op(twopence_transaction_t *trans, const twopence_file_op_t *op)
+{
+	const char *username = op->user;
+	const char *path = op->path;
+	struct saved_ids saved_ids;
+	const char *opname;
+	struct passwd *user;
+	int status = 0;
+
+	if ((opname = twopence_file_op_name(op->op)) == NULL)
+		opname = "fileop";
+
+	AUDIT("%s \"%s\"; user=%s\n", opname, path, username);
+	if (!(user = server_get_user(username, &status)))
+		goto out;
+
+	/* If the path is not absolute, interpret it relatively to the
+	 * user's home directory */
+	if (path[0] != '/') {
+		path = server_build_path(user->pw_dir, path);
+		if (path == NULL) {
+			status = ENAMETOOLONG;
+			goto out;
+		}
+	}
+
+	if (!server_change_hats_temporarily(user, &saved_ids, &status))
+		goto out;
+	status = __server_file_op(trans, op, path);
+	server_restore_privileges(&saved_ids);
+
+out:
+	twopence_transaction_fail2(trans, status, 0);
+	return status == 0;
+}
+
 bool
 server_run_command_send(twopence_transaction_t *trans)
 {
 	twopence_trans_channel_t *channel;
+	struct rusage rusage;
 	int status;
 	pid_t pid;
 	bool pending_output;
@@ -544,10 +1111,20 @@ server_run_command_send(twopence_transaction_t *trans)
 		pending_output = true;
 
 	if (trans->pid) {
-		pid = waitpid(trans->pid, &status, WNOHANG);
+		pid = wait4(trans->pid, &status, WNOHANG, &rusage);
 		if (pid > 0) {
 			twopence_debug("%s: process exited, status=%u\n", twopence_transaction_describe(trans), status);
 			twopence_transaction_close_sink(trans, 0);
+
+			server_rusage_init(&trans->rusage, &rusage);
+			if (trans->perf_fds)
+				server_perf_read(trans->perf_fds, &trans->rusage);
+
+			/* On timeout, take down any children that still hold on
+			 * to the output pipes, too. Otherwise we'd wait for them, and
+			 * the next command of a sequential batch would be held up. */
+			if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+				kill(-trans->pid, SIGKILL);
 			trans->status = status;
 			trans->pid = 0;
 		}
@@ -556,6 +1133,10 @@ server_run_command_send(twopence_transaction_t *trans)
 	if (!trans->done && trans->pid == 0 && !pending_output) {
 		int st = trans->status;
 
+		if (trans->ps.rusage && trans->rusage.valid)
+			twopence_transaction_send_client(trans,
+					twopence_protocol_build_rusage_packet(&trans->ps, &trans->rusage));
+
 		if (WIFEXITED(st)) {
 			twopence_transaction_send_major(trans, 0);
 			twopence_transaction_send_minor(trans, WEXITSTATUS(st));
@@ -600,6 +1181,20 @@ server_run_command_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr
 	return true;
 }
 
+/*
+ * Command output going to a pipe is spliced straight to the transport;
+ * everything else (a pty, in particular) is read into buffers.
+ */
+static twopence_trans_channel_t *
+server_attach_command_output(twopence_transaction_t *trans, uint16_t id, int fd)
+{
+	struct stat stb;
+
+	if (fstat(fd, &stb) == 0 && S_ISFIFO(stb.st_mode))
+		return twopence_transaction_attach_local_source_pipe(trans, id, fd);
+	return twopence_transaction_attach_local_source(trans, id, fd);
+}
+
 bool
 server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 {
@@ -611,7 +1206,23 @@ server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 
 	AUDIT("run \"%s\"; user=%s timeout=%u%s\n", cmd->command, cmd->user, cmd->timeout,
 				cmd->request_tty? ", use a tty" : "");
-	if ((pid = server_run_command_as(cmd, command_fds, &status)) < 0) {
+
+	/* Counters can only be reported to clients that know about them */
+	if (cmd->perf_counters && trans->ps.rusage) {
+		unsigned int i;
+
+		trans->perf_fds = twopence_calloc(__TWOPENCE_PERF_MAX, sizeof(int));
+		for (i = 0; i < __TWOPENCE_PERF_MAX; ++i)
+			trans->perf_fds[i] = -1;
+	}
+
+	/* Likewise for timestamps of the command's output */
+	if (cmd->timestamps && trans->ps.timestamps) {
+		trans->timestamps = true;
+		trans->start_nsec = twopence_monotonic_nsec();
+	}
+
+	if ((pid = server_run_command_as(cmd, command_fds, trans->perf_fds, &status)) < 0) {
 		twopence_transaction_fail2(trans, status, 0);
 		return false;
 	}
@@ -622,14 +1233,14 @@ server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 	twopence_transaction_channel_set_name(channel, "stdin");
 	nattached++;
 
-	channel = twopence_transaction_attach_local_source(trans, TWOPENCE_STDOUT, command_fds[1]);
+	channel = server_attach_command_output(trans, TWOPENCE_STDOUT, command_fds[1]);
 	if (channel == NULL)
 		goto failed;
 	twopence_transaction_channel_set_name(channel, "stdout");
 	nattached++;
 
 	if (command_fds[2] >= 0) {
-		channel = twopence_transaction_attach_local_source(trans, TWOPENCE_STDERR, command_fds[2]);
+		channel = server_attach_command_output(trans, TWOPENCE_STDERR, command_fds[2]);
 		if (channel == NULL)
 			goto failed;
 		twopence_transaction_channel_set_name(channel, "stderr");
@@ -653,6 +1264,222 @@ failed:
 	return false;
 }
 
+/*
+ * A batch of commands, received in a single BATCH request.
+ * Every command runs in a transaction of its own; the first one uses the
+ * xid of the BATCH packet, and the following ones the xids after it.
+ * Depending on the policy, we start them all at once, or one after the
+ * other as the previous command completes.
+ */
+typedef struct server_batch server_batch_t;
+struct server_batch {
+	server_batch_t *	next;
+	twopence_conn_t *	conn;
+
+	/* Protocol state of the command started last */
+	twopence_protocol_state_t ps;
+
+	unsigned int		policy;
+	unsigned int		count;
+	unsigned int		started;
+	unsigned int		running;
+
+	/* A command failed */
+	bool			failed;
+	/* The connection went away; do not start any more commands */
+	bool			aborted;
+
+	twopence_command_t *	commands;
+	uint32_t *		xids;
+};
+
+static server_batch_t *		server_batches;
+
+static void
+server_batch_free(server_batch_t *batch)
+{
+	server_batch_t **pos;
+	unsigned int i;
+
+	for (pos = &server_batches; *pos; pos = &(*pos)->next) {
+		if (*pos == batch) {
+			*pos = batch->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < batch->count; ++i) {
+		twopence_command_t *cmd = &batch->commands[i];
+
+		free((char *) cmd->user);
+		free((char *) cmd->command);
+		twopence_command_destroy(cmd);
+	}
+	free(batch->commands);
+	free(batch->xids);
+	free(batch);
+}
+
+static server_batch_t *
+server_batch_find(const twopence_conn_t *conn, uint32_t xid)
+{
+	server_batch_t *batch;
+	unsigned int i;
+
+	for (batch = server_batches; batch; batch = batch->next) {
+		if (batch->conn != conn)
+			continue;
+		for (i = 0; i < batch->started; ++i) {
+			if (batch->xids[i] == xid)
+				return batch;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start the next command of the batch in the given transaction.
+ * Returns true if the command is running, and false if the transaction
+ * has already been completed.
+ */
+static bool
+server_batch_start_command(server_batch_t *batch, twopence_transaction_t *trans)
+{
+	twopence_command_t *cmd = &batch->commands[batch->started++];
+
+	if (batch->failed && batch->policy == TWOPENCE_BATCH_STOP_ON_FAILURE) {
+		AUDIT("skip \"%s\"; an earlier command of the batch failed\n", cmd->command);
+		twopence_transaction_fail2(trans, ECANCELED, 0);
+		return false;
+	}
+
+	if (!server_run_command(trans, cmd)) {
+		batch->failed = true;
+		return false;
+	}
+
+	/* Commands in a batch do not receive any input */
+	twopence_transaction_close_sink(trans, TWOPENCE_STDIN);
+	batch->running++;
+	return true;
+}
+
+static void
+server_batch_advance(server_batch_t *batch)
+{
+	while (!batch->aborted && batch->started < batch->count) {
+		twopence_transaction_t *trans;
+
+		if (batch->policy != TWOPENCE_BATCH_PARALLEL && batch->running)
+			break;
+
+		twopence_protocol_next_xid(&batch->ps);
+		batch->xids[batch->started] = batch->ps.xid;
+
+		trans = twopence_conn_transaction_new(batch->conn, TWOPENCE_PROTO_TYPE_COMMAND, &batch->ps);
+		if (server_batch_start_command(batch, trans))
+			twopence_conn_add_transaction(batch->conn, trans);
+		else
+			twopence_transaction_free(trans);
+	}
+
+	if (batch->running == 0 && (batch->aborted || batch->started == batch->count))
+		server_batch_free(batch);
+}
+
+static bool
+server_run_batch(twopence_conn_t *conn, twopence_transaction_t *trans, twopence_buf_t *payload)
+{
+	server_batch_t *batch;
+	unsigned int policy, count, i;
+
+	if (!twopence_protocol_dissect_batch_packet(payload, &policy, &count))
+		return false;
+
+	if (policy != TWOPENCE_BATCH_SEQUENTIAL
+	 && policy != TWOPENCE_BATCH_PARALLEL
+	 && policy != TWOPENCE_BATCH_STOP_ON_FAILURE) {
+		twopence_log_error("batch request with unknown policy %u", policy);
+		return false;
+	}
+
+	/* Every command takes up more than a few bytes */
+	if (count > twopence_buf_count(payload))
+		return false;
+
+	batch = twopence_calloc(1, sizeof(*batch));
+	batch->conn = conn;
+	batch->ps = trans->ps;
+	batch->policy = policy;
+	batch->count = count;
+	batch->commands = twopence_calloc(count, sizeof(batch->commands[0]));
+	batch->xids = twopence_calloc(count, sizeof(batch->xids[0]));
+
+	for (i = 0; i < count; ++i) {
+		twopence_command_t *cmd = &batch->commands[i];
+
+		if (!twopence_protocol_dissect_batch_command(payload, &trans->ps, cmd)
+		 || cmd->command[0] == '\0') {
+			/* Do not free strings that point into the packet */
+			cmd->user = cmd->command = NULL;
+			server_batch_free(batch);
+			return false;
+		}
+		cmd->user = twopence_strdup(cmd->user);
+		cmd->command = twopence_strdup(cmd->command);
+	}
+
+	AUDIT("batch of %u commands; policy=%u\n", count, policy);
+
+	batch->next = server_batches;
+	server_batches = batch;
+
+	/* The first command runs in the transaction of the BATCH request */
+	trans->type = TWOPENCE_PROTO_TYPE_COMMAND;
+	batch->xids[0] = trans->id;
+	server_batch_start_command(batch, trans);
+
+	server_batch_advance(batch);
+	return true;
+}
+
+/*
+ * A transaction has completed. If it belongs to a batch, see whether
+ * we should start the next command.
+ */
+static void
+server_end_transaction(twopence_conn_t *conn, twopence_transaction_t *trans)
+{
+	server_batch_t *batch;
+
+	if ((batch = server_batch_find(conn, trans->id)) != NULL) {
+		batch->running--;
+		if (trans->client.exception < 0)
+			batch->aborted = true;
+		else if (!WIFEXITED(trans->status) || WEXITSTATUS(trans->status) != 0)
+			batch->failed = true;
+	}
+
+	twopence_transaction_free(trans);
+
+	if (batch)
+		server_batch_advance(batch);
+}
+
+static void
+server_close_connection(twopence_conn_t *conn)
+{
+	server_batch_t *batch, *next;
+
+	for (batch = server_batches; batch; batch = next) {
+		next = batch->next;
+		if (batch->conn == conn)
+			server_batch_free(batch);
+	}
+
+	twopence_conn_free(conn);
+}
+
 /*
  * Handle incoming HELLO packet. Respond with the ID we assigned to the client
  */
@@ -663,10 +1490,11 @@ server_request_quit(void)
 }
 
 bool
-server_process_request(twopence_transaction_t *trans, twopence_buf_t *payload)
+server_process_request(twopence_conn_t *conn, twopence_transaction_t *trans, twopence_buf_t *payload)
 {
 	twopence_file_xfer_t xfer;
 	twopence_command_t cmd;
+	twopence_file_op_t fileop;
 
 	switch (trans->type) {
 	case TWOPENCE_PROTO_TYPE_INJECT:
@@ -690,13 +1518,29 @@ server_process_request(twopence_transaction_t *trans, twopence_buf_t *payload)
 	case TWOPENCE_PROTO_TYPE_COMMAND:
 		memset(&cmd, 0, sizeof(cmd));
 		if (!twopence_protocol_dissect_command_packet(payload, &cmd)
-		 || cmd.command[0] == '\0')
+		 || cmd.command[0] == '\0') {
+			twopence_command_destroy(&cmd);
 			goto bad_packet;
+		}
 
 		server_run_command(trans, &cmd);
 		twopence_command_destroy(&cmd);
 		break;
 
+	case TWOPENCE_PROTO_TYPE_BATCH:
+		if (!server_run_batch(conn, trans, payload))
+			goto bad_packet;
+		break;
+
+	case TWOPENCE_PROTO_TYPE_FILE_OP:
+		twopence_file_op_init(&fileop, 0, NULL);
+		if (!twopence_protocol_dissect_file_op_packet(payload, &fileop)
+		 || fileop.path[0] == '\0')
+			goto bad_packet;
+
+		server_file_op(trans, &fileop);
+		break;
+
 	case TWOPENCE_PROTO_TYPE_QUIT:
 		server_request_quit();
 		/* we should not get here */
@@ -717,6 +1561,7 @@ bad_packet:
 
 static twopence_conn_semantics_t	server_ops = {
 	.process_request	= server_process_request,
+	.end_transaction	= server_end_transaction,
 };
 
 /*
@@ -751,14 +1596,19 @@ static twopence_conn_t *
 server_new_connection(twopence_sock_t *sock, twopence_conn_semantics_t *semantics)
 {
 	static unsigned int global_client_id = 1;
+	twopence_conn_t *conn;
 
-	return twopence_conn_new(semantics,  sock, global_client_id++);
+	conn = twopence_conn_new(semantics,  sock, global_client_id++);
+	twopence_conn_set_grace_period(conn, server_grace_period);
+	return conn;
 }
 
 static void
 __server_run(twopence_conn_t *conn)
 {
-	twopence_conn_pool_t *pool;
+	/* Sessions that lost their transport stay in the pool, so that the
+	 * client can resume them on the next connection. */
+	static twopence_conn_pool_t *pool;
 	struct sigaction sa;
 	sigset_t mask, omask;
 
@@ -775,7 +1625,10 @@ __server_run(twopence_conn_t *conn)
 
 	signal(SIGPIPE, SIG_IGN);
 
-	pool = twopence_conn_pool_new();
+	if (pool == NULL) {
+		pool = twopence_conn_pool_new();
+		twopence_conn_pool_set_callback_close_connection(pool, server_close_connection);
+	}
 
 	twopence_conn_pool_add_connection(pool, conn);
 	while (twopence_conn_pool_poll(pool))
@@ -783,8 +1636,7 @@ __server_run(twopence_conn_t *conn)
 
 	sigprocmask(SIG_SETMASK, &omask, NULL);
 
-	/* FIXME: */
-	/* twopence_conn_pool_free(pool); */
+	twopence_slab_dump_stats(1);
 }
 
 void
@@ -26,6 +26,8 @@
 #include "connection.h"
 
 #define DEFAULT_COMMAND_TIMEOUT	12	/* seconds */
+#define DEFAULT_GRACE_PERIOD	0	/* seconds; resumption is opt-in */
+#define DEFAULT_IO_THREADS	4
 
 extern void		server_run(twopence_sock_t *);
 extern void		server_listen(twopence_sock_t *);
@@ -43,5 +45,6 @@ extern unsigned int	twopence_debug_level;
 
 extern bool		server_audit;
 extern unsigned int	server_audit_seq;
+extern unsigned int	server_grace_period;
 
 #endif /* SERVER_H */
@@ -31,7 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 struct twopence_target *twopence_handle;
 
-enum { OPT_KEEPALIVE };
+enum { OPT_KEEPALIVE = 256, OPT_COMPRESSION, OPT_TIMESTAMPS, OPT_EXEC };
 
 char *short_options = "u:t:o:1:2:qbdvh";
 struct option long_options[] = {
@@ -43,6 +43,9 @@ struct option long_options[] = {
   { "quiet", 0, NULL, 'q' },
   { "batch", 0, NULL, 'b' },
   { "keepalive", required_argument, NULL, OPT_KEEPALIVE },
+  { "compression", required_argument, NULL, OPT_COMPRESSION },
+  { "timestamps", 0, NULL, OPT_TIMESTAMPS },
+  { "exec", 0, NULL, OPT_EXEC },
   { "setenv", required_argument, NULL, 'e' },
   { "debug", 0, NULL, 'd' },
   { "version", 0, NULL, 'v' },
@@ -119,23 +122,38 @@ int write_output(const char *filename, const twopence_buf_t *bp)
   return 0;
 }
 
+// Display when the first and last byte of output were produced and received
+static void print_timing(const twopence_timing_t *timing)
+{
+  printf("First byte of output received after %.6f seconds", timing->first_byte_nsec * 1e-9);
+  if (timing->server_valid)
+    printf(" (produced after %.6f)", timing->server_first_byte_nsec * 1e-9);
+  printf("\nLast byte of output received after %.6f seconds", timing->last_byte_nsec * 1e-9);
+  if (timing->server_valid)
+    printf(" (produced after %.6f)", timing->server_last_byte_nsec * 1e-9);
+  printf("\n");
+}
+
 // Display a message about the command usage
 void usage(const char *program_name)
 {
     fprintf(stderr, "Usage: %s [<options>] <target> <command>\n\
+       %s [<options>] --exec <target> [--] <program> [<argument>...]\n\
 Options: -u|--user <user>: user running the command (default: root)\n\
          -t|--timeout: time in seconds before aborting the command (default: 60)\n\
          -o|--output <file>: store both the output and the errors in the same file\n\
          -1|--stdout <file1> -2|--stderr <file2>: store them separately\n\
          -q|--quiet: do not display command output nor errors\n\
          -b|--batch: do not display status messages\n\
+         --timestamps: prefix output lines with the time they were produced\n\
+         --exec: run the program with the given arguments, without a shell\n\
          -d|--debug: print debug information\n\
          -v|--version: print version information\n\
          -h|--help: print this help message\n\
 Target: serial:<character device>\n\
         ssh:<address and port>\n\
         virtio:<socket file>\n\
-Command: any UNIX command\n", program_name);
+Command: any UNIX command\n", program_name, program_name);
 }
 
 // Main program
@@ -143,9 +161,10 @@ int main(int argc, char *argv[])
 {
   int option;
   const char *opt_output, *opt_stdout, *opt_stderr;
-  bool opt_quiet, opt_batch;
+  bool opt_quiet, opt_batch, opt_exec = false;
   const char *opt_target;
   int opt_keepalive = -1;
+  int opt_compression = -1;
 
   twopence_command_t cmd;
   struct twopence_target *target;
@@ -189,6 +208,15 @@ int main(int argc, char *argv[])
 	      else
 		opt_keepalive = atoi(optarg);
 	      break;
+    case OPT_COMPRESSION:
+	      opt_compression = strcmp(optarg, "no") != 0;
+	      break;
+    case OPT_TIMESTAMPS:
+	      cmd.timestamps = TWOPENCE_TIMESTAMP_LINES;
+	      break;
+    case OPT_EXEC:
+	      opt_exec = true;
+	      break;
     case 'e':
 	      {
 		char *name = optarg, *value;
@@ -206,11 +234,14 @@ int main(int argc, char *argv[])
              exit(RC_INVALID_PARAMETERS);
   }
 
-  if (argc != optind + 2)              // mandatory arguments: target and command
-    goto invalid_options;
+  if (opt_exec? argc < optind + 2 : argc != optind + 2)
+    goto invalid_options;              // mandatory arguments: target and command
 
   opt_target = argv[optind++];
-  cmd.command = argv[optind++];
+  if (opt_exec)                        // the rest is the program and its arguments
+    twopence_command_set_argv(&cmd, (const char * const *) argv + optind);
+  else
+    cmd.command = argv[optind++];
 
   twopence_command_ostreams_reset(&cmd);
   twopence_command_iostream_redirect(&cmd, TWOPENCE_STDIN, 0, false);
@@ -270,6 +301,15 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (opt_compression != -1) {
+    rc = twopence_target_set_option(target, TWOPENCE_TARGET_OPTION_COMPRESSION,
+		    &opt_compression);
+    if (rc < 0) {
+      twopence_perror("Unable to set connection compression", rc);
+      exit(RC_LIBRARY_INIT_ERROR);
+    }
+  }
+
   // Install signal handler
   twopence_handle = target;
   if (install_handler(SIGINT, &old_action))
@@ -288,6 +328,8 @@ int main(int argc, char *argv[])
     {
       printf("Return code from the test server: %d\n", status.major);
       printf("Return code of tested command: %d\n", status.minor);
+      if (cmd.timestamps && status.timing.nbytes)
+        print_timing(&status.timing);
     }
     if (status.major || status.minor)
       rc = RC_REMOTE_COMMAND_FAILED;
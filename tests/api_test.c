@@ -0,0 +1,442 @@
+/*
+Test script to exercise parts of the C API the other tests do not reach.
+
+Usage: api_test target
+
+
+Copyright (C) 2014-2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "twopence.h"
+
+static const char *	opt_target;
+
+static unsigned int	num_tests;
+static unsigned int	num_failed;
+static unsigned int	num_skipped;
+static int		test_case_status;
+
+enum { TEST_OK, TEST_FAILED, TEST_SKIPPED };
+
+static void
+test_case_begin(const char *name)
+{
+  printf("\n### TEST: %s\n", name);
+  test_case_status = TEST_OK;
+  num_tests++;
+}
+
+static void
+test_case_fail(const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  printf("### ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+
+  test_case_status = TEST_FAILED;
+}
+
+static void
+test_case_skip(const char *msg)
+{
+  printf("### %s\n", msg);
+  test_case_status = TEST_SKIPPED;
+}
+
+static void
+test_case_report(void)
+{
+  switch (test_case_status) {
+  case TEST_OK:
+    printf("### SUCCESS\n");
+    break;
+  case TEST_SKIPPED:
+    num_skipped++;
+    printf("### SKIPPED\n");
+    break;
+  default:
+    num_failed++;
+    printf("### FAIL\n");
+  }
+  fflush(stdout);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static twopence_target_t *
+test_case_target_new(void)
+{
+  twopence_target_t *target;
+  int rc;
+
+  if ((rc = twopence_target_new(opt_target, &target)) < 0) {
+    test_case_fail("cannot create target %s: %s", opt_target, twopence_strerror(rc));
+    return NULL;
+  }
+  return target;
+}
+
+static bool
+test_case_run_true(twopence_target_t *target)
+{
+  twopence_command_t cmd;
+  twopence_status_t status;
+  int rc;
+
+  twopence_command_init(&cmd, "true");
+  twopence_command_ostreams_reset(&cmd);
+  rc = twopence_run_test(target, &cmd, &status);
+  twopence_command_destroy(&cmd);
+
+  if (rc < 0 || status.major || status.minor) {
+    test_case_fail("cannot run a command on the target");
+    return false;
+  }
+  return true;
+}
+
+static void
+test_case_check_completion(const twopence_completion_t *comp, int id, const twopence_command_t *cmd, int minor)
+{
+  if (comp->id != id || comp->command != cmd)
+    test_case_fail("got completion of operation %d, expected %d", comp->id, id);
+  else if (comp->rc < 0)
+    test_case_fail("operation %d failed: %s", id, twopence_strerror(comp->rc));
+  else if (comp->status.major != 0 || comp->status.minor != minor)
+    test_case_fail("operation %d: expected status 0/%d, got %d/%d",
+		    id, minor, comp->status.major, comp->status.minor);
+}
+
+/*
+ * Completion callback of test_wait_any()
+ */
+struct callback_data {
+  unsigned int count;
+  twopence_completion_t last;
+};
+
+static void
+test_completion_callback(const twopence_completion_t *comp, void *user_data)
+{
+  struct callback_data *data = user_data;
+
+  data->count++;
+  data->last = *comp;
+}
+
+/*
+ * Submit three commands, and wait for any of them; the one that finishes
+ * first must be returned. Then install a completion callback, and wait for
+ * the command that takes longest. The remaining command finishes in the
+ * meantime, and must be passed to the callback rather than returned.
+ */
+static void
+test_wait_any(void)
+{
+  static const char *cmdlines[3] = { "sleep 1; exit 1", "sleep 0.2; exit 2", "sleep 2; exit 3" };
+  twopence_target_t *target;
+  twopence_command_t cmd[3];
+  twopence_completion_t comp;
+  struct callback_data cbdata;
+  int ids[3], rc;
+  unsigned int i;
+
+  test_case_begin("twopence_wait_any() and completion callbacks");
+  if ((target = test_case_target_new()) == NULL)
+    goto out;
+
+  for (i = 0; i < 3; ++i) {
+    twopence_command_init(&cmd[i], cmdlines[i]);
+    twopence_command_ostreams_reset(&cmd[i]);
+  }
+
+  for (i = 0; i < 3; ++i) {
+    if ((ids[i] = twopence_submit_command(target, &cmd[i])) == TWOPENCE_UNSUPPORTED_FUNCTION_ERROR) {
+      test_case_skip("asynchronous commands not supported by this plugin");
+      goto out_free;
+    }
+    if (ids[i] < 0) {
+      test_case_fail("cannot submit \"%s\": %s", cmdlines[i], twopence_strerror(ids[i]));
+      goto out_free;
+    }
+  }
+
+  rc = twopence_wait_any(target, ids, 3, 10000, &comp);
+  if (rc != 1) {
+    test_case_fail("twopence_wait_any() returned %d, expected 1", rc);
+    goto out_free;
+  }
+  test_case_check_completion(&comp, ids[1], &cmd[1], 2);
+
+  memset(&cbdata, 0, sizeof(cbdata));
+  twopence_target_set_completion_callback(target, test_completion_callback, &cbdata);
+
+  rc = twopence_wait_any(target, &ids[2], 1, 10000, &comp);
+  if (rc != 1) {
+    test_case_fail("twopence_wait_any() returned %d, expected 1", rc);
+    goto out_free;
+  }
+  test_case_check_completion(&comp, ids[2], &cmd[2], 3);
+
+  if (cbdata.count != 1)
+    test_case_fail("completion callback was invoked %u times, expected once", cbdata.count);
+  else
+    test_case_check_completion(&cbdata.last, ids[0], &cmd[0], 1);
+
+  if ((rc = twopence_poll(&target, 1, 0, &comp, 1)) != 0)
+    test_case_fail("twopence_poll() returned %d after all commands completed", rc);
+
+out_free:
+  /* This cancels whatever is still running */
+  twopence_target_free(target);
+  for (i = 0; i < 3; ++i)
+    twopence_command_destroy(&cmd[i]);
+out:
+  test_case_report();
+}
+
+/*
+ * Connect to our target, a virtio target that does not exist, and two
+ * virtio targets that accept the connection but never answer. With a
+ * connect timeout of one second, this should take about one second, as
+ * all of them are connected at once.
+ */
+#define CONNECT_TIMEOUT	1000
+
+static void
+test_connect(void)
+{
+  twopence_target_t *targets[4];
+  int results[4], expect[4];
+  struct sockaddr_un sun;
+  char mute_spec[128];
+  int timeout = CONNECT_TIMEOUT;
+  int mute_fd, rc;
+  unsigned int i, ntargets = 0;
+  double t0, elapsed;
+
+  test_case_begin("twopence_connect() to several targets at once");
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  snprintf(sun.sun_path, sizeof(sun.sun_path), "/tmp/twopence-api-test.%d.sock", (int) getpid());
+  snprintf(mute_spec, sizeof(mute_spec), "virtio:%s", sun.sun_path);
+
+  /* Nobody ever accepts connections on this socket */
+  if ((mute_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+   || bind(mute_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0
+   || listen(mute_fd, 8) < 0) {
+    test_case_fail("cannot create %s: %m", sun.sun_path);
+    goto out;
+  }
+
+  if ((targets[ntargets] = test_case_target_new()) == NULL)
+    goto out;
+  expect[ntargets++] = 0;
+
+  if ((rc = twopence_target_new("virtio:/does/not/exist", &targets[ntargets])) < 0) {
+    test_case_fail("cannot create virtio target: %s", twopence_strerror(rc));
+    goto out;
+  }
+  expect[ntargets++] = TWOPENCE_OPEN_SESSION_ERROR;
+
+  while (ntargets < 4) {
+    if ((rc = twopence_target_new(mute_spec, &targets[ntargets])) < 0) {
+      test_case_fail("cannot create target %s: %s", mute_spec, twopence_strerror(rc));
+      goto out;
+    }
+    expect[ntargets++] = TWOPENCE_OPEN_SESSION_ERROR;
+  }
+
+  for (i = 0; i < ntargets; ++i)
+    twopence_target_set_option(targets[i], TWOPENCE_TARGET_OPTION_CONNECT_TIMEOUT, &timeout);
+
+  t0 = now();
+  rc = twopence_connect(targets, ntargets, results);
+  elapsed = now() - t0;
+
+  printf("twopence_connect() returned %d after %.2f seconds\n", rc, elapsed);
+  if (rc != TWOPENCE_OPEN_SESSION_ERROR)
+    test_case_fail("twopence_connect() returned %d, expected %d", rc, TWOPENCE_OPEN_SESSION_ERROR);
+  for (i = 0; i < ntargets; ++i) {
+    if (results[i] != expect[i])
+      test_case_fail("target %u: result %d, expected %d", i, results[i], expect[i]);
+  }
+  if (elapsed >= 1.8 * CONNECT_TIMEOUT / 1000)
+    test_case_fail("the targets were not connected concurrently");
+
+  if (results[0] == 0)
+    test_case_run_true(targets[0]);
+
+out:
+  while (ntargets)
+    twopence_target_free(targets[--ntargets]);
+  if (mute_fd >= 0) {
+    close(mute_fd);
+    unlink(sun.sun_path);
+  }
+  test_case_report();
+}
+
+static void
+test_case_check_cache(const twopence_target_cache_stats_t *base,
+		unsigned long hits, unsigned long misses, unsigned long parked,
+		unsigned long flushed, unsigned int cached)
+{
+  twopence_target_cache_stats_t stats;
+
+  twopence_target_cache_get_stats(&stats);
+  printf("cache: hits %lu misses %lu parked %lu flushed %lu cached %u\n",
+		  stats.hits - base->hits, stats.misses - base->misses,
+		  stats.parked - base->parked, stats.flushed - base->flushed, stats.cached);
+
+  if (stats.hits - base->hits != hits
+   || stats.misses - base->misses != misses
+   || stats.parked - base->parked != parked
+   || stats.flushed - base->flushed != flushed
+   || stats.cached != cached)
+    test_case_fail("expected hits %lu misses %lu parked %lu flushed %lu cached %u",
+		    hits, misses, parked, flushed, cached);
+}
+
+/*
+ * Free a target with the connection cache enabled, and create it again.
+ * The second time, it should come from the cache.
+ */
+static void
+test_target_cache(void)
+{
+  twopence_target_cache_stats_t base;
+  twopence_target_t *target;
+
+  test_case_begin("connection cache");
+  if (!strncmp(opt_target, "ssh:", 4)) {
+    test_case_skip("ssh targets are not cached");
+    goto out;
+  }
+
+  twopence_target_cache_flush();
+  twopence_target_cache_set_idle_timeout(60);
+  twopence_target_cache_get_stats(&base);
+
+  if ((target = test_case_target_new()) == NULL)
+    goto out_disable;
+  test_case_run_true(target);
+  twopence_target_free(target);
+  test_case_check_cache(&base, 0, 1, 1, 0, 1);
+
+  if ((target = test_case_target_new()) == NULL)
+    goto out_disable;
+  test_case_check_cache(&base, 1, 1, 1, 0, 0);
+  test_case_run_true(target);
+  twopence_target_free(target);
+
+  twopence_target_cache_flush();
+  test_case_check_cache(&base, 1, 1, 2, 1, 0);
+
+out_disable:
+  twopence_target_cache_set_idle_timeout(0);
+out:
+  test_case_report();
+}
+
+/*
+ * Run a command with lots of compressible output on a target with
+ * compression enabled, and check the counters of the packets received.
+ */
+static void
+test_compress_stats(void)
+{
+  twopence_compress_stats_t stats;
+  twopence_command_t cmd;
+  twopence_status_t status;
+  twopence_target_t *target;
+  int compress = 1, rc;
+
+  test_case_begin("compression statistics");
+  if ((target = test_case_target_new()) == NULL)
+    goto out;
+
+  if (twopence_target_set_option(target, TWOPENCE_TARGET_OPTION_COMPRESSION, &compress) < 0) {
+    test_case_skip("compression not supported by this plugin");
+    goto out_free;
+  }
+
+  twopence_command_init(&cmd, "yes twopence | head -c 262144");
+  twopence_command_ostreams_reset(&cmd);
+  rc = twopence_run_test(target, &cmd, &status);
+  twopence_command_destroy(&cmd);
+  if (rc < 0 || status.major || status.minor) {
+    test_case_fail("cannot run a command on the target");
+    goto out_free;
+  }
+
+  if ((rc = twopence_target_get_compress_stats(target, &stats)) < 0) {
+    test_case_fail("twopence_target_get_compress_stats() returned %d", rc);
+    goto out_free;
+  }
+
+  printf("inflate: %lu packets (%lu compressed), %llu bytes -> %llu bytes\n",
+		  stats.inflate.npackets, stats.inflate.ncompressed,
+		  stats.inflate.raw_bytes, stats.inflate.wire_bytes);
+  if (stats.inflate.npackets == 0)
+    test_case_skip("the link is not compressed");
+  else if (stats.inflate.ncompressed == 0 || stats.inflate.wire_bytes >= stats.inflate.raw_bytes)
+    test_case_fail("expected the command output to be compressed");
+
+out_free:
+  twopence_target_free(target);
+out:
+  test_case_report();
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s target\n", argv[0]);
+    return 1;
+  }
+  opt_target = argv[1];
+
+  test_wait_any();
+  test_connect();
+  test_target_cache();
+  test_compress_stats();
+
+  printf("### SUMMARY %u %u %u %u\n", num_tests, num_skipped, num_failed, 0);
+  return num_failed? 1 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+Benchmark for starting commands on the system under test.
+
+This runs a trivial command over and over again, one at a time, and
+reports the time from submitting it until its status arrives. For
+commands that do next to nothing, this is dominated by the cost of
+starting the process on the server: first as a shell command line, and
+then as an argument vector the server executes directly.
+
+Usage: bench_spawn target [count]
+
+
+Copyright (C) 2014-2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "twopence.h"
+
+static const char *	true_argv[] = { "true", NULL };
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double
+bench(struct twopence_target *target, unsigned long count, bool use_argv)
+{
+  unsigned long i, failed = 0;
+  double t0, t1;
+
+  t0 = now();
+  for (i = 0; i < count; ++i) {
+    twopence_command_t cmd;
+    twopence_status_t status;
+
+    twopence_command_init(&cmd, "true");
+    if (use_argv)
+      twopence_command_set_argv(&cmd, true_argv);
+
+    if (twopence_run_test(target, &cmd, &status) < 0 || status.major || status.minor)
+      failed++;
+    twopence_command_destroy(&cmd);
+  }
+  t1 = now();
+
+  if (failed)
+    fprintf(stderr, "%lu of %lu commands failed\n", failed, count);
+
+  return 1e6 * (t1 - t0) / count;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct twopence_target *target;
+  unsigned long count = 1000;
+  int rc;
+
+  if (argc > 2)
+    count = strtoul(argv[2], NULL, 0);
+  if (argc < 2 || argc > 3 || count == 0) {
+    fprintf(stderr, "Usage: %s target [count]\n", argv[0]);
+    return 1;
+  }
+
+  if ((rc = twopence_target_new(argv[1], &target)) < 0) {
+    twopence_perror("Unable to create target", rc);
+    return 1;
+  }
+
+  /* Warm up; this also sets up the connection */
+  bench(target, 10, false);
+
+  printf("%-8s %14s\n", "mode", "usec per command");
+  printf("%-8s %14.1f\n", "shell", bench(target, count, false));
+  printf("%-8s %14.1f\n", "argv", bench(target, count, true));
+
+  twopence_target_free(target);
+  return 0;
+}
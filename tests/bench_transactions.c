@@ -0,0 +1,114 @@
+/*
+Benchmark for matching incoming packets to their transaction.
+
+For every CHAN_DATA packet, the connection code has to look up the
+transaction by xid, and then the sink for the packet's channel. This
+measures the cost of those two lookups with 1 up to 10000 transactions
+running on a single connection. It should not depend on the number
+of transactions.
+
+Usage: bench_transactions [lookups]
+
+
+Copyright (C) 2014-2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "twopence.h"
+#include "connection.h"
+
+static const unsigned int	counts[] = { 1, 10, 100, 1000, 10000 };
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double
+bench(unsigned int ntrans, unsigned long nlookups, twopence_iostream_t *stream)
+{
+  twopence_protocol_state_t ps = { .cid = 1 };
+  twopence_conn_t *conn;
+  unsigned long i, found = 0;
+  uint32_t rnd = 1;
+  double t0, t1;
+
+  conn = twopence_conn_new(NULL, NULL, 1);
+  for (i = 1; i <= ntrans; ++i) {
+    twopence_transaction_t *trans;
+
+    ps.xid = i;
+    trans = twopence_conn_transaction_new(conn, TWOPENCE_PROTO_TYPE_COMMAND, &ps);
+    twopence_transaction_attach_local_sink_stream(trans, TWOPENCE_STDOUT, stream);
+    twopence_transaction_attach_local_sink_stream(trans, TWOPENCE_STDERR, stream);
+    twopence_conn_add_transaction(conn, trans);
+  }
+
+  t0 = now();
+  for (i = 0; i < nlookups; ++i) {
+    twopence_transaction_t *trans;
+
+    /* xorshift, so that we hit transactions all over the list */
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+
+    trans = twopence_conn_find_transaction(conn, 1 + rnd % ntrans);
+    if (trans && twopence_transaction_find_sink(trans, TWOPENCE_STDERR))
+      found++;
+  }
+  t1 = now();
+
+  if (found != nlookups)
+    fprintf(stderr, "%u transactions: only %lu of %lu lookups succeeded\n", ntrans, found, nlookups);
+
+  twopence_conn_free(conn);
+  return 1e9 * (t1 - t0) / nlookups;
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long nlookups = 1000000;
+  twopence_iostream_t *stream;
+  twopence_buf_t buffer;
+  unsigned int i;
+
+  if (argc > 1)
+    nlookups = strtoul(argv[1], NULL, 0);
+  if (nlookups == 0) {
+    fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+    return 1;
+  }
+
+  twopence_buf_init(&buffer);
+  twopence_iostream_wrap_buffer(&buffer, true, &stream);
+
+  printf("%12s %14s\n", "transactions", "ns per packet");
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    printf("%12u %14.1f\n", counts[i], bench(counts[i], nlookups, stream));
+
+  twopence_iostream_free(stream);
+  twopence_buf_destroy(&buffer);
+  return 0;
+}
@@ -1128,5 +1128,130 @@ except:
 
 testCaseReport()
 
+testCaseBegin("run a batch of commands, stopping on failure")
+try:
+	results = target.runBatch(["true", "exit 3", "echo should not run"], policy = twopence.BATCH_STOP_ON_FAILURE)
+	if len(results) != 3:
+		testCaseFail("runBatch returned %d results, expected 3" % len(results))
+	else:
+		testCaseCheckStatus(results[0], 0)
+		testCaseCheckStatus(results[1], 3)
+		testCaseCheckLocalError(results[2], twopence.COMMAND_CANCELED_ERROR)
+		if str(results[2].stdout).strip():
+			testCaseFail("the skipped command produced output")
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("create, inspect and remove files on the SUT")
+if target.type == "ssh":
+    testCaseSkip("file operations not available for %s plugin" % target.type)
+else:
+    try:
+	import stat
+	import errno
+
+	dirname = "/tmp/twopence-fileops"
+	filename = dirname + "/file"
+
+	target.run("rm -rf " + dirname, quiet = True)
+	target.mkdir(dirname, mode = 0750)
+	info = target.stat(dirname)
+	if not stat.S_ISDIR(info['mode']):
+		testCaseFail("%s is not a directory (mode 0%o)" % (dirname, info['mode']))
+	elif stat.S_IMODE(info['mode']) != 0750:
+		testCaseFail("%s has mode 0%o, expected 0750" % (dirname, stat.S_IMODE(info['mode'])))
+
+	target.run("echo hello > " + filename, quiet = True)
+	info = target.stat(filename)
+	if not stat.S_ISREG(info['mode']):
+		testCaseFail("%s is not a regular file (mode 0%o)" % (filename, info['mode']))
+	elif info['size'] != 6:
+		testCaseFail("%s has size %d, expected 6" % (filename, info['size']))
+
+	target.unlink(filename)
+	if target.exists(filename):
+		testCaseFail("%s still exists after unlink()" % filename)
+	target.rmdir(dirname)
+
+	try:
+		target.stat(dirname)
+		testCaseFail("stat() of the removed directory did not fail")
+	except OSError as e:
+		if e.errno != errno.ENOENT:
+			testCaseFail("stat() of the removed directory failed with errno %d, expected ENOENT" % e.errno)
+		else:
+			print "Good, stat() of the removed directory raised ENOENT"
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("verify that the resource usage of a command is reported")
+if target.type == "ssh":
+    testCaseSkip("resource usage not available for %s plugin" % target.type)
+else:
+    try:
+	cmd = twopence.Command("i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done", perfCounters = twopence.PERF_TASK_CLOCK)
+	status = target.run(cmd)
+	if testCaseCheckStatus(status):
+		ru = status.rusage
+		if ru == None:
+			testCaseFail("status.rusage is None")
+		else:
+			print "utime=%d stime=%d maxrss=%d perf=%s" % (ru['utime'], ru['stime'], ru['maxrss'], ru['perf'])
+			if ru['utime'] + ru['stime'] == 0:
+				testCaseFail("command used no CPU time at all")
+			if ru['maxrss'] == 0:
+				testCaseFail("command has a maxrss of 0")
+
+			# The server may not be allowed to open perf counters
+			if 'task-clock' not in ru['perf']:
+				print "task-clock was not reported, perf counters probably not available on the SUT"
+			elif ru['perf']['task-clock'] == 0:
+				testCaseFail("task-clock counter is 0")
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("verify that output timestamps are monotonic")
+if target.type == "ssh":
+    testCaseSkip("timestamps not available for %s plugin" % target.type)
+else:
+    try:
+	import re
+
+	cmd = twopence.Command("echo one; sleep 0.5; echo two; sleep 0.5; echo three", timestamps = twopence.TIMESTAMP_LINES)
+	status = target.run(cmd)
+	if testCaseCheckStatus(status):
+		stamps = []
+		for line in str(status.stdout).splitlines():
+			m = re.match(r"^\[ *([0-9]+\.[0-9]{6})\] (.*)$", line)
+			if not m:
+				testCaseFail("line without timestamp: \"%s\"" % line)
+				continue
+			stamps.append(float(m.group(1)))
+
+		if len(stamps) != 3:
+			testCaseFail("expected 3 timestamped lines, got %d" % len(stamps))
+		elif stamps != sorted(stamps):
+			testCaseFail("timestamps are not monotonic: %s" % stamps)
+		elif stamps[-1] - stamps[0] < 0.9:
+			testCaseFail("timestamps %s do not reflect the 1 second the command slept" % stamps)
+		else:
+			print "Good, timestamps are %s" % stamps
+
+		timing = status.timing
+		if timing == None:
+			testCaseFail("status.timing is None")
+		else:
+			print "timing:", timing
+			if timing['firstByte'] > timing['lastByte']:
+				testCaseFail("first byte arrived after the last byte")
+			if 'serverFirstByte' in timing and timing['serverFirstByte'] > timing['serverLastByte']:
+				testCaseFail("server read the first byte after the last byte")
+    except:
+	testCaseException()
+testCaseReport()
+
 
 testSuiteExit()
@@ -0,0 +1,289 @@
+/*
+Test resuming a session after the link to the server was lost.
+
+This puts a proxy between the client and a virtio server, and runs a
+command that prints a line every 100ms. A second into the command, the
+proxy is killed; a second later, a new one is started on the same
+socket. The client should reconnect through it, and receive the
+complete output and exit status of the command.
+
+The server has to be started with --grace-period, as session
+resumption is off by default:
+
+  TWOPENCE_SERVER_OPTIONS=--grace-period=10 ./run-one virtio ./resume_test
+
+Usage: resume_test virtio:/path/to/server.sock
+
+
+Copyright (C) 2014-2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "twopence.h"
+
+#define PROXY_MAX_LINKS	8
+#define NUM_LINES	30
+
+static const char *	server_path;
+static char		proxy_path[108];
+
+struct client_result {
+  int rc;
+  twopence_status_t status;
+  twopence_buf_t output;
+};
+
+static int
+unix_socket(const char *path, bool listening)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+
+  if (listening) {
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 8) < 0) {
+      close(fd);
+      return -1;
+    }
+  } else
+  if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static bool
+write_all(int fd, const char *buf, ssize_t count)
+{
+  while (count > 0) {
+    ssize_t n = write(fd, buf, count);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    count -= n;
+  }
+  return true;
+}
+
+/*
+ * Executed by the proxy process. Every link is a pair of fds,
+ * the client side at even and the server side at odd indices.
+ */
+static void
+proxy_run(int listen_fd)
+{
+  int fds[2 * PROXY_MAX_LINKS];
+  unsigned int nfds = 0, i;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    struct pollfd pfd[2 * PROXY_MAX_LINKS + 1];
+    char buffer[16384];
+
+    for (i = 0; i < nfds; ++i) {
+      pfd[i].fd = fds[i];
+      pfd[i].events = POLLIN;
+    }
+    pfd[nfds].fd = listen_fd;
+    pfd[nfds].events = (nfds < 2 * PROXY_MAX_LINKS)? POLLIN : 0;
+
+    if (poll(pfd, nfds + 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      _exit(1);
+    }
+
+    for (i = 0; i < nfds; ++i) {
+      ssize_t n;
+
+      if (pfd[i].revents == 0)
+        continue;
+
+      n = read(fds[i], buffer, sizeof(buffer));
+      if (n <= 0 || !write_all(fds[i ^ 1], buffer, n)) {
+        /* Drop the link, and move the last one into its place */
+        unsigned int link = i & ~1;
+
+        close(fds[link]);
+        close(fds[link + 1]);
+        nfds -= 2;
+        fds[link] = fds[nfds];
+        fds[link + 1] = fds[nfds + 1];
+        break;
+      }
+    }
+
+    if (pfd[nfds].revents & POLLIN) {
+      int client_fd, server_fd;
+
+      if ((client_fd = accept(listen_fd, NULL, NULL)) < 0)
+        continue;
+      if ((server_fd = unix_socket(server_path, false)) < 0) {
+        close(client_fd);
+        continue;
+      }
+      fds[nfds++] = client_fd;
+      fds[nfds++] = server_fd;
+    }
+  }
+}
+
+static pid_t
+proxy_start(void)
+{
+  int listen_fd;
+  pid_t pid;
+
+  if ((listen_fd = unix_socket(proxy_path, true)) < 0) {
+    perror(proxy_path);
+    return -1;
+  }
+
+  if ((pid = fork()) == 0)
+    proxy_run(listen_fd);
+
+  close(listen_fd);
+  return pid;
+}
+
+static void
+proxy_kill(pid_t pid)
+{
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+static void *
+client_thread_main(void *arg)
+{
+  struct client_result *result = arg;
+  twopence_target_t *target;
+  twopence_command_t cmd;
+  char spec[128];
+  char cmdline[128];
+
+  snprintf(spec, sizeof(spec), "virtio:%s", proxy_path);
+  if ((result->rc = twopence_target_new(spec, &target)) < 0)
+    return NULL;
+
+  snprintf(cmdline, sizeof(cmdline),
+		  "i=0; while [ $i -lt %u ]; do echo line $i; i=$((i+1)); sleep 0.1; done",
+		  NUM_LINES);
+  twopence_command_init(&cmd, cmdline);
+  twopence_command_ostreams_reset(&cmd);
+  twopence_command_ostream_capture(&cmd, TWOPENCE_STDOUT, &result->output);
+  twopence_command_ostream_capture(&cmd, TWOPENCE_STDERR, &result->output);
+
+  result->rc = twopence_run_test(target, &cmd, &result->status);
+
+  twopence_command_destroy(&cmd);
+  twopence_target_free(target);
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct client_result result;
+  char expect[16 * NUM_LINES];
+  unsigned int i, len = 0;
+  pthread_t client;
+  pid_t proxy;
+  bool failed = false;
+
+  if (argc != 2 || strncmp(argv[1], "virtio:", 7)) {
+    fprintf(stderr, "Usage: %s virtio:/path/to/server.sock\n", argv[0]);
+    return 1;
+  }
+  server_path = argv[1] + 7;
+  snprintf(proxy_path, sizeof(proxy_path), "/tmp/twopence-resume-test.%d.sock", (int) getpid());
+
+  for (i = 0; i < NUM_LINES; ++i)
+    len += snprintf(expect + len, sizeof(expect) - len, "line %u\n", i);
+
+  memset(&result, 0, sizeof(result));
+  twopence_buf_init(&result.output);
+  twopence_buf_resize(&result.output, 1024);
+
+  if ((proxy = proxy_start()) < 0)
+    return 1;
+
+  if (pthread_create(&client, NULL, client_thread_main, &result) != 0) {
+    perror("pthread_create");
+    proxy_kill(proxy);
+    return 1;
+  }
+
+  sleep(1);
+  printf("Killing the proxy\n");
+  proxy_kill(proxy);
+
+  sleep(1);
+  printf("Restarting the proxy\n");
+  proxy = proxy_start();
+
+  pthread_join(client, NULL);
+  if (proxy > 0)
+    proxy_kill(proxy);
+  unlink(proxy_path);
+
+  if (result.rc < 0) {
+    fprintf(stderr, "command failed: %s (is the server running with --grace-period?)\n",
+		    twopence_strerror(result.rc));
+    failed = true;
+  } else
+  if (result.status.major != 0 || result.status.minor != 0) {
+    fprintf(stderr, "expected status 0/0, got %d/%d\n", result.status.major, result.status.minor);
+    failed = true;
+  } else
+  if (twopence_buf_count(&result.output) != len
+   || memcmp(twopence_buf_head(&result.output), expect, len)) {
+    fprintf(stderr, "expected %u lines of output, got \"%.*s\"\n", NUM_LINES,
+		    (int) twopence_buf_count(&result.output), (const char *) twopence_buf_head(&result.output));
+    failed = true;
+  } else {
+    printf("Good, received the complete output after resuming the session\n");
+  }
+
+  twopence_buf_destroy(&result.output);
+
+  printf("### SUMMARY %u %u %u %u\n", 1, 0, failed? 1 : 0, 0);
+  return failed? 1 : 0;
+}
@@ -202,6 +202,22 @@ twopence_command $TARGET 'ls *' >/dev/null
 test_case_check_status $?
 test_case_report
 
+# With --exec, the arguments must reach the program exactly as given,
+# whether the server executes it directly or through a shell
+test_case_begin "Verify that --exec passes arguments unchanged"
+twopence_command -1 stdout.txt --exec $TARGET printf '%s|\n' 'two words' '$HOME' "it's" '*' 'a; echo injected' ''
+test_case_check_status $?
+expected=`printf '%s|\n' 'two words' '$HOME' "it's" '*' 'a; echo injected' ''`
+output=`cat stdout.txt`
+if [ "$output" = "$expected" ]; then
+	echo "Good, command output is"
+	echo "$output"
+else
+	test_case_fail "unexpected output from command: $output"
+fi
+rm -f stdout.txt stderr.txt
+test_case_report
+
 test_case_begin "Verify that environment passing works"
 case $TARGET in
 ssh:*)	test_case_skip "Environment passing currently usually doesn't work with ssh";;
@@ -478,6 +494,30 @@ elif [ $elapsed -gt 11 ]; then
 fi
 test_case_report
 
+# Every output line should be prefixed with the time it was produced.
+# The timestamps must not go backwards, and should reflect the time
+# the command slept between the lines.
+test_case_begin "verify that output timestamps are monotonic"
+case $TARGET in
+ssh:*)	test_case_skip "Timestamps are not available with ssh; so no testing them";;
+*)	output=`twopence_command -b --timestamps $TARGET 'echo one; sleep 1; echo two; sleep 1; echo three'`
+	test_case_check_status $?
+	echo "$output"
+	if ! echo "$output" | awk '
+		/^\[ *[0-9]+\.[0-9]+\] / {
+			t = substr($0, 2, index($0, "]") - 2) + 0
+			if (n++ == 0)
+				first = t
+			else if (t < last)
+				bad = 1
+			last = t
+		}
+		END { exit (bad || n != 3 || last - first < 1.9) }'; then
+		test_case_fail "timestamps are missing, not monotonic, or do not reflect the time slept"
+	fi
+esac
+test_case_report
+
 # Run a command that takes longer than the default keepalive timeout.
 # This should "just work"
 test_case_begin "making sure that link keepalives are delivered"
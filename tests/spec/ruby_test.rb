@@ -65,6 +65,21 @@ describe Twopence::Target do
     end
   end
 
+  describe "#run_batch" do
+    it "skips the remaining commands after a failure" do
+      results = @target.run_batch(['echo one', 'exit 3', 'echo three'], Twopence::BATCH_STOP_ON_FAILURE)
+      expect(results.length).to eq(3)
+      out, err, rc, major, minor = results[0]
+      expect(rc).to eq(0); expect(major).to eq(0); expect(minor).to eq(0)
+      expect(out).to eq("one\n")
+      out, err, rc, major, minor = results[1]
+      expect(rc).to eq(0); expect(major).to eq(0); expect(minor).to eq(3)
+      out, err, rc, major, minor = results[2]
+      expect(rc).to eq(Twopence::COMMAND_CANCELED_ERROR)
+      expect(out).to eq("")
+    end
+  end
+
   describe "#inject_file" do
     it "injects a file" do
       rc, remote_rc = @target.inject_file('/etc/hosts', '/tmp/injected')
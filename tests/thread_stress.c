@@ -0,0 +1,167 @@
+/*
+Stress test for using the library from several threads at once.
+
+Every thread opens its own target, runs a number of commands on it,
+and checks that it gets back exactly the output and exit status it
+asked for. Any cross-talk between threads shows up as a mismatch.
+
+Usage: thread_stress [-n threads] [-c commands] target
+
+
+Copyright (C) 2014-2016 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "twopence.h"
+
+struct stress_thread {
+  pthread_t thread;
+  unsigned int index;
+
+  unsigned int total;
+  unsigned int failed;
+  unsigned int error;
+};
+
+static const char *opt_target;
+static unsigned int opt_commands = 100;
+
+static int
+run_one(twopence_target_t *target, unsigned int thread, unsigned int seq)
+{
+  char cmdline[128], expect[64];
+  twopence_command_t cmd;
+  twopence_status_t status;
+  twopence_buf_t buffer;
+  unsigned int exitcode = seq % 3;
+  int rc, result = 0;
+
+  snprintf(expect, sizeof(expect), "thread %u command %u\n", thread, seq);
+  snprintf(cmdline, sizeof(cmdline), "echo 'thread %u command %u'; exit %u", thread, seq, exitcode);
+
+  twopence_command_init(&cmd, cmdline);
+  twopence_buf_init(&buffer);
+  twopence_buf_resize(&buffer, 1024);
+  twopence_command_ostreams_reset(&cmd);
+  twopence_command_ostream_capture(&cmd, TWOPENCE_STDOUT, &buffer);
+  twopence_command_ostream_capture(&cmd, TWOPENCE_STDERR, &buffer);
+
+  rc = twopence_run_test(target, &cmd, &status);
+  if (rc < 0) {
+    fprintf(stderr, "thread %u: command %u: %s\n", thread, seq, twopence_strerror(rc));
+    result = -1;
+  } else
+  if (status.major != 0 || status.minor != (int) exitcode) {
+    fprintf(stderr, "thread %u: command %u: expected status 0/%u, got %d/%d\n",
+		    thread, seq, exitcode, status.major, status.minor);
+    result = 1;
+  } else
+  if (twopence_buf_count(&buffer) != strlen(expect)
+   || memcmp(twopence_buf_head(&buffer), expect, strlen(expect))) {
+    fprintf(stderr, "thread %u: command %u: expected output \"%.*s\", got \"%.*s\"\n",
+		    thread, seq,
+		    (int) strlen(expect) - 1, expect,
+		    (int) twopence_buf_count(&buffer), (const char *) twopence_buf_head(&buffer));
+    result = 1;
+  }
+
+  twopence_command_destroy(&cmd);
+  twopence_buf_destroy(&buffer);
+  return result;
+}
+
+static void *
+stress_thread_main(void *arg)
+{
+  struct stress_thread *t = arg;
+  twopence_target_t *target;
+  unsigned int i;
+  int rc;
+
+  rc = twopence_target_new(opt_target, &target);
+  if (rc < 0) {
+    fprintf(stderr, "thread %u: cannot create target: %s\n", t->index, twopence_strerror(rc));
+    t->total = t->error = opt_commands;
+    return NULL;
+  }
+
+  for (i = 0; i < opt_commands; ++i) {
+    t->total++;
+    rc = run_one(target, t->index, i);
+    if (rc < 0)
+      t->error++;
+    else if (rc > 0)
+      t->failed++;
+  }
+
+  twopence_target_free(target);
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct stress_thread *threads;
+  unsigned int nthreads = 8, i;
+  unsigned int total = 0, failed = 0, error = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:c:")) != -1) {
+    switch (c) {
+    case 'n':
+      nthreads = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      opt_commands = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      goto usage;
+    }
+  }
+
+  if (optind + 1 != argc || nthreads == 0)
+    goto usage;
+  opt_target = argv[optind];
+
+  threads = calloc(nthreads, sizeof(threads[0]));
+  for (i = 0; i < nthreads; ++i) {
+    threads[i].index = i;
+    if (pthread_create(&threads[i].thread, NULL, stress_thread_main, &threads[i]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  for (i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i].thread, NULL);
+    total += threads[i].total;
+    failed += threads[i].failed;
+    error += threads[i].error;
+  }
+  free(threads);
+
+  printf("### SUMMARY %u %u %u %u\n", total, 0, failed, error);
+  return (failed || error)? 1 : 0;
+
+usage:
+  fprintf(stderr, "Usage: %s [-n threads] [-c commands] target\n", argv[0]);
+  return 1;
+}